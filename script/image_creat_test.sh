@@ -60,6 +60,24 @@ file ${IMG_FILE} || exit 1
 rm ${IMG_FILE} || exit 1
 echo
 
+# FreeBSD UFS2 with sort file
+echo "### FreeBSD UFS2 (sortfile)"
+SORT_FILE=`mktemp` || exit 1
+(cd ${SRC_DIR} && find . -type f | head -n 100) > ${SORT_FILE} || exit 1
+${MAKEFS} -Z -t ffs -o version=2,sortfile=${SORT_FILE} ${IMG_FILE} ${SRC_DIR} || exit 1
+file ${IMG_FILE} || exit 1
+rm ${IMG_FILE} || exit 1
+rm ${SORT_FILE} || exit 1
+echo
+
+# FreeBSD UFS2 updated in place
+echo "### FreeBSD UFS2 (update)"
+${MAKEFS} -Z -t ffs -o version=2 -b 10% ${IMG_FILE} ${SRC_DIR} || exit 1
+${MAKEFS} -t ffs -o update=2 ${IMG_FILE} ${SRC_DIR} || exit 1
+file ${IMG_FILE} || exit 1
+rm ${IMG_FILE} || exit 1
+echo
+
 # ISO9660
 echo "### ISO9660"
 ${MAKEFS} -Z -t cd9660 ${IMG_FILE} ${SRC_DIR} || exit 1
@@ -163,4 +181,105 @@ run_fsck fsck_hammer2 "" ${IMG_FILE}
 rm ${IMG_FILE} || exit 1
 echo
 
+# HAMMER2 with worker threads
+echo "### HAMMER2 (threads)"
+${MAKEFS} -Z -t hammer2 -o T=4 ${IMG_FILE} ${SRC_DIR} || exit 1
+file ${IMG_FILE} || exit 1
+${MAKEFS} -t hammer2 -o B ${IMG_FILE} __ || exit 1
+rm ${IMG_FILE} || exit 1
+echo
+
+# HAMMER2 with XOP worker threads
+echo "### HAMMER2 (XOP threads)"
+${MAKEFS} -Z -t hammer2 -o X=2 ${IMG_FILE} ${SRC_DIR} || exit 1
+file ${IMG_FILE} || exit 1
+${MAKEFS} -t hammer2 -o X=2 -o B ${IMG_FILE} __ || exit 1
+rm ${IMG_FILE} || exit 1
+echo
+
+# HAMMER2 checksum benchmark
+echo "### HAMMER2 (checksum benchmark)"
+${MAKEFS} -t hammer2 -o K=4096:65536 ${IMG_FILE} __ || exit 1
+echo
+
+# HAMMER2 volume set
+echo "### HAMMER2 (volume set)"
+VOLS=${IMG_FILE}.0:${IMG_FILE}.1:${IMG_FILE}.2
+${MAKEFS} -Z -t hammer2 -s 12g ${VOLS} ${SRC_DIR} || exit 1
+file ${IMG_FILE}.0 || exit 1
+${MAKEFS} -t hammer2 -o B ${VOLS} __ || exit 1
+rm ${IMG_FILE}.0 ${IMG_FILE}.1 ${IMG_FILE}.2 || exit 1
+echo
+
+# HAMMER2 compression benchmark
+echo "### HAMMER2 (compression benchmark)"
+${MAKEFS} -t hammer2 -o z ${IMG_FILE} __ || exit 1
+echo
+
+# HAMMER2 with per-file compression policy
+echo "### HAMMER2 (compression policy)"
+${MAKEFS} -Z -t hammer2 -o p=auto ${IMG_FILE} ${SRC_DIR} || exit 1
+file ${IMG_FILE} || exit 1
+rm ${IMG_FILE} || exit 1
+POLICY_FILE=`mktemp` || exit 1
+echo "*.txt zlib:9" > ${POLICY_FILE} || exit 1
+${MAKEFS} -Z -t hammer2 -o p=${POLICY_FILE} ${IMG_FILE} ${SRC_DIR} || exit 1
+file ${IMG_FILE} || exit 1
+rm ${IMG_FILE} || exit 1
+rm ${POLICY_FILE} || exit 1
+echo
+
+# HAMMER2 with build report
+echo "### HAMMER2 (report)"
+${MAKEFS} -Z -t hammer2 -o S=text ${IMG_FILE} ${SRC_DIR} || exit 1
+rm ${IMG_FILE} || exit 1
+REPORT_FILE=`mktemp` || exit 1
+${MAKEFS} -Z -t hammer2 -o S=json:${REPORT_FILE} ${IMG_FILE} ${SRC_DIR} || exit 1
+cat ${REPORT_FILE} || exit 1
+rm ${IMG_FILE} || exit 1
+rm ${REPORT_FILE} || exit 1
+echo
+
+# HAMMER2 recompressed offline
+echo "### HAMMER2 (recompress)"
+${MAKEFS} -Z -t hammer2 -o c=none ${IMG_FILE} ${SRC_DIR} || exit 1
+${MAKEFS} -t hammer2 -o T=4 -o I=recompress:/:zlib:9 ${IMG_FILE} __ || exit 1
+RECOMP_DIR=`mktemp -d` || exit 1
+${MAKEFS} -t hammer2 -o R=/ ${IMG_FILE} ${RECOMP_DIR} || exit 1
+# R does not extract symlinks
+diff -r --no-dereference ${SRC_DIR} ${RECOMP_DIR} | grep -v "^Only in ${SRC_DIR}" && exit 1
+rm -r ${RECOMP_DIR} || exit 1
+rm ${IMG_FILE} || exit 1
+echo
+
+# HAMMER2 image as the source tree
+echo "### HAMMER2 (source image)"
+SRC_IMG=${IMG_FILE}.h2
+${MAKEFS} -Z -t hammer2 ${SRC_IMG} ${SRC_DIR} || exit 1
+${MAKEFS} -Z -t ffs -o version=2 ${IMG_FILE} ${SRC_IMG} || exit 1
+file ${IMG_FILE} || exit 1
+rm ${IMG_FILE} || exit 1
+${MAKEFS} -Z -t cd9660 -o rockridge ${IMG_FILE} ${SRC_IMG}@DATA || exit 1
+file ${IMG_FILE} || exit 1
+rm ${IMG_FILE} || exit 1
+rm ${SRC_IMG} || exit 1
+echo
+
+# HAMMER2 with several PFSes populated at once
+echo "### HAMMER2 (PFS trees)"
+${MAKEFS} -Z -t hammer2 -o T=4,M=B:${SRC_DIR},M=C:${SRC_DIR} ${IMG_FILE} ${SRC_DIR} || exit 1
+file ${IMG_FILE} || exit 1
+${MAKEFS} -t hammer2 -o B ${IMG_FILE} __ > ${IMG_FILE}.log || exit 1
+cat ${IMG_FILE}.log
+grep -q "ERR(0[01])->allocated [1-9]" ${IMG_FILE}.log && exit 1
+rm ${IMG_FILE}.log || exit 1
+TREE_DIR=`mktemp -d` || exit 1
+${MAKEFS} -t hammer2 -o m=C -o R=/ ${IMG_FILE} ${TREE_DIR} || exit 1
+# R does not extract symlinks
+diff -r --no-dereference ${SRC_DIR} ${TREE_DIR} | grep -v "^Only in ${SRC_DIR}" && exit 1
+rm -r ${TREE_DIR} || exit 1
+${MAKEFS} -Z -t hammer2 -o M=B:${SRC_DIR},M=C:${SRC_DIR},M=D:${SRC_DIR} ${IMG_FILE} ${SRC_DIR} && exit 1
+rm -f ${IMG_FILE} || exit 1
+echo
+
 echo "success"
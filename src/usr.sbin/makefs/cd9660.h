@@ -316,7 +316,8 @@ int	cd9660_setup_boot_volume_descriptor(iso9660_disk *,
 
 /*** Write Functions ***/
 int	cd9660_write_image(iso9660_disk *, const char *image);
-int	cd9660_copy_file(iso9660_disk *, FILE *, off_t, const char *);
+int	cd9660_copy_file(iso9660_disk *, FILE *, off_t, const char *,
+    const fsnode *);
 
 void	cd9660_compute_full_filename(cd9660node *, char *);
 int	cd9660_compute_record_size(iso9660_disk *, cd9660node *);
@@ -664,7 +664,8 @@ cd9660_write_boot(iso9660_disk *diskStructure, FILE *fd)
 			printf("Writing boot image from %s to sectors %d\n",
 			    t->filename, t->sector);
 		}
-		cd9660_copy_file(diskStructure, fd, t->sector, t->filename);
+		cd9660_copy_file(diskStructure, fd, t->sector, t->filename,
+		    NULL);
 
 		if (t->system == ET_SYS_MAC)
 			apm_partitions++;
@@ -74,7 +74,7 @@ cd9660_write_image(iso9660_disk *diskStructure, const char* image)
 
 	if (diskStructure->has_generic_bootimage) {
 		status = cd9660_copy_file(diskStructure, fd, 0,
-		    diskStructure->generic_bootimage);
+		    diskStructure->generic_bootimage, NULL);
 		if (status == 0) {
 			warnx("%s: Error writing generic boot image",
 			    __func__);
@@ -290,7 +290,8 @@ cd9660_write_file(iso9660_disk *diskStructure, FILE *fd, cd9660node *writenode)
 			ret = cd9660_copy_file(diskStructure, fd,
 			    writenode->fileDataSector,
 			    (writenode->node->contents != NULL) ?
-			    writenode->node->contents : temp_file_name);
+			    writenode->node->contents : temp_file_name,
+			    writenode->node);
 			if (ret == 0)
 				goto out;
 		}
@@ -423,16 +424,19 @@ cd9660_write_buffered(FILE *fd, off_t offset, int buff_len,
 
 int
 cd9660_copy_file(iso9660_disk *diskStructure, FILE *fd, off_t start_sector,
-    const char *filename)
+    const char *filename, const fsnode *node)
 {
 	FILE *rf;
-	int bytes_read;
+	int bytes_read, rfd;
 	int buf_size = diskStructure->sectorSize;
 	char *buf;
 
 	buf = emalloc(buf_size);
-	if ((rf = fopen(filename, "rb")) == NULL) {
+	if ((rfd = fsnode_open(node, filename)) == -1 ||
+	    (rf = fdopen(rfd, "rb")) == NULL) {
 		warn("%s: cannot open %s", __func__, filename);
+		if (rfd != -1)
+			close(rfd);
 		free(buf);
 		return 0;
 	}
@@ -291,11 +291,14 @@ exfat_populate_dir(struct exfat *ef, const char *dir, fsnode *root,
 	assert(!root->child);
 	assert(!root->parent || root->parent->child == root);
 
+	/* nodes of a HAMMER2 source image aren't on disk */
 	struct stat st;
-	if (stat(dir, &st) == -1)
-		err(1, "no such path %s", dir);
-	if (!S_ISDIR(st.st_mode))
-		errx(1, "no such dir %s", dir);
+	if ((root->inode->flags & FI_SOURCE) == 0) {
+		if (stat(dir, &st) == -1)
+			err(1, "no such path %s", dir);
+		if (!S_ISDIR(st.st_mode))
+			errx(1, "no such dir %s", dir);
+	}
 
 	for (fsnode *cur = root->next; cur != NULL; cur = cur->next) {
 		/* construct source path */
@@ -305,8 +308,8 @@ exfat_populate_dir(struct exfat *ef, const char *dir, fsnode *root,
 		if ((size_t)ret >= sizeof(f))
 			errx(1, "path %s too long", f);
 
-		struct stat st;
-		if (stat(f, &st) == -1)
+		if ((cur->inode->flags & FI_SOURCE) == 0 &&
+		    stat(f, &st) == -1)
 			err(1, "no such file %s", f);
 
 		/* get pointer to exFAT path */
@@ -390,7 +393,7 @@ exfat_write_file(struct exfat *ef, struct exfat_node *en, const char *path,
 		return 0;
 	/* XXX check nsize vs maximum file size */
 
-	int fd = open(path, O_RDONLY);
+	int fd = fsnode_open(node, path);
 	if (fd < 0)
 		err(1, "failed to open %s", path);
 
@@ -75,6 +75,7 @@
 #include <sys/mount.h>
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
@@ -108,6 +109,16 @@
 	((ffs_opts->version == 1) ? \
 	(dp)->dp1.di_##field : (dp)->dp2.di_##field)
 
+	/* block pointers stay in image byte order in a dinode */
+#define	DBPTR(dp, i) \
+	((ffs_opts->version == 1) ? \
+	(daddr_t)ufs_rw32((dp)->dp1.di_db[i], fsopts->needswap) : \
+	(daddr_t)ufs_rw64((dp)->dp2.di_db[i], fsopts->needswap))
+#define	IBPTR(dp, i) \
+	((ffs_opts->version == 1) ? \
+	(daddr_t)ufs_rw32((dp)->dp1.di_ib[i], fsopts->needswap) : \
+	(daddr_t)ufs_rw64((dp)->dp2.di_ib[i], fsopts->needswap))
+
 /*
  * Various file system defaults (cribbed from newfs(8)).
  */
@@ -129,16 +140,87 @@ typedef struct {
 	doff_t		cur;		/* offset of current entry */
 } dirbuf_t;
 
+typedef struct {
+	char		*path;		/* path relative to the source root */
+	long long	weight;		/* placement priority */
+	size_t		seq;		/* line number in the sort file */
+} sortent_t;
+
+typedef struct {
+	off_t		*sizes;		/* allocation sizes seen by size_dir */
+	size_t		count;		/* # of entries in sizes */
+	size_t		max;		/* # of entries allocated */
+} sizehist_t;
+
+typedef struct {
+	const char	*name;		/* entry name */
+	uint32_t	ino;		/* inode number in the image */
+} updent_t;
+
+/*
+ * State of each inode of an image being updated in place.
+ */
+enum {
+	UPD_FREE,			/* not allocated */
+	UPD_USED,			/* allocated, not in the tree */
+	UPD_KEEP,			/* unchanged */
+	UPD_ATTR,			/* attributes changed, blocks kept */
+	UPD_REUSE,			/* contents changed, rewritten */
+	UPD_DIR,			/* directory, compared when written */
+	UPD_NEW,			/* newly allocated */
+};
+
+static	uint8_t		*updstate;	/* UPD_* per inode */
+static	uint32_t	 updninodes;	/* # of inodes in the image */
+static	struct {
+	long long	kept, attr, rewritten, added, removed;
+} updstats;
+
+static	sizehist_t	*sizehist;	/* non-NULL while collecting sizes */
+static	off_t		 geom_data;	/* predicted data size of autogeom */
+
+static	struct {
+	daddr_t		 d;		/* disk address, -1 if none */
+	void		*buf;		/* inode block in host byte order */
+} inoblk = { -1, NULL };
+
 
 static	int	ffs_create_image(const char *, fsinfo_t *);
 static	void	ffs_dump_fsinfo(fsinfo_t *);
 static	void	ffs_dump_dirbuf(dirbuf_t *, const char *, int);
 static	void	ffs_make_dirbuf(dirbuf_t *, const char *, fsnode *, int);
 static	int	ffs_populate_dir(const char *, fsnode *, fsinfo_t *);
+static	void	ffs_write_sorted(const char *, fsnode *, fsinfo_t *);
+static	fsnode *ffs_lookup_node(fsnode *, char *);
+static	int	ffs_sortent_cmp(const void *, const void *);
+static	int	ffs_open_image(const char *, fsinfo_t *);
+static	void	ffs_update_prepare(fsnode *, fsinfo_t *);
+static	void	ffs_update_match(fsnode *, uint32_t, fsinfo_t *);
+static	void	ffs_update_alloc(fsnode *, uint32_t *);
+static	int	ffs_update_compare(union dinode *, union dinode *, fsnode *,
+				 const char *, fsinfo_t *);
+static	int	ffs_update_cmpdata(union dinode *, const void *, int,
+				 const fsnode *, fsinfo_t *);
+static	int	ffs_update_node(union dinode *, fsnode *, void *, fsinfo_t *);
+static	void	ffs_update_rewrite(union dinode *, union dinode *, uint32_t,
+				 fsinfo_t *);
+static	void	ffs_update_free(union dinode *, uint32_t, int, fsinfo_t *);
+static	void	ffs_update_freeind(struct inode *, daddr_t, int, fsinfo_t *);
+static	void	ffs_read_inode(union dinode *, uint32_t, const fsinfo_t *);
+static	void	ffs_read_block(union dinode *, daddr_t, void *, int,
+				 const fsinfo_t *);
+static	int	ffs_updent_cmp(const void *, const void *);
 static	void	ffs_size_dir(fsnode *, fsinfo_t *);
+static	off_t	ffs_file_size(off_t, int, int);
+static	void	ffs_size_slop(const fsinfo_t *, off_t *, off_t *);
+static	off_t	ffs_size_overhead(const fsinfo_t *, const ffs_opt_t *, off_t,
+				 off_t);
+static	void	ffs_choose_geometry(const char *, fsinfo_t *);
 static	void	ffs_validate(const char *, fsnode *, fsinfo_t *);
-static	void	ffs_write_file(union dinode *, uint32_t, void *, fsinfo_t *);
+static	void	ffs_write_file(union dinode *, uint32_t, void *,
+				 const fsnode *, fsinfo_t *);
 static	void	ffs_write_inode(union dinode *, uint32_t, const fsinfo_t *);
+static	void	ffs_flush_inodes(const fsinfo_t *);
 static  void	*ffs_build_dinode1(struct ufs1_dinode *, dirbuf_t *, fsnode *,
 				 fsnode *, fsinfo_t *);
 static  void	*ffs_build_dinode2(struct ufs2_dinode *, dirbuf_t *, fsnode *,
@@ -179,6 +261,12 @@ ffs_prep_opts(fsinfo_t *fsopts)
 	      1, sizeof(ffs_opts->label), "UFS label" },
 	    { 's', "softupdates", &ffs_opts->softupdates, OPT_INT32,
 	      0, 1, "enable softupdates" },
+	    { '\0', "sortfile", &ffs_opts->sortfile, OPT_STRPTR,
+	      0, 0, "file placement order list" },
+	    { '\0', "autogeom", &ffs_opts->autogeom, OPT_INT32,
+	      0, 1, "choose bsize/fsize to minimize image size" },
+	    { '\0', "update", &ffs_opts->update, OPT_INT32,
+	      0, 2, "update existing image in place" },
 	    { .name = NULL }
 	};
 
@@ -195,6 +283,9 @@ ffs_prep_opts(fsinfo_t *fsopts)
 	ffs_opts->avgfpdir= -1;
 	ffs_opts->version = 1;
 	ffs_opts->softupdates = 0;
+	ffs_opts->sortfile = NULL;
+	ffs_opts->autogeom = 0;
+	ffs_opts->update = 0;
 
 	fsopts->fs_specific = ffs_opts;
 	fsopts->fs_options = copy_opts(ffs_options);
@@ -203,6 +294,10 @@ ffs_prep_opts(fsinfo_t *fsopts)
 void
 ffs_cleanup_opts(fsinfo_t *fsopts)
 {
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+
+	if (ffs_opts != NULL)
+		free(ffs_opts->sortfile);
 	free(fsopts->fs_specific);
 	free(fsopts->fs_options);
 }
@@ -253,6 +348,7 @@ ffs_makefs(const char *image, const char *dir, fsnode *root, fsinfo_t *fsopts)
 {
 	struct fs	*superblock;
 	struct timeval	start;
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
 
 	assert(image != NULL);
 	assert(dir != NULL);
@@ -263,36 +359,63 @@ ffs_makefs(const char *image, const char *dir, fsnode *root, fsinfo_t *fsopts)
 		printf("ffs_makefs: image %s directory %s root %p\n",
 		    image, dir, root);
 
-		/* if user wants no free space, use minimum number of inodes */
-	if (fsopts->minsize == 0 && fsopts->freeblockpc == 0 &&
-	    fsopts->freeblocks == 0)
-		((ffs_opt_t *)fsopts->fs_specific)->min_inodes = true;
-
-		/* validate tree and options */
-	TIMER_START(start);
-	ffs_validate(dir, root, fsopts);
-	TIMER_RESULTS(start, "ffs_validate");
-
-	printf("Calculated size of `%s': %lld bytes, %lld inodes\n",
-	    image, (long long)fsopts->size, (long long)fsopts->inodes);
-
-		/* create image */
-	TIMER_START(start);
-	if (ffs_create_image(image, fsopts) == -1)
-		errx(1, "Image file `%s' not created.", image);
-	TIMER_RESULTS(start, "ffs_create_image");
-
-	fsopts->curinode = UFS_ROOTINO;
+	if (ffs_opts->update) {
+		if (ffs_opts->sortfile != NULL)
+			errx(1, "sortfile cannot be used with update.");
+
+			/* open existing image and match it to the tree */
+		TIMER_START(start);
+		if (ffs_open_image(image, fsopts) == -1)
+			errx(1, "Image file `%s' not opened.", image);
+		TIMER_RESULTS(start, "ffs_open_image");
+
+		printf("Updating `%s': %lld bytes, UFS%d, "
+		    "block size %d, fragment size %d\n", image,
+		    (long long)fsopts->size, ffs_opts->version,
+		    ffs_opts->bsize, ffs_opts->fsize);
+		TIMER_START(start);
+		ffs_update_prepare(root, fsopts);
+		TIMER_RESULTS(start, "ffs_update_prepare");
+	} else {
+			/* if user wants no free space, use minimum # of inodes */
+		if (fsopts->minsize == 0 && fsopts->freeblockpc == 0 &&
+		    fsopts->freeblocks == 0)
+			ffs_opts->min_inodes = true;
+
+			/* validate tree and options */
+		TIMER_START(start);
+		ffs_validate(dir, root, fsopts);
+		TIMER_RESULTS(start, "ffs_validate");
+
+		printf("Calculated size of `%s': %lld bytes, %lld inodes\n",
+		    image, (long long)fsopts->size, (long long)fsopts->inodes);
+
+			/* create image */
+		TIMER_START(start);
+		if (ffs_create_image(image, fsopts) == -1)
+			errx(1, "Image file `%s' not created.", image);
+		TIMER_RESULTS(start, "ffs_create_image");
+
+		fsopts->curinode = UFS_ROOTINO;
+	}
 
 	if (debug & DEBUG_FS_MAKEFS)
 		putchar('\n');
 
+		/* place files from the sort list first */
+	if (ffs_opts->sortfile != NULL) {
+		TIMER_START(start);
+		ffs_write_sorted(dir, root, fsopts);
+		TIMER_RESULTS(start, "ffs_write_sorted");
+	}
+
 		/* populate image */
 	printf("Populating `%s'\n", image);
 	TIMER_START(start);
 	if (! ffs_populate_dir(dir, root, fsopts))
 		errx(1, "Image file `%s' not populated.", image);
 	TIMER_RESULTS(start, "ffs_populate_dir");
+	ffs_flush_inodes(fsopts);
 
 		/* ensure no outstanding buffers remain */
 	if (debug & DEBUG_FS_MAKEFS)
@@ -300,6 +423,19 @@ ffs_makefs(const char *image, const char *dir, fsnode *root, fsinfo_t *fsopts)
 
 		/* update various superblock parameters */
 	superblock = fsopts->superblock;
+	if (ffs_opts->update)
+		printf("Updated `%s': %lld kept, %lld attributes changed, "
+		    "%lld rewritten, %lld added, %lld removed\n", image,
+		    updstats.kept, updstats.attr, updstats.rewritten,
+		    updstats.added, updstats.removed);
+	if (ffs_opts->autogeom)
+		printf("Data size of `%s': predicted %lld bytes, "
+		    "actual %lld bytes\n", image, (long long)geom_data,
+		    (long long)(superblock->fs_dsize -
+		    superblock->fs_cstotal.cs_nbfree * superblock->fs_frag -
+		    superblock->fs_cstotal.cs_nffree -
+		    howmany(superblock->fs_cssize, superblock->fs_fsize)) *
+		    superblock->fs_fsize);
 	superblock->fs_fmod = 0;
 	superblock->fs_old_cstotal.cs_ndir   = superblock->fs_cstotal.cs_ndir;
 	superblock->fs_old_cstotal.cs_nbfree = superblock->fs_cstotal.cs_nbfree;
@@ -341,6 +477,13 @@ ffs_validate(const char *dir, fsnode *root, fsinfo_t *fsopts)
 	if (fsopts->sectorsize != DFL_SECSIZE)
 		warnx("sectorsize %d may produce nonfunctional image",
 		    fsopts->sectorsize);
+		/* size the tree first so the geometry can be fitted to it */
+	if (ffs_opts->autogeom) {
+		sizehist = ecalloc(1, sizeof(*sizehist));
+		ffs_size_dir(root, fsopts);
+		fsopts->inodes += UFS_ROOTINO;	/* include first two inodes */
+		ffs_choose_geometry(dir, fsopts);
+	}
 	if (ffs_opts->fsize == -1)
 		ffs_opts->fsize = MAX(DFL_FRAGSIZE, fsopts->sectorsize);
 	if (ffs_opts->bsize == -1)
@@ -376,22 +519,59 @@ ffs_validate(const char *dir, fsnode *root, fsinfo_t *fsopts)
 		    (long long)fsopts->maxsize);
 
 		/* calculate size of tree */
-	ffs_size_dir(root, fsopts);
-	fsopts->inodes += UFS_ROOTINO;		/* include first two inodes */
+	if (! ffs_opts->autogeom) {
+		ffs_size_dir(root, fsopts);
+		fsopts->inodes += UFS_ROOTINO;	/* include first two inodes */
+	}
 
 	if (debug & DEBUG_FS_VALIDATE)
 		printf("ffs_validate: size of tree: %lld bytes, %lld inodes\n",
 		    (long long)fsopts->size, (long long)fsopts->inodes);
 
-		/* add requested slop */
-	fsopts->size += fsopts->freeblocks;
-	fsopts->inodes += fsopts->freefiles;
+	ffs_size_slop(fsopts, &fsopts->size, &fsopts->inodes);
+	fsopts->size = ffs_size_overhead(fsopts, ffs_opts, fsopts->size,
+	    fsopts->inodes);
+
+		/* calculate density to just fit inodes if no free space */
+	if (ffs_opts->density == -1)
+		ffs_opts->density = fsopts->size / fsopts->inodes + 1;
+
+	if (debug & DEBUG_FS_VALIDATE) {
+		printf("ffs_validate: after defaults set:\n");
+		ffs_dump_fsinfo(fsopts);
+		printf("ffs_validate: dir %s; %lld bytes, %lld inodes\n",
+		    dir, (long long)fsopts->size, (long long)fsopts->inodes);
+	}
+		/* now check calculated sizes vs requested sizes */
+	if (fsopts->maxsize > 0 && fsopts->size > fsopts->maxsize) {
+		errx(1, "`%s' size of %lld is larger than the maxsize of %lld.",
+		    dir, (long long)fsopts->size, (long long)fsopts->maxsize);
+	}
+}
+
+/*
+ * Add the requested free blocks and free inodes to a tree size.
+ */
+static void
+ffs_size_slop(const fsinfo_t *fsopts, off_t *size, off_t *inodes)
+{
+
+	*size += fsopts->freeblocks;
+	*inodes += fsopts->freefiles;
 	if (fsopts->freefilepc > 0)
-		fsopts->inodes =
-		    fsopts->inodes * (100 + fsopts->freefilepc) / 100;
+		*inodes = *inodes * (100 + fsopts->freefilepc) / 100;
 	if (fsopts->freeblockpc > 0)
-		fsopts->size =
-		    fsopts->size * (100 + fsopts->freeblockpc) / 100;
+		*size = *size * (100 + fsopts->freeblockpc) / 100;
+}
+
+/*
+ * Return the image size needed to hold size bytes of data and inodes
+ * inodes with the geometry in ffs_opts.
+ */
+static off_t
+ffs_size_overhead(const fsinfo_t *fsopts, const ffs_opt_t *ffs_opts,
+    off_t size, off_t inodes)
+{
 
 	/*
 	 * Add space needed for superblock, cylblock and to store inodes.
@@ -399,54 +579,131 @@ ffs_validate(const char *dir, fsnode *root, fsinfo_t *fsopts)
 	 * XXX: This has to match calculations done in ffs_mkfs.
 	 */
 	if (ffs_opts->version == 1) {
-		fsopts->size +=
-		    roundup(SBLOCK_UFS1 + SBLOCKSIZE, ffs_opts->bsize);
-		fsopts->size += roundup(SBLOCKSIZE, ffs_opts->bsize);
-		fsopts->size += ffs_opts->bsize;
-		fsopts->size +=  DINODE1_SIZE *
-		    roundup(fsopts->inodes, ffs_opts->bsize / DINODE1_SIZE);
+		size += roundup(SBLOCK_UFS1 + SBLOCKSIZE, ffs_opts->bsize);
+		size += roundup(SBLOCKSIZE, ffs_opts->bsize);
+		size += ffs_opts->bsize;
+		size += DINODE1_SIZE *
+		    roundup(inodes, ffs_opts->bsize / DINODE1_SIZE);
 	} else {
-		fsopts->size +=
-		    roundup(SBLOCK_UFS2 + SBLOCKSIZE, ffs_opts->bsize);
-		fsopts->size += roundup(SBLOCKSIZE, ffs_opts->bsize);
-		fsopts->size += ffs_opts->bsize;
-		fsopts->size += DINODE2_SIZE *
-		    roundup(fsopts->inodes, ffs_opts->bsize / DINODE2_SIZE);
+		size += roundup(SBLOCK_UFS2 + SBLOCKSIZE, ffs_opts->bsize);
+		size += roundup(SBLOCKSIZE, ffs_opts->bsize);
+		size += ffs_opts->bsize;
+		size += DINODE2_SIZE *
+		    roundup(inodes, ffs_opts->bsize / DINODE2_SIZE);
 	}
 
 		/* add minfree */
 	if (ffs_opts->minfree > 0)
-		fsopts->size =
-		    fsopts->size * (100 + ffs_opts->minfree) / 100;
+		size = size * (100 + ffs_opts->minfree) / 100;
 	/*
 	 * XXX	any other fs slop to add, such as csum's, bitmaps, etc ??
 	 */
 
-	if (fsopts->size < fsopts->minsize)	/* ensure meets minimum size */
-		fsopts->size = fsopts->minsize;
+	if (size < fsopts->minsize)	/* ensure meets minimum size */
+		size = fsopts->minsize;
 
 		/* round up to the next block */
-	fsopts->size = roundup(fsopts->size, ffs_opts->bsize);
+	size = roundup(size, ffs_opts->bsize);
 
 		/* round up to requested block size, if any */
 	if (fsopts->roundup > 0)
-		fsopts->size = roundup(fsopts->size, fsopts->roundup);
+		size = roundup(size, fsopts->roundup);
 
-		/* calculate density to just fit inodes if no free space */
-	if (ffs_opts->density == -1)
-		ffs_opts->density = fsopts->size / fsopts->inodes + 1;
+	return (size);
+}
 
-	if (debug & DEBUG_FS_VALIDATE) {
-		printf("ffs_validate: after defaults set:\n");
-		ffs_dump_fsinfo(fsopts);
-		printf("ffs_validate: dir %s; %lld bytes, %lld inodes\n",
-		    dir, (long long)fsopts->size, (long long)fsopts->inodes);
-	}
-		/* now check calculated sizes vs requested sizes */
-	if (fsopts->maxsize > 0 && fsopts->size > fsopts->maxsize) {
-		errx(1, "`%s' size of %lld is larger than the maxsize of %lld.",
-		    dir, (long long)fsopts->size, (long long)fsopts->maxsize);
+/*
+ * Pick the bsize/fsize pair giving the smallest image for the file
+ * sizes collected by ffs_size_dir().  Block and fragment sizes given
+ * on the command line are kept; every other legal combination is
+ * evaluated and reported.  On return fsopts->size holds the data size
+ * for the chosen geometry, as ffs_size_dir() would have computed it.
+ */
+static void
+ffs_choose_geometry(const char *dir, fsinfo_t *fsopts)
+{
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+	ffs_opt_t	cand;
+	off_t		data, tail, indir, itab, total, bdata, btotal;
+	off_t		size, inodes, x;
+	int		bsize, fsize, bbsize, bfsize, frag, ndinode;
+	size_t		i;
+
+	assert(sizehist != NULL);
+
+	printf("Geometry candidates for `%s' (%zu allocations, %lld inodes):\n",
+	    dir, sizehist->count, (long long)fsopts->inodes);
+	printf("%6s %6s %12s %12s %12s %12s %12s\n", "bsize", "fsize",
+	    "data", "tail", "indirect", "inodes", "total");
+
+	bbsize = bfsize = -1;
+	bdata = btotal = 0;
+	ndinode = ffs_opts->version == 1 ? DINODE1_SIZE : DINODE2_SIZE;
+	for (bsize = MINBSIZE; bsize <= FFS_MAXBSIZE; bsize <<= 1) {
+		if (ffs_opts->bsize != -1 && ffs_opts->bsize != bsize)
+			continue;
+		for (frag = MAXFRAG; frag >= 1; frag >>= 1) {
+			fsize = bsize / frag;
+			if (fsize < fsopts->sectorsize)
+				continue;
+			if (ffs_opts->fsize != -1 && ffs_opts->fsize != fsize)
+				continue;
+
+			data = tail = indir = 0;
+			for (i = 0; i < sizehist->count; i++) {
+				x = sizehist->sizes[i];
+				size = ffs_file_size(x, bsize, fsize);
+				if ((size_t)x >= UFS_NDADDR * (size_t)bsize)
+					indir += bsize *
+					    (howmany(x, UFS_NDADDR * bsize) - 1);
+				data += size;
+			}
+			tail = data - indir;
+			for (i = 0; i < sizehist->count; i++)
+				tail -= sizehist->sizes[i];
+
+			cand = *ffs_opts;
+			cand.bsize = bsize;
+			cand.fsize = fsize;
+			if (cand.minfree == -1)
+				cand.minfree = MINFREE;
+			size = data;
+			inodes = fsopts->inodes;
+			ffs_size_slop(fsopts, &size, &inodes);
+			total = ffs_size_overhead(fsopts, &cand, size, inodes);
+			itab = ndinode * roundup(inodes, bsize / ndinode);
+
+			printf("%6d %6d %12lld %12lld %12lld %12lld %12lld%s\n",
+			    bsize, fsize, (long long)data, (long long)tail,
+			    (long long)indir, (long long)itab, (long long)total,
+			    fsopts->maxsize > 0 && total > fsopts->maxsize ?
+			    " (exceeds maxsize)" : "");
+			if (fsopts->maxsize > 0 && total > fsopts->maxsize)
+				continue;
+				/* prefer the larger block on a tie */
+			if (bbsize == -1 || total < btotal ||
+			    (total == btotal && bsize > bbsize)) {
+				bbsize = bsize;
+				bfsize = fsize;
+				bdata = data;
+				btotal = total;
+			}
+		}
 	}
+	if (bbsize == -1)
+		errx(1, "`%s' does not fit in maxsize %lld with any geometry.",
+		    dir, (long long)fsopts->maxsize);
+
+	printf("Chose bsize %d fsize %d: predicted size %lld bytes\n",
+	    bbsize, bfsize, (long long)btotal);
+	ffs_opts->bsize = bbsize;
+	ffs_opts->fsize = bfsize;
+	fsopts->size = bdata;
+	geom_data = bdata;
+
+	free(sizehist->sizes);
+	free(sizehist);
+	sizehist = NULL;
 }
 
 
@@ -623,18 +880,17 @@ ffs_size_dir(fsnode *root, fsinfo_t *fsopts)
 } while (0);
 
 #define	ADDSIZE(x) do {							\
-	if ((size_t)(x) < UFS_NDADDR * (size_t)ffs_opts->bsize) {	\
-		fsopts->size += roundup((x), ffs_opts->fsize);		\
-	} else {							\
-		/* Count space consumed by indirecttion blocks. */	\
-		fsopts->size +=	ffs_opts->bsize *			\
-		    (howmany((x), UFS_NDADDR * ffs_opts->bsize) - 1);	\
-		/*							\
-		 * If the file is big enough to use indirect blocks,	\
-		 * we allocate bsize block for trailing data.		\
-		 */							\
-		fsopts->size += roundup((x), ffs_opts->bsize);		\
-	}								\
+	if (sizehist != NULL) {						\
+		if (sizehist->count == sizehist->max) {			\
+			sizehist->max = sizehist->max ?			\
+			    sizehist->max * 2 : 1024;			\
+			sizehist->sizes = erealloc(sizehist->sizes,	\
+			    sizehist->max * sizeof(*sizehist->sizes));	\
+		}							\
+		sizehist->sizes[sizehist->count++] = (x);		\
+	} else								\
+		fsopts->size += ffs_file_size((x), ffs_opts->bsize,	\
+		    ffs_opts->fsize);					\
 } while (0);
 
 	curdirsize = 0;
@@ -673,6 +929,28 @@ ffs_size_dir(fsnode *root, fsinfo_t *fsopts)
 		    (long long)fsopts->size, (long long)fsopts->inodes);
 }
 
+/*
+ * Return the space allocated to a file of x bytes, including
+ * indirect blocks.
+ */
+static off_t
+ffs_file_size(off_t x, int bsize, int fsize)
+{
+	off_t	size;
+
+	if ((size_t)x < UFS_NDADDR * (size_t)bsize)
+		return (roundup(x, fsize));
+
+		/* Count space consumed by indirecttion blocks. */
+	size = bsize * (howmany(x, UFS_NDADDR * bsize) - 1);
+	/*
+	 * If the file is big enough to use indirect blocks,
+	 * we allocate bsize block for trailing data.
+	 */
+	size += roundup(x, bsize);
+	return (size);
+}
+
 static void *
 ffs_build_dinode1(struct ufs1_dinode *dinp, dirbuf_t *dbufp, fsnode *cur,
 		 fsnode *root, fsinfo_t *fsopts)
@@ -859,6 +1137,10 @@ ffs_populate_dir(const char *dir, fsnode *root, fsinfo_t *fsopts)
 			membuf = ffs_build_dinode2(&din.dp2, &dirbuf, cur,
 			    root, fsopts);
 
+		if (ffs_opts->update &&
+		    ! ffs_update_node(&din, cur, membuf, fsopts))
+			continue;		/* already in the image */
+
 		if (debug & DEBUG_FS_POPULATE_NODE) {
 			printf("ffs_populate_dir: writing ino %d, %s",
 			    cur->inode->ino, inode_type(cur->type));
@@ -868,10 +1150,12 @@ ffs_populate_dir(const char *dir, fsnode *root, fsinfo_t *fsopts)
 		}
 
 		if (membuf != NULL) {
-			ffs_write_file(&din, cur->inode->ino, membuf, fsopts);
+			ffs_write_file(&din, cur->inode->ino, membuf, NULL,
+			    fsopts);
 		} else if (S_ISREG(cur->type)) {
 			ffs_write_file(&din, cur->inode->ino,
-			    (cur->contents) ?  cur->contents : path, fsopts);
+			    (cur->contents) ?  cur->contents : path, cur,
+			    fsopts);
 		} else {
 			assert (! S_ISDIR(cur->type));
 			ffs_write_inode(&din, cur->inode->ino, fsopts);
@@ -902,9 +1186,795 @@ ffs_populate_dir(const char *dir, fsnode *root, fsinfo_t *fsopts)
 	return (1);
 }
 
+/*
+ * Write the regular files listed in the sort file before anything else,
+ * so that their data is laid out contiguously from the first cylinder
+ * group in the order given.
+ *
+ * Each line holds a path relative to the source directory (or starting
+ * with it), optionally followed by an integer weight.  Entries are
+ * placed by descending weight, then in file order.  Paths which do not
+ * name a regular file in the tree, and repeated paths, are ignored.
+ */
+static void
+ffs_write_sorted(const char *dir, fsnode *root, fsinfo_t *fsopts)
+{
+	FILE		*fp;
+	char		*line, *p, *w, *end;
+	char		path[MAXPATHLEN + 1];
+	size_t		linesize, dirlen, i, n, nalloc, nplaced;
+	ssize_t		len;
+	long long	weight;
+	sortent_t	*ents;
+	fsnode		*cur;
+	union dinode	din;
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+
+	assert(dir != NULL);
+	assert(root != NULL);
+	assert(ffs_opts->sortfile != NULL);
+
+	if ((fp = fopen(ffs_opts->sortfile, "r")) == NULL)
+		err(1, "Can't open `%s'", ffs_opts->sortfile);
+
+	dirlen = strlen(dir);
+	while (dirlen > 1 && dir[dirlen - 1] == '/')
+		dirlen--;
+	ents = NULL;
+	n = nalloc = 0;
+	line = NULL;
+	linesize = 0;
+	while ((len = getline(&line, &linesize, fp)) != -1) {
+		while (len > 0 && isspace((unsigned char)line[len - 1]))
+			line[--len] = '\0';
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		/* optional trailing weight */
+		weight = 0;
+		for (w = p + len - (p - line); w > p; w--)
+			if (isspace((unsigned char)w[-1]))
+				break;
+		if (w > p) {
+			errno = 0;
+			weight = strtoll(w, &end, 0);
+			if (errno == 0 && end != w && *end == '\0') {
+				while (w > p && isspace((unsigned char)w[-1]))
+					*--w = '\0';
+			} else
+				weight = 0;
+		}
+
+		/* strip source directory prefix */
+		if (strncmp(p, dir, dirlen) == 0 &&
+		    (p[dirlen] == '/' || p[dirlen] == '\0'))
+			p += dirlen;
+
+		if (n == nalloc) {
+			nalloc = nalloc ? nalloc * 2 : 64;
+			ents = erealloc(ents, nalloc * sizeof(*ents));
+		}
+		ents[n].path = estrdup(p);
+		ents[n].weight = weight;
+		ents[n].seq = n;
+		n++;
+	}
+	if (ferror(fp))
+		err(1, "Reading `%s'", ffs_opts->sortfile);
+	free(line);
+	fclose(fp);
+
+	qsort(ents, n, sizeof(*ents), ffs_sortent_cmp);
+
+		/* the root directory must keep UFS_ROOTINO */
+	if ((root->inode->flags & FI_ALLOCATED) == 0) {
+		root->inode->flags |= FI_ALLOCATED;
+		root->inode->ino = fsopts->curinode;
+		fsopts->curinode++;
+	}
+
+	ffs_seqalloc_start(fsopts->superblock);
+	nplaced = 0;
+	for (i = 0; i < n; i++) {
+		strlcpy(path, ents[i].path, sizeof(path));
+		cur = ffs_lookup_node(root, path);
+		if (cur == NULL || cur->type != S_IFREG ||
+		    FSNODE_EXCLUDE_P(fsopts, cur) ||
+		    (cur->inode->flags & FI_WRITTEN)) {
+			if (debug & DEBUG_FS_POPULATE)
+				printf("ffs_write_sorted: skipping `%s'\n",
+				    ents[i].path);
+			continue;
+		}
+		if ((cur->inode->flags & FI_ALLOCATED) == 0) {
+			cur->inode->flags |= FI_ALLOCATED;
+			cur->inode->ino = fsopts->curinode;
+			fsopts->curinode++;
+		}
+		cur->inode->flags |= FI_WRITTEN;
+
+		if (cur->contents == NULL) {
+			if (snprintf(path, sizeof(path), "%s/%s/%s", cur->root,
+			    cur->path, cur->name) >= (int)sizeof(path))
+				errx(1, "Pathname too long.");
+		}
+		if (ffs_opts->version == 1)
+			ffs_build_dinode1(&din.dp1, NULL, cur, root, fsopts);
+		else
+			ffs_build_dinode2(&din.dp2, NULL, cur, root, fsopts);
+
+		if (debug & DEBUG_FS_POPULATE_NODE)
+			printf("ffs_write_sorted: writing ino %d, %s\n",
+			    cur->inode->ino, ents[i].path);
+		ffs_write_file(&din, cur->inode->ino,
+		    (cur->contents) ? cur->contents : path, cur, fsopts);
+		nplaced++;
+	}
+	ffs_seqalloc_stop();
+
+	if (debug & DEBUG_FS_POPULATE)
+		printf("ffs_write_sorted: placed %zu of %zu entries\n",
+		    nplaced, n);
+
+	for (i = 0; i < n; i++)
+		free(ents[i].path);
+	free(ents);
+}
+
+/*
+ * Look up a `/' separated path relative to root in the fsnode tree.
+ * The path is modified.
+ */
+static fsnode *
+ffs_lookup_node(fsnode *root, char *path)
+{
+	fsnode	*list, *cur;
+	char	*name;
+
+	cur = NULL;
+	list = root;
+	while ((name = strsep(&path, "/")) != NULL) {
+		if (*name == '\0' || strcmp(name, ".") == 0)
+			continue;
+		for (cur = list; cur != NULL; cur = cur->next)
+			if (strcmp(cur->name, name) == 0)
+				break;
+		if (cur == NULL)
+			return (NULL);
+		list = cur->child;
+	}
+	return (cur);
+}
+
+static int
+ffs_sortent_cmp(const void *a, const void *b)
+{
+	const sortent_t *ea = a, *eb = b;
+
+	if (ea->weight != eb->weight)
+		return (ea->weight > eb->weight ? -1 : 1);
+	if (ea->seq != eb->seq)
+		return (ea->seq < eb->seq ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Open an existing image for -o update and load its superblock and
+ * cylinder group summaries.  The geometry, UFS version and byte order
+ * are taken from the image.
+ */
+static int
+ffs_open_image(const char *image, fsinfo_t *fsopts)
+{
+	struct fs	*fs;
+	time_t		tstamp;
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+
+	assert (image != NULL);
+	assert (fsopts != NULL);
+
+	if ((fsopts->fd = open(image, O_RDWR)) == -1) {
+		warn("Can't open `%s' for update", image);
+		return (-1);
+	}
+	if (fsopts->sectorsize == -1)
+		fsopts->sectorsize = DFL_SECSIZE;
+
+	fs = ffs_loadfs(image, fsopts);
+	fsopts->superblock = (void *)fs;
+	ffs_opts->version = fs->fs_magic == FS_UFS1_MAGIC ? 1 : 2;
+	ffs_opts->bsize = fs->fs_bsize;
+	ffs_opts->fsize = fs->fs_fsize;
+	fsopts->size = (off_t)fs->fs_size * fs->fs_fsize;
+
+	if (stampst.st_ino != 0)
+		tstamp = stampst.st_ctime;
+	else
+		tstamp = start_time.tv_sec;
+	srandom(tstamp);
+	fs->fs_time = tstamp;
+
+	if (debug & DEBUG_FS_CREATE_IMAGE)
+		printf("ffs_open_image: %s UFS%d, bsize %d, fsize %d, ncg %d, "
+		    "needswap %d\n", image, ffs_opts->version, fs->fs_bsize,
+		    fs->fs_fsize, fs->fs_ncg, fsopts->needswap);
+	return (fsopts->fd);
+}
+
+/*
+ * Diff the tree against the image being updated.  Nodes are matched
+ * to the existing inodes by path; unchanged inodes are kept with their
+ * blocks, changed ones and those no longer in the tree are freed, and
+ * new nodes get free inode numbers.  Directories are compared when
+ * their contents are known, in ffs_update_node().
+ */
+static void
+ffs_update_prepare(fsnode *root, fsinfo_t *fsopts)
+{
+	struct fs	*fs;
+	struct cg	*cgp;
+	union dinode	din;
+	char		*cgbuf;
+	uint32_t	cg, i, ino, next;
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+
+	assert(root != NULL);
+	assert(fsopts != NULL);
+	assert(ffs_opts != NULL);
+
+	fs = (struct fs *)fsopts->superblock;
+	updninodes = fs->fs_ncg * fs->fs_ipg;
+	updstate = ecalloc(updninodes, sizeof(*updstate));
+
+	cgbuf = emalloc(fs->fs_cgsize);
+	cgp = (struct cg *)cgbuf;
+	for (cg = 0; cg < fs->fs_ncg; cg++) {
+		ffs_rdfs(fsbtodb(fs, cgtod(fs, cg)), (int)fs->fs_cgsize,
+		    cgbuf, fsopts);
+		if (!cg_chkmagic_swap(cgp, fsopts->needswap))
+			errx(1, "ffs_update_prepare: cg %d: bad magic number",
+			    cg);
+		for (i = 0; i < fs->fs_ipg; i++)
+			if (isset(cg_inosused_swap(cgp, fsopts->needswap), i))
+				updstate[cg * fs->fs_ipg + i] = UPD_USED;
+	}
+	free(cgbuf);
+	for (ino = 0; ino < UFS_ROOTINO; ino++)
+		updstate[ino] = UPD_KEEP;	/* reserved */
+
+	if (updstate[UFS_ROOTINO] != UPD_USED)
+		errx(1, "ffs_update_prepare: root inode not allocated");
+	ffs_read_inode(&din, UFS_ROOTINO, fsopts);
+	if (!S_ISDIR(DIP(&din, mode)))
+		errx(1, "ffs_update_prepare: root inode not a directory");
+	updstate[UFS_ROOTINO] = UPD_DIR;
+	root->inode->ino = UFS_ROOTINO;
+	root->inode->flags |= FI_ALLOCATED;
+	ffs_update_match(root, UFS_ROOTINO, fsopts);
+
+		/* release what is not kept, before anything is allocated */
+	for (ino = UFS_ROOTINO; ino < updninodes; ino++) {
+		switch (updstate[ino]) {
+		case UPD_USED:
+			ffs_read_inode(&din, ino, fsopts);
+			ffs_update_free(&din, ino, 1, fsopts);
+			updstate[ino] = UPD_FREE;
+			updstats.removed++;
+			break;
+		case UPD_REUSE:
+			ffs_read_inode(&din, ino, fsopts);
+			ffs_update_free(&din, ino, 1, fsopts);
+			updstats.rewritten++;
+			break;
+		case UPD_ATTR:
+			ffs_read_inode(&din, ino, fsopts);
+			ffs_update_free(&din, ino, 0, fsopts);
+			updstats.attr++;
+			break;
+		case UPD_KEEP:
+			updstats.kept++;
+			break;
+		}
+	}
+
+	next = UFS_ROOTINO;
+	ffs_update_alloc(root, &next);
+}
 
+/*
+ * Match the entries of directory root against those of the existing
+ * directory inode dino, recursing into matched sub-directories.
+ */
 static void
-ffs_write_file(union dinode *din, uint32_t ino, void *buf, fsinfo_t *fsopts)
+ffs_update_match(fsnode *root, uint32_t dino, fsinfo_t *fsopts)
+{
+	struct fs	*fs;
+	struct direct	*dp;
+	union dinode	din, old;
+	updent_t	*ents, key, *ent;
+	fsnode		*cur;
+	char		*buf, path[MAXPATHLEN + 1];
+	off_t		size, off;
+	daddr_t		lbn;
+	size_t		nents, maxents;
+	uint16_t	reclen;
+	uint32_t	ino;
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+
+	fs = (struct fs *)fsopts->superblock;
+	ffs_read_inode(&din, dino, fsopts);
+	size = DIP(&din, size);
+	buf = emalloc(roundup(size, fs->fs_bsize) + 1);
+	for (lbn = 0, off = 0; off < size; lbn++, off += fs->fs_bsize)
+		ffs_read_block(&din, lbn, buf + off,
+		    fragroundup(fs, MIN(size - off, fs->fs_bsize)), fsopts);
+
+	ents = NULL;
+	nents = maxents = 0;
+	for (off = 0; off < size; off += reclen) {
+		dp = (struct direct *)(buf + off);
+		reclen = ufs_rw16(dp->d_reclen, fsopts->needswap);
+		if (reclen == 0 || off + reclen > size)
+			errx(1, "ffs_update_match: ino %u: bad directory", dino);
+		if (dp->d_ino == 0)
+			continue;
+		if (nents == maxents) {
+			maxents = maxents ? maxents * 2 : 64;
+			ents = erealloc(ents, maxents * sizeof(*ents));
+		}
+		dp->d_name[dp->d_namlen] = '\0';
+		ents[nents].name = dp->d_name;
+		ents[nents].ino = ufs_rw32(dp->d_ino, fsopts->needswap);
+		nents++;
+	}
+	if (nents > 0)
+		qsort(ents, nents, sizeof(*ents), ffs_updent_cmp);
+
+	for (cur = root; cur != NULL; cur = cur->next) {
+		if (cur == root || (cur->inode->flags & FI_ALLOCATED))
+			continue;		/* "." or a hard link */
+		key.name = cur->name;
+		ent = nents > 0 ? bsearch(&key, ents, nents, sizeof(*ents),
+		    ffs_updent_cmp) : NULL;
+		if (ent == NULL)
+			continue;
+		ino = ent->ino;
+		if (ino < UFS_ROOTINO || ino >= updninodes ||
+		    updstate[ino] != UPD_USED)
+			continue;
+		ffs_read_inode(&old, ino, fsopts);
+		if ((DIP(&old, mode) & S_IFMT) != cur->type)
+			continue;
+
+		cur->inode->ino = ino;
+		cur->inode->flags |= FI_ALLOCATED;
+		if (cur->type == S_IFDIR) {
+			updstate[ino] = UPD_DIR;
+			if (cur->child != NULL)
+				ffs_update_match(cur->child, ino, fsopts);
+			continue;
+		}
+
+		if (cur->contents == NULL) {
+			if (snprintf(path, sizeof(path), "%s/%s/%s", cur->root,
+			    cur->path, cur->name) >= (int)sizeof(path))
+				errx(1, "Pathname too long.");
+		}
+		if (ffs_opts->version == 1)
+			ffs_build_dinode1(&din.dp1, NULL, cur, NULL, fsopts);
+		else
+			ffs_build_dinode2(&din.dp2, NULL, cur, NULL, fsopts);
+		updstate[ino] = ffs_update_compare(&old, &din, cur,
+		    cur->contents ? cur->contents : path, fsopts);
+		if (debug & DEBUG_FS_POPULATE_NODE)
+			printf("ffs_update_match: %s/%s: ino %u state %d\n",
+			    cur->path, cur->name, ino, updstate[ino]);
+	}
+	free(ents);
+	free(buf);
+}
+
+/*
+ * Give the nodes left unmatched by ffs_update_match() free inode
+ * numbers, in tree order.
+ */
+static void
+ffs_update_alloc(fsnode *root, uint32_t *next)
+{
+	fsnode	*cur;
+
+	for (cur = root; cur != NULL; cur = cur->next) {
+		if (cur != root && (cur->inode->flags & FI_ALLOCATED) == 0) {
+			while (*next < updninodes &&
+			    updstate[*next] != UPD_FREE)
+				(*next)++;
+			if (*next >= updninodes)
+				errx(1, "Image is out of inodes; "
+				    "rebuild it without -o update.");
+			updstate[*next] = UPD_NEW;
+			cur->inode->ino = *next;
+			cur->inode->flags |= FI_ALLOCATED;
+			updstats.added++;
+		}
+		if (cur != root && cur->child != NULL)
+			ffs_update_alloc(cur->child, next);
+	}
+}
+
+/*
+ * Compare the existing inode old with the new inode din built for cur.
+ * Return the update state of the inode.
+ */
+static int
+ffs_update_compare(union dinode *old, union dinode *din, fsnode *cur,
+    const char *path, fsinfo_t *fsopts)
+{
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+	struct fs	*fs = (struct fs *)fsopts->superblock;
+
+	if (DIP(old, size) != DIP(din, size) ||
+	    DIP(old, mtime) != DIP(din, mtime) ||
+	    DIP(old, mtimensec) != DIP(din, mtimensec))
+		return (UPD_REUSE);
+
+	switch (cur->type) {
+	case S_IFLNK:
+		if (DIP(old, size) < fs->fs_maxsymlinklen ||
+		    DIP(old, blocks) == 0) {
+			if (memcmp(ffs_opts->version == 1 ?
+			    old->dp1.di_shortlink : old->dp2.di_shortlink,
+			    cur->symlink, DIP(old, size)) != 0)
+				return (UPD_REUSE);
+		} else if (ffs_update_cmpdata(old, cur->symlink, 0, NULL,
+		    fsopts))
+			return (UPD_REUSE);
+		break;
+	case S_IFBLK:
+	case S_IFCHR:
+		if (DIP(old, rdev) != DIP(din, rdev))
+			return (UPD_REUSE);
+		break;
+	case S_IFREG:
+		if (ffs_opts->update == 2 &&
+		    ffs_update_cmpdata(old, path, 1, cur, fsopts))
+			return (UPD_REUSE);
+		break;
+	}
+
+	if (DIP(old, mode) != DIP(din, mode) ||
+	    DIP(old, uid) != DIP(din, uid) ||
+	    DIP(old, gid) != DIP(din, gid) ||
+	    DIP(old, nlink) != DIP(din, nlink) ||
+	    DIP(old, flags) != DIP(din, flags))
+		return (UPD_ATTR);
+	return (UPD_KEEP);
+}
+
+/*
+ * Compare the data of the existing inode old with the file named by
+ * src (isfile, the contents of node) or the buffer src.  Return 0 if
+ * they are the same.
+ */
+static int
+ffs_update_cmpdata(union dinode *old, const void *src, int isfile,
+    const fsnode *node, fsinfo_t *fsopts)
+{
+	struct fs	*fs;
+	char		*fbuf, *ibuf;
+	const char	*p;
+	off_t		size, off, chunk;
+	daddr_t		lbn;
+	int		ffd, rv;
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+
+	fs = (struct fs *)fsopts->superblock;
+	size = DIP(old, size);
+	fbuf = emalloc(fs->fs_bsize);
+	ibuf = NULL;
+	ffd = -1;
+	if (isfile) {
+		if ((ffd = fsnode_open(node, (const char *)src)) == -1)
+			err(EXIT_FAILURE, "Can't open `%s' for reading",
+			    (const char *)src);
+		ibuf = emalloc(fs->fs_bsize);
+	}
+
+	rv = 0;
+	p = src;
+	for (lbn = 0, off = 0; off < size && rv == 0; lbn++, off += chunk) {
+		chunk = MIN(size - off, fs->fs_bsize);
+		ffs_read_block(old, lbn, fbuf, fragroundup(fs, chunk), fsopts);
+		if (isfile) {
+			if (read(ffd, ibuf, chunk) != chunk)
+				rv = 1;
+			p = ibuf;
+		} else
+			p = (const char *)src + off;
+		if (rv == 0 && memcmp(fbuf, p, chunk) != 0)
+			rv = 1;
+	}
+
+	if (ffd != -1)
+		close(ffd);
+	free(ibuf);
+	free(fbuf);
+	return (rv);
+}
+
+/*
+ * Called from pass 2 of ffs_populate_dir() before writing the inode
+ * din of cur.  Return 1 if it must be written out as for a new image,
+ * or 0 if the image already holds it or it was rewritten in place.
+ */
+static int
+ffs_update_node(union dinode *din, fsnode *cur, void *membuf,
+    fsinfo_t *fsopts)
+{
+	union dinode	old;
+	uint32_t	ino;
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+
+	ino = cur->inode->ino;
+	switch (updstate[ino]) {
+	case UPD_KEEP:
+		return (0);
+	case UPD_ATTR:
+		ffs_read_inode(&old, ino, fsopts);
+		ffs_update_rewrite(din, &old, ino, fsopts);
+		return (0);
+	case UPD_DIR:
+		ffs_read_inode(&old, ino, fsopts);
+		if (DIP(&old, size) == DIP(din, size) &&
+		    ffs_update_cmpdata(&old, membuf, 0, NULL, fsopts) == 0) {
+			if (DIP(&old, mode) == DIP(din, mode) &&
+			    DIP(&old, uid) == DIP(din, uid) &&
+			    DIP(&old, gid) == DIP(din, gid) &&
+			    DIP(&old, nlink) == DIP(din, nlink) &&
+			    DIP(&old, flags) == DIP(din, flags) &&
+			    DIP(&old, mtime) == DIP(din, mtime)) {
+				updstats.kept++;
+				return (0);
+			}
+			ffs_update_free(&old, ino, 0, fsopts);
+			ffs_update_rewrite(din, &old, ino, fsopts);
+			updstats.attr++;
+			return (0);
+		}
+		ffs_update_free(&old, ino, 1, fsopts);
+		updstats.rewritten++;
+		return (1);
+	default:
+		return (1);
+	}
+}
+
+/*
+ * Write the attributes in din to inode ino, keeping the blocks of
+ * the existing inode old.
+ */
+static void
+ffs_update_rewrite(union dinode *din, union dinode *old, uint32_t ino,
+    fsinfo_t *fsopts)
+{
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+
+	if (ffs_opts->version == 1) {
+		memcpy(din->dp1.di_db, old->dp1.di_db,
+		    sizeof(din->dp1.di_db));
+		memcpy(din->dp1.di_ib, old->dp1.di_ib,
+		    sizeof(din->dp1.di_ib));
+		din->dp1.di_blocks = old->dp1.di_blocks;
+		din->dp1.di_gen = old->dp1.di_gen;
+	} else {
+		memcpy(din->dp2.di_db, old->dp2.di_db,
+		    sizeof(din->dp2.di_db));
+		memcpy(din->dp2.di_ib, old->dp2.di_ib,
+		    sizeof(din->dp2.di_ib));
+		din->dp2.di_blocks = old->dp2.di_blocks;
+		din->dp2.di_gen = old->dp2.di_gen;
+	}
+	ffs_write_inode(din, ino, fsopts);
+}
+
+/*
+ * Release inode ino, whose on-disk copy is din.  If blocks is set, its
+ * data and indirect blocks are freed and the inode is cleared too.
+ */
+static void
+ffs_update_free(union dinode *din, uint32_t ino, int blocks,
+    fsinfo_t *fsopts)
+{
+	struct fs	*fs;
+	struct cg	*cgp;
+	struct inode	in;
+	daddr_t		bno;
+	char		*buf;
+	char		cgbuf[FFS_MAXBSIZE];
+	int		cg, cgino, i;
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+	struct m_vnode vp = { fsopts, NULL };
+
+	ffs_flush_inodes(fsopts);
+	fs = (struct fs *)fsopts->superblock;
+	if (blocks && DIP(din, blocks) != 0) {
+		in.i_fs = fs;
+		in.i_devvp = (void *)&vp;
+		in.i_number = ino;
+		for (i = 0; i < UFS_NDADDR; i++) {
+			bno = DBPTR(din, i);
+			if (bno != 0)
+				ffs_blkfree(&in, bno,
+				    sblksize(fs, DIP(din, size), i));
+		}
+		for (i = 0; i < UFS_NIADDR; i++) {
+			bno = IBPTR(din, i);
+			if (bno != 0)
+				ffs_update_freeind(&in, bno, i, fsopts);
+		}
+	}
+
+	cg = ino_to_cg(fs, ino);
+	cgino = ino % fs->fs_ipg;
+	ffs_rdfs(fsbtodb(fs, cgtod(fs, cg)), (int)fs->fs_cgsize, cgbuf,
+	    fsopts);
+	cgp = (struct cg *)cgbuf;
+	if (!cg_chkmagic_swap(cgp, fsopts->needswap))
+		errx(1, "ffs_update_free: cg %d: bad magic number", cg);
+	assert(isset(cg_inosused_swap(cgp, fsopts->needswap), cgino));
+	clrbit(cg_inosused_swap(cgp, fsopts->needswap), cgino);
+	ufs_add32(cgp->cg_cs.cs_nifree, 1, fsopts->needswap);
+	fs->fs_cstotal.cs_nifree++;
+	fs->fs_cs(fs, cg).cs_nifree++;
+	if (S_ISDIR(DIP(din, mode))) {
+		ufs_add32(cgp->cg_cs.cs_ndir, -1, fsopts->needswap);
+		fs->fs_cstotal.cs_ndir--;
+		fs->fs_cs(fs, cg).cs_ndir--;
+	}
+	ffs_wtfs(fsbtodb(fs, cgtod(fs, cg)), (int)fs->fs_cgsize, cgbuf,
+	    fsopts);
+
+	if (blocks) {
+		buf = emalloc(fs->fs_bsize);
+		bno = fsbtodb(fs, ino_to_fsba(fs, ino));
+		ffs_rdfs(bno, fs->fs_bsize, buf, fsopts);
+		if (ffs_opts->version == 1)
+			memset((struct ufs1_dinode *)buf +
+			    ino_to_fsbo(fs, ino), 0, DINODE1_SIZE);
+		else
+			memset((struct ufs2_dinode *)buf +
+			    ino_to_fsbo(fs, ino), 0, DINODE2_SIZE);
+		ffs_wtfs(bno, fs->fs_bsize, buf, fsopts);
+		free(buf);
+	}
+}
+
+/*
+ * Free indirect block bno at the given level and everything it maps.
+ */
+static void
+ffs_update_freeind(struct inode *ip, daddr_t bno, int level,
+    fsinfo_t *fsopts)
+{
+	struct fs	*fs = ip->i_fs;
+	daddr_t		nb;
+	char		*buf;
+	int		i;
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+
+	buf = emalloc(fs->fs_bsize);
+	ffs_rdfs(fsbtodb(fs, bno), fs->fs_bsize, buf, fsopts);
+	for (i = 0; i < NINDIR(fs); i++) {
+		if (ffs_opts->version == 1)
+			nb = ufs_rw32(((int32_t *)buf)[i], fsopts->needswap);
+		else
+			nb = ufs_rw64(((int64_t *)buf)[i], fsopts->needswap);
+		if (nb == 0)
+			continue;
+		if (level > 0)
+			ffs_update_freeind(ip, nb, level - 1, fsopts);
+		else
+			ffs_blkfree(ip, nb, fs->fs_bsize);
+	}
+	free(buf);
+	ffs_blkfree(ip, bno, fs->fs_bsize);
+}
+
+/*
+ * Read inode ino from the image into din, in host byte order.
+ */
+static void
+ffs_read_inode(union dinode *din, uint32_t ino, const fsinfo_t *fsopts)
+{
+	struct fs	*fs;
+	char		*buf;
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+
+	ffs_flush_inodes(fsopts);
+	fs = (struct fs *)fsopts->superblock;
+	buf = emalloc(fs->fs_bsize);
+	ffs_rdfs(fsbtodb(fs, ino_to_fsba(fs, ino)), fs->fs_bsize, buf, fsopts);
+	if (ffs_opts->version == 1) {
+		if (fsopts->needswap)
+			ffs_dinode1_swap((struct ufs1_dinode *)buf +
+			    ino_to_fsbo(fs, ino), &din->dp1);
+		else
+			din->dp1 = ((struct ufs1_dinode *)buf)
+			    [ino_to_fsbo(fs, ino)];
+	} else {
+		if (fsopts->needswap)
+			ffs_dinode2_swap((struct ufs2_dinode *)buf +
+			    ino_to_fsbo(fs, ino), &din->dp2);
+		else
+			din->dp2 = ((struct ufs2_dinode *)buf)
+			    [ino_to_fsbo(fs, ino)];
+	}
+	free(buf);
+}
+
+/*
+ * Read size bytes of logical block lbn of inode din into buf.
+ * Holes read as zeroes.
+ */
+static void
+ffs_read_block(union dinode *din, daddr_t lbn, void *buf, int size,
+    const fsinfo_t *fsopts)
+{
+	struct fs	*fs;
+	daddr_t		bno;
+	int64_t		span;
+	int		level;
+	char		*ibuf;
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+
+	fs = (struct fs *)fsopts->superblock;
+	if (lbn < UFS_NDADDR)
+		bno = DBPTR(din, lbn);
+	else {
+		lbn -= UFS_NDADDR;
+		span = NINDIR(fs);
+		for (level = 0; level < UFS_NIADDR; level++) {
+			if (lbn < span)
+				break;
+			lbn -= span;
+			span *= NINDIR(fs);
+		}
+		if (level == UFS_NIADDR)
+			errx(1, "ffs_read_block: block %lld out of range",
+			    (long long)lbn);
+		ibuf = emalloc(fs->fs_bsize);
+		for (bno = IBPTR(din, level); bno != 0 && span > 1; ) {
+			ffs_rdfs(fsbtodb(fs, bno), fs->fs_bsize, ibuf, fsopts);
+			span /= NINDIR(fs);
+			if (ffs_opts->version == 1)
+				bno = ufs_rw32(((int32_t *)ibuf)[lbn / span],
+				    fsopts->needswap);
+			else
+				bno = ufs_rw64(((int64_t *)ibuf)[lbn / span],
+				    fsopts->needswap);
+			lbn %= span;
+		}
+		free(ibuf);
+	}
+	if (bno == 0)
+		memset(buf, 0, size);
+	else
+		ffs_rdfs(fsbtodb(fs, bno), size, buf, fsopts);
+}
+
+static int
+ffs_updent_cmp(const void *a, const void *b)
+{
+	const updent_t *ea = a, *eb = b;
+
+	return (strcmp(ea->name, eb->name));
+}
+
+
+static void
+ffs_write_file(union dinode *din, uint32_t ino, void *buf, const fsnode *node,
+    fsinfo_t *fsopts)
 {
 	int	isfile, ffd;
 	char	*fbuf, *p;
@@ -953,7 +2023,7 @@ ffs_write_file(union dinode *din, uint32_t ino, void *buf, fsinfo_t *fsopts)
 
 	if (isfile) {
 		fbuf = emalloc(ffs_opts->bsize);
-		if ((ffd = open((char *)buf, O_RDONLY)) == -1) {
+		if ((ffd = fsnode_open(node, (char *)buf)) == -1) {
 			err(EXIT_FAILURE, "Can't open `%s' for reading", (char *)buf);
 		}
 	} else {
@@ -1096,8 +2166,7 @@ static void
 ffs_write_inode(union dinode *dp, uint32_t ino, const fsinfo_t *fsopts)
 {
 	char		*buf;
-	struct ufs1_dinode *dp1;
-	struct ufs2_dinode *dp2, *dip;
+	struct ufs2_dinode *dip;
 	struct cg	*cgp;
 	struct fs	*fs;
 	int		cg, cgino;
@@ -1128,8 +2197,6 @@ ffs_write_inode(union dinode *dp, uint32_t ino, const fsinfo_t *fsopts)
 	assert (isclr(cg_inosused_swap(cgp, fsopts->needswap), cgino));
 
 	buf = emalloc(fs->fs_bsize);
-	dp1 = (struct ufs1_dinode *)buf;
-	dp2 = (struct ufs2_dinode *)buf;
 
 	if (fs->fs_cstotal.cs_nifree == 0)
 		errx(1, "ffs_write_inode: fs out of inodes for ino %u",
@@ -1172,23 +2239,54 @@ ffs_write_inode(union dinode *dp, uint32_t ino, const fsinfo_t *fsopts)
 	    fsopts);
 
 					/* now write inode */
+	free(buf);
 	d = fsbtodb(fs, ino_to_fsba(fs, ino));
-	ffs_rdfs(d, fs->fs_bsize, buf, fsopts);
+	if (inoblk.buf == NULL || inoblk.d != d) {
+		ffs_flush_inodes(fsopts);
+		if (inoblk.buf == NULL)
+			inoblk.buf = emalloc(fs->fs_bsize);
+		ffs_rdfs(d, fs->fs_bsize, inoblk.buf, fsopts);
+		if (fsopts->needswap) {
+			if (ffs_opts->version == 1)
+				ffs_dinode1_swap_array(inoblk.buf, inoblk.buf,
+				    INOPB(fs));
+			else
+				ffs_dinode2_swap_array(inoblk.buf, inoblk.buf,
+				    INOPB(fs));
+		}
+		inoblk.d = d;
+	}
+	if (ffs_opts->version == 1)
+		((struct ufs1_dinode *)inoblk.buf)[ino_to_fsbo(fs, ino)] =
+		    dp->dp1;
+	else
+		((struct ufs2_dinode *)inoblk.buf)[ino_to_fsbo(fs, ino)] =
+		    dp->dp2;
+}
+
+/*
+ * Write back the inode block cached by ffs_write_inode(), swapping it
+ * to disk byte order in one pass.
+ */
+static void
+ffs_flush_inodes(const fsinfo_t *fsopts)
+{
+	struct fs	*fs;
+	ffs_opt_t	*ffs_opts = fsopts->fs_specific;
+
+	if (inoblk.buf == NULL || inoblk.d == -1)
+		return;
+	fs = (struct fs *)fsopts->superblock;
 	if (fsopts->needswap) {
 		if (ffs_opts->version == 1)
-			ffs_dinode1_swap(&dp->dp1,
-			    &dp1[ino_to_fsbo(fs, ino)]);
-		else
-			ffs_dinode2_swap(&dp->dp2,
-			    &dp2[ino_to_fsbo(fs, ino)]);
-	} else {
-		if (ffs_opts->version == 1)
-			dp1[ino_to_fsbo(fs, ino)] = dp->dp1;
+			ffs_dinode1_swap_array(inoblk.buf, inoblk.buf,
+			    INOPB(fs));
 		else
-			dp2[ino_to_fsbo(fs, ino)] = dp->dp2;
+			ffs_dinode2_swap_array(inoblk.buf, inoblk.buf,
+			    INOPB(fs));
 	}
-	ffs_wtfs(d, fs->fs_bsize, buf, fsopts);
-	free(buf);
+	ffs_wtfs(inoblk.d, fs->fs_bsize, inoblk.buf, fsopts);
+	inoblk.d = -1;
 }
 
 void
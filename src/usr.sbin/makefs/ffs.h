@@ -67,6 +67,9 @@ typedef struct {
 	int	maxbsize;	/* maximum extent size */
 	int	maxblkspercg;	/* max # of blocks per cylinder group */
 	int	softupdates;	/* soft updates */
+	char	*sortfile;	/* file placement order list */
+	int	autogeom;	/* choose bsize/fsize from the tree */
+	int	update;		/* update an existing image in place */
 		/* XXX: support `old' file systems ? */
 } ffs_opt_t;
 
@@ -122,6 +122,19 @@ brelse(struct m_buf *bp)
 	free(bp);
 }
 
+/*
+ * DragonFly: take a buffer off the lookup list without releasing it,
+ * the caller now owns it.
+ */
+void
+bremlist(struct m_buf *bp)
+{
+
+	assert(bp->b_vp);
+	if (!bp->b_vp->v_logical)
+		TAILQ_REMOVE(&buftail, bp, b_tailq);
+}
+
 int
 bwrite(struct m_buf *bp)
 {
@@ -210,7 +223,8 @@ getblk(struct m_vnode *vp, makefs_daddr_t blkno, int size, int u1 __unused,
 		buftailinitted = 1;
 	} else {
 		TAILQ_FOREACH(bp, &buftail, b_tailq) {
-			if (bp->b_lblkno != blkno)
+			/* hammer2 volume sets have one fsinfo per volume */
+			if (bp->b_lblkno != blkno || bp->b_fs != vp->fs)
 				continue;
 			break;
 		}
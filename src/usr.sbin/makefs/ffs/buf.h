@@ -71,6 +71,7 @@ struct m_vnode {
 	int v_logical; /* DragonFly */
 	int v_vflushed; /* DragonFly */
 	int v_malloced; /* DragonFly */
+	void *v_devq; /* DragonFly */
 };
 
 typedef enum buf_cmd {
@@ -97,6 +98,7 @@ void		bcleanup(void);
 int		bread(struct m_vnode *, makefs_daddr_t, int, struct m_ucred *,
     struct m_buf **);
 void		brelse(struct m_buf *);
+void		bremlist(struct m_buf *);
 int		bwrite(struct m_buf *);
 struct m_buf *	getblk(struct m_vnode *, makefs_daddr_t, int, int, int, int);
 
@@ -46,6 +46,8 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <util.h>
 
 #include "makefs.h"
 
@@ -65,6 +67,39 @@ static daddr_t ffs_hashalloc(struct inode *, u_int, daddr_t, int,
 		     daddr_t (*)(struct inode *, int, daddr_t, int));
 static int32_t ffs_mapsearch(struct fs *, struct cg *, daddr_t, int);
 
+static void ffs_cgidx_init(struct fs *);
+static int ffs_cgidx_get(struct fs *, int);
+static void ffs_cgidx_set(struct fs *, int, int);
+static void ffs_cgidx_update(struct fs *, int, struct cg *);
+static int ffs_cgidx_find(struct fs *, int, int);
+
+/*
+ * In-memory free space index over all cylinder groups.
+ *
+ * For each cylinder group we keep the largest allocation (in fragments)
+ * the group can currently satisfy: fs_frag if it has a free block,
+ * otherwise the largest fragment run recorded in cg_frsum[].  The values
+ * are kept in a max segment tree so that the first group at or after a
+ * given one that can satisfy a request is found in O(log ncg), without
+ * reading cylinder group blocks that cannot satisfy it.
+ *
+ * Entries are seeded from the in-core csum array (which may overestimate
+ * the fragment case) and made exact whenever a group's cg block is read.
+ */
+static struct {
+	struct fs	*fs;		/* file system the index describes */
+	int		ncg;		/* number of cylinder groups */
+	int		nleaf;		/* ncg rounded up to a power of 2 */
+	uint8_t		*tree;		/* max segment tree, 2 * nleaf */
+} cgidx;
+
+/*
+ * Sequential placement cursor used while writing files from a sort list.
+ * When non-zero, new sections of a file are placed at the cursor instead
+ * of the inode's cylinder group, and the cursor follows each allocation.
+ */
+static daddr_t seqpref;
+
 /*
  * Allocate a block in the file system.
  * 
@@ -101,12 +136,16 @@ ffs_alloc(struct inode *ip, daddr_t lbn __unused, daddr_t bpref, int size,
 		goto nospace;
 	if (bpref >= fs->fs_size)
 		bpref = 0;
+	if (bpref == 0 && seqpref != 0 && seqpref < fs->fs_size)
+		bpref = seqpref;
 	if (bpref == 0)
 		cg = ino_to_cg(fs, ip->i_number);
 	else
 		cg = dtog(fs, bpref);
 	bno = ffs_hashalloc(ip, cg, bpref, size, ffs_alloccg);
 	if (bno > 0) {
+		if (seqpref != 0 && bno + numfrags(fs, size) > seqpref)
+			seqpref = bno + numfrags(fs, size);
 		if (ip->i_fs->fs_magic == FS_UFS1_MAGIC)
 			ip->i_ffs1_blocks += size / DEV_BSIZE;
 		else
@@ -154,6 +193,8 @@ ffs_blkpref_ufs1(struct inode *ip, daddr_t lbn, int indx, int32_t *bap)
 
 	fs = ip->i_fs;
 	if (indx % fs->fs_maxbpg == 0 || bap[indx - 1] == 0) {
+		if (seqpref != 0 && seqpref < fs->fs_size)
+			return (seqpref);
 		if (lbn < UFS_NDADDR + NINDIR(fs)) {
 			cg = ino_to_cg(fs, ip->i_number);
 			return (fs->fs_fpg * cg + fs->fs_frag);
@@ -193,6 +234,8 @@ ffs_blkpref_ufs2(struct inode *ip, daddr_t lbn, int indx, int64_t *bap)
 
 	fs = ip->i_fs;
 	if (indx % fs->fs_maxbpg == 0 || bap[indx - 1] == 0) {
+		if (seqpref != 0 && seqpref < fs->fs_size)
+			return (seqpref);
 		if (lbn < UFS_NDADDR + NINDIR(fs)) {
 			cg = ino_to_cg(fs, ip->i_number);
 			return (fs->fs_fpg * cg + fs->fs_frag);
@@ -225,6 +268,24 @@ ffs_blkpref_ufs2(struct inode *ip, daddr_t lbn, int indx, int64_t *bap)
 	return ufs_rw64(bap[indx - 1], UFS_FSNEEDSWAP(fs)) + fs->fs_frag;
 }
 
+/*
+ * Start placing blocks sequentially from the beginning of the first
+ * cylinder group, regardless of the cylinder group of the inode.
+ */
+void
+ffs_seqalloc_start(struct fs *fs)
+{
+
+	seqpref = fs->fs_frag;
+}
+
+void
+ffs_seqalloc_stop(void)
+{
+
+	seqpref = 0;
+}
+
 /*
  * Implement the cylinder overflow algorithm.
  *
@@ -243,6 +304,7 @@ ffs_hashalloc(struct inode *ip, u_int cg, daddr_t pref, int size,
 	struct fs *fs;
 	daddr_t result;
 	u_int i, icg = cg;
+	int next;
 
 	fs = ip->i_fs;
 	/*
@@ -263,12 +325,19 @@ ffs_hashalloc(struct inode *ip, u_int cg, daddr_t pref, int size,
 			return (result);
 	}
 	/*
-	 * 3: brute force search
+	 * 3: search the free space index
 	 * Note that we start at i == 2, since 0 was checked initially,
 	 * and 1 is always checked in the quadratic rehash.
+	 * Groups that cannot satisfy the request are skipped without
+	 * being read, so this visits groups in the same order as a brute
+	 * force search would succeed.
 	 */
 	cg = (icg + 2) % fs->fs_ncg;
 	for (i = 2; i < fs->fs_ncg; i++) {
+		next = ffs_cgidx_find(fs, cg, numfrags(fs, size));
+		if (next < 0)
+			break;
+		cg = next;
 		result = (*allocator)(ip, cg, 0, size);
 		if (result)
 			return (result);
@@ -297,19 +366,26 @@ ffs_alloccg(struct inode *ip, int cg, daddr_t bpref, int size)
 
 	if (fs->fs_cs(fs, cg).cs_nbfree == 0 && size == fs->fs_bsize)
 		return (0);
+	if (ffs_cgidx_get(fs, cg) < numfrags(fs, size))
+		return (0);
 	error = bread((void *)ip->i_devvp, fsbtodb(fs, cgtod(fs, cg)),
 	    (int)fs->fs_cgsize, NULL, &bp);
 	if (error) {
 		return (0);
 	}
 	cgp = (struct cg *)bp->b_data;
-	if (!cg_chkmagic_swap(cgp, needswap) ||
-	    (cgp->cg_cs.cs_nbfree == 0 && size == fs->fs_bsize)) {
+	if (!cg_chkmagic_swap(cgp, needswap)) {
+		brelse(bp);
+		return (0);
+	}
+	if (cgp->cg_cs.cs_nbfree == 0 && size == fs->fs_bsize) {
+		ffs_cgidx_update(fs, cg, cgp);
 		brelse(bp);
 		return (0);
 	}
 	if (size == fs->fs_bsize) {
 		bno = ffs_alloccgblk(ip, bp, bpref);
+		ffs_cgidx_update(fs, cg, cgp);
 		bdwrite(bp);
 		return (bno);
 	}
@@ -328,6 +404,7 @@ ffs_alloccg(struct inode *ip, int cg, daddr_t bpref, int size)
 		 * allocated, and hacked up
 		 */
 		if (cgp->cg_cs.cs_nbfree == 0) {
+			ffs_cgidx_update(fs, cg, cgp);
 			brelse(bp);
 			return (0);
 		}
@@ -341,6 +418,7 @@ ffs_alloccg(struct inode *ip, int cg, daddr_t bpref, int size)
 		fs->fs_cs(fs, cg).cs_nffree += i;
 		fs->fs_fmod = 1;
 		ufs_add32(cgp->cg_frsum[i], 1, needswap);
+		ffs_cgidx_update(fs, cg, cgp);
 		bdwrite(bp);
 		return (bno);
 	}
@@ -355,6 +433,7 @@ ffs_alloccg(struct inode *ip, int cg, daddr_t bpref, int size)
 	if (frags != allocsiz)
 		ufs_add32(cgp->cg_frsum[allocsiz - frags], 1, needswap);
 	blkno = cg * fs->fs_fpg + bno;
+	ffs_cgidx_update(fs, cg, cgp);
 	bdwrite(bp);
 	return blkno;
 }
@@ -503,9 +582,121 @@ ffs_blkfree(struct inode *ip, daddr_t bno, long size)
 		}
 	}
 	fs->fs_fmod = 1;
+	ffs_cgidx_update(fs, cg, cgp);
 	bdwrite(bp);
 }
 
+/*
+ * (Re)build the free space index for the given file system from the
+ * in-core cylinder group summaries.
+ */
+static void
+ffs_cgidx_init(struct fs *fs)
+{
+	int cg, cap;
+
+	free(cgidx.tree);
+	cgidx.fs = fs;
+	cgidx.ncg = fs->fs_ncg;
+	for (cgidx.nleaf = 1; cgidx.nleaf < cgidx.ncg; cgidx.nleaf <<= 1)
+		;
+	cgidx.tree = ecalloc(2 * cgidx.nleaf, sizeof(*cgidx.tree));
+	for (cg = 0; cg < cgidx.ncg; cg++) {
+		if (fs->fs_cs(fs, cg).cs_nbfree > 0)
+			cap = fs->fs_frag;
+		else
+			cap = MIN(fs->fs_cs(fs, cg).cs_nffree, fs->fs_frag - 1);
+		cgidx.tree[cgidx.nleaf + cg] = cap;
+	}
+	for (cg = cgidx.nleaf - 1; cg > 0; cg--)
+		cgidx.tree[cg] = MAX(cgidx.tree[2 * cg],
+		    cgidx.tree[2 * cg + 1]);
+}
+
+/*
+ * Return the largest allocation in fragments cylinder group cg
+ * may satisfy.
+ */
+static int
+ffs_cgidx_get(struct fs *fs, int cg)
+{
+
+	if (cgidx.fs != fs || cgidx.ncg != fs->fs_ncg)
+		ffs_cgidx_init(fs);
+	return (cgidx.tree[cgidx.nleaf + cg]);
+}
+
+static void
+ffs_cgidx_set(struct fs *fs, int cg, int cap)
+{
+	int i;
+
+	if (cgidx.fs != fs || cgidx.ncg != fs->fs_ncg)
+		ffs_cgidx_init(fs);
+	i = cgidx.nleaf + cg;
+	if (cgidx.tree[i] == cap)
+		return;
+	cgidx.tree[i] = cap;
+	for (i /= 2; i > 0; i /= 2)
+		cgidx.tree[i] = MAX(cgidx.tree[2 * i], cgidx.tree[2 * i + 1]);
+}
+
+/*
+ * Make the index entry of cylinder group cg exact from its cg block.
+ */
+static void
+ffs_cgidx_update(struct fs *fs, int cg, struct cg *cgp)
+{
+	const int needswap = UFS_FSNEEDSWAP(fs);
+	int i;
+
+	if (ufs_rw32(cgp->cg_cs.cs_nbfree, needswap) > 0) {
+		ffs_cgidx_set(fs, cg, fs->fs_frag);
+		return;
+	}
+	for (i = fs->fs_frag - 1; i > 0; i--)
+		if (ufs_rw32(cgp->cg_frsum[i], needswap) != 0)
+			break;
+	ffs_cgidx_set(fs, cg, i);
+}
+
+/*
+ * Find the first cylinder group in [lo, hi) of the subtree rooted at
+ * node, which covers [nlo, nhi), that can satisfy frags fragments.
+ */
+static int
+ffs_cgidx_search(int node, int nlo, int nhi, int lo, int hi, int frags)
+{
+	int mid, cg;
+
+	if (nhi <= lo || nlo >= hi || cgidx.tree[node] < frags)
+		return (-1);
+	if (nhi - nlo == 1)
+		return (nlo);
+	mid = (nlo + nhi) / 2;
+	cg = ffs_cgidx_search(2 * node, nlo, mid, lo, hi, frags);
+	if (cg >= 0)
+		return (cg);
+	return (ffs_cgidx_search(2 * node + 1, mid, nhi, lo, hi, frags));
+}
+
+/*
+ * Find the first cylinder group at or after startcg, wrapping around,
+ * that may satisfy an allocation of frags fragments.
+ * Return -1 if there is none.
+ */
+static int
+ffs_cgidx_find(struct fs *fs, int startcg, int frags)
+{
+	int cg;
+
+	if (cgidx.fs != fs || cgidx.ncg != fs->fs_ncg)
+		ffs_cgidx_init(fs);
+	cg = ffs_cgidx_search(1, 0, cgidx.nleaf, startcg, cgidx.ncg, frags);
+	if (cg < 0)
+		cg = ffs_cgidx_search(1, 0, cgidx.nleaf, 0, startcg, frags);
+	return (cg);
+}
 
 static int
 scanc(u_int size, const u_char *cp, const u_char table[], int mask)
@@ -33,6 +33,7 @@
 #endif
 
 #if !defined(_KERNEL)
+#include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -56,9 +57,91 @@
 #define	FS_42POSTBLFMT		-1	/* 4.2BSD rotational table format */
 #define	FS_DYNAMICPOSTBLFMT	1	/* dynamic rotational table format */
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define	FFS_BSWAP_SSSE3
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define	FFS_BSWAP_NEON
+#endif
+
 void ffs_csum_swap(struct csum *o, struct csum *n, int size);
 void ffs_csumtotal_swap(struct csum_total *o, struct csum_total *n);
 
+static int ffs_bswap_simd(void);
+static void ffs_bswap_shuffle(const uint8_t *, uint8_t *, size_t,
+    const uint8_t (*)[16], size_t);
+static void ffs_bswap_masks(const uint16_t (*)[2], size_t, uint8_t (*)[16],
+    size_t);
+
+/*
+ * Byte permutations of 16 byte chunks: reverse each 2, 4 and 8 byte
+ * element.
+ */
+static const uint8_t bswap16_mask[1][16] = {
+	{ 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 }
+};
+static const uint8_t bswap32_mask[1][16] = {
+	{ 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 }
+};
+static const uint8_t bswap64_mask[1][16] = {
+	{ 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 }
+};
+
+/*
+ * Fields of the dinodes that are byte swapped, as { offset, size }.
+ * The block pointers (and the short symlinks overlaying them) are kept
+ * in disk byte order and only copied.
+ */
+#define	DIFIELD(t, f)	{ offsetof(struct t, f), sizeof(((struct t *)0)->f) }
+static const uint16_t ufs1_dinode_fields[][2] = {
+	DIFIELD(ufs1_dinode, di_mode),
+	DIFIELD(ufs1_dinode, di_nlink),
+	DIFIELD(ufs1_dinode, di_freelink),
+	DIFIELD(ufs1_dinode, di_size),
+	DIFIELD(ufs1_dinode, di_atime),
+	DIFIELD(ufs1_dinode, di_atimensec),
+	DIFIELD(ufs1_dinode, di_mtime),
+	DIFIELD(ufs1_dinode, di_mtimensec),
+	DIFIELD(ufs1_dinode, di_ctime),
+	DIFIELD(ufs1_dinode, di_ctimensec),
+	DIFIELD(ufs1_dinode, di_flags),
+	DIFIELD(ufs1_dinode, di_blocks),
+	DIFIELD(ufs1_dinode, di_gen),
+	DIFIELD(ufs1_dinode, di_uid),
+	DIFIELD(ufs1_dinode, di_gid),
+	DIFIELD(ufs1_dinode, di_modrev),
+};
+static const uint16_t ufs2_dinode_fields[][2] = {
+	DIFIELD(ufs2_dinode, di_mode),
+	DIFIELD(ufs2_dinode, di_nlink),
+	DIFIELD(ufs2_dinode, di_uid),
+	DIFIELD(ufs2_dinode, di_gid),
+	DIFIELD(ufs2_dinode, di_blksize),
+	DIFIELD(ufs2_dinode, di_size),
+	DIFIELD(ufs2_dinode, di_blocks),
+	DIFIELD(ufs2_dinode, di_atime),
+	DIFIELD(ufs2_dinode, di_mtime),
+	DIFIELD(ufs2_dinode, di_ctime),
+	DIFIELD(ufs2_dinode, di_birthtime),
+	DIFIELD(ufs2_dinode, di_mtimensec),
+	DIFIELD(ufs2_dinode, di_atimensec),
+	DIFIELD(ufs2_dinode, di_ctimensec),
+	DIFIELD(ufs2_dinode, di_birthnsec),
+	DIFIELD(ufs2_dinode, di_gen),
+	DIFIELD(ufs2_dinode, di_kernflags),
+	DIFIELD(ufs2_dinode, di_flags),
+	DIFIELD(ufs2_dinode, di_extsize),
+	DIFIELD(ufs2_dinode, di_modrev),
+	DIFIELD(ufs2_dinode, di_freelink),
+	DIFIELD(ufs2_dinode, di_ckhash),
+};
+#undef DIFIELD
+
+static uint8_t ufs1_dinode_masks[sizeof(struct ufs1_dinode) / 16][16];
+static uint8_t ufs2_dinode_masks[sizeof(struct ufs2_dinode) / 16][16];
+static int ufs1_dinode_masks_built, ufs2_dinode_masks_built;
+
 void
 ffs_sb_swap(struct fs *o, struct fs *n)
 {
@@ -121,62 +204,58 @@ void
 ffs_dinode1_swap(struct ufs1_dinode *o, struct ufs1_dinode *n)
 {
 
-	n->di_mode = bswap16(o->di_mode);
-	n->di_nlink = bswap16(o->di_nlink);
-	n->di_size = bswap64(o->di_size);
-	n->di_atime = bswap32(o->di_atime);
-	n->di_atimensec = bswap32(o->di_atimensec);
-	n->di_mtime = bswap32(o->di_mtime);
-	n->di_mtimensec = bswap32(o->di_mtimensec);
-	n->di_ctime = bswap32(o->di_ctime);
-	n->di_ctimensec = bswap32(o->di_ctimensec);
-	memcpy(n->di_db, o->di_db, sizeof(n->di_db));
-	memcpy(n->di_ib, o->di_ib, sizeof(n->di_ib));
-	n->di_flags = bswap32(o->di_flags);
-	n->di_blocks = bswap32(o->di_blocks);
-	n->di_gen = bswap32(o->di_gen);
-	n->di_uid = bswap32(o->di_uid);
-	n->di_gid = bswap32(o->di_gid);
+	ffs_dinode1_swap_array(o, n, 1);
 }
 
 void
 ffs_dinode2_swap(struct ufs2_dinode *o, struct ufs2_dinode *n)
 {
-	n->di_mode = bswap16(o->di_mode);
-	n->di_nlink = bswap16(o->di_nlink);
-	n->di_uid = bswap32(o->di_uid);
-	n->di_gid = bswap32(o->di_gid);
-	n->di_blksize = bswap32(o->di_blksize);
-	n->di_size = bswap64(o->di_size);
-	n->di_blocks = bswap64(o->di_blocks);
-	n->di_atime = bswap64(o->di_atime);
-	n->di_atimensec = bswap32(o->di_atimensec);
-	n->di_mtime = bswap64(o->di_mtime);
-	n->di_mtimensec = bswap32(o->di_mtimensec);
-	n->di_ctime = bswap64(o->di_ctime);
-	n->di_ctimensec = bswap32(o->di_ctimensec);
-	n->di_birthtime = bswap64(o->di_ctime);
-	n->di_birthnsec = bswap32(o->di_ctimensec);
-	n->di_gen = bswap32(o->di_gen);
-	n->di_kernflags = bswap32(o->di_kernflags);
-	n->di_flags = bswap32(o->di_flags);
-	n->di_extsize = bswap32(o->di_extsize);
-	memcpy(n->di_extb, o->di_extb, sizeof(n->di_extb));
-	memcpy(n->di_db, o->di_db, sizeof(n->di_db));
-	memcpy(n->di_ib, o->di_ib, sizeof(n->di_ib));
+
+	ffs_dinode2_swap_array(o, n, 1);
 }
 
+/*
+ * Swap count consecutive dinodes, e.g. a whole inode block.
+ * o and n may be the same.
+ */
 void
-ffs_csum_swap(struct csum *o, struct csum *n, int size)
+ffs_dinode1_swap_array(struct ufs1_dinode *o, struct ufs1_dinode *n,
+    size_t count)
 {
-	size_t i;
-	u_int32_t *oint, *nint;
 
-	oint = (u_int32_t*)o;
-	nint = (u_int32_t*)n;
+	if (!ufs1_dinode_masks_built) {
+		ffs_bswap_masks(ufs1_dinode_fields,
+		    nitems(ufs1_dinode_fields), ufs1_dinode_masks,
+		    nitems(ufs1_dinode_masks));
+		ufs1_dinode_masks_built = 1;
+	}
+	ffs_bswap_shuffle((const uint8_t *)o, (uint8_t *)n,
+	    count * nitems(ufs1_dinode_masks), ufs1_dinode_masks,
+	    nitems(ufs1_dinode_masks));
+}
+
+void
+ffs_dinode2_swap_array(struct ufs2_dinode *o, struct ufs2_dinode *n,
+    size_t count)
+{
 
-	for (i = 0; i < size / sizeof(u_int32_t); i++)
-		nint[i] = bswap32(oint[i]);
+	if (!ufs2_dinode_masks_built) {
+		ffs_bswap_masks(ufs2_dinode_fields,
+		    nitems(ufs2_dinode_fields), ufs2_dinode_masks,
+		    nitems(ufs2_dinode_masks));
+		ufs2_dinode_masks_built = 1;
+	}
+	ffs_bswap_shuffle((const uint8_t *)o, (uint8_t *)n,
+	    count * nitems(ufs2_dinode_masks), ufs2_dinode_masks,
+	    nitems(ufs2_dinode_masks));
+}
+
+void
+ffs_csum_swap(struct csum *o, struct csum *n, int size)
+{
+
+	ffs_bswap32_array((const uint32_t *)o, (uint32_t *)n,
+	    size / sizeof(uint32_t));
 }
 
 void
@@ -194,9 +273,6 @@ ffs_csumtotal_swap(struct csum_total *o, struct csum_total *n)
 void
 ffs_cg_swap(struct cg *o, struct cg *n, struct fs *fs)
 {
-	int i;
-	u_int32_t *n32, *o32;
-	u_int16_t *n16, *o16;
 	int32_t btotoff, boff, clustersumoff;
 
 	n->cg_firstfield = bswap32(o->cg_firstfield);
@@ -213,9 +289,9 @@ ffs_cg_swap(struct cg *o, struct cg *n, struct fs *fs)
 	n->cg_rotor = bswap32(o->cg_rotor);
 	n->cg_frotor = bswap32(o->cg_frotor);
 	n->cg_irotor = bswap32(o->cg_irotor);
-	for (i = 0; i < MAXFRAG; i++)
-		n->cg_frsum[i] = bswap32(o->cg_frsum[i]);
-	
+	ffs_bswap32_array((const uint32_t *)o->cg_frsum,
+	    (uint32_t *)n->cg_frsum, MAXFRAG);
+
 	n->cg_old_btotoff = bswap32(o->cg_old_btotoff);
 	n->cg_old_boff = bswap32(o->cg_old_boff);
 	n->cg_iusedoff = bswap32(o->cg_iusedoff);
@@ -228,9 +304,6 @@ ffs_cg_swap(struct cg *o, struct cg *n, struct fs *fs)
 	n->cg_initediblk = bswap32(o->cg_initediblk);
 	n->cg_time = bswap64(o->cg_time);
 
-	if (fs->fs_magic == FS_UFS2_MAGIC)
-		return;
-
 	if (n->cg_magic == CG_MAGIC) {
 		btotoff = n->cg_old_btotoff;
 		boff = n->cg_old_boff;
@@ -240,19 +313,175 @@ ffs_cg_swap(struct cg *o, struct cg *n, struct fs *fs)
 		boff = bswap32(n->cg_old_boff);
 		clustersumoff = bswap32(n->cg_clustersumoff);
 	}
-	n32 = (u_int32_t *)((u_int8_t *)n + btotoff);
-	o32 = (u_int32_t *)((u_int8_t *)o + btotoff);
-	n16 = (u_int16_t *)((u_int8_t *)n + boff);
-	o16 = (u_int16_t *)((u_int8_t *)o + boff);
 
-	for (i = 0; i < fs->fs_old_cpg; i++)
-		n32[i] = bswap32(o32[i]);
-	
-	for (i = 0; i < fs->fs_old_cpg * fs->fs_old_nrpos; i++)
-		n16[i] = bswap16(o16[i]);
+	/* cluster summary, indexed from 1 */
+	if (fs->fs_contigsumsize > 0)
+		ffs_bswap32_array(
+		    (const uint32_t *)((const uint8_t *)o + clustersumoff) + 1,
+		    (uint32_t *)((uint8_t *)n + clustersumoff) + 1,
+		    fs->fs_contigsumsize);
 
-	n32 = (u_int32_t *)((u_int8_t *)n + clustersumoff);
-	o32 = (u_int32_t *)((u_int8_t *)o + clustersumoff);
-	for (i = 1; i < fs->fs_contigsumsize + 1; i++)
-		n32[i] = bswap32(o32[i]);
+	if (fs->fs_magic == FS_UFS2_MAGIC)
+		return;
+
+	ffs_bswap32_array((const uint32_t *)((const uint8_t *)o + btotoff),
+	    (uint32_t *)((uint8_t *)n + btotoff), fs->fs_old_cpg);
+	ffs_bswap16_array((const uint16_t *)((const uint8_t *)o + boff),
+	    (uint16_t *)((uint8_t *)n + boff),
+	    fs->fs_old_cpg * fs->fs_old_nrpos);
+}
+
+/*
+ * Array byte swap kernels; o and n may be the same.  Whole 16 byte
+ * chunks go through the SIMD shuffle when the CPU has one, the rest
+ * is swapped one element at a time.
+ */
+void
+ffs_bswap16_array(const uint16_t *o, uint16_t *n, size_t count)
+{
+	size_t i;
+
+	i = 0;
+	if (ffs_bswap_simd()) {
+		i = count / 8 * 8;
+		ffs_bswap_shuffle((const uint8_t *)o, (uint8_t *)n, i / 8,
+		    bswap16_mask, 1);
+	}
+	for (; i < count; i++)
+		n[i] = bswap16(o[i]);
+}
+
+void
+ffs_bswap32_array(const uint32_t *o, uint32_t *n, size_t count)
+{
+	size_t i;
+
+	i = 0;
+	if (ffs_bswap_simd()) {
+		i = count / 4 * 4;
+		ffs_bswap_shuffle((const uint8_t *)o, (uint8_t *)n, i / 4,
+		    bswap32_mask, 1);
+	}
+	for (; i < count; i++)
+		n[i] = bswap32(o[i]);
+}
+
+void
+ffs_bswap64_array(const uint64_t *o, uint64_t *n, size_t count)
+{
+	size_t i;
+
+	i = 0;
+	if (ffs_bswap_simd()) {
+		i = count / 2 * 2;
+		ffs_bswap_shuffle((const uint8_t *)o, (uint8_t *)n, i / 2,
+		    bswap64_mask, 1);
+	}
+	for (; i < count; i++)
+		n[i] = bswap64(o[i]);
+}
+
+/*
+ * Build the per-chunk shuffle masks of a structure from its list of
+ * byte swapped fields.  Bytes outside those fields are copied.
+ */
+static void
+ffs_bswap_masks(const uint16_t (*fields)[2], size_t nfields,
+    uint8_t (*masks)[16], size_t nmasks)
+{
+	size_t i, j, off, size;
+
+	for (i = 0; i < nmasks; i++)
+		for (j = 0; j < 16; j++)
+			masks[i][j] = j;
+	for (i = 0; i < nfields; i++) {
+		off = fields[i][0];
+		size = fields[i][1];
+		/* fields are naturally aligned, never straddling a chunk */
+		assert(off / 16 == (off + size - 1) / 16);
+		for (j = 0; j < size; j++)
+			masks[(off + j) / 16][(off + j) % 16] =
+			    (off + size - 1 - j) % 16;
+	}
+}
+
+#ifdef FFS_BSWAP_SSSE3
+__attribute__((target("ssse3")))
+static void
+ffs_bswap_shuffle_ssse3(const uint8_t *o, uint8_t *n, size_t nchunks,
+    const uint8_t (*masks)[16], size_t nmasks)
+{
+	size_t i;
+	__m128i v;
+
+	if (nmasks == 1) {
+		const __m128i m = _mm_loadu_si128((const __m128i *)masks[0]);
+
+		for (i = 0; i < nchunks; i++) {
+			v = _mm_loadu_si128((const __m128i *)(o + 16 * i));
+			_mm_storeu_si128((__m128i *)(n + 16 * i),
+			    _mm_shuffle_epi8(v, m));
+		}
+		return;
+	}
+	for (i = 0; i < nchunks; i++) {
+		v = _mm_loadu_si128((const __m128i *)(o + 16 * i));
+		v = _mm_shuffle_epi8(v,
+		    _mm_loadu_si128((const __m128i *)masks[i % nmasks]));
+		_mm_storeu_si128((__m128i *)(n + 16 * i), v);
+	}
+}
+#endif
+
+/*
+ * Return non-zero if ffs_bswap_shuffle() has a SIMD implementation
+ * on this CPU.
+ */
+static int
+ffs_bswap_simd(void)
+{
+#if defined(FFS_BSWAP_SSSE3)
+	static int simd = -1;
+
+	if (simd == -1) {
+		__builtin_cpu_init();
+		simd = __builtin_cpu_supports("ssse3") != 0;
+	}
+	return (simd);
+#elif defined(FFS_BSWAP_NEON)
+	return (1);
+#else
+	return (0);
+#endif
+}
+
+/*
+ * Permute each 16 byte chunk of o into n, chunk i by masks[i % nmasks].
+ * o and n may be the same.
+ */
+static void
+ffs_bswap_shuffle(const uint8_t *o, uint8_t *n, size_t nchunks,
+    const uint8_t (*masks)[16], size_t nmasks)
+{
+	const uint8_t *m;
+	uint8_t t[16];
+	size_t i, j;
+
+#if defined(FFS_BSWAP_SSSE3)
+	if (ffs_bswap_simd()) {
+		ffs_bswap_shuffle_ssse3(o, n, nchunks, masks, nmasks);
+		return;
+	}
+#elif defined(FFS_BSWAP_NEON)
+	for (i = 0; i < nchunks; i++)
+		vst1q_u8(n + 16 * i, vqtbl1q_u8(vld1q_u8(o + 16 * i),
+		    vld1q_u8(masks[i % nmasks])));
+	return;
+#endif
+	for (i = 0; i < nchunks; i++, o += 16, n += 16) {
+		m = masks[i % nmasks];
+		for (j = 0; j < 16; j++)
+			t[j] = o[m[j]];
+		memcpy(n, t, sizeof(t));
+	}
 }
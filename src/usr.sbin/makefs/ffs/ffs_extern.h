@@ -56,6 +56,8 @@ daddr_t ffs_blkpref_ufs1(struct inode *, daddr_t, int, int32_t *);
 daddr_t ffs_blkpref_ufs2(struct inode *, daddr_t, int, int64_t *);
 void ffs_blkfree(struct inode *, daddr_t, long);
 void ffs_clusteracct(struct fs *, struct cg *, int32_t, int);
+void ffs_seqalloc_start(struct fs *);
+void ffs_seqalloc_stop(void);
 
 	/* ffs_balloc.c */
 int ffs_balloc(struct inode *, off_t, int, struct m_buf **);
@@ -64,6 +66,13 @@ int ffs_balloc(struct inode *, off_t, int, struct m_buf **);
 void ffs_sb_swap(struct fs*, struct fs *);
 void ffs_dinode1_swap(struct ufs1_dinode *, struct ufs1_dinode *);
 void ffs_dinode2_swap(struct ufs2_dinode *, struct ufs2_dinode *);
+void ffs_dinode1_swap_array(struct ufs1_dinode *, struct ufs1_dinode *,
+    size_t);
+void ffs_dinode2_swap_array(struct ufs2_dinode *, struct ufs2_dinode *,
+    size_t);
+void ffs_bswap16_array(const uint16_t *, uint16_t *, size_t);
+void ffs_bswap32_array(const uint32_t *, uint32_t *, size_t);
+void ffs_bswap64_array(const uint64_t *, uint64_t *, size_t);
 void ffs_csum_swap(struct csum *, struct csum *, int);
 void ffs_cg_swap(struct cg *, struct cg *, struct fs *);
 
@@ -570,6 +570,91 @@ ffs_mkfs(const char *fsys, const fsinfo_t *fsopts, time_t tstamp)
 	return (&sblock);
 }
 
+/*
+ * Read the superblock and cylinder group summaries of an existing
+ * file system so that it can be updated in place.  The byte order
+ * of the image overrides fsopts->needswap.
+ */
+struct fs *
+ffs_loadfs(const char *fsys, fsinfo_t *fsopts)
+{
+	static const int64_t sblocks[] = { SBLOCK_UFS2, SBLOCK_UFS1 };
+	struct fs *fs;
+	uint32_t i;
+	int32_t magic;
+	int blks, size;
+	void *space;
+	char *rdbuf;
+
+	sectorsize = fsopts->sectorsize;
+	sbsize = SBLOCKSIZE;
+	fs = (struct fs *)writebuf;
+	for (i = 0; i < nitems(sblocks); i++) {
+		ffs_rdfs(sblocks[i] / sectorsize, sbsize, writebuf, fsopts);
+		magic = fs->fs_magic;
+		if ((magic == FS_UFS1_MAGIC || magic == FS_UFS2_MAGIC) &&
+		    fs->fs_sblockloc == sblocks[i]) {
+			fsopts->needswap = 0;
+			break;
+		}
+		magic = bswap32(magic);
+		if ((magic == FS_UFS1_MAGIC || magic == FS_UFS2_MAGIC) &&
+		    (int64_t)bswap64(fs->fs_sblockloc) == sblocks[i]) {
+			fsopts->needswap = 1;
+			break;
+		}
+	}
+	if (i == nitems(sblocks))
+		errx(1, "%s: no ffs superblock found", fsys);
+	if (fsopts->needswap)
+		ffs_sb_swap(fs, &sblock);
+	else
+		memcpy(&sblock, fs, sbsize);
+	if (sblock.fs_bsize < MINBSIZE || sblock.fs_bsize > FFS_MAXBSIZE ||
+	    !POWEROF2(sblock.fs_bsize) || sblock.fs_fsize < sectorsize ||
+	    sblock.fs_frag > MAXFRAG || sblock.fs_ncg < 1)
+		errx(1, "%s: bad ffs superblock", fsys);
+	if (fsopts->needswap)
+		sblock.fs_flags |= FS_SWAPPED;
+
+	/*
+	 * Setup memory for in-core cylgroup summaries, as in ffs_mkfs().
+	 */
+	size = sblock.fs_cssize;
+	if (sblock.fs_contigsumsize > 0)
+		size += sblock.fs_ncg * sizeof(int32_t);
+	space = ecalloc(1, size);
+	sblock.fs_si = ecalloc(1, sizeof(struct fs_summary_info));
+	sblock.fs_csp = space;
+	if (sblock.fs_contigsumsize > 0) {
+		int32_t *lp;
+
+		sblock.fs_maxcluster = lp =
+		    (int32_t *)((char *)space + sblock.fs_cssize);
+		for (i = 0; i < sblock.fs_ncg; i++)
+			*lp++ = sblock.fs_contigsumsize;
+	}
+
+	/* Read in the cylinder group summaries */
+	blks = howmany(sblock.fs_cssize, sblock.fs_fsize);
+	rdbuf = emalloc(sblock.fs_bsize);
+	for (i = 0; i < (uint32_t)blks; i += sblock.fs_frag) {
+		size = sblock.fs_bsize;
+		if (i + sblock.fs_frag > (uint32_t)blks)
+			size = (blks - i) * sblock.fs_fsize;
+		ffs_rdfs(fsbtodb(&sblock, sblock.fs_csaddr + i), size, rdbuf,
+		    fsopts);
+		if (fsopts->needswap)
+			ffs_csum_swap((struct csum *)rdbuf,
+			    (struct csum *)space, size);
+		else
+			memcpy(space, rdbuf, (u_int)size);
+		space = (char *)space + size;
+	}
+	free(rdbuf);
+	return (&sblock);
+}
+
 /*
  * Write out the superblock and its duplicates,
  * and the cylinder group summaries
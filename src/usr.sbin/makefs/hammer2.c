@@ -44,6 +44,10 @@
 #ifdef __DragonFly__
 #include <sys/sysctl.h>
 #endif
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -52,8 +56,10 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <time.h>
 #include <err.h>
+#include <errno.h>
 #include <assert.h>
 #include <util.h>
 
@@ -66,13 +72,31 @@
 
 static void hammer2_parse_pfs_opts(const char *, fsinfo_t *);
 static void hammer2_parse_inode_opts(const char *, fsinfo_t *);
+static void hammer2_parse_bench_opts(const char *, fsinfo_t *);
 static void hammer2_dump_fsinfo(fsinfo_t *);
+static void hammer2_parse_volumes(const char *, fsinfo_t *);
 static int hammer2_create_image(const char *, fsinfo_t *);
 static int hammer2_populate_dir(struct m_vnode *, const char *, fsnode *,
     fsnode *, fsinfo_t *, int);
 static void hammer2_validate(const char *, fsnode *, fsinfo_t *);
 static void hammer2_size_dir(fsnode *, fsinfo_t *);
 static int hammer2_write_file(struct m_vnode *, const char *, fsnode *);
+static void hammer2_walk_trees(fsnode *, fsinfo_t *);
+static void hammer2_populate(const char *, struct m_vnode *, struct m_vnode *,
+    const char *, fsnode *, fsinfo_t *);
+static void hammer2_policy_load(const char *);
+static int hammer2_policy_select(struct m_vnode *, fsnode *, const char *,
+    size_t);
+static void hammer2_policy_account(hammer2_inode_t *, fsnode *, int, size_t);
+static void hammer2_policy_print(void);
+static void hammer2_report(const char *, fsinfo_t *);
+static void hammer2_write_commit(void);
+static void hammer2_release_vnode(struct m_vnode *);
+static void hammer2_populate_sync(hammer2_pfs_t *);
+static void hammer2_populate_bulkload(struct m_vnode *, fsnode *, fsinfo_t *);
+static void hammer2_link_enter(fsinode *, hammer2_tid_t);
+static hammer2_tid_t hammer2_link_lookup(fsinode *);
+static void hammer2_link_free(void);
 static int hammer2_version_get(struct m_vnode *);
 static int hammer2_pfs_get(struct m_vnode *);
 static int hammer2_pfs_lookup(struct m_vnode *, const char *);
@@ -81,18 +105,182 @@ static int hammer2_pfs_delete(struct m_vnode *, const char *);
 static int hammer2_pfs_snapshot(struct m_vnode *, const char *, const char *);
 static int hammer2_inode_getx(struct m_vnode *, const char *);
 static int hammer2_inode_setcheck(struct m_vnode *, const char *);
-static int hammer2_inode_setcomp(struct m_vnode *, const char *);
+static int hammer2_inode_setcomp(struct m_vnode *, const char *, bool);
+static int hammer2_recompress(struct m_vnode *, uint8_t);
+static int hammer2_comp_level(int, const char *);
 static int hammer2_bulkfree(struct m_vnode *);
 static int hammer2_destroy_path(struct m_vnode *, const char *);
 static int hammer2_destroy_inum(struct m_vnode *, hammer2_tid_t);
 static int hammer2_growfs(struct m_vnode *, hammer2_off_t);
-struct hammer2_linkq;
-static int hammer2_readx_handle(struct m_vnode *, const char *, const char *,
-    struct hammer2_linkq *);
-static int hammer2_readx(struct m_vnode *, const char *, const char *);
+static int hammer2_readx(struct m_vnode *, const char *, const char *, int);
+static mode_t hammer2_source_stat(hammer2_inode_t *, struct stat *);
+static fsnode *hammer2_source_dir(struct m_vnode *, const char *, fsnode *);
+static int hammer2_source_memfd(void);
+static int hammer2_source_write(void *, hammer2_key_t, const char *, size_t);
 static void unittest_trim_slash(void);
 
-fsnode *hammer2_curnode;
+__thread fsnode *hammer2_curnode;	/* per populate thread */
+
+/*
+ * File whose blocks are in the write pipeline.
+ */
+typedef struct hammer2_wfile {
+	struct m_vnode	*vp;
+	fsnode		*node;
+	char		*p;		/* mmap'd contents */
+	size_t		nsize;
+	int		refs;		/* blocks in pipeline + submitter */
+	int		policy;		/* HAMMER2_POLICY_xxx */
+	bool		rewrite;	/* recompress, node is NULL */
+	bool		hold;		/* vp not released once written */
+	uint64_t	mtime;		/* recompress, restored once written */
+} hammer2_wfile_t;
+
+static __thread hammer2_wpipe_t *hammer2_wpipe;	/* per populate thread */
+
+/*
+ * Inode number of each hardlinked file written so far, vnodes are
+ * released once their file is written.
+ */
+#define HAMMER2_LINKHASH_SIZE	1024
+#define HAMMER2_LINKHASH_MASK	(HAMMER2_LINKHASH_SIZE - 1)
+
+typedef struct hammer2_linkent {
+	struct hammer2_linkent	*next;
+	fsinode			*inode;
+	hammer2_tid_t		inum;
+} hammer2_linkent_t;
+
+static hammer2_linkent_t *hammer2_linkhash[HAMMER2_LINKHASH_SIZE];
+static pthread_mutex_t hammer2_link_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Per-file compression policy, see hammer2_policy_select().  Each file
+ * is accounted to the reason its compression was chosen.
+ */
+#define HAMMER2_POLICY_INHERIT	0	/* directory's comp_algo */
+#define HAMMER2_POLICY_RULE	1	/* rule table */
+#define HAMMER2_POLICY_SMALL	2	/* too small to gain a block */
+#define HAMMER2_POLICY_SUFFIX	3	/* already compressed format */
+#define HAMMER2_POLICY_ENTROPY	4	/* first block looks random */
+#define HAMMER2_POLICY_COUNT	5
+
+/* order-0 entropy of the first block, in 1/256 bits per byte */
+#define HAMMER2_POLICY_ENTROPY_MAX	(7 * 256 + 192)
+
+typedef struct hammer2_policy_rule {
+	char		*pattern;
+	int		comp_algo;
+	off_t		min_size;
+} hammer2_policy_rule_t;
+
+typedef struct hammer2_policy_stat {
+	uint64_t	files;
+	uint64_t	lbytes;		/* file size */
+	uint64_t	pbytes;		/* data blocks allocated */
+} hammer2_policy_stat_t;
+
+static bool hammer2_policy_enabled;
+static hammer2_policy_rule_t *hammer2_policy_rules;
+static int hammer2_policy_nrules;
+static hammer2_policy_stat_t hammer2_policy_stats[HAMMER2_POLICY_COUNT];
+static pthread_mutex_t hammer2_policy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *hammer2_policy_names[HAMMER2_POLICY_COUNT] = {
+	"inherit", "rule", "small", "suffix", "entropy",
+};
+
+/* formats which are already compressed */
+static const char *hammer2_policy_suffixes[] = {
+	"7z", "aac", "apk", "avif", "br", "bz2", "cab", "deb", "docx",
+	"flac", "gif", "gz", "heic", "jar", "jpeg", "jpg", "lz", "lz4",
+	"lzma", "m4a", "m4v", "mkv", "mov", "mp3", "mp4", "odp", "ods",
+	"odt", "ogg", "opus", "png", "pptx", "rar", "rpm", "tbz", "tgz",
+	"txz", "webm", "webp", "whl", "xlsx", "xz", "zip", "zst",
+};
+
+/*
+ * Build report, gathered by walking the blockrefs of the written image.
+ */
+#define HAMMER2_REPORT_LEVELS	8	/* indirect block levels reported */
+#define HAMMER2_REPORT_TOPN	10	/* directories reported */
+#define HAMMER2_REPORT_MAXPFS	64
+
+typedef struct hammer2_report_inode {
+	struct hammer2_report_inode *next;
+	int		pfs;
+	hammer2_tid_t	inum;
+	hammer2_tid_t	iparent;
+	uint8_t		type;
+	char		*name;		/* directories only */
+	hammer2_off_t	size;
+	uint64_t	lbytes;		/* file data present */
+	uint64_t	pbytes;		/* blocks referenced by this inode */
+	uint64_t	tbytes;		/* blocks referenced by the subtree */
+} hammer2_report_inode_t;
+
+typedef struct hammer2_report_comp {
+	uint64_t	blocks;
+	uint64_t	lbytes;
+	uint64_t	pbytes;		/* allocated, shared blocks once */
+} hammer2_report_comp_t;
+
+typedef struct hammer2_report_data {
+	hammer2_off_t	data_off;
+	int		comp;
+} hammer2_report_data_t;
+
+typedef struct hammer2_report {
+	hammer2_volume_data_t	voldata;
+	int			fd[HAMMER2_MAX_VOLUMES];
+	int			nvolumes;
+	char			*buf;
+	int			npfs;
+	char			*pfs_names[HAMMER2_REPORT_MAXPFS];
+
+	hammer2_report_comp_t	comp[4];	/* HAMMER2_COMP_xxx */
+	uint64_t		file_bytes;	/* regular file sizes */
+	uint64_t		embed_bytes;	/* data in inodes */
+	uint64_t		hole_bytes;
+	uint64_t		meta_bytes;	/* inode/indirect/dirent */
+	uint64_t		inodes;
+	uint64_t		dirents;
+	uint64_t		indirects[HAMMER2_REPORT_LEVELS];
+	uint64_t		fmap_nodes;
+	uint64_t		fmap_leaves;
+	uint64_t		fmap_bytes;
+
+	hammer2_report_data_t	*data_offs;	/* for dedup */
+	size_t			ndata;
+	size_t			maxdata;
+
+	hammer2_report_inode_t	**ihash;
+	size_t			ihash_size;
+	size_t			ninodes;
+} hammer2_report_t;
+
+static const char *hammer2_report_comps[] = {
+	"none", "autozero", "lz4", "zlib",
+};
+
+/*
+ * HAMMER2 image used as the source tree of another file system, mounted
+ * read-only until the target image is written.  Regular file contents are
+ * read from the image when the target opens them.
+ */
+#define HAMMER2_SOURCE_BUFSIZE	(HAMMER2_PBUFSIZE * 16)
+
+typedef struct hammer2_source {
+	char			*spec;		/* image[:volume...][@label] */
+	struct m_mount		mp;
+	struct m_vnode		devvp[HAMMER2_MAX_VOLUMES];
+	fsinfo_t		fs[HAMMER2_MAX_VOLUMES];
+	int			num_volumes;
+	char			*buf;		/* read buffer */
+	long			files;
+} hammer2_source_t;
+
+static hammer2_source_t *hammer2_source;
 
 void
 hammer2_prep_opts(fsinfo_t *fsopts)
@@ -108,8 +296,14 @@ hammer2_prep_opts(fsinfo_t *fsopts)
 		{ 'L', "Label", NULL, OPT_STRBUF, 0, 0, "PFS label" },
 		/* makefs(8) specific options */
 		{ 'm', "MountLabel", NULL, OPT_STRBUF, 0, 0, "destination PFS label" },
+		{ 'M', "MountTree", NULL, OPT_STRBUF, 0, 0,
+		    "extra PFS label:directory" },
 		{ 'v', "NumVolhdr", &h2_opt->num_volhdr, OPT_INT32,
 		    1, HAMMER2_NUM_VOLHDRS, "number of volume headers" },
+		{ 'T', "Threads", &h2_opt->num_threads, OPT_INT32,
+		    1, HAMMER2_MAX_THREADS, "number of worker threads" },
+		{ 'X', "XopThreads", &h2_opt->num_xop_threads, OPT_INT32,
+		    0, HAMMER2_MAX_THREADS, "number of XOP worker threads" },
 		{ 'c', "CompressionType", NULL, OPT_STRBUF, 0, 0, "compression type" },
 		{ 'C', "CheckType", NULL, OPT_STRBUF, 0, 0, "check type" },
 		{ 'd', "Hammer2Debug", NULL, OPT_STRBUF, 0, 0, "debug tunable" },
@@ -121,6 +315,13 @@ hammer2_prep_opts(fsinfo_t *fsopts)
 		{ 'D', "Destroy", NULL, OPT_STRBUF, 0, 0, "offline destroy" },
 		{ 'G', "Growfs", NULL, OPT_STRBUF, 0, 0, "offline growfs" },
 		{ 'R', "Read", NULL, OPT_STRBUF, 0, 0, "offline read" },
+		{ 'K', "CheckBench", NULL, OPT_STRBUF, 0, 0,
+		    "checksum benchmark" },
+		{ 'z', "CompressBench", NULL, OPT_STRBUF, 0, 0,
+		    "compression benchmark" },
+		{ 'p', "CompressPolicy", NULL, OPT_STRBUF, 0, 0,
+		    "per-file compression policy" },
+		{ 'S', "Report", NULL, OPT_STRBUF, 0, 0, "build report" },
 		{ .name = NULL },
 	};
 
@@ -142,9 +343,19 @@ hammer2_cleanup_opts(fsinfo_t *fsopts)
 {
 	hammer2_makefs_options_t *h2_opt = fsopts->fs_specific;
 	hammer2_mkfs_options_t *opt = &h2_opt->mkfs_options;
+	int i;
 
 	hammer2_mkfs_cleanup(opt);
 
+	for (i = 0; i < h2_opt->num_volumes; i++) {
+		free(h2_opt->volume_path[i]);
+		if (i > 0)
+			free(h2_opt->volume_fs[i]);
+	}
+	for (i = 0; i < h2_opt->num_trees; i++) {
+		free(h2_opt->tree_label[i]);
+		free(h2_opt->tree_dir[i]);
+	}
 	free(h2_opt);
 	free(fsopts->fs_options);
 }
@@ -157,7 +368,8 @@ hammer2_parse_opts(const char *option, fsinfo_t *fsopts)
 
 	option_t *hammer2_options = fsopts->fs_options;
 	char buf[1024]; /* > HAMMER2_INODE_MAXNAME */
-	int i;
+	char *p;
+	int i, level;
 
 	assert(option != NULL);
 	assert(fsopts != NULL);
@@ -214,9 +426,28 @@ hammer2_parse_opts(const char *option, fsinfo_t *fsopts)
 			    buf, HAMMER2_INODE_MAXNAME - 1);
 		strlcpy(h2_opt->mount_label, buf, sizeof(h2_opt->mount_label));
 		break;
+	case 'M':
+		p = strchr(buf, ':');
+		if (p == NULL || p == buf || strlen(p + 1) == 0)
+			errx(1, "PFS tree '%s' is not label:directory", buf);
+		*p++ = 0; /* NULL terminate label */
+		if (strlen(buf) >= HAMMER2_INODE_MAXNAME)
+			errx(1, "Volume label '%s' is too long (%d chars max)",
+			    buf, HAMMER2_INODE_MAXNAME - 1);
+		if (h2_opt->num_trees >= HAMMER2_MAX_TREES)
+			errx(1, "Limit of %d PFS trees, the image has at most "
+			    "%d PFSes including LOCAL and the mount label",
+			    HAMMER2_MAX_TREES, HAMMER2_SET_COUNT);
+		h2_opt->tree_label[h2_opt->num_trees] = estrdup(buf);
+		h2_opt->tree_dir[h2_opt->num_trees] = estrdup(p);
+		h2_opt->num_trees++;
+		break;
 	case 'c':
 		if (strlen(buf) == 0)
 			errx(1, "Compression type '%s' cannot be 0-length", buf);
+		p = strchr(buf, ':');
+		if (p)
+			*p++ = 0; /* NULL terminate compression type */
 		if (strcasecmp(buf, "none") == 0)
 			opt->CompType = HAMMER2_COMP_NONE;
 		else if (strcasecmp(buf, "autozero") == 0)
@@ -227,6 +458,10 @@ hammer2_parse_opts(const char *option, fsinfo_t *fsopts)
 			opt->CompType = HAMMER2_COMP_ZLIB;
 		else
 			errx(1, "Invalid compression type '%s'", buf);
+		level = hammer2_comp_level(opt->CompType, p);
+		if (level < 0)
+			errx(1, "Invalid compression level '%s' for %s", p, buf);
+		opt->CompType |= HAMMER2_ENC_LEVEL(level);
 		break;
 	case 'C':
 		if (strlen(buf) == 0)
@@ -287,6 +522,35 @@ hammer2_parse_opts(const char *option, fsinfo_t *fsopts)
 			errx(1, "Read argument '%s' cannot be 0-length", buf);
 		strlcpy(h2_opt->read_path, buf, sizeof(h2_opt->read_path));
 		break;
+	case 'K':
+		h2_opt->cksum_bench = true;
+		hammer2_parse_bench_opts(buf, fsopts);
+		break;
+	case 'p':
+		if (strlen(buf) == 0)
+			errx(1, "Compression policy '%s' cannot be 0-length",
+			    buf);
+		strlcpy(h2_opt->comp_policy, buf, sizeof(h2_opt->comp_policy));
+		break;
+	case 'S':
+		p = strchr(buf, ':');
+		if (p)
+			*p++ = 0; /* NULL terminate report format */
+		if (strcasecmp(buf, "text") == 0)
+			h2_opt->report = HAMMER2_REPORT_TEXT;
+		else if (strcasecmp(buf, "json") == 0)
+			h2_opt->report = HAMMER2_REPORT_JSON;
+		else
+			errx(1, "Invalid report format '%s'", buf);
+		if (p && strlen(p))
+			strlcpy(h2_opt->report_path, p,
+			    sizeof(h2_opt->report_path));
+		break;
+	case 'z':
+		h2_opt->comp_bench = true;
+		strlcpy(h2_opt->comp_bench_path, buf,
+		    sizeof(h2_opt->comp_bench_path));
+		break;
 	default:
 		break;
 	}
@@ -304,10 +568,11 @@ hammer2_makefs(const char *image, const char *dir, fsnode *root,
 	hammer2_makefs_options_t *h2_opt = fsopts->fs_specific;
 	struct m_mount mp;
 	struct hammer2_mount_info info;
-	struct m_vnode devvp, *vroot;
+	struct m_vnode devvp[HAMMER2_MAX_VOLUMES], *vroot;
 	hammer2_inode_t *iroot;
 	struct timeval start;
-	int error;
+	fsinfo_t *fs;
+	int i, error;
 
 	/* ioctl commands could have NULL dir / root */
 	assert(image != NULL);
@@ -317,16 +582,41 @@ hammer2_makefs(const char *image, const char *dir, fsnode *root,
 		APRINTF("image \"%s\" directory \"%s\" root %p\n",
 		    image, dir, root);
 
+	if (h2_opt->cksum_bench) {
+		hammer2_cksum_bench(h2_opt->cksum_bench_sizes,
+		    h2_opt->cksum_bench_nsizes);
+		return;
+	}
+
+	if (h2_opt->comp_bench) {
+		hammer2_comp_bench(strlen(h2_opt->comp_bench_path) ?
+		    h2_opt->comp_bench_path : NULL);
+		return;
+	}
+
+	if (h2_opt->num_trees) {
+		if (h2_opt->ioctl_cmd)
+			errx(1, "PFS trees only populate a new image");
+		hammer2_walk_trees(root, fsopts);
+	}
+
 	/* validate tree and options */
 	TIMER_START(start);
+	hammer2_parse_volumes(image, fsopts);
 	hammer2_validate(dir, root, fsopts);
+	if (strlen(h2_opt->comp_policy) && !h2_opt->ioctl_cmd)
+		hammer2_policy_load(h2_opt->comp_policy);
 	TIMER_RESULTS(start, "hammer2_validate");
 
 	if (h2_opt->ioctl_cmd) {
 		/* open existing image */
-		fsopts->fd = open(image, O_RDWR);
-		if (fsopts->fd < 0)
-			err(1, "failed to open `%s'", image);
+		for (i = 0; i < h2_opt->num_volumes; i++) {
+			fs = h2_opt->volume_fs[i];
+			fs->fd = open(h2_opt->volume_path[i], O_RDWR);
+			if (fs->fd < 0)
+				err(1, "failed to open `%s'",
+				    h2_opt->volume_path[i]);
+		}
 	} else {
 		/* create image */
 		TIMER_START(start);
@@ -340,16 +630,30 @@ hammer2_makefs(const char *image, const char *dir, fsnode *root,
 		putchar('\n');
 
 	/* vfs init */
+	hammer2_xop_workers = h2_opt->num_xop_threads;
+	/* concurrent readers can't share the caller-run XOP backend */
+	if (h2_opt->ioctl_cmd == HAMMER2IOC_READ && h2_opt->num_threads > 1 &&
+	    hammer2_xop_workers == 0)
+		hammer2_xop_workers = h2_opt->num_threads;
+	hammer2_bulkfree_workers = h2_opt->num_threads;
 	error = hammer2_vfs_init();
 	if (error)
 		errx(1, "failed to vfs init, error %d", error);
 
-	/* mount image */
-	memset(&devvp, 0, sizeof(devvp));
-	devvp.fs = fsopts;
+	/*
+	 * Mount image.  Each volume of a volume set is written by its own
+	 * I/O thread.
+	 */
+	memset(devvp, 0, sizeof(devvp));
+	for (i = 0; i < h2_opt->num_volumes; i++) {
+		devvp[i].fs = h2_opt->volume_fs[i];
+		if (h2_opt->num_volumes > 1)
+			hammer2_devq_init(&devvp[i]);
+	}
 	memset(&mp, 0, sizeof(mp));
 	memset(&info, 0, sizeof(info));
-	error = hammer2_vfs_mount(&devvp, &mp, h2_opt->mount_label, &info);
+	info.volume = image;
+	error = hammer2_vfs_mount(devvp, &mp, h2_opt->mount_label, &info);
 	if (error)
 		errx(1, "failed to mount, error %d", error);
 	assert(mp.mnt_data);
@@ -446,11 +750,24 @@ hammer2_makefs(const char *image, const char *dir, fsnode *root,
 				    strerror(error));
 		} else if (!strcmp(h2_opt->inode_cmd_name, "setcomp")) {
 			error = hammer2_inode_setcomp(vroot,
-			    h2_opt->inode_path);
+			    h2_opt->inode_path, false);
+			if (error)
+				errx(1, "inode %s `%s' failed '%s'",
+				    h2_opt->inode_cmd_name, image,
+				    strerror(error));
+		} else if (!strcmp(h2_opt->inode_cmd_name, "recompress")) {
+			hammer2_wpipe = hammer2_wpipe_create(
+			    h2_opt->num_threads);
+			error = hammer2_inode_setcomp(vroot,
+			    h2_opt->inode_path, true);
 			if (error)
 				errx(1, "inode %s `%s' failed '%s'",
 				    h2_opt->inode_cmd_name, image,
 				    strerror(error));
+			if (hammer2_wpipe) {
+				hammer2_wpipe_destroy(hammer2_wpipe);
+				hammer2_wpipe = NULL;
+			}
 		} else {
 			assert(0);
 		}
@@ -500,7 +817,8 @@ hammer2_makefs(const char *image, const char *dir, fsnode *root,
 	case HAMMER2IOC_READ:
 		printf("read `%s'\n", image);
 		TIMER_START(start);
-		error = hammer2_readx(vroot, dir, h2_opt->read_path);
+		error = hammer2_readx(vroot, dir, h2_opt->read_path,
+		    h2_opt->num_threads);
 		if (error)
 			errx(1, "read `%s' failed '%s'", image,
 			    strerror(error));
@@ -509,9 +827,13 @@ hammer2_makefs(const char *image, const char *dir, fsnode *root,
 	default:
 		printf("populating `%s'\n", image);
 		TIMER_START(start);
-		if (hammer2_populate_dir(vroot, dir, root, root, fsopts, 0))
-			errx(1, "image file `%s' not populated", image);
+		/* fresh image, allocate sequentially */
+		hammer2_freemap_bump_start(iroot->pmp->pfs_hmps[0]);
+		hammer2_populate(image, devvp, vroot, dir, root, fsopts);
+		hammer2_link_free();
 		TIMER_RESULTS(start, "hammer2_populate_dir");
+		if (hammer2_policy_enabled)
+			hammer2_policy_print();
 		break;
 	}
 
@@ -532,13 +854,193 @@ hammer2_makefs(const char *image, const char *dir, fsnode *root,
 	if (error)
 		errx(1, "failed to vfs uninit, error %d", error);
 
-	if (close(fsopts->fd) == -1)
-		err(1, "closing `%s'", image);
-	fsopts->fd = -1;
+	for (i = 0; i < h2_opt->num_volumes; i++) {
+		error = hammer2_devq_destroy(&devvp[i]);
+		if (error)
+			errx(1, "writing `%s' failed '%s'",
+			    h2_opt->volume_path[i], strerror(error));
+	}
+
+	/* report from the image as written */
+	if (h2_opt->report)
+		hammer2_report(image, fsopts);
+
+	for (i = 0; i < h2_opt->num_volumes; i++) {
+		fs = h2_opt->volume_fs[i];
+		if (close(fs->fd) == -1)
+			err(1, "closing `%s'", h2_opt->volume_path[i]);
+		fs->fd = -1;
+	}
 
 	printf("image `%s' complete\n", image);
 }
 
+/*
+ * Return 1 if the first volume of spec, image[:volume...][@label], starts
+ * with a HAMMER2 volume header.
+ */
+int
+hammer2_source_probe(const char *spec)
+{
+	uint64_t magic;
+	char *path;
+	int fd, ret = 0;
+
+	path = estrdup(spec);
+	path[strcspn(path, ":@")] = '\0';
+	fd = open(path, O_RDONLY);
+	if (fd != -1) {
+		/* fails on a directory */
+		if (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+		    magic == HAMMER2_VOLUME_ID_HBO)
+			ret = 1;
+		close(fd);
+	}
+	free(path);
+
+	return (ret);
+}
+
+/*
+ * Mount the source image read-only and build a tree of fsnodes from the
+ * root of its PFS, "DATA" unless given after '@'.
+ */
+fsnode *
+hammer2_source_walk(const char *spec)
+{
+	hammer2_source_t *src;
+	struct hammer2_mount_info info;
+	struct m_vnode *vroot;
+	fsnode *root;
+	char *o, *p, *path, *volumes;
+	const char *label;
+	int i, error;
+
+	assert(hammer2_source == NULL);
+	src = hammer2_source = ecalloc(1, sizeof(*src));
+	src->spec = estrdup(spec);
+	src->buf = emalloc(HAMMER2_SOURCE_BUFSIZE);
+
+	volumes = estrdup(spec);
+	p = strrchr(volumes, '@');
+	if (p != NULL) {
+		*p++ = '\0';
+		label = p;
+	} else {
+		label = "DATA";
+	}
+	if (strlen(label) == 0)
+		errx(1, "Empty PFS label in `%s'", spec);
+
+	o = p = estrdup(volumes);
+	while ((path = strsep(&p, ":")) != NULL) {
+		if (strlen(path) == 0)
+			errx(1, "Empty volume path in `%s'", spec);
+		if (src->num_volumes >= HAMMER2_MAX_VOLUMES)
+			errx(1, "Limit of %d volumes", HAMMER2_MAX_VOLUMES);
+		i = src->num_volumes++;
+		src->fs[i].fd = open(path, O_RDONLY);
+		if (src->fs[i].fd == -1)
+			err(1, "failed to open `%s'", path);
+		src->devvp[i].fs = &src->fs[i];
+	}
+	free(o);
+
+	error = hammer2_vfs_init();
+	if (error)
+		errx(1, "failed to vfs init, error %d", error);
+
+	src->mp.mnt_flag = MNT_RDONLY;
+	memset(&info, 0, sizeof(info));
+	info.volume = volumes;
+	error = hammer2_vfs_mount(src->devvp, &src->mp, label, &info);
+	if (error)
+		errx(1, "failed to mount `%s', error %d", spec, error);
+
+	vroot = NULL;
+	error = hammer2_vfs_root(&src->mp, &vroot);
+	if (error)
+		errx(1, "failed to get root vnode, error %d", error);
+	assert(vroot);
+
+	root = hammer2_source_dir(vroot, ".", NULL);
+	free(volumes);
+
+	return (root);
+}
+
+/*
+ * Open the contents of a regular file of the source image, read into an
+ * anonymous memory file so the target can read or mmap it like a file on
+ * disk.
+ */
+int
+hammer2_source_open(const fsnode *node)
+{
+	hammer2_source_t *src = hammer2_source;
+	hammer2_inode_t *ip;
+	struct m_vnode *vp;
+	int fd, error;
+
+	assert(src != NULL);
+	assert(node->inode->flags & FI_SOURCE);
+
+	vp = NULL;
+	error = hammer2_vfs_vget(&src->mp, NULL, node->inode->st.st_ino, &vp);
+	if (error) {
+		errno = error;
+		return (-1);
+	}
+	ip = VTOI(vp);
+
+	fd = hammer2_source_memfd();
+	if (fd != -1) {
+		/* holes are left as zeros */
+		if (ftruncate(fd, ip->meta.size) == -1)
+			error = errno;
+		else
+			error = hammer2_read_stream(vp, src->buf,
+			    HAMMER2_SOURCE_BUFSIZE, hammer2_source_write, &fd);
+		if (error == 0 && lseek(fd, 0, SEEK_SET) == -1)
+			error = errno;
+		if (error) {
+			close(fd);
+			fd = -1;
+			errno = error;
+		}
+	}
+
+	/* hardlinked vnodes are held until the source is closed */
+	if (ip->meta.nlinks == 1)
+		hammer2_release_vnode(vp);
+
+	return (fd);
+}
+
+void
+hammer2_source_close(void)
+{
+	hammer2_source_t *src = hammer2_source;
+	int i, error;
+
+	if (src == NULL)
+		return;
+
+	error = hammer2_vfs_unmount(&src->mp, 0);
+	if (error)
+		errx(1, "failed to unmount `%s', error %d", src->spec, error);
+	error = hammer2_vfs_uninit();
+	if (error)
+		errx(1, "failed to vfs uninit, error %d", error);
+
+	for (i = 0; i < src->num_volumes; i++)
+		close(src->fs[i].fd);
+	free(src->buf);
+	free(src->spec);
+	free(src);
+	hammer2_source = NULL;
+}
+
 /* end of public functions */
 
 static void
@@ -610,7 +1112,7 @@ hammer2_parse_inode_opts(const char *buf, fsinfo_t *fsopts)
 		if (n == 0 || n > PATH_MAX - 10)
 			errx(1, "invalid argument \"%s\"", p);
 		h2_opt->ioctl_cmd = HAMMER2IOC_INODE_SET;
-	} else if (!strcmp(o, "setcomp")) {
+	} else if (!strcmp(o, "setcomp") || !strcmp(o, "recompress")) {
 		if (n == 0 || n > PATH_MAX - 10)
 			errx(1, "invalid argument \"%s\"", p);
 		h2_opt->ioctl_cmd = HAMMER2IOC_INODE_SET;
@@ -625,6 +1127,37 @@ hammer2_parse_inode_opts(const char *buf, fsinfo_t *fsopts)
 	free(o);
 }
 
+/*
+ * Block sizes to benchmark, separated by `:'.
+ */
+static void
+hammer2_parse_bench_opts(const char *buf, fsinfo_t *fsopts)
+{
+	hammer2_makefs_options_t *h2_opt = fsopts->fs_specific;
+	static const int sizes[] = { 512, 4096, 16384, 65536 };
+	char *o, *p, *s;
+	int n;
+
+	if (strlen(buf) == 0) {
+		for (n = 0; n < (int)nitems(sizes); ++n)
+			h2_opt->cksum_bench_sizes[n] = sizes[n];
+		h2_opt->cksum_bench_nsizes = n;
+		return;
+	}
+
+	o = p = strdup(buf);
+	n = 0;
+	while ((s = strsep(&p, ":")) != NULL) {
+		if (n >= HAMMER2_CKSUM_BENCH_MAXSIZES)
+			errx(1, "too many block sizes \"%s\"", buf);
+		h2_opt->cksum_bench_sizes[n++] = strsuftoll("block size", s,
+		    1, HAMMER2_PBUFSIZE);
+	}
+	h2_opt->cksum_bench_nsizes = n;
+
+	free(o);
+}
+
 static hammer2_off_t
 hammer2_image_size(fsinfo_t *fsopts)
 {
@@ -697,13 +1230,38 @@ hammer2_label_name(int label_type)
 	return NULL;
 }
 
+/*
+ * Create the PFS label at mkfs time unless it already is.
+ */
+static void
+hammer2_label_add(hammer2_mkfs_options_t *opt, const char *label)
+{
+	int i, n;
+
+	for (i = 0; i < opt->NLabels; i++)
+		if (!strcmp(opt->Label[i], label))
+			return;
+	n = opt->NLabels;
+	if (opt->DefaultLabelType != HAMMER2_LABEL_NONE) {
+		if (!strcmp(hammer2_label_name(opt->DefaultLabelType), label))
+			return;
+		n++; /* added by newfs */
+	}
+	if (n >= MAXLABELS)
+		errx(1, "Cannot create PFS \"%s\", the image has at most %d "
+		    "PFSes including LOCAL", label, MAXLABELS);
+	opt->Label[opt->NLabels++] = strdup(label);
+}
+
 static void
 hammer2_validate(const char *dir, fsnode *root, fsinfo_t *fsopts)
 {
 	hammer2_makefs_options_t *h2_opt = fsopts->fs_specific;
 	hammer2_mkfs_options_t *opt = &h2_opt->mkfs_options;
 	hammer2_off_t image_size = 0, minsize, maxsize;
+	off_t inodes;
 	const char *s;
+	int i, j;
 
 	/* ioctl commands could have NULL dir / root */
 	assert(fsopts != NULL);
@@ -727,12 +1285,33 @@ hammer2_validate(const char *dir, fsnode *root, fsinfo_t *fsopts)
 		printf("using default mount label \"%s\"\n", s);
 	}
 
+	/* PFSes of -o M are created along with the others */
+	for (i = 0; i < h2_opt->num_trees; i++) {
+		s = h2_opt->tree_label[i];
+		if (!strcmp(s, h2_opt->mount_label))
+			errx(1, "PFS \"%s\" populated twice", s);
+		for (j = 0; j < i; j++)
+			if (!strcmp(s, h2_opt->tree_label[j]))
+				errx(1, "PFS \"%s\" populated twice", s);
+		hammer2_label_add(opt, s);
+	}
+
 	/* set default number of volume headers */
 	if (!h2_opt->num_volhdr) {
 		h2_opt->num_volhdr = HAMMER2_NUM_VOLHDRS;
 		printf("using default %d volume headers\n", h2_opt->num_volhdr);
 	}
 
+	/* set default number of worker threads */
+	if (!h2_opt->num_threads) {
+		h2_opt->num_threads = MIN(sysconf(_SC_NPROCESSORS_ONLN),
+		    HAMMER2_MAX_THREADS);
+		if (h2_opt->num_threads < 1)
+			h2_opt->num_threads = 1;
+		printf("using default %d worker threads\n",
+		    h2_opt->num_threads);
+	}
+
 	/* done if ioctl commands */
 	if (h2_opt->ioctl_cmd) {
 		if (h2_opt->ioctl_cmd == HAMMER2IOC_GROWFS)
@@ -747,6 +1326,12 @@ hammer2_validate(const char *dir, fsnode *root, fsinfo_t *fsopts)
 	if (root == NULL)
 		errx(1, "fsnode tree not constructed");
 	hammer2_size_dir(root, fsopts);
+	h2_opt->tree_inodes[0] = fsopts->inodes;
+	for (i = 0; i < h2_opt->num_trees; i++) {
+		inodes = fsopts->inodes;
+		hammer2_size_dir(h2_opt->tree_root[i], fsopts);
+		h2_opt->tree_inodes[i + 1] = fsopts->inodes - inodes;
+	}
 	printf("estimated data size %s from %lld inode\n",
 	    sizetostr(fsopts->size), (long long)fsopts->inodes);
 
@@ -765,6 +1350,15 @@ ignore_size_dir:
 	assert((image_size & HAMMER2_FREEMAP_LEVEL1_MASK) == 0);
 	h2_opt->image_size = image_size;
 	printf("using %s image size\n", sizetostr(h2_opt->image_size));
+
+	/* split evenly across a volume set, volumes are 1GB aligned */
+	h2_opt->volume_size = roundup(howmany(image_size, h2_opt->num_volumes),
+	    HAMMER2_FREEMAP_LEVEL1_SIZE);
+	if (h2_opt->num_volumes > 1) {
+		h2_opt->image_size = h2_opt->volume_size * h2_opt->num_volumes;
+		printf("using %d x %s volume set\n", h2_opt->num_volumes,
+		    sizetostr(h2_opt->volume_size));
+	}
 done:
 	if (debug & DEBUG_FS_VALIDATE) {
 		APRINTF("after defaults set:\n");
@@ -795,6 +1389,8 @@ hammer2_dump_fsinfo(fsinfo_t *fsopts)
 	printf("\tlabel_specified %d\n", h2_opt->label_specified);
 	printf("\tmount_label \"%s\"\n", h2_opt->mount_label);
 	printf("\tnum_volhdr %d\n", h2_opt->num_volhdr);
+	printf("\tnum_threads %d\n", h2_opt->num_threads);
+	printf("\tnum_xop_threads %d\n", h2_opt->num_xop_threads);
 	printf("\tioctl_cmd %ld\n", h2_opt->ioctl_cmd);
 	printf("\temergency_mode %d\n", h2_opt->emergency_mode);
 	printf("\tpfs_cmd_name \"%s\"\n", h2_opt->pfs_cmd_name);
@@ -804,6 +1400,12 @@ hammer2_dump_fsinfo(fsinfo_t *fsopts)
 	printf("\tdestroy_path \"%s\"\n", h2_opt->destroy_path);
 	printf("\tdestroy_inum %lld\n", (long long)h2_opt->destroy_inum);
 	printf("\tread_path \"%s\"\n", h2_opt->read_path);
+	printf("\tcksum_bench %d\n", h2_opt->cksum_bench);
+	printf("\tcomp_bench %d\n", h2_opt->comp_bench);
+	printf("\tcomp_bench_path \"%s\"\n", h2_opt->comp_bench_path);
+	printf("\tcomp_policy \"%s\"\n", h2_opt->comp_policy);
+	printf("\treport %d\n", h2_opt->report);
+	printf("\treport_path \"%s\"\n", h2_opt->report_path);
 	printf("\timage_size 0x%llx\n", (long long)h2_opt->image_size);
 
 	printf("\tHammer2Version %d\n", opt->Hammer2Version);
@@ -842,9 +1444,9 @@ hammer2_dump_fsinfo(fsinfo_t *fsopts)
 }
 
 static int
-hammer2_setup_blkdev(const char *image, fsinfo_t *fsopts)
+hammer2_setup_blkdev(const char *image, fsinfo_t *fsopts,
+    hammer2_off_t volume_size)
 {
-	hammer2_makefs_options_t *h2_opt = fsopts->fs_specific;
 	hammer2_off_t size;
 
 	if ((fsopts->fd = open(image, O_RDWR)) == -1) {
@@ -853,36 +1455,36 @@ hammer2_setup_blkdev(const char *image, fsinfo_t *fsopts)
 	}
 
 	size = check_volume(fsopts->fd);
-	if (h2_opt->image_size > size) {
+	if (volume_size > size) {
 		warnx("image size %lld exceeds %s size %lld",
-		    (long long)h2_opt->image_size, image, (long long)size);
+		    (long long)volume_size, image, (long long)size);
 		return -1;
 	}
 
 	return 0;
 }
 
+typedef struct hammer2_create_volume {
+	const char	*path;
+	fsinfo_t	*fs;
+	hammer2_off_t	size;
+	pthread_t	td;
+	int		error;
+} hammer2_create_volume_t;
+
 static int
-hammer2_create_image(const char *image, fsinfo_t *fsopts)
+hammer2_create_volume(const char *image, fsinfo_t *fsopts,
+    hammer2_off_t volume_size)
 {
-	hammer2_makefs_options_t *h2_opt = fsopts->fs_specific;
-	hammer2_mkfs_options_t *opt = &h2_opt->mkfs_options;
-	char *av[] = { (char *)image, }; /* XXX support multi-volumes */
 	char *buf;
 	int i, bufsize, oflags;
 	off_t bufrem;
 	struct stat st;
 
-	assert(image != NULL);
-	assert(fsopts != NULL);
-
 	/* check if image is blk or chr */
 	if (stat(image, &st) == 0) {
-		if (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)) {
-			if (hammer2_setup_blkdev(image, fsopts))
-				return -1;
-			goto done;
-		}
+		if (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode))
+			return hammer2_setup_blkdev(image, fsopts, volume_size);
 	}
 
 	/* create image */
@@ -896,7 +1498,7 @@ hammer2_create_image(const char *image, fsinfo_t *fsopts)
 
 	/* zero image */
 	bufsize = HAMMER2_PBUFSIZE;
-	bufrem = h2_opt->image_size;
+	bufrem = volume_size;
 	if (fsopts->sparse) {
 		if (ftruncate(fsopts->fd, bufrem) == -1) {
 			warn("sparse option disabled");
@@ -935,7 +1537,54 @@ hammer2_create_image(const char *image, fsinfo_t *fsopts)
 	}
 	if (buf)
 		free(buf);
-done:
+
+	return 0;
+}
+
+static void *
+hammer2_create_volume_thread(void *arg)
+{
+	hammer2_create_volume_t *cv = arg;
+
+	cv->error = hammer2_create_volume(cv->path, cv->fs, cv->size);
+
+	return NULL;
+}
+
+static int
+hammer2_create_image(const char *image, fsinfo_t *fsopts)
+{
+	hammer2_makefs_options_t *h2_opt = fsopts->fs_specific;
+	hammer2_mkfs_options_t *opt = &h2_opt->mkfs_options;
+	hammer2_create_volume_t *cv;
+	int i, error = 0;
+
+	assert(image != NULL);
+	assert(fsopts != NULL);
+	assert(h2_opt->num_volumes >= 1);
+
+	/* create volumes, each volume of a volume set is zeroed in parallel */
+	cv = ecalloc(h2_opt->num_volumes, sizeof(*cv));
+	for (i = 0; i < h2_opt->num_volumes; i++) {
+		cv[i].path = h2_opt->volume_path[i];
+		cv[i].fs = h2_opt->volume_fs[i];
+		cv[i].size = h2_opt->volume_size;
+		if (h2_opt->num_volumes == 1)
+			hammer2_create_volume_thread(&cv[i]);
+		else if (pthread_create(&cv[i].td, NULL,
+		    hammer2_create_volume_thread, &cv[i]))
+			errx(1, "failed to create thread");
+	}
+	for (i = 0; i < h2_opt->num_volumes; i++) {
+		if (h2_opt->num_volumes > 1)
+			pthread_join(cv[i].td, NULL);
+		if (cv[i].error)
+			error = -1;
+	}
+	free(cv);
+	if (error)
+		return -1;
+
 	/* make the file system */
 	if (debug & DEBUG_FS_CREATE_IMAGE)
 		APRINTF("calling mkfs(\"%s\", ...)\n", image);
@@ -943,11 +1592,134 @@ done:
 	 * XXX NetBSD fails if av[] image is block device,
 	 * as it doesn't allow multiple open fd's for write.
 	 */
-	hammer2_mkfs(1, av, opt); /* success if returned */
+	hammer2_mkfs(h2_opt->num_volumes, h2_opt->volume_path, opt);
+	/* success if returned */
 
 	return fsopts->fd;
 }
 
+/*
+ * The image argument is a ':' separated list of volumes, as with
+ * mount_hammer2(8) and hammer2(8).  The first volume is the root volume
+ * and uses fsopts itself.
+ */
+static void
+hammer2_parse_volumes(const char *image, fsinfo_t *fsopts)
+{
+	hammer2_makefs_options_t *h2_opt = fsopts->fs_specific;
+	char *o, *p, *path;
+	int i;
+
+	assert(h2_opt->num_volumes == 0);
+
+	o = p = estrdup(image);
+	while ((path = strsep(&p, ":")) != NULL) {
+		if (strlen(path) == 0)
+			errx(1, "Empty volume path in `%s'", image);
+		if (h2_opt->num_volumes >= HAMMER2_MAX_VOLUMES)
+			errx(1, "Limit of %d volumes", HAMMER2_MAX_VOLUMES);
+		i = h2_opt->num_volumes++;
+		h2_opt->volume_path[i] = estrdup(path);
+		if (i == 0) {
+			h2_opt->volume_fs[i] = fsopts;
+		} else {
+			h2_opt->volume_fs[i] = emalloc(sizeof(*fsopts));
+			*h2_opt->volume_fs[i] = *fsopts;
+		}
+	}
+	free(o);
+}
+
+/*
+ * Fsinodes of one tree shared with a tree walked before it, walk_dir()
+ * joins hardlinks by st_dev and st_ino across trees.
+ */
+typedef struct hammer2_treelink {
+	struct hammer2_treelink	*next;
+	fsinode			*from;
+	fsinode			*to;
+} hammer2_treelink_t;
+
+static void
+hammer2_tree_unshare(fsnode *root, uint32_t tree, hammer2_treelink_t **hash)
+{
+	hammer2_treelink_t *e;
+	fsnode *cur;
+	int n;
+
+	for (cur = root; cur != NULL; cur = cur->next) {
+		if (S_ISDIR(cur->type)) {
+			if (cur != root)
+				hammer2_tree_unshare(cur->child, tree, hash);
+			continue;
+		}
+		if (cur->inode->st.st_nlink <= 1)
+			continue;
+		/* fsinode->ino isn't used by hammer2, it tags the tree */
+		if (cur->inode->ino == 0)
+			cur->inode->ino = tree;
+		if (cur->inode->ino == tree)
+			continue;
+
+		n = ((uintptr_t)cur->inode / sizeof(*cur->inode)) &
+		    HAMMER2_LINKHASH_MASK;
+		for (e = hash[n]; e != NULL; e = e->next)
+			if (e->from == cur->inode)
+				break;
+		if (e == NULL) {
+			e = ecalloc(1, sizeof(*e));
+			e->from = cur->inode;
+			e->to = emalloc(sizeof(*e->to));
+			*e->to = *cur->inode;
+			e->to->ino = tree;
+			e->to->nlink = 0;
+			e->next = hash[n];
+			hash[n] = e;
+		}
+		cur->inode->nlink--;
+		cur->inode = e->to;
+		cur->inode->nlink++;
+	}
+}
+
+/*
+ * Walk the directory of each PFS given with -o M.  A hardlink can't cross
+ * PFSes, each tree gets its own copy of the fsinodes it shares with the
+ * trees walked before it.
+ */
+static void
+hammer2_walk_trees(fsnode *root, fsinfo_t *fsopts)
+{
+	hammer2_makefs_options_t *h2_opt = fsopts->fs_specific;
+	hammer2_treelink_t *hash[HAMMER2_LINKHASH_SIZE], *e;
+	struct timeval start;
+	struct stat st;
+	const char *dir;
+	int i, j;
+
+	bzero(hash, sizeof(hash));
+	hammer2_tree_unshare(root, 1, hash);
+
+	for (i = 0; i < h2_opt->num_trees; i++) {
+		dir = h2_opt->tree_dir[i];
+		if (stat(dir, &st) == -1)
+			err(1, "Can't stat `%s'", dir);
+		if (!S_ISDIR(st.st_mode))
+			errx(1, "%s: not a directory", dir);
+		TIMER_START(start);
+		h2_opt->tree_root[i] = walk_dir(dir, ".", NULL, NULL);
+		TIMER_RESULTS(start, "walk_dir");
+
+		hammer2_tree_unshare(h2_opt->tree_root[i], i + 2, hash);
+		for (j = 0; j < HAMMER2_LINKHASH_SIZE; j++) {
+			while ((e = hash[j]) != NULL) {
+				hash[j] = e->next;
+				free(e);
+			}
+		}
+	}
+}
+
 static off_t
 hammer2_phys_size(off_t size)
 {
@@ -1055,27 +1827,135 @@ hammer2_print(const struct m_vnode *dvp, const struct m_vnode *vp,
 }
 
 /*
- * + root->name is ".".
- * + root->child is NULL.
- * + root->parent->child points to root.
- * + fsnode for ".." does not exist, even if a dirent ".." physically exists.
- *
- *   ... -> root's parent -> next -> next -> ...
- *          ^ | child
- *   parent | v
- *          root -> next -> next -> next -> ...
- *          "."             ^ |
- *                          | v
+ * PFS populated from a directory tree.  The PFSes of -o M are mounted from
+ * the same devices and populated concurrently, each by its own thread with
+ * its own write pipeline.  They have separate inode numbers and chain
+ * topologies, only the freemap and the devices are shared and those are
+ * locked by the chain and buffer code.
  */
-static int
-hammer2_populate_dir(struct m_vnode *dvp, const char *dir, fsnode *root,
-    fsnode *parent, fsinfo_t *fsopts, int depth)
+typedef struct hammer2_ptree {
+	const char		*label;
+	const char		*dir;
+	fsnode			*root;
+	fsinfo_t		fs;		/* inodes of this tree */
+	struct m_mount		mp;
+	struct m_vnode		*vroot;
+	int			nthreads;	/* write pipeline threads */
+	int			attached;	/* hammer2_thr_attach()ed */
+	pthread_t		td;
+} hammer2_ptree_t;
+
+static void *
+hammer2_populate_tree(void *arg)
 {
-	fsnode *cur;
-	struct m_vnode *vp;
+	hammer2_ptree_t *pt = arg;
+
+	hammer2_wpipe = hammer2_wpipe_create(pt->nthreads);
+	if (hammer2_populate_dir(pt->vroot, pt->dir, pt->root, pt->root,
+	    &pt->fs, 0))
+		errx(1, "PFS \"%s\" not populated", pt->label);
+	if (hammer2_wpipe) {
+		while (hammer2_wpipe_pending(hammer2_wpipe))
+			hammer2_write_commit();
+		hammer2_wpipe_destroy(hammer2_wpipe);
+		hammer2_wpipe = NULL;
+	}
+	if (pt->attached)
+		hammer2_thr_detach();
+
+	return NULL;
+}
+
+static void
+hammer2_populate(const char *image, struct m_vnode *devvp,
+    struct m_vnode *vroot, const char *dir, fsnode *root, fsinfo_t *fsopts)
+{
+	hammer2_makefs_options_t *h2_opt = fsopts->fs_specific;
+	struct hammer2_mount_info info;
+	hammer2_ptree_t *pt;
+	int i, ntrees, error;
+
+	ntrees = h2_opt->num_trees + 1;
+	pt = ecalloc(ntrees, sizeof(*pt));
+	for (i = 0; i < ntrees; i++) {
+		pt[i].fs = *fsopts;
+		pt[i].fs.inodes = h2_opt->tree_inodes[i];
+		pt[i].nthreads = howmany(h2_opt->num_threads, ntrees);
+		if (i == 0) {
+			pt[i].label = h2_opt->mount_label;
+			pt[i].dir = dir;
+			pt[i].root = root;
+			pt[i].vroot = vroot;
+			continue;
+		}
+		pt[i].label = h2_opt->tree_label[i - 1];
+		pt[i].dir = h2_opt->tree_dir[i - 1];
+		pt[i].root = h2_opt->tree_root[i - 1];
+
+		/* another PFS of the mounted devices */
+		memset(&info, 0, sizeof(info));
+		info.volume = image;
+		error = hammer2_vfs_mount(devvp, &pt[i].mp, pt[i].label,
+		    &info);
+		if (error)
+			errx(1, "failed to mount PFS \"%s\", error %d",
+			    pt[i].label, error);
+		error = hammer2_vfs_root(&pt[i].mp, &pt[i].vroot);
+		if (error)
+			errx(1, "failed to get root vnode, error %d", error);
+		printf("populating PFS \"%s\" from `%s'\n", pt[i].label,
+		    pt[i].dir);
+	}
+
+	for (i = 0; i < ntrees; i++) {
+		if (ntrees == 1) {
+			hammer2_populate_tree(&pt[i]);
+			continue;
+		}
+		hammer2_thr_attach(); /* detached by the thread */
+		pt[i].attached = 1;
+		if (pthread_create(&pt[i].td, NULL, hammer2_populate_tree,
+		    &pt[i]))
+			errx(1, "failed to create thread");
+	}
+	for (i = 0; i < ntrees; i++)
+		if (pt[i].attached)
+			pthread_join(pt[i].td, NULL);
+
+	for (i = 1; i < ntrees; i++) {
+		error = hammer2_vfs_unmount(&pt[i].mp, 0);
+		if (error)
+			errx(1, "failed to unmount PFS \"%s\", error %d",
+			    pt[i].label, error);
+		free_fsnodes(pt[i].root);
+		h2_opt->tree_root[i - 1] = NULL;
+	}
+	free(pt);
+}
+
+/*
+ * + root->name is ".".
+ * + root->child is NULL.
+ * + root->parent->child points to root.
+ * + fsnode for ".." does not exist, even if a dirent ".." physically exists.
+ *
+ *   ... -> root's parent -> next -> next -> ...
+ *          ^ | child
+ *   parent | v
+ *          root -> next -> next -> next -> ...
+ *          "."             ^ |
+ *                          | v
+ */
+static int
+hammer2_populate_dir(struct m_vnode *dvp, const char *dir, fsnode *root,
+    fsnode *parent, fsinfo_t *fsopts, int depth)
+{
+	fsnode *cur;
+	struct m_vnode *vp;
 	struct stat st;
 	char f[MAXPATHLEN];
 	const char *path;
+	hammer2_tid_t inum;
 	int hardlink;
 	int error;
 
@@ -1097,7 +1977,13 @@ hammer2_populate_dir(struct m_vnode *dvp, const char *dir, fsnode *root,
 	if (!S_ISDIR(st.st_mode))
 		errx(1, "no such dir %s", dir);
 
+	/* prebuild indirect blocks for all dirents (and inodes) */
+	hammer2_populate_bulkload(dvp, root, fsopts);
+
 	for (cur = root->next; cur != NULL; cur = cur->next) {
+		/* flush if too much has been dirtied */
+		hammer2_populate_sync(VTOI(dvp)->pmp);
+
 		/* global variable for HAMMER2 vnops */
 		hammer2_curnode = cur;
 
@@ -1161,7 +2047,7 @@ hammer2_populate_dir(struct m_vnode *dvp, const char *dir, fsnode *root,
 			if (error)
 				errx(1, "failed to populate %s: %s",
 				    path, strerror(error));
-			cur->inode->param = vp;
+			hammer2_release_vnode(vp);
 			continue;
 		}
 
@@ -1177,12 +2063,15 @@ hammer2_populate_dir(struct m_vnode *dvp, const char *dir, fsnode *root,
 				    cur->name, strerror(error));
 			assert(vp);
 			hammer2_print(dvp, vp, cur, depth, "ncreate");
+			if (cur->inode->nlink > 1)
+				hammer2_link_enter(cur->inode,
+				    VTOI(vp)->meta.inum);
 
+			/* releases vp */
 			error = hammer2_write_file(vp, path, cur);
 			if (error)
 				errx(1, "hammer2_write_file(\"%s\") failed: %s",
 				    path, strerror(error));
-			cur->inode->param = vp;
 			continue;
 		}
 
@@ -1199,7 +2088,7 @@ hammer2_populate_dir(struct m_vnode *dvp, const char *dir, fsnode *root,
 				    cur->name, strerror(error));
 			assert(vp);
 			hammer2_print(dvp, vp, cur, depth, "nsymlink");
-			cur->inode->param = vp;
+			hammer2_release_vnode(vp);
 			continue;
 		}
 
@@ -1215,7 +2104,10 @@ hammer2_populate_dir(struct m_vnode *dvp, const char *dir, fsnode *root,
 				    cur->name, strerror(error));
 			assert(vp);
 			hammer2_print(dvp, vp, cur, depth, "nmknod");
-			cur->inode->param = vp;
+			if (cur->inode->nlink > 1)
+				hammer2_link_enter(cur->inode,
+				    VTOI(vp)->meta.inum);
+			hammer2_release_vnode(vp);
 			continue;
 		}
 
@@ -1224,10 +2116,24 @@ hammer2_populate_dir(struct m_vnode *dvp, const char *dir, fsnode *root,
 			char buf[64];
 			assert(cur->child == NULL);
 
-			/* source vnode must not be NULL */
-			vp = cur->inode->param;
-			assert(vp);
+			/*
+			 * Source inode was written earlier, get a vnode
+			 * for it once any of its pending blocks are written.
+			 */
+			inum = hammer2_link_lookup(cur->inode);
+			assert(inum);
+			if (hammer2_wpipe) {
+				while (hammer2_wpipe_pending(hammer2_wpipe))
+					hammer2_write_commit();
+			}
+			vp = NULL;
+			error = hammer2_vfs_vget(VTOI(dvp)->pmp->mp, NULL, inum,
+			    &vp);
+			if (error)
+				errx(1, "hammer2_vfs_vget(%lld) failed: %s",
+				    (long long)inum, strerror(error));
 			/* currently these conditions must be true */
+			assert(vp);
 			assert(vp->v_data);
 			assert(vp->v_type == VREG || vp->v_type == VFIFO);
 			assert(vp->v_logical);
@@ -1243,6 +2149,7 @@ hammer2_populate_dir(struct m_vnode *dvp, const char *dir, fsnode *root,
 			snprintf(buf, sizeof(buf), "nlink=%lld",
 			    (long long)VTOI(vp)->meta.nlinks);
 			hammer2_print(dvp, vp, cur, depth, buf);
+			hammer2_release_vnode(vp);
 			continue;
 		}
 
@@ -1253,18 +2160,255 @@ hammer2_populate_dir(struct m_vnode *dvp, const char *dir, fsnode *root,
 	return 0;
 }
 
+/*
+ * Disconnect and free a vnode which is no longer needed, a modified inode
+ * remains referenced until it is flushed.
+ */
+static void
+hammer2_release_vnode(struct m_vnode *vp)
+{
+	assert(vp->v_malloced);
+	assert(!vp->v_vflushed);
+
+	hammer2_reclaim(vp);
+	freevnode(vp);
+}
+
+/*
+ * Flush the PFS when the number of modified chains or inodes is over the
+ * same limits the VFS uses to throttle writers, so the chain topology
+ * doesn't grow with the number of files and unmount doesn't flush it all.
+ */
+static void
+hammer2_populate_sync(hammer2_pfs_t *pmp)
+{
+	if (hammer2_count_modified_chains < hammer2_limit_dirty_chains &&
+	    pmp->sideq_count < hammer2_limit_dirty_inodes)
+		return;
+
+	if (hammer2_wpipe) {
+		while (hammer2_wpipe_pending(hammer2_wpipe))
+			hammer2_write_commit();
+	}
+	if (debug & DEBUG_FS_POPULATE)
+		APRINTF("sync %ld modified chains %ld inodes\n",
+		    hammer2_count_modified_chains, pmp->sideq_count);
+	hammer2_vfs_sync(pmp->mp, MNT_WAIT);
+	hammer2_pfs_free_recq(pmp);
+}
+
+static void
+hammer2_link_enter(fsinode *inode, hammer2_tid_t inum)
+{
+	hammer2_linkent_t *ent;
+	int n;
+
+	n = ((uintptr_t)inode / sizeof(*inode)) & HAMMER2_LINKHASH_MASK;
+	ent = ecalloc(1, sizeof(*ent));
+	ent->inode = inode;
+	ent->inum = inum;
+	pthread_mutex_lock(&hammer2_link_lock);
+	ent->next = hammer2_linkhash[n];
+	hammer2_linkhash[n] = ent;
+	pthread_mutex_unlock(&hammer2_link_lock);
+}
+
+static hammer2_tid_t
+hammer2_link_lookup(fsinode *inode)
+{
+	hammer2_linkent_t *ent;
+	int n;
+
+	n = ((uintptr_t)inode / sizeof(*inode)) & HAMMER2_LINKHASH_MASK;
+	pthread_mutex_lock(&hammer2_link_lock);
+	for (ent = hammer2_linkhash[n]; ent; ent = ent->next)
+		if (ent->inode == inode)
+			break;
+	pthread_mutex_unlock(&hammer2_link_lock);
+	return (ent != NULL ? ent->inum : 0);
+}
+
+static void
+hammer2_link_free(void)
+{
+	hammer2_linkent_t *ent;
+	int i;
+
+	for (i = 0; i < HAMMER2_LINKHASH_SIZE; ++i) {
+		while ((ent = hammer2_linkhash[i]) != NULL) {
+			hammer2_linkhash[i] = ent->next;
+			free(ent);
+		}
+	}
+}
+
+static void
+hammer2_wfile_error(hammer2_wfile_t *wf, int error)
+{
+	if (wf->node != NULL)
+		errx(1, "failed to write to %s vnode: %s",
+		    wf->node->name, strerror(error));
+	errx(1, "failed to write to inode %ju: %s",
+	    (uintmax_t)VTOI(wf->vp)->meta.inum, strerror(error));
+}
+
+/*
+ * Put the mtime of a rewritten file back, the writes stamped it with the
+ * current time.
+ */
+static void
+hammer2_wfile_restore(hammer2_wfile_t *wf)
+{
+	hammer2_inode_t *ip = VTOI(wf->vp);
+
+	hammer2_trans_init(ip->pmp, 0);
+	hammer2_inode_lock(ip, 0);
+	hammer2_inode_modify(ip);
+	ip->meta.mtime = wf->mtime;
+	hammer2_inode_unlock(ip);
+	hammer2_trans_done(ip->pmp, HAMMER2_TRANS_SIDEQ);
+}
+
+static void
+hammer2_wfile_drop(hammer2_wfile_t *wf)
+{
+	if (--wf->refs == 0) {
+		if (wf->rewrite)
+			hammer2_wfile_restore(wf);
+		else
+			hammer2_policy_account(VTOI(wf->vp), wf->node,
+			    wf->policy, wf->nsize);
+		munmap(wf->p, wf->nsize);
+		if (!wf->hold)
+			hammer2_release_vnode(wf->vp);
+		free(wf);
+	}
+}
+
+/*
+ * Write the contents of wf to its vnode and drop the submitter reference.
+ * Blocks are queued to the write pipeline if any, they are written once
+ * prepared, possibly after the following files have been created.  Data
+ * embedded in the inode doesn't go through the pipeline.
+ */
+static void
+hammer2_wfile_write(hammer2_wfile_t *wf)
+{
+	size_t bufsize;
+	off_t offset;
+	int error;
+
+	wf->refs = 1;
+	for (offset = 0; offset < (off_t)wf->nsize; offset += bufsize) {
+		bufsize = MIN(wf->nsize - offset, HAMMER2_PBUFSIZE);
+		if (hammer2_wpipe != NULL &&
+		    wf->nsize > HAMMER2_EMBEDDED_BYTES) {
+			while (hammer2_wpipe_full(hammer2_wpipe))
+				hammer2_write_commit();
+			++wf->refs;
+			hammer2_wpipe_submit(hammer2_wpipe, VTOI(wf->vp),
+			    wf->p + offset, bufsize, offset, wf);
+		} else {
+			error = hammer2_write_direct(wf->vp, wf->p + offset,
+			    bufsize, offset);
+			if (error)
+				hammer2_wfile_error(wf, error);
+		}
+	}
+	hammer2_wfile_drop(wf);
+}
+
+/*
+ * Write the oldest block of the write pipeline to its file.
+ */
+static void
+hammer2_write_commit(void)
+{
+	hammer2_wcomp_t *wc;
+	hammer2_wfile_t *wf;
+	hammer2_inode_t *ip;
+	fsnode *curnode;
+	int error;
+
+	wc = hammer2_wpipe_wait(hammer2_wpipe);
+	wf = wc->priv;
+	ip = VTOI(wf->vp);
+
+	/* vnops take the file times from the current node */
+	curnode = hammer2_curnode;
+	hammer2_curnode = wf->node;
+	ip->wcomp = wc;
+	error = hammer2_write_direct(wf->vp, wc->data, wc->bytes, wc->lbase);
+	ip->wcomp = NULL;
+	hammer2_curnode = curnode;
+	if (error)
+		hammer2_wfile_error(wf, error);
+
+	hammer2_wpipe_retire(hammer2_wpipe);
+	hammer2_wfile_drop(wf);
+}
+
+/*
+ * Bulk-load the indirect blocks of a new directory before its entries
+ * are created, keys are the dirhash of each entry.  The PFS root also
+ * indexes every inode by inum, so the range of inums about to be
+ * allocated is loaded along with its own entries.
+ *
+ * The indirect blocks are held until the PFS is unmounted, otherwise
+ * hammer2_populate_sync() would delete or collapse the ones not yet
+ * filled.
+ */
+static void
+hammer2_populate_bulkload(struct m_vnode *dvp, fsnode *root, fsinfo_t *fsopts)
+{
+	hammer2_inode_t *dip = VTOI(dvp);
+	hammer2_pfs_t *pmp = dip->pmp;
+	hammer2_key_t *keys;
+	fsnode *cur;
+	int nkeys, n;
+	int error;
+
+	nkeys = 0;
+	for (cur = root->next; cur != NULL; cur = cur->next)
+		nkeys++;
+	if (dip == pmp->iroot)
+		nkeys += fsopts->inodes;
+	if (nkeys <= HAMMER2_SET_COUNT)
+		return;
+
+	keys = ecalloc(nkeys, sizeof(*keys));
+	n = 0;
+	for (cur = root->next; cur != NULL; cur = cur->next)
+		keys[n++] = hammer2_dirhash(cur->name, strlen(cur->name));
+	while (n < nkeys) {
+		keys[n] = pmp->inode_tid + n - (nkeys - fsopts->inodes);
+		n++;
+	}
+
+	error = hammer2_inode_bulkload(dip, keys, nkeys, 75,
+	    HAMMER2_BULKLOAD_HOLD);
+	if (error)
+		errx(1, "failed to bulk-load directory: %s", strerror(error));
+	free(keys);
+}
+
+/*
+ * Write the contents of path to vp, vp is released once written.
+ */
 static int
 hammer2_write_file(struct m_vnode *vp, const char *path, fsnode *node)
 {
 	struct stat *st = &node->inode->st;
-	size_t nsize, bufsize;
-	off_t offset;
-	int fd, error;
+	hammer2_wfile_t *wf;
+	size_t nsize;
+	int fd, error, policy;
 	char *p;
 
 	nsize = st->st_size;
-	if (nsize == 0)
+	if (nsize == 0) {
+		hammer2_release_vnode(vp);
 		return 0;
+	}
 	/* check nsize vs maximum file size */
 
 	fd = open(path, O_RDONLY);
@@ -1276,22 +2420,793 @@ hammer2_write_file(struct m_vnode *vp, const char *path, fsnode *node)
 		err(1, "failed to mmap %s", path);
 	close(fd);
 
-	for (offset = 0; offset < nsize; ) {
-		bufsize = MIN(nsize - offset, HAMMER2_PBUFSIZE);
-		assert(bufsize <= HAMMER2_PBUFSIZE);
-		error = hammer2_write(vp, p + offset, bufsize, offset);
-		if (error)
-			errx(1, "failed to write to %s vnode: %s",
-			    path, strerror(error));
-		offset += bufsize;
-		if (bufsize == HAMMER2_PBUFSIZE)
-			assert((offset & (HAMMER2_PBUFSIZE - 1)) == 0);
-	}
-	munmap(p, nsize);
+	error = hammer2_write_prepare(vp, p, nsize);
+	if (error)
+		errx(1, "failed to prepare %s vnode: %s", path,
+		    strerror(error));
+
+	policy = HAMMER2_POLICY_INHERIT;
+	if (hammer2_policy_enabled)
+		policy = hammer2_policy_select(vp, node, p, nsize);
+
+	wf = ecalloc(1, sizeof(*wf));
+	wf->vp = vp;
+	wf->node = node;
+	wf->p = p;
+	wf->nsize = nsize;
+	wf->policy = policy;
+	hammer2_wfile_write(wf);
 
 	return 0;
 }
 
+/*
+ * Load the compression policy, either "auto" for the builtin heuristics
+ * only, or a rule table file whose rules are consulted first.  Each line
+ * of the file is a pattern, a compression type as for the `c' option and
+ * an optional minimum file size, the first matching rule wins.  A pattern
+ * containing `/' matches the path relative to the source directory,
+ * otherwise it matches the file name.
+ */
+static void
+hammer2_policy_load(const char *arg)
+{
+	hammer2_policy_rule_t *rule;
+	const char *comps[] = { "none", "autozero", "lz4", "zlib", };
+	char *line, *o, *p, *pattern, *comp, *size, *level;
+	size_t linecap;
+	int i, lineno;
+	FILE *fp;
+
+	hammer2_policy_enabled = true;
+	if (strcmp(arg, "auto") == 0)
+		return;
+
+	fp = fopen(arg, "r");
+	if (fp == NULL)
+		err(1, "failed to open compression policy `%s'", arg);
+	line = NULL;
+	linecap = 0;
+	lineno = 0;
+	while (getline(&line, &linecap, fp) != -1) {
+		++lineno;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = 0;
+		pattern = comp = size = NULL;
+		o = line;
+		while ((p = strsep(&o, " \t\n")) != NULL) {
+			if (*p == 0)
+				continue;
+			if (pattern == NULL)
+				pattern = p;
+			else if (comp == NULL)
+				comp = p;
+			else if (size == NULL)
+				size = p;
+			else
+				errx(1, "%s:%d: too many fields", arg, lineno);
+		}
+		if (pattern == NULL)
+			continue;
+		if (comp == NULL)
+			errx(1, "%s:%d: missing compression type", arg, lineno);
+
+		hammer2_policy_rules = erealloc(hammer2_policy_rules,
+		    (hammer2_policy_nrules + 1) * sizeof(*rule));
+		rule = &hammer2_policy_rules[hammer2_policy_nrules++];
+		rule->pattern = estrdup(pattern);
+		if ((level = strchr(comp, ':')) != NULL)
+			*level++ = 0;
+		for (i = 0; i < (int)nitems(comps); ++i)
+			if (strcasecmp(comp, comps[i]) == 0)
+				break;
+		if (i == (int)nitems(comps))
+			errx(1, "%s:%d: invalid compression type '%s'",
+			    arg, lineno, comp);
+		rule->comp_algo = hammer2_comp_level(i, level);
+		if (rule->comp_algo < 0)
+			errx(1, "%s:%d: invalid compression level '%s' for %s",
+			    arg, lineno, level, comp);
+		rule->comp_algo = HAMMER2_ENC_ALGO(i) |
+		    HAMMER2_ENC_LEVEL(rule->comp_algo);
+		rule->min_size = size ? strsuftoll("minimum size", size, 0,
+		    LLONG_MAX) : 0;
+	}
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * log2(x) in 16.16 fixed point, x > 0.
+ */
+static uint32_t
+hammer2_policy_log2(uint32_t x)
+{
+	uint64_t y;
+	uint32_t r;
+	int n, i;
+
+	n = 31 - __builtin_clz(x);
+	r = (uint32_t)n << 16;
+	y = (uint64_t)x << (31 - n);	/* 1.31 fixed point in [1, 2) */
+	for (i = 15; i >= 0; --i) {
+		y = (y * y) >> 31;
+		if (y >= (2ULL << 31)) {
+			y >>= 1;
+			r |= 1U << i;
+		}
+	}
+	return (r);
+}
+
+/*
+ * Order-0 entropy of the data, in 1/256 bits per byte.
+ */
+static int
+hammer2_policy_entropy(const unsigned char *p, size_t size)
+{
+	uint32_t counts[256];
+	uint64_t sum;
+	size_t i;
+
+	bzero(counts, sizeof(counts));
+	for (i = 0; i < size; ++i)
+		counts[p[i]]++;
+	sum = 0;
+	for (i = 0; i < nitems(counts); ++i)
+		if (counts[i])
+			sum += (uint64_t)counts[i] *
+			    hammer2_policy_log2(counts[i]);
+	return ((((uint64_t)size * hammer2_policy_log2(size) - sum) / size)
+	    >> 8);
+}
+
+/*
+ * Choose the compression of a new file before its data is written and
+ * set it in the inode, returning the reason (HAMMER2_POLICY_xxx).  The
+ * heuristics only ever turn compression off, leaving zero-checking on,
+ * for files which compression can't shrink:
+ *
+ *	- files that fit in the minimum allocation
+ *	- files with the suffix of an already compressed format
+ *	- files whose first block has near 8 bits of entropy per byte
+ */
+static int
+hammer2_policy_select(struct m_vnode *vp, fsnode *node, const char *data,
+    size_t nsize)
+{
+	hammer2_ioc_inode_t inode;
+	hammer2_policy_rule_t *rule;
+	hammer2_inode_t *ip = VTOI(vp);
+	char rpath[PATH_MAX];
+	const char *name, *suffix;
+	int i, policy, comp_algo, entropy;
+
+	/* embedded in the inode, never compressed */
+	if (nsize <= HAMMER2_EMBEDDED_BYTES)
+		return (HAMMER2_POLICY_INHERIT);
+
+	policy = HAMMER2_POLICY_INHERIT;
+	comp_algo = ip->meta.comp_algo;
+
+	name = node->name;
+	snprintf(rpath, sizeof(rpath), "%s/%s", node->path, name);
+	if (strncmp(rpath, "./", 2) == 0)
+		memmove(rpath, rpath + 2, strlen(rpath + 2) + 1);
+
+	for (i = 0; i < hammer2_policy_nrules; ++i) {
+		rule = &hammer2_policy_rules[i];
+		if ((off_t)nsize < rule->min_size)
+			continue;
+		if (fnmatch(rule->pattern,
+		    strchr(rule->pattern, '/') ? rpath : name, 0) == 0) {
+			policy = HAMMER2_POLICY_RULE;
+			comp_algo = rule->comp_algo;
+			break;
+		}
+	}
+
+	if (policy == HAMMER2_POLICY_INHERIT &&
+	    HAMMER2_DEC_ALGO(comp_algo) != HAMMER2_COMP_NONE &&
+	    HAMMER2_DEC_ALGO(comp_algo) != HAMMER2_COMP_AUTOZERO) {
+		suffix = strrchr(name, '.');
+		if (nsize <= HAMMER2_ALLOC_MIN) {
+			policy = HAMMER2_POLICY_SMALL;
+		} else if (suffix && suffix != name) {
+			for (i = 0; i < (int)nitems(hammer2_policy_suffixes);
+			    ++i) {
+				if (strcasecmp(suffix + 1,
+				    hammer2_policy_suffixes[i]) == 0) {
+					policy = HAMMER2_POLICY_SUFFIX;
+					break;
+				}
+			}
+		}
+		if (policy == HAMMER2_POLICY_INHERIT) {
+			entropy = hammer2_policy_entropy(
+			    (const unsigned char *)data,
+			    MIN(nsize, HAMMER2_PBUFSIZE));
+			if (entropy >= HAMMER2_POLICY_ENTROPY_MAX)
+				policy = HAMMER2_POLICY_ENTROPY;
+		}
+		if (policy != HAMMER2_POLICY_INHERIT)
+			comp_algo = HAMMER2_ENC_ALGO(HAMMER2_COMP_AUTOZERO);
+	}
+
+	if (debug & DEBUG_FS_WRITE_FILE)
+		APRINTF("%s: %s comp_algo 0x%02x\n", rpath,
+		    hammer2_policy_names[policy], comp_algo);
+
+	if (comp_algo != ip->meta.comp_algo) {
+		bzero(&inode, sizeof(inode));
+		if (hammer2_ioctl_inode_get(ip, &inode))
+			errx(1, "failed to get inode of %s", rpath);
+		inode.flags |= HAMMER2IOC_INODE_FLAG_COMP;
+		inode.ip_data.meta.comp_algo = comp_algo;
+		if (hammer2_ioctl_inode_set(ip, &inode))
+			errx(1, "failed to set compression of %s", rpath);
+	}
+
+	return (policy);
+}
+
+/*
+ * Account a written file to the reason of its compression.
+ */
+static void
+hammer2_policy_account(hammer2_inode_t *ip, fsnode *node, int policy,
+    size_t nsize)
+{
+	hammer2_policy_stat_t *st = &hammer2_policy_stats[policy];
+
+	if (!hammer2_policy_enabled)
+		return;
+	pthread_mutex_lock(&hammer2_policy_lock);
+	st->files++;
+	st->lbytes += nsize;
+	st->pbytes += ip->wbytes;
+	pthread_mutex_unlock(&hammer2_policy_lock);
+
+	if (debug & DEBUG_FS_WRITE_FILE)
+		APRINTF("%s: %s %zu -> %ju bytes\n", node->name,
+		    hammer2_policy_names[policy], nsize,
+		    (uintmax_t)ip->wbytes);
+}
+
+static void
+hammer2_policy_print(void)
+{
+	hammer2_policy_stat_t *st;
+	int i;
+
+	printf("compression policy:\n");
+	printf("\t%-8s %10s %14s %14s %6s\n",
+	    "reason", "files", "bytes", "allocated", "ratio");
+	for (i = 0; i < HAMMER2_POLICY_COUNT; ++i) {
+		st = &hammer2_policy_stats[i];
+		printf("\t%-8s %10ju %14ju %14ju %6.3f\n",
+		    hammer2_policy_names[i], (uintmax_t)st->files,
+		    (uintmax_t)st->lbytes, (uintmax_t)st->pbytes,
+		    st->lbytes ? (double)st->pbytes / st->lbytes : 0.0);
+	}
+}
+
+/*
+ * Read a block of the image by its media offset.
+ */
+static void
+hammer2_report_read(hammer2_report_t *rp, hammer2_off_t off, void *buf,
+    size_t bytes)
+{
+	int i;
+
+	for (i = rp->nvolumes - 1; i > 0; --i)
+		if (off >= rp->voldata.volu_loff[i])
+			break;
+	if (pread(rp->fd[i], buf, bytes, off - rp->voldata.volu_loff[i]) !=
+	    (ssize_t)bytes)
+		err(1, "failed to read block at 0x%016jx", (uintmax_t)off);
+}
+
+static hammer2_report_inode_t *
+hammer2_report_lookup(hammer2_report_t *rp, int pfs, hammer2_tid_t inum)
+{
+	hammer2_report_inode_t *ent;
+
+	ent = rp->ihash[(inum ^ pfs) & (rp->ihash_size - 1)];
+	while (ent && (ent->inum != inum || ent->pfs != pfs))
+		ent = ent->next;
+	return (ent);
+}
+
+static hammer2_report_inode_t *
+hammer2_report_enter(hammer2_report_t *rp, int pfs, hammer2_tid_t inum)
+{
+	hammer2_report_inode_t **ihash, *ent, *next;
+	size_t i, n;
+
+	if (rp->ninodes >= rp->ihash_size * 2) {
+		n = rp->ihash_size * 2;
+		ihash = ecalloc(n, sizeof(*ihash));
+		for (i = 0; i < rp->ihash_size; ++i) {
+			for (ent = rp->ihash[i]; ent; ent = next) {
+				next = ent->next;
+				ent->next = ihash[(ent->inum ^ ent->pfs) &
+				    (n - 1)];
+				ihash[(ent->inum ^ ent->pfs) & (n - 1)] = ent;
+			}
+		}
+		free(rp->ihash);
+		rp->ihash = ihash;
+		rp->ihash_size = n;
+	}
+
+	ent = ecalloc(1, sizeof(*ent));
+	ent->pfs = pfs;
+	ent->inum = inum;
+	i = (inum ^ pfs) & (rp->ihash_size - 1);
+	ent->next = rp->ihash[i];
+	rp->ihash[i] = ent;
+	rp->ninodes++;
+
+	return (ent);
+}
+
+static char *
+hammer2_report_name(const hammer2_inode_data_t *ipdata)
+{
+	char name[HAMMER2_INODE_MAXNAME + 1];
+	size_t len;
+
+	len = MIN(ipdata->meta.name_len, HAMMER2_INODE_MAXNAME);
+	bcopy(ipdata->filename, name, len);
+	name[len] = 0;
+	return (estrdup(name));
+}
+
+/*
+ * Account a blockref and recurse into it.  Data and indirect blocks
+ * are charged to the inode they belong to, level is the indirect block
+ * level below that inode.
+ */
+static void
+hammer2_report_scan(hammer2_report_t *rp, const hammer2_blockref_t *bref,
+    hammer2_report_inode_t *owner, int pfs, int level)
+{
+	const hammer2_inode_data_t *ipdata;
+	hammer2_report_inode_t *ent;
+	hammer2_blockref_t *brefs;
+	hammer2_report_comp_t *comp;
+	hammer2_off_t off;
+	size_t bytes, lbytes;
+	int i, n, radix;
+
+	radix = bref->data_off & HAMMER2_OFF_MASK_RADIX;
+	bytes = radix ? (size_t)1 << radix : 0;
+	off = bref->data_off & ~HAMMER2_OFF_MASK_RADIX;
+
+	switch (bref->type) {
+	case HAMMER2_BREF_TYPE_EMPTY:
+		return;
+	case HAMMER2_BREF_TYPE_DIRENT:
+		rp->dirents++;
+		rp->meta_bytes += bytes;
+		if (owner)
+			owner->pbytes += bytes;
+		/*
+		 * Inodes are named by their inum, directory names come
+		 * from their entries, long names are in a data block.
+		 */
+		if (bref->embed.dirent.type != HAMMER2_OBJTYPE_DIRECTORY ||
+		    pfs < 0)
+			return;
+		ent = hammer2_report_lookup(rp, pfs, bref->embed.dirent.inum);
+		if (ent == NULL)
+			ent = hammer2_report_enter(rp, pfs,
+			    bref->embed.dirent.inum);
+		if (ent->name)
+			return;
+		n = bref->embed.dirent.namlen;
+		if (n <= (int)sizeof(bref->check.buf)) {
+			ent->name = emalloc(n + 1);
+			bcopy(bref->check.buf, ent->name, n);
+		} else {
+			n = MIN(n, (int)bytes);
+			hammer2_report_read(rp, off, rp->buf, bytes);
+			ent->name = emalloc(n + 1);
+			bcopy(rp->buf, ent->name, n);
+		}
+		ent->name[n] = 0;
+		return;
+	case HAMMER2_BREF_TYPE_DATA:
+		n = HAMMER2_DEC_COMP(bref->methods) & (nitems(rp->comp) - 1);
+		comp = &rp->comp[n];
+		/* the file data in the block, keybits is always 64KB */
+		lbytes = (size_t)1 << bref->keybits;
+		if (owner) {
+			lbytes = bref->key < owner->size ?
+			    MIN(lbytes, owner->size - bref->key) : 0;
+			owner->lbytes += lbytes;
+			owner->pbytes += bytes;
+		}
+		comp->blocks++;
+		comp->lbytes += lbytes;
+		comp->pbytes += bytes;
+		if (rp->ndata == rp->maxdata) {
+			rp->maxdata = rp->maxdata ? rp->maxdata * 2 : 4096;
+			rp->data_offs = erealloc(rp->data_offs,
+			    rp->maxdata * sizeof(*rp->data_offs));
+		}
+		rp->data_offs[rp->ndata].data_off = bref->data_off;
+		rp->data_offs[rp->ndata].comp = n;
+		rp->ndata++;
+		return;
+	default:
+		break;
+	}
+	if (bytes == 0)
+		return;
+
+	/* copy the block out, the buffer is reused by the recursion */
+	hammer2_report_read(rp, off, rp->buf, bytes);
+	brefs = emalloc(bytes);
+
+	switch (bref->type) {
+	case HAMMER2_BREF_TYPE_INODE:
+		bcopy(rp->buf, brefs, bytes);
+		ipdata = (const hammer2_inode_data_t *)brefs;
+		rp->inodes++;
+		rp->meta_bytes += bytes;
+		if (bref->flags & HAMMER2_BREF_FLAG_PFSROOT) {
+			if (rp->npfs == HAMMER2_REPORT_MAXPFS)
+				break;
+			pfs = rp->npfs++;
+			rp->pfs_names[pfs] = hammer2_report_name(ipdata);
+		} else if (pfs < 0) {
+			/* super-root */
+			ent = NULL;
+			goto children;
+		}
+		ent = hammer2_report_lookup(rp, pfs, ipdata->meta.inum);
+		if (ent == NULL)
+			ent = hammer2_report_enter(rp, pfs, ipdata->meta.inum);
+		ent->iparent = ipdata->meta.iparent;
+		ent->type = ipdata->meta.type;
+		ent->size = ipdata->meta.size;
+		ent->pbytes += bytes;
+		if (ent->type == HAMMER2_OBJTYPE_REGFILE)
+			rp->file_bytes += ent->size;
+children:
+		if (ipdata->meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA) {
+			rp->embed_bytes += ipdata->meta.size;
+			break;
+		}
+		for (i = 0; i < HAMMER2_SET_COUNT; ++i)
+			hammer2_report_scan(rp,
+			    &ipdata->u.blockset.blockref[i], ent, pfs, 1);
+		if (ent && ent->type == HAMMER2_OBJTYPE_REGFILE &&
+		    ent->size > HAMMER2_EMBEDDED_BYTES &&
+		    ent->lbytes < ent->size)
+			rp->hole_bytes += ent->size - ent->lbytes;
+		break;
+	case HAMMER2_BREF_TYPE_INDIRECT:
+		rp->indirects[MIN(level, HAMMER2_REPORT_LEVELS - 1)]++;
+		rp->meta_bytes += bytes;
+		if (owner)
+			owner->pbytes += bytes;
+		/* FALLTHROUGH */
+	case HAMMER2_BREF_TYPE_FREEMAP_NODE:
+		if (bref->type == HAMMER2_BREF_TYPE_FREEMAP_NODE) {
+			rp->fmap_nodes++;
+			rp->fmap_bytes += bytes;
+		}
+		bcopy(rp->buf, brefs, bytes);
+		n = bytes / sizeof(*brefs);
+		for (i = 0; i < n; ++i)
+			hammer2_report_scan(rp, &brefs[i], owner, pfs,
+			    level + 1);
+		break;
+	case HAMMER2_BREF_TYPE_FREEMAP_LEAF:
+		rp->fmap_leaves++;
+		rp->fmap_bytes += bytes;
+		break;
+	default:
+		break;
+	}
+	free(brefs);
+}
+
+static int
+hammer2_report_cmp_off(const void *a, const void *b)
+{
+	hammer2_off_t x = ((const hammer2_report_data_t *)a)->data_off;
+	hammer2_off_t y = ((const hammer2_report_data_t *)b)->data_off;
+
+	return (x < y ? -1 : x > y);
+}
+
+static int
+hammer2_report_cmp_dir(const void *a, const void *b)
+{
+	const hammer2_report_inode_t *x = *(hammer2_report_inode_t * const *)a;
+	const hammer2_report_inode_t *y = *(hammer2_report_inode_t * const *)b;
+
+	return (x->tbytes > y->tbytes ? -1 : x->tbytes < y->tbytes);
+}
+
+/*
+ * Path of a directory from the names of its parents.
+ */
+static void
+hammer2_report_path(hammer2_report_t *rp, hammer2_report_inode_t *ent,
+    char *path, size_t size)
+{
+	char tmp[PATH_MAX];
+	int depth;
+
+	path[0] = 0;
+	for (depth = 0; ent && ent->inum != 1 && depth < PATH_MAX / 2;
+	    ++depth) {
+		snprintf(tmp, sizeof(tmp), "/%s%s", ent->name ? ent->name : "?",
+		    path);
+		strlcpy(path, tmp, size);
+		ent = hammer2_report_lookup(rp, ent->pfs, ent->iparent);
+	}
+	if (path[0] == 0)
+		strlcpy(path, "/", size);
+}
+
+static void
+hammer2_report_json_str(FILE *fp, const char *str)
+{
+	const unsigned char *p;
+
+	fputc('"', fp);
+	for (p = (const unsigned char *)str; *p; ++p) {
+		if (*p == '"' || *p == '\\')
+			fprintf(fp, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(fp, "\\u%04x", *p);
+		else
+			fputc(*p, fp);
+	}
+	fputc('"', fp);
+}
+
+/*
+ * Print the space, compression, dedup and block accounting of the image
+ * along with the directories using the most space, as text or JSON.
+ */
+static void
+hammer2_report(const char *image, fsinfo_t *fsopts)
+{
+	hammer2_makefs_options_t *h2_opt = fsopts->fs_specific;
+	hammer2_report_inode_t *ent, *dir, **dirs;
+	hammer2_report_comp_t *comp;
+	hammer2_volume_data_t *vd;
+	hammer2_report_t rp;
+	hammer2_off_t used;
+	uint64_t dedup_hits, dedup_bytes, data_lbytes, data_pbytes, bytes;
+	size_t i, ndirs;
+	char path[PATH_MAX];
+	bool json;
+	int depth, n;
+	FILE *fp;
+
+	bzero(&rp, sizeof(rp));
+	json = h2_opt->report == HAMMER2_REPORT_JSON;
+	rp.nvolumes = h2_opt->num_volumes;
+	for (n = 0; n < rp.nvolumes; ++n)
+		rp.fd[n] = h2_opt->volume_fs[n]->fd;
+
+	/* the latest volume header of the root volume */
+	vd = emalloc(sizeof(*vd));
+	for (n = 0; n < HAMMER2_NUM_VOLHDRS; ++n) {
+		if (pread(rp.fd[0], vd, sizeof(*vd),
+		    n * HAMMER2_ZONE_BYTES64) != sizeof(*vd))
+			break;
+		if (vd->magic != HAMMER2_VOLUME_ID_HBO)
+			continue;
+		if (rp.voldata.magic == 0 ||
+		    vd->mirror_tid > rp.voldata.mirror_tid)
+			bcopy(vd, &rp.voldata, sizeof(*vd));
+	}
+	free(vd);
+	if (rp.voldata.magic != HAMMER2_VOLUME_ID_HBO)
+		errx(1, "no valid volume header in `%s'", image);
+
+	rp.buf = emalloc(HAMMER2_PBUFSIZE);
+	rp.ihash_size = 1024;
+	rp.ihash = ecalloc(rp.ihash_size, sizeof(*rp.ihash));
+	for (n = 0; n < HAMMER2_SET_COUNT; ++n)
+		hammer2_report_scan(&rp, &rp.voldata.sroot_blockset.blockref[n],
+		    NULL, -1, 0);
+	for (n = 0; n < HAMMER2_SET_COUNT; ++n)
+		hammer2_report_scan(&rp,
+		    &rp.voldata.freemap_blockset.blockref[n], NULL, -1, 0);
+
+	/*
+	 * Blocks referenced more than once were deduplicated, only their
+	 * first reference is allocated.
+	 */
+	qsort(rp.data_offs, rp.ndata, sizeof(*rp.data_offs),
+	    hammer2_report_cmp_off);
+	dedup_hits = dedup_bytes = 0;
+	for (i = 1; i < rp.ndata; ++i) {
+		if (rp.data_offs[i].data_off ==
+		    rp.data_offs[i - 1].data_off) {
+			bytes = (uint64_t)1 <<
+			    (rp.data_offs[i].data_off & HAMMER2_OFF_MASK_RADIX);
+			dedup_hits++;
+			dedup_bytes += bytes;
+			rp.comp[rp.data_offs[i].comp].pbytes -= bytes;
+		}
+	}
+	data_lbytes = data_pbytes = 0;
+	for (n = 0; n < (int)nitems(rp.comp); ++n) {
+		data_lbytes += rp.comp[n].lbytes;
+		data_pbytes += rp.comp[n].pbytes;
+	}
+
+	/* charge each inode to its parent directories */
+	ndirs = 0;
+	dirs = ecalloc(rp.ninodes + 1, sizeof(*dirs));
+	for (i = 0; i < rp.ihash_size; ++i) {
+		for (ent = rp.ihash[i]; ent; ent = ent->next) {
+			if (ent->type == HAMMER2_OBJTYPE_DIRECTORY)
+				dirs[ndirs++] = ent;
+			dir = ent;
+			for (depth = 0; dir && depth < PATH_MAX / 2; ++depth) {
+				if (dir != ent &&
+				    dir->type != HAMMER2_OBJTYPE_DIRECTORY)
+					break;
+				dir->tbytes += ent->pbytes;
+				if (dir->inum == 1)
+					break;
+				dir = hammer2_report_lookup(&rp, dir->pfs,
+				    dir->iparent);
+			}
+		}
+	}
+	qsort(dirs, ndirs, sizeof(*dirs), hammer2_report_cmp_dir);
+	if (ndirs > HAMMER2_REPORT_TOPN)
+		ndirs = HAMMER2_REPORT_TOPN;
+
+	if (strlen(h2_opt->report_path)) {
+		fp = fopen(h2_opt->report_path, "w");
+		if (fp == NULL)
+			err(1, "failed to open `%s'", h2_opt->report_path);
+	} else {
+		fp = stdout;
+	}
+
+	vd = &rp.voldata;
+	used = vd->allocator_size - vd->allocator_free;
+	if (json) {
+		fprintf(fp, "{\n\t\"image\": ");
+		hammer2_report_json_str(fp, image);
+		fprintf(fp, ",\n"
+		    "\t\"file_bytes\": %ju,\n"
+		    "\t\"embedded_bytes\": %ju,\n"
+		    "\t\"data_logical_bytes\": %ju,\n"
+		    "\t\"data_physical_bytes\": %ju,\n"
+		    "\t\"meta_bytes\": %ju,\n",
+		    (uintmax_t)rp.file_bytes, (uintmax_t)rp.embed_bytes,
+		    (uintmax_t)data_lbytes, (uintmax_t)data_pbytes,
+		    (uintmax_t)rp.meta_bytes);
+		fprintf(fp, "\t\"compression\": {");
+		for (n = 0; n < (int)nitems(rp.comp); ++n) {
+			comp = &rp.comp[n];
+			fprintf(fp, "%s\n\t\t\"%s\": { \"blocks\": %ju, "
+			    "\"logical_bytes\": %ju, \"physical_bytes\": %ju, "
+			    "\"ratio\": %.3f }", n ? "," : "",
+			    hammer2_report_comps[n], (uintmax_t)comp->blocks,
+			    (uintmax_t)comp->lbytes, (uintmax_t)comp->pbytes,
+			    comp->lbytes ?
+			    (double)comp->pbytes / comp->lbytes : 0.0);
+		}
+		fprintf(fp, "\n\t},\n");
+		fprintf(fp, "\t\"zero_holes\": { \"blocks\": %ld, "
+		    "\"bytes\": %ju },\n",
+		    hammer2_iod_file_wzero, (uintmax_t)rp.hole_bytes);
+		fprintf(fp, "\t\"dedup\": { \"hits\": %ju, "
+		    "\"bytes_saved\": %ju },\n",
+		    (uintmax_t)dedup_hits, (uintmax_t)dedup_bytes);
+		fprintf(fp, "\t\"blocks\": { \"inodes\": %ju, "
+		    "\"dirents\": %ju, \"data\": %zu, \"indirect\": [",
+		    (uintmax_t)rp.inodes, (uintmax_t)rp.dirents, rp.ndata);
+		for (n = 1; n < HAMMER2_REPORT_LEVELS; ++n)
+			fprintf(fp, "%s%ju", n > 1 ? ", " : "",
+			    (uintmax_t)rp.indirects[n]);
+		fprintf(fp, "], \"freemap_nodes\": %ju, "
+		    "\"freemap_leaves\": %ju },\n",
+		    (uintmax_t)rp.fmap_nodes, (uintmax_t)rp.fmap_leaves);
+		fprintf(fp, "\t\"freemap\": { \"size\": %ju, \"free\": %ju, "
+		    "\"used\": %ju, \"utilization\": %.3f },\n",
+		    (uintmax_t)vd->allocator_size,
+		    (uintmax_t)vd->allocator_free, (uintmax_t)used,
+		    vd->allocator_size ?
+		    (double)used / vd->allocator_size : 0.0);
+		fprintf(fp, "\t\"top_directories\": [");
+		for (i = 0; i < ndirs; ++i) {
+			hammer2_report_path(&rp, dirs[i], path, sizeof(path));
+			fprintf(fp, "%s\n\t\t{ \"pfs\": ", i ? "," : "");
+			hammer2_report_json_str(fp, rp.pfs_names[dirs[i]->pfs]);
+			fprintf(fp, ", \"path\": ");
+			hammer2_report_json_str(fp, path);
+			fprintf(fp, ", \"referenced_bytes\": %ju }",
+			    (uintmax_t)dirs[i]->tbytes);
+		}
+		fprintf(fp, "\n\t]\n}\n");
+	} else {
+		fprintf(fp, "build report of `%s':\n", image);
+		fprintf(fp, "\tfile bytes          %14ju\n",
+		    (uintmax_t)rp.file_bytes);
+		fprintf(fp, "\tembedded bytes      %14ju\n",
+		    (uintmax_t)rp.embed_bytes);
+		fprintf(fp, "\tdata logical bytes  %14ju\n",
+		    (uintmax_t)data_lbytes);
+		fprintf(fp, "\tdata physical bytes %14ju\n",
+		    (uintmax_t)data_pbytes);
+		fprintf(fp, "\tmeta bytes          %14ju\n",
+		    (uintmax_t)rp.meta_bytes);
+		fprintf(fp, "compression:\n");
+		fprintf(fp, "\t%-8s %10s %14s %14s %6s\n",
+		    "algo", "blocks", "logical", "physical", "ratio");
+		for (n = 0; n < (int)nitems(rp.comp); ++n) {
+			comp = &rp.comp[n];
+			fprintf(fp, "\t%-8s %10ju %14ju %14ju %6.3f\n",
+			    hammer2_report_comps[n], (uintmax_t)comp->blocks,
+			    (uintmax_t)comp->lbytes, (uintmax_t)comp->pbytes,
+			    comp->lbytes ?
+			    (double)comp->pbytes / comp->lbytes : 0.0);
+		}
+		fprintf(fp, "zero holes:\n\tblocks %ld bytes %ju\n",
+		    hammer2_iod_file_wzero, (uintmax_t)rp.hole_bytes);
+		fprintf(fp, "dedup:\n\thits %ju bytes saved %ju\n",
+		    (uintmax_t)dedup_hits, (uintmax_t)dedup_bytes);
+		fprintf(fp, "blocks:\n");
+		fprintf(fp, "\tinodes %ju dirents %ju data %zu\n",
+		    (uintmax_t)rp.inodes, (uintmax_t)rp.dirents, rp.ndata);
+		for (n = 1; n < HAMMER2_REPORT_LEVELS; ++n)
+			if (rp.indirects[n])
+				fprintf(fp, "\tindirect level %d: %ju\n", n,
+				    (uintmax_t)rp.indirects[n]);
+		fprintf(fp, "\tfreemap nodes %ju leaves %ju\n",
+		    (uintmax_t)rp.fmap_nodes, (uintmax_t)rp.fmap_leaves);
+		fprintf(fp, "freemap:\n\tsize %ju free %ju used %ju (%.1f%%)\n",
+		    (uintmax_t)vd->allocator_size,
+		    (uintmax_t)vd->allocator_free, (uintmax_t)used,
+		    vd->allocator_size ?
+		    (double)used * 100 / vd->allocator_size : 0.0);
+		fprintf(fp, "top directories (referenced bytes):\n");
+		for (i = 0; i < ndirs; ++i) {
+			hammer2_report_path(&rp, dirs[i], path, sizeof(path));
+			fprintf(fp, "\t%14ju %s:%s\n",
+			    (uintmax_t)dirs[i]->tbytes,
+			    rp.pfs_names[dirs[i]->pfs], path);
+		}
+	}
+	if (fp != stdout)
+		fclose(fp);
+	else
+		fflush(fp);
+
+	for (i = 0; i < rp.ihash_size; ++i) {
+		while ((ent = rp.ihash[i]) != NULL) {
+			rp.ihash[i] = ent->next;
+			free(ent->name);
+			free(ent);
+		}
+	}
+	for (n = 0; n < rp.npfs; ++n)
+		free(rp.pfs_names[n]);
+	free(rp.ihash);
+	free(dirs);
+	free(rp.data_offs);
+	free(rp.buf);
+}
+
 static int
 trim_char(char *p, char c)
 {
@@ -1791,8 +3706,52 @@ start_ioctl:
 	return error;
 }
 
+/*
+ * Convert a compression level string to the comp_algo level of the given
+ * algorithm, returning -1 if it is not supported.  NULL or "default" is
+ * level 0.  zlib takes levels 6-9, lz4 takes levels 1-15 or "fast" and
+ * "hc", see HAMMER2_LZ4_LEVEL_*.
+ */
+static int
+hammer2_comp_level(int comp_algo, const char *str)
+{
+	char *endp;
+	long level;
+
+	if (str == NULL || strcasecmp(str, "default") == 0)
+		return 0;
+
+	switch (comp_algo) {
+	case HAMMER2_COMP_ZLIB:
+		if (!isdigit((int)str[0]))
+			return -1;
+		level = strtol(str, &endp, 0);
+		if (*endp != 0 || level < 6 || level > 9)
+			return -1;
+		return level;
+	case HAMMER2_COMP_LZ4:
+		if (strcasecmp(str, "fast") == 0)
+			return HAMMER2_LZ4_LEVEL_FAST;
+		if (strcasecmp(str, "hc") == 0)
+			return HAMMER2_LZ4_LEVEL_HC;
+		if (!isdigit((int)str[0]))
+			return -1;
+		level = strtol(str, &endp, 0);
+		if (*endp != 0 || level < 1 || level > HAMMER2_LZ4_LEVEL_MAX)
+			return -1;
+		return level;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Set the compression of f given as path:algo[:level], with recompress
+ * also every inode under it and rewrite their data, see
+ * hammer2_recompress().
+ */
 static int
-hammer2_inode_setcomp(struct m_vnode *dvp, const char *f)
+hammer2_inode_setcomp(struct m_vnode *dvp, const char *f, bool recompress)
 {
 	hammer2_ioc_inode_t inode;
 	hammer2_inode_t *ip;
@@ -1855,31 +3814,12 @@ hammer2_inode_setcomp(struct m_vnode *dvp, const char *f)
 	comp_algo = HAMMER2_ENC_ALGO(comp_algo_idx);
 
 	/* convert comp_level_str to comp_level_idx */
-	if (comp_level_str == NULL) {
-		comp_level_idx = 0;
-	} else if (isdigit((int)comp_level_str[0])) {
-		comp_level_idx = strtol(comp_level_str, NULL, 0);
-	} else if (strcasecmp(comp_level_str, "default") == 0) {
-		comp_level_idx = 0;
-	} else {
-		printf("invalid comp_level_str: %s\n", comp_level_str);
+	comp_level_idx = hammer2_comp_level(comp_algo, comp_level_str);
+	if (comp_level_idx < 0) {
+		printf("unsupported comp_level %s for %s\n",
+		    comp_level_str, comp_algo_str);
 		return EINVAL;
 	}
-	if (comp_level_idx) {
-		switch (comp_algo) {
-		case HAMMER2_COMP_ZLIB:
-			if (comp_level_idx < 6 || comp_level_idx > 9) {
-				printf("unsupported comp_level %d for %s\n",
-				    comp_level_idx, comp_algo_str);
-				return EINVAL;
-			}
-			break;
-		default:
-			printf("unsupported comp_level %d for %s\n",
-			    comp_level_idx, comp_algo_str);
-			return EINVAL;
-		}
-	}
 	comp_level = HAMMER2_ENC_LEVEL(comp_level_idx);
 	printf("change %s to algo %d (%s) level %d\n",
 	    p, comp_algo, comp_algo_str, comp_level_idx);
@@ -1900,52 +3840,313 @@ hammer2_inode_setcomp(struct m_vnode *dvp, const char *f)
 		if (error)
 			return error;
 
-		ip = VTOI(vp);
-		switch (ip->meta.type) {
-		case HAMMER2_OBJTYPE_DIRECTORY:
-			break;
-		case HAMMER2_OBJTYPE_SOFTLINK:
-			bzero(tmp, sizeof(tmp));
-			error = hammer2_readlink(vp, tmp, sizeof(tmp));
+		ip = VTOI(vp);
+		switch (ip->meta.type) {
+		case HAMMER2_OBJTYPE_DIRECTORY:
+			break;
+		case HAMMER2_OBJTYPE_SOFTLINK:
+			bzero(tmp, sizeof(tmp));
+			error = hammer2_readlink(vp, tmp, sizeof(tmp));
+			if (error)
+				return error;
+			if (!is_supported_link(tmp))
+				return EINVAL;
+			strlcat(tmp, "/", sizeof(tmp));
+			strlcat(tmp, p, sizeof(tmp));
+			error = trim_slash(tmp);
+			if (error)
+				return error;
+			p = name = tmp;
+			continue;
+		default:
+			return EINVAL;
+		}
+
+		dvp = vp;
+		name = p;
+	}
+
+	error = hammer2_nresolve(dvp, &vp, name, strlen(name));
+	if (error)
+		return error;
+start_ioctl:
+	ip = VTOI(vp);
+
+	bzero(&inode, sizeof(inode));
+	error = hammer2_ioctl_inode_get(ip, &inode);
+	if (error)
+		return error;
+
+	inode.flags |= HAMMER2IOC_INODE_FLAG_COMP;
+	inode.ip_data.meta.comp_algo = comp_algo | comp_level;
+	error = hammer2_ioctl_inode_set(ip, &inode);
+	if (error)
+		return error;
+
+	free(o);
+
+	if (recompress)
+		error = hammer2_recompress(vp, comp_algo | comp_level);
+
+	return error;
+}
+
+/*
+ * Offline recompression of a subtree.  Every inode under the given one
+ * takes the new comp_algo, and the data of each regular file is read back
+ * and rewritten through the strategy code, compressed by the write
+ * pipeline workers with -o T>1.  Holes read back as zeroes and are
+ * detected again on write.  Once the new blocks are flushed, two bulkfree
+ * passes free the blocks they replaced (allocated->staged->free).
+ */
+#define HAMMER2_RECOMP_BUFSIZE	(HAMMER2_PBUFSIZE * 16)
+
+typedef struct hammer2_recomp_link {
+	struct hammer2_recomp_link *next;
+	struct m_vnode		*vp;
+} hammer2_recomp_link_t;
+
+typedef struct hammer2_recomp {
+	uint8_t			comp_algo;
+	char			*buf;		/* read buffer */
+	long			files;
+	hammer2_off_t		bytes;
+	hammer2_recomp_link_t	*links[HAMMER2_LINKHASH_SIZE];
+} hammer2_recomp_t;
+
+typedef struct hammer2_recomp_out {
+	char			*p;
+	size_t			nsize;
+} hammer2_recomp_out_t;
+
+static int hammer2_recompress_vnode(hammer2_recomp_t *, struct m_vnode *);
+
+/*
+ * Hardlinked files are rewritten once, their vnode is shared by each of
+ * their directory entries and held until recompress is done.
+ */
+static bool
+hammer2_recompress_link(hammer2_recomp_t *rc, struct m_vnode *vp)
+{
+	hammer2_recomp_link_t *e, **ep;
+
+	ep = &rc->links[VTOI(vp)->meta.inum & HAMMER2_LINKHASH_MASK];
+	for (e = *ep; e != NULL; e = e->next)
+		if (e->vp == vp)
+			return (true);
+	e = ecalloc(1, sizeof(*e));
+	e->vp = vp;
+	e->next = *ep;
+	*ep = e;
+
+	return (false);
+}
+
+static int
+hammer2_recompress_read(void *arg, hammer2_key_t off, const char *data,
+    size_t bytes)
+{
+	hammer2_recomp_out_t *out = arg;
+
+	if (off >= out->nsize)
+		return 0;
+	bcopy(data, out->p + off, MIN(bytes, out->nsize - off));
+
+	return 0;
+}
+
+static int
+hammer2_recompress_regfile(hammer2_recomp_t *rc, struct m_vnode *vp,
+    bool hold)
+{
+	hammer2_inode_t *ip = VTOI(vp);
+	hammer2_recomp_out_t out;
+	hammer2_wfile_t *wf;
+	int error;
+
+	out.nsize = ip->meta.size;
+	out.p = mmap(0, out.nsize, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE,
+	    -1, 0);
+	if (out.p == MAP_FAILED)
+		err(1, "failed to mmap %ju bytes", (uintmax_t)out.nsize);
+	error = hammer2_read_stream(vp, rc->buf, HAMMER2_RECOMP_BUFSIZE,
+	    hammer2_recompress_read, &out);
+	if (error) {
+		munmap(out.p, out.nsize);
+		return error;
+	}
+
+	if (debug & DEBUG_FS_WRITE_FILE)
+		APRINTF("recompress inode %ju %zu bytes\n",
+		    (uintmax_t)ip->meta.inum, out.nsize);
+
+	wf = ecalloc(1, sizeof(*wf));
+	wf->vp = vp;
+	wf->p = out.p;
+	wf->nsize = out.nsize;
+	wf->rewrite = true;
+	wf->hold = hold;
+	wf->mtime = ip->meta.mtime;
+	hammer2_wfile_write(wf);
+
+	rc->files++;
+	rc->bytes += out.nsize;
+	hammer2_populate_sync(ip->pmp);
+
+	return 0;
+}
+
+static int
+hammer2_recompress_directory(hammer2_recomp_t *rc, struct m_vnode *dvp)
+{
+	struct m_vnode *vp;
+	struct m_dirent *dp;
+	char *dirbuf;
+	off_t offset = 0;
+	int ndirent = 0;
+	int eofflag = 0;
+	int i, error = 0;
+
+	/* entries are handled depth first, one buffer per level */
+	dirbuf = ecalloc(1, HAMMER2_PBUFSIZE);
+	while (!eofflag) {
+		error = hammer2_readdir(dvp, dirbuf, HAMMER2_PBUFSIZE,
+		    &offset, &ndirent, &eofflag);
+		if (error)
+			break;
+		dp = (void *)dirbuf;
+
+		for (i = 0; i < ndirent; i++) {
+			if (strcmp(dp->d_name, ".") &&
+			    strcmp(dp->d_name, "..")) {
+				error = hammer2_nresolve(dvp, &vp,
+				    dp->d_name, strlen(dp->d_name));
+				if (error)
+					goto done;
+				error = hammer2_recompress_vnode(rc, vp);
+				if (error)
+					goto done;
+			}
+			dp = (void *)((char *)dp +
+			    _DIRENT_RECLEN(dp->d_namlen));
+		}
+	}
+done:
+	free(dirbuf);
+
+	return error;
+}
+
+/*
+ * Recompress a directory entry, its vnode is released once done with
+ * unless it is hardlinked.
+ */
+static int
+hammer2_recompress_vnode(hammer2_recomp_t *rc, struct m_vnode *vp)
+{
+	hammer2_ioc_inode_t inode;
+	hammer2_inode_t *ip = VTOI(vp);
+	int error;
+
+	if (ip->meta.type == HAMMER2_OBJTYPE_REGFILE &&
+	    ip->meta.nlinks > 1 && hammer2_recompress_link(rc, vp))
+		return 0;
+
+	if (ip->meta.type == HAMMER2_OBJTYPE_DIRECTORY ||
+	    ip->meta.type == HAMMER2_OBJTYPE_REGFILE) {
+		if (ip->meta.comp_algo != rc->comp_algo) {
+			bzero(&inode, sizeof(inode));
+			error = hammer2_ioctl_inode_get(ip, &inode);
 			if (error)
 				return error;
-			if (!is_supported_link(tmp))
-				return EINVAL;
-			strlcat(tmp, "/", sizeof(tmp));
-			strlcat(tmp, p, sizeof(tmp));
-			error = trim_slash(tmp);
+			inode.flags |= HAMMER2IOC_INODE_FLAG_COMP;
+			inode.ip_data.meta.comp_algo = rc->comp_algo;
+			error = hammer2_ioctl_inode_set(ip, &inode);
 			if (error)
 				return error;
-			p = name = tmp;
-			continue;
-		default:
-			return EINVAL;
 		}
-
-		dvp = vp;
-		name = p;
 	}
 
-	error = hammer2_nresolve(dvp, &vp, name, strlen(name));
-	if (error)
+	switch (ip->meta.type) {
+	case HAMMER2_OBJTYPE_DIRECTORY:
+		error = hammer2_recompress_directory(rc, vp);
+		hammer2_release_vnode(vp);
 		return error;
-start_ioctl:
-	ip = VTOI(vp);
+	case HAMMER2_OBJTYPE_REGFILE:
+		/* released once written, hardlinks once recompress is done */
+		if (ip->meta.size > HAMMER2_EMBEDDED_BYTES)
+			return hammer2_recompress_regfile(rc, vp,
+			    ip->meta.nlinks > 1);
+		break;
+	default:
+		break;
+	}
+	if (ip->meta.nlinks == 1)
+		hammer2_release_vnode(vp);
 
-	bzero(&inode, sizeof(inode));
-	error = hammer2_ioctl_inode_get(ip, &inode);
-	if (error)
-		return error;
+	return 0;
+}
 
-	inode.flags |= HAMMER2IOC_INODE_FLAG_COMP;
-	inode.ip_data.meta.comp_algo = comp_algo | comp_level;
-	error = hammer2_ioctl_inode_set(ip, &inode);
+static int
+hammer2_recompress(struct m_vnode *vp, uint8_t comp_algo)
+{
+	hammer2_inode_t *ip = VTOI(vp);
+	hammer2_pfs_t *pmp = ip->pmp;
+	hammer2_dev_t *hmp = pmp->pfs_hmps[0];
+	hammer2_recomp_t rc;
+	hammer2_recomp_link_t *e;
+	hammer2_off_t free_before;
+	int i, error;
+
+	bzero(&rc, sizeof(rc));
+	rc.comp_algo = comp_algo;
+	rc.buf = ecalloc(1, HAMMER2_RECOMP_BUFSIZE);
+	free_before = hmp->voldata.allocator_free;
+
+	/* the given inode itself was set by the caller */
+	switch (ip->meta.type) {
+	case HAMMER2_OBJTYPE_DIRECTORY:
+		error = hammer2_recompress_directory(&rc, vp);
+		break;
+	case HAMMER2_OBJTYPE_REGFILE:
+		error = 0;
+		if (ip->meta.size > HAMMER2_EMBEDDED_BYTES)
+			error = hammer2_recompress_regfile(&rc, vp, true);
+		break;
+	default:
+		error = EINVAL;
+		break;
+	}
+
+	if (hammer2_wpipe) {
+		while (hammer2_wpipe_pending(hammer2_wpipe))
+			hammer2_write_commit();
+	}
+	for (i = 0; i < HAMMER2_LINKHASH_SIZE; ++i) {
+		while ((e = rc.links[i]) != NULL) {
+			rc.links[i] = e->next;
+			hammer2_release_vnode(e->vp);
+			free(e);
+		}
+	}
+	free(rc.buf);
 	if (error)
 		return error;
 
-	free(o);
+	printf("recompressed %ld files %ju bytes\n", rc.files,
+	    (uintmax_t)rc.bytes);
 
-	return error;
+	/* old blocks are only unreferenced once the new ones are flushed */
+	hammer2_vfs_sync(pmp->mp, MNT_WAIT);
+	for (i = 0; i < 2; ++i) {
+		error = hammer2_bulkfree(vp);
+		if (error)
+			return error;
+	}
+	printf("free space %ju -> %ju bytes\n", (uintmax_t)free_before,
+	    (uintmax_t)hmp->voldata.allocator_free);
+
+	return 0;
 }
 
 static int
@@ -2089,127 +4290,180 @@ hammer2_growfs(struct m_vnode *vp, hammer2_off_t size)
 	return error;
 }
 
+/*
+ * Offline read.  Directories and regular files are extraction jobs run by
+ * worker threads, so different subtrees are extracted concurrently.  Each
+ * file is extracted with a single streaming read of its data chains, and
+ * written without fsync, the destination is synced once at the end.
+ */
+#define HAMMER2_READX_BUFSIZE	(HAMMER2_PBUFSIZE * 16)	/* per worker */
+
+typedef struct hammer2_readx_job {
+	TAILQ_ENTRY(hammer2_readx_job) entry;
+	struct m_vnode		*vp;
+	char			*path;		/* destination */
+	bool			release;	/* vp released when done */
+	uint64_t		atime;		/* directory times */
+	uint64_t		mtime;
+} hammer2_readx_job_t;
+
 struct hammer2_link {
-	TAILQ_ENTRY(hammer2_link) entry;
-	hammer2_tid_t inum;
-	uint64_t nlinks;
-	char path[PATH_MAX];
+	struct hammer2_link	*next;
+	hammer2_tid_t		inum;
+	uint64_t		nlinks;
+	char			*path;
 };
 
-TAILQ_HEAD(hammer2_linkq, hammer2_link);
-
-static void
-hammer2_linkq_init(struct hammer2_linkq *linkq)
+typedef struct hammer2_readx {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cv;
+	TAILQ_HEAD(, hammer2_readx_job) jobq;	/* pending jobs */
+	TAILQ_HEAD(, hammer2_readx_job) dirq;	/* extracted directories */
+	int			njobs;
+	int			maxjobs;	/* queued regular files */
+	int			busy;		/* workers running a job */
+	int			error;		/* first error */
+	pthread_mutex_t		link_lock;
+	struct hammer2_link	*links[HAMMER2_LINKHASH_SIZE];
+} hammer2_readx_t;
+
+typedef struct hammer2_readx_worker {
+	hammer2_readx_t		*rx;
+	pthread_t		td;
+	char			*buf;		/* file data */
+	char			*dirbuf;	/* directory entries */
+} hammer2_readx_worker_t;
+
+typedef struct hammer2_readx_out {
+	int			fd;
+	const char		*path;
+} hammer2_readx_out_t;
+
+static int hammer2_readx_handle(hammer2_readx_worker_t *, struct m_vnode *,
+    char *);
+
+static struct hammer2_link **
+hammer2_link_find(hammer2_readx_t *rx, hammer2_tid_t inum)
 {
-	TAILQ_INIT(linkq);
+	struct hammer2_link **ep;
+
+	ep = &rx->links[inum & HAMMER2_LINKHASH_MASK];
+	while (*ep != NULL && (*ep)->inum != inum)
+		ep = &(*ep)->next;
+
+	return (ep);
 }
 
 static void
-hammer2_linkq_cleanup(struct hammer2_linkq *linkq, bool is_root)
+hammer2_link_cleanup(hammer2_readx_t *rx, bool is_root)
 {
 	struct hammer2_link *e;
-	int count = 0;
+	int i, count = 0;
 
 	/*
-	 * If is_root is true, linkq must be empty, or link count is broken.
+	 * If is_root is true, the hash must be empty, or link count is broken.
 	 * Note that if an image was made by makefs, hardlinks in the source
 	 * directory became hardlinks in the image only if >1 links existed under
 	 * that directory, as makefs doesn't determine hardlink via link count.
 	 */
-	while ((e = TAILQ_FIRST(linkq)) != NULL) {
-		count++;
-		TAILQ_REMOVE(linkq, e, entry);
-		free(e);
+	for (i = 0; i < HAMMER2_LINKHASH_SIZE; i++) {
+		while ((e = rx->links[i]) != NULL) {
+			count++;
+			rx->links[i] = e->next;
+			free(e->path);
+			free(e);
+		}
 	}
-	assert(TAILQ_EMPTY(linkq));
 
 	if (count && is_root)
 		errx(1, "%d link entries remained", count);
 }
 
 static void
-hammer2_linkq_add(struct hammer2_linkq *linkq, hammer2_tid_t inum,
-    uint64_t nlinks, const char *path)
+hammer2_utimes(struct m_vnode *vp, const char *f)
 {
-	struct hammer2_link *e;
-	int count = 0;
+	hammer2_inode_t *ip = VTOI(vp);
+	struct timeval tv[2];
 
-	e = ecalloc(1, sizeof(*e));
-	e->inum = inum;
-	e->nlinks = nlinks;
-	strlcpy(e->path, path, sizeof(e->path));
-	TAILQ_INSERT_TAIL(linkq, e, entry);
+	hammer2_time_to_timeval(ip->meta.atime, &tv[0]);
+	hammer2_time_to_timeval(ip->meta.mtime, &tv[1]);
 
-	TAILQ_FOREACH(e, linkq, entry)
-		if (e->inum == inum)
-			count++;
-	if (count > 1)
-		errx(1, "%d link entries exist for inum %jd",
-		    count, (intmax_t)inum);
+	utimes(f, tv); /* ignore failure */
 }
 
-static void
-hammer2_linkq_del(struct hammer2_linkq *linkq, hammer2_tid_t inum)
+/*
+ * Queue an extraction job.  Regular files are only queued while there
+ * are few pending jobs, otherwise the caller extracts them itself.
+ */
+static bool
+hammer2_readx_push(hammer2_readx_t *rx, struct m_vnode *vp, char *path,
+    bool release)
 {
-	struct hammer2_link *e, *next;
+	hammer2_readx_job_t *job;
 
-	TAILQ_FOREACH_SAFE(e, linkq, entry, next)
-		if (e->inum == inum) {
-			e->nlinks--;
-			if (e->nlinks == 1) {
-				TAILQ_REMOVE(linkq, e, entry);
-				free(e);
-			}
-		}
+	pthread_mutex_lock(&rx->lock);
+	if (VTOI(vp)->meta.type == HAMMER2_OBJTYPE_REGFILE &&
+	    rx->njobs >= rx->maxjobs) {
+		pthread_mutex_unlock(&rx->lock);
+		return (false);
+	}
+	job = ecalloc(1, sizeof(*job));
+	job->vp = vp;
+	job->path = path;
+	job->release = release;
+	/* depth first, keeps the queue short */
+	TAILQ_INSERT_HEAD(&rx->jobq, job, entry);
+	rx->njobs++;
+	pthread_cond_signal(&rx->cv);
+	pthread_mutex_unlock(&rx->lock);
+
+	return (true);
 }
 
-static void
-hammer2_utimes(struct m_vnode *vp, const char *f)
+static char *
+hammer2_readx_path(const char *dir, const char *name)
 {
-	hammer2_inode_t *ip = VTOI(vp);
-	struct timeval tv[2];
+	char tmp[PATH_MAX];
 
-	hammer2_time_to_timeval(ip->meta.atime, &tv[0]);
-	hammer2_time_to_timeval(ip->meta.mtime, &tv[1]);
+	snprintf(tmp, sizeof(tmp), "%s/%s", dir, name);
 
-	utimes(f, tv); /* ignore failure */
+	return estrdup(tmp);
 }
 
 static int
-hammer2_readx_directory(struct m_vnode *dvp, const char *dir, const char *name,
-    struct hammer2_linkq *linkq)
+hammer2_readx_directory(hammer2_readx_worker_t *w, hammer2_readx_job_t *job)
 {
+	hammer2_readx_t *rx = w->rx;
+	hammer2_inode_t *ip = VTOI(job->vp);
 	struct m_vnode *vp;
 	struct m_dirent *dp;
 	struct stat st;
-	char *buf, tmp[PATH_MAX];
+	char *path;
 	off_t offset = 0;
 	int ndirent = 0;
 	int eofflag = 0;
 	int i, error;
 
-	snprintf(tmp, sizeof(tmp), "%s/%s", dir, name);
-	if (stat(tmp, &st) == -1 && mkdir(tmp, 0666) == -1)
-		err(1, "failed to mkdir %s", tmp);
-
-	buf = ecalloc(1, HAMMER2_PBUFSIZE);
+	if (stat(job->path, &st) == -1 && mkdir(job->path, 0666) == -1)
+		err(1, "failed to mkdir %s", job->path);
 
 	while (!eofflag) {
-		error = hammer2_readdir(dvp, buf, HAMMER2_PBUFSIZE, &offset,
-		    &ndirent, &eofflag);
+		error = hammer2_readdir(job->vp, w->dirbuf, HAMMER2_PBUFSIZE,
+		    &offset, &ndirent, &eofflag);
 		if (error)
 			errx(1, "failed to readdir");
-		dp = (void *)buf;
+		dp = (void *)w->dirbuf;
 
 		for (i = 0; i < ndirent; i++) {
 			if (strcmp(dp->d_name, ".") &&
 			    strcmp(dp->d_name, "..")) {
-				error = hammer2_nresolve(dvp, &vp, dp->d_name,
-				    strlen(dp->d_name));
+				error = hammer2_nresolve(job->vp, &vp,
+				    dp->d_name, strlen(dp->d_name));
 				if (error)
 					return error;
-				error = hammer2_readx_handle(vp, tmp,
-				    dp->d_name, linkq);
+				path = hammer2_readx_path(job->path,
+				    dp->d_name);
+				error = hammer2_readx_handle(w, vp, path);
 				if (error)
 					return error;
 			}
@@ -2218,17 +4472,19 @@ hammer2_readx_directory(struct m_vnode *dvp, const char *dir, const char *name,
 		}
 	}
 
-	free(buf);
-	hammer2_utimes(dvp, tmp);
+	/* set once all workers are done with its contents */
+	job->atime = ip->meta.atime;
+	job->mtime = ip->meta.mtime;
+	pthread_mutex_lock(&rx->lock);
+	TAILQ_INSERT_TAIL(&rx->dirq, job, entry);
+	pthread_mutex_unlock(&rx->lock);
 
 	return 0;
 }
 
 static int
-hammer2_readx_link(struct m_vnode *vp, const char *src, const char *lnk,
-    struct hammer2_linkq *linkq)
+hammer2_readx_link(const char *src, const char *lnk)
 {
-	hammer2_inode_t *ip = VTOI(vp);
 	struct stat st;
 	int error;
 
@@ -2238,104 +4494,285 @@ hammer2_readx_link(struct m_vnode *vp, const char *src, const char *lnk,
 			return error;
 	}
 
-	error = link(src, lnk);
-	if (error)
-		return error;
+	return link(src, lnk);
+}
 
-	hammer2_linkq_del(linkq, ip->meta.inum);
+static int
+hammer2_readx_write(void *arg, hammer2_key_t off, const char *data,
+    size_t bytes)
+{
+	hammer2_readx_out_t *out = arg;
+	ssize_t ret;
+
+	ret = pwrite(out->fd, data, bytes, off);
+	if (ret == -1)
+		err(1, "failed to write to %s", out->path);
+	else if (ret != bytes)
+		return EINVAL;
 
 	return 0;
 }
 
 static int
-hammer2_readx_regfile(struct m_vnode *vp, const char *dir, const char *name,
-    struct hammer2_linkq *linkq)
+hammer2_readx_regfile(hammer2_readx_worker_t *w, struct m_vnode *vp,
+    const char *out)
 {
+	hammer2_readx_t *rx = w->rx;
 	hammer2_inode_t *ip = VTOI(vp);
-	struct hammer2_link *e;
-	char *buf, out[PATH_MAX];
-	size_t resid, n;
-	off_t offset;
-	int fd, error;
-	bool found = false;
-
-	snprintf(out, sizeof(out), "%s/%s", dir, name);
+	hammer2_readx_out_t o;
+	struct hammer2_link **ep, *e;
+	int fd = -1;
+	int error;
 
 	if (ip->meta.nlinks > 1) {
-		TAILQ_FOREACH(e, linkq, entry)
-			if (e->inum == ip->meta.inum) {
-				found = true;
-				error = hammer2_readx_link(vp, e->path, out,
-				    linkq);
-				if (error == 0)
-					return 0;
-				/* ignore failure */
+		pthread_mutex_lock(&rx->link_lock);
+		ep = hammer2_link_find(rx, ip->meta.inum);
+		e = *ep;
+		if (e != NULL) {
+			error = hammer2_readx_link(e->path, out);
+			if (error == 0) {
+				if (--e->nlinks == 1) {
+					*ep = e->next;
+					free(e->path);
+					free(e);
+				}
+				pthread_mutex_unlock(&rx->link_lock);
+				return 0;
 			}
-		if (!found)
-			hammer2_linkq_add(linkq, ip->meta.inum, ip->meta.nlinks,
-			    out);
+			/* ignore failure */
+		} else {
+			e = ecalloc(1, sizeof(*e));
+			e->inum = ip->meta.inum;
+			e->nlinks = ip->meta.nlinks;
+			e->path = estrdup(out);
+			*ep = e;
+			/* exists before other links to it are made */
+			fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (fd == -1)
+				err(1, "failed to create %s", out);
+		}
+		pthread_mutex_unlock(&rx->link_lock);
 	}
 
-	fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-	if (fd == -1)
-		err(1, "failed to create %s", out);
-
-	buf = ecalloc(1, HAMMER2_PBUFSIZE);
-	resid = ip->meta.size;
-	offset = 0;
-
-	while (resid > 0) {
-		bzero(buf, HAMMER2_PBUFSIZE);
-		error = hammer2_read(vp, buf, HAMMER2_PBUFSIZE, offset);
-		if (error)
-			errx(1, "failed to read from %s", name);
+	if (fd == -1) {
+		fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd == -1)
+			err(1, "failed to create %s", out);
+	}
 
-		n = resid >= HAMMER2_PBUFSIZE ? HAMMER2_PBUFSIZE : resid;
-		error = write(fd, buf, n);
-		if (error == -1)
-			err(1, "failed to write to %s", out);
-		else if (error != n)
-			return EINVAL;
+	o.fd = fd;
+	o.path = out;
+	error = hammer2_read_stream(vp, w->buf, HAMMER2_READX_BUFSIZE,
+	    hammer2_readx_write, &o);
+	if (error)
+		errx(1, "failed to read from %s: %s", out, strerror(error));
 
-		resid -= n;
-		offset += HAMMER2_PBUFSIZE;
-	}
-	fsync(fd);
+	/* holes and trailing zeros */
+	if (ftruncate(fd, ip->meta.size) == -1)
+		err(1, "failed to truncate %s", out);
 	close(fd);
 
-	free(buf);
 	hammer2_utimes(vp, out);
 
 	return 0;
 }
 
+static void
+hammer2_readx_done(hammer2_readx_job_t *job)
+{
+	if (job->release)
+		hammer2_release_vnode(job->vp);
+	job->vp = NULL;
+}
+
+/*
+ * Queue or extract vp to path, a directory entry of a directory being
+ * extracted.  Directories and files with a single link are only reachable
+ * through one entry, their vnodes are released once extracted.
+ */
 static int
-hammer2_readx_handle(struct m_vnode *vp, const char *dir, const char *name,
-    struct hammer2_linkq *linkq)
+hammer2_readx_handle(hammer2_readx_worker_t *w, struct m_vnode *vp,
+    char *path)
 {
 	hammer2_inode_t *ip = VTOI(vp);
+	hammer2_readx_job_t job;
+	int error = 0;
+
+	bzero(&job, sizeof(job));
+	job.vp = vp;
+	job.path = path;
+	job.release = ip->meta.type == HAMMER2_OBJTYPE_DIRECTORY ||
+	    ip->meta.nlinks == 1;
 
 	switch (ip->meta.type) {
 	case HAMMER2_OBJTYPE_DIRECTORY:
-		return hammer2_readx_directory(vp, dir, name, linkq);
 	case HAMMER2_OBJTYPE_REGFILE:
-		return hammer2_readx_regfile(vp, dir, name, linkq);
+		if (hammer2_readx_push(w->rx, vp, path, job.release))
+			return 0;
+		error = hammer2_readx_regfile(w, vp, path);
+		break;
 	default:
 		/* XXX */
 		printf("ignore inode %jd %s \"%s\"\n",
 		    (intmax_t)ip->meta.inum,
 		    hammer2_iptype_to_str(ip->meta.type),
-		    name);
-		return 0;
+		    strrchr(path, '/') + 1);
+		break;
+	}
+	hammer2_readx_done(&job);
+	free(path);
+
+	return error;
+}
+
+static int
+hammer2_readx_run(hammer2_readx_worker_t *w, hammer2_readx_job_t *job)
+{
+	hammer2_inode_t *ip = VTOI(job->vp);
+	int error;
+
+	switch (ip->meta.type) {
+	case HAMMER2_OBJTYPE_DIRECTORY:
+		error = hammer2_readx_directory(w, job);
+		hammer2_readx_done(job);
+		/* queued to dirq on success */
+		return error;
+	case HAMMER2_OBJTYPE_REGFILE:
+		error = hammer2_readx_regfile(w, job->vp, job->path);
+		break;
+	default:
+		/* XXX */
+		printf("ignore inode %jd %s \"%s\"\n",
+		    (intmax_t)ip->meta.inum,
+		    hammer2_iptype_to_str(ip->meta.type),
+		    strrchr(job->path, '/') + 1);
+		error = 0;
+		break;
 	}
-	return EINVAL;
+	hammer2_readx_done(job);
+	free(job->path);
+	free(job);
+
+	return error;
+}
+
+static void *
+hammer2_readx_worker(void *arg)
+{
+	hammer2_readx_worker_t *w = arg;
+	hammer2_readx_t *rx = w->rx;
+	hammer2_readx_job_t *job;
+	int error;
+
+	pthread_mutex_lock(&rx->lock);
+	for (;;) {
+		while ((job = TAILQ_FIRST(&rx->jobq)) == NULL && rx->busy &&
+		    !rx->error)
+			pthread_cond_wait(&rx->cv, &rx->lock);
+		if (job == NULL || rx->error)
+			break;
+		TAILQ_REMOVE(&rx->jobq, job, entry);
+		rx->njobs--;
+		rx->busy++;
+		pthread_mutex_unlock(&rx->lock);
+
+		error = hammer2_readx_run(w, job);
+
+		pthread_mutex_lock(&rx->lock);
+		rx->busy--;
+		if (error && !rx->error)
+			rx->error = error;
+		if (rx->busy == 0 || rx->error)
+			pthread_cond_broadcast(&rx->cv);
+	}
+	pthread_cond_broadcast(&rx->cv);
+	pthread_mutex_unlock(&rx->lock);
+
+	return (NULL);
+}
+
+static int
+hammer2_readx_tree(struct m_vnode *vp, const char *dir, const char *name,
+    int nworkers, bool is_root)
+{
+	hammer2_readx_t rx;
+	hammer2_readx_worker_t *w;
+	hammer2_readx_job_t *job;
+	struct timeval tv[2];
+	char *path;
+	int i, error;
+
+	bzero(&rx, sizeof(rx));
+	pthread_mutex_init(&rx.lock, NULL);
+	pthread_cond_init(&rx.cv, NULL);
+	pthread_mutex_init(&rx.link_lock, NULL);
+	TAILQ_INIT(&rx.jobq);
+	TAILQ_INIT(&rx.dirq);
+	rx.maxjobs = nworkers * 4;
+
+	path = hammer2_readx_path(dir, name);
+	job = ecalloc(1, sizeof(*job));
+	job->vp = vp;
+	job->path = path;
+	job->release = false;
+	TAILQ_INSERT_HEAD(&rx.jobq, job, entry);
+	rx.njobs++;
+
+	w = ecalloc(nworkers, sizeof(*w));
+	for (i = 0; i < nworkers; i++) {
+		w[i].rx = &rx;
+		w[i].buf = emalloc(HAMMER2_READX_BUFSIZE);
+		w[i].dirbuf = ecalloc(1, HAMMER2_PBUFSIZE);
+	}
+	if (nworkers == 1) {
+		hammer2_readx_worker(&w[0]);
+	} else {
+		for (i = 0; i < nworkers; i++)
+			if (pthread_create(&w[i].td, NULL,
+			    hammer2_readx_worker, &w[i]))
+				errx(1, "failed to create worker thread");
+		for (i = 0; i < nworkers; i++)
+			pthread_join(w[i].td, NULL);
+	}
+	error = rx.error;
+
+	/* directory mtimes changed while their contents were extracted */
+	while ((job = TAILQ_FIRST(&rx.dirq)) != NULL) {
+		TAILQ_REMOVE(&rx.dirq, job, entry);
+		hammer2_time_to_timeval(job->atime, &tv[0]);
+		hammer2_time_to_timeval(job->mtime, &tv[1]);
+		utimes(job->path, tv); /* ignore failure */
+		free(job->path);
+		free(job);
+	}
+	/* left over on error */
+	while ((job = TAILQ_FIRST(&rx.jobq)) != NULL) {
+		TAILQ_REMOVE(&rx.jobq, job, entry);
+		free(job->path);
+		free(job);
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		free(w[i].buf);
+		free(w[i].dirbuf);
+	}
+	free(w);
+
+	/* extracted files are not synced individually */
+	sync();
+	hammer2_link_cleanup(&rx, is_root);
+	pthread_mutex_destroy(&rx.lock);
+	pthread_cond_destroy(&rx.cv);
+	pthread_mutex_destroy(&rx.link_lock);
+
+	return error;
 }
 
 static int
-hammer2_readx(struct m_vnode *dvp, const char *dir, const char *f)
+hammer2_readx(struct m_vnode *dvp, const char *dir, const char *f,
+    int nworkers)
 {
 	hammer2_inode_t *ip;
-	struct hammer2_linkq linkq;
 	struct m_vnode *vp, *ovp = dvp;
 	char *o, *p, *name;
 	char tmp[PATH_MAX];
@@ -2396,9 +4833,7 @@ hammer2_readx(struct m_vnode *dvp, const char *dir, const char *f)
 	if (error)
 		return error;
 start_read:
-	hammer2_linkq_init(&linkq);
-	error = hammer2_readx_handle(vp, dir, name, &linkq);
-	hammer2_linkq_cleanup(&linkq, vp == ovp);
+	error = hammer2_readx_tree(vp, dir, name, nworkers, vp == ovp);
 	if (error)
 		return error;
 
@@ -2407,6 +4842,228 @@ start_read:
 	return 0;
 }
 
+/*
+ * Source image inodes as struct stat.  The inode number stands in for
+ * st_ino and st_dev is 0, so link_check() finds hardlinks.  Sockets and
+ * whiteouts aren't returned, as walk_dir() skips sockets.
+ */
+static mode_t
+hammer2_source_stat(hammer2_inode_t *ip, struct stat *st)
+{
+	const hammer2_inode_meta_t *meta = &ip->meta;
+	struct timespec ts;
+	mode_t type;
+
+	switch (meta->type) {
+	case HAMMER2_OBJTYPE_DIRECTORY:
+		type = S_IFDIR;
+		break;
+	case HAMMER2_OBJTYPE_REGFILE:
+		type = S_IFREG;
+		break;
+	case HAMMER2_OBJTYPE_FIFO:
+		type = S_IFIFO;
+		break;
+	case HAMMER2_OBJTYPE_CDEV:
+		type = S_IFCHR;
+		break;
+	case HAMMER2_OBJTYPE_BDEV:
+		type = S_IFBLK;
+		break;
+	case HAMMER2_OBJTYPE_SOFTLINK:
+		type = S_IFLNK;
+		break;
+	default:
+		return (0);
+	}
+
+	bzero(st, sizeof(*st));
+	st->st_mode = type | (meta->mode & ~S_IFMT);
+	st->st_nlink = meta->nlinks;
+	st->st_ino = meta->inum;
+	st->st_uid = hammer2_to_unix_xid(&meta->uid);
+	st->st_gid = hammer2_to_unix_xid(&meta->gid);
+	st->st_size = meta->size;
+	if (type == S_IFCHR || type == S_IFBLK)
+		st->st_rdev = makedev(meta->rmajor, meta->rminor);
+
+	hammer2_time_to_timespec(meta->atime, &ts);
+	st->st_atime = ts.tv_sec;
+#if HAVE_STRUCT_STAT_ST_MTIMENSEC
+	st->st_atimensec = ts.tv_nsec;
+#endif
+	hammer2_time_to_timespec(meta->mtime, &ts);
+	st->st_mtime = ts.tv_sec;
+#if HAVE_STRUCT_STAT_ST_MTIMENSEC
+	st->st_mtimensec = ts.tv_nsec;
+#endif
+	hammer2_time_to_timespec(meta->ctime, &ts);
+	st->st_ctime = ts.tv_sec;
+#if HAVE_STRUCT_STAT_ST_MTIMENSEC
+	st->st_ctimensec = ts.tv_nsec;
+#endif
+#if HAVE_STRUCT_STAT_BIRTHTIME
+	hammer2_time_to_timespec(meta->btime, &ts);
+	st->st_birthtime = ts.tv_sec;
+	st->st_birthtimensec = ts.tv_nsec;
+#endif
+#if HAVE_STRUCT_STAT_ST_FLAGS
+	st->st_flags = meta->uflags;
+#endif
+
+	return (type);
+}
+
+/*
+ * Build the fsnodes of a source image directory the way walk_dir() does
+ * for a directory on disk, "." first and no "..".
+ */
+static fsnode *
+hammer2_source_dir(struct m_vnode *dvp, const char *dir, fsnode *parent)
+{
+	hammer2_source_t *src = hammer2_source;
+	hammer2_inode_t *ip;
+	struct m_vnode *vp;
+	struct m_dirent *dp;
+	struct stat st;
+	fsnode *first, *prev, *cur;
+	fsinode *curino;
+	char path[MAXPATHLEN + 1];
+	char slink[PATH_MAX + 1];
+	char *dirbuf;
+	off_t offset = 0;
+	mode_t type;
+	int ndirent = 0;
+	int eofflag = 0;
+	int i, error;
+
+	/* HAMMER2 directories have 1 link, count "." and ".." as on disk */
+	hammer2_source_stat(VTOI(dvp), &st);
+	st.st_nlink = 2;
+	first = prev = create_fsnode(src->spec, dir, ".", &st);
+	first->parent = parent;
+	first->first = first;
+	first->inode->flags |= FI_SOURCE;
+
+	dirbuf = ecalloc(1, HAMMER2_PBUFSIZE);
+	while (!eofflag) {
+		error = hammer2_readdir(dvp, dirbuf, HAMMER2_PBUFSIZE, &offset,
+		    &ndirent, &eofflag);
+		if (error)
+			errx(1, "Can't readdir `%s/%s': %s", src->spec, dir,
+			    strerror(error));
+		dp = (void *)dirbuf;
+
+		for (i = 0; i < ndirent; i++,
+		    dp = (void *)((char *)dp + _DIRENT_RECLEN(dp->d_namlen))) {
+			if (!strcmp(dp->d_name, ".") ||
+			    !strcmp(dp->d_name, ".."))
+				continue;
+			if (debug & DEBUG_WALK_DIR_NODE)
+				printf("scanning %s/%s/%s\n", src->spec, dir,
+				    dp->d_name);
+			vp = NULL;
+			error = hammer2_nresolve(dvp, &vp, dp->d_name,
+			    strlen(dp->d_name));
+			if (error)
+				errx(1, "Can't lookup `%s/%s/%s': %s",
+				    src->spec, dir, dp->d_name,
+				    strerror(error));
+			ip = VTOI(vp);
+
+			type = hammer2_source_stat(ip, &st);
+			if (type == 0) {
+				if (debug & DEBUG_WALK_DIR_NODE)
+					printf("  skipping %s %s/%s/%s\n",
+					    hammer2_iptype_to_str(
+					    ip->meta.type), src->spec, dir,
+					    dp->d_name);
+			} else {
+				cur = create_fsnode(src->spec, dir,
+				    dp->d_name, &st);
+				cur->parent = parent;
+				cur->first = first;
+				cur->inode->flags |= FI_SOURCE;
+				prev->next = cur;
+				prev = cur;
+			}
+
+			if (type == S_IFDIR) {
+				if ((size_t)snprintf(path, sizeof(path),
+				    "%s/%s", dir, dp->d_name) >= sizeof(path))
+					errx(1, "Pathname too long.");
+				cur->child = hammer2_source_dir(vp, path, cur);
+				cur->inode->st.st_nlink =
+				    cur->child->inode->st.st_nlink;
+				first->inode->st.st_nlink++;
+			} else if (type != 0 && st.st_nlink > 1) {
+				curino = link_check(cur->inode);
+				if (curino != NULL) {
+					free(cur->inode);
+					cur->inode = curino;
+					cur->inode->nlink++;
+				}
+			}
+			if (type == S_IFLNK) {
+				bzero(slink, sizeof(slink));
+				error = hammer2_readlink(vp, slink,
+				    sizeof(slink) - 1);
+				if (error)
+					errx(1, "Readlink `%s/%s/%s': %s",
+					    src->spec, dir, dp->d_name,
+					    strerror(error));
+				cur->symlink = estrdup(slink);
+			}
+
+			/* hardlinked vnodes are shared by their entries */
+			if (ip->meta.type == HAMMER2_OBJTYPE_DIRECTORY ||
+			    ip->meta.nlinks == 1)
+				hammer2_release_vnode(vp);
+		}
+	}
+	free(dirbuf);
+
+	return (first);
+}
+
+static int
+hammer2_source_write(void *arg, hammer2_key_t off, const char *data,
+    size_t bytes)
+{
+	int fd = *(int *)arg;
+	ssize_t ret;
+
+	ret = pwrite(fd, data, bytes, off);
+	if (ret == -1)
+		return errno;
+	else if (ret != bytes)
+		return EIO;
+
+	return 0;
+}
+
+/*
+ * Unlinked shared memory object, memfd on Linux.
+ */
+static int
+hammer2_source_memfd(void)
+{
+#if defined(SHM_ANON)
+	return (shm_open(SHM_ANON, O_RDWR, 0600));
+#elif defined(__linux__) && defined(SYS_memfd_create)
+	return (syscall(SYS_memfd_create, "makefs", 0));
+#else
+	char name[64];
+	int fd;
+
+	snprintf(name, sizeof(name), "/makefs.%d", (int)getpid());
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd != -1)
+		shm_unlink(name);
+	return (fd);
+#endif
+}
+
 static void
 assert_trim_slash(const char *input, const char *expected)
 {
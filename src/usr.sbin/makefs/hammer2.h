@@ -39,11 +39,20 @@
 
 #include "hammer2/hammer2.h"
 
+#define HAMMER2_MAX_THREADS	64	/* -o T limit */
+#define HAMMER2_CKSUM_BENCH_MAXSIZES	16	/* -o K limit */
+#define HAMMER2_MAX_TREES	(HAMMER2_SET_COUNT - 2)	/* -o M limit */
+
+#define HAMMER2_REPORT_TEXT	1	/* -o S formats */
+#define HAMMER2_REPORT_JSON	2
+
 typedef struct {
 	hammer2_mkfs_options_t mkfs_options;
 	int label_specified;
 	char mount_label[HAMMER2_INODE_MAXNAME];
 	int num_volhdr;
+	int num_threads;
+	int num_xop_threads;
 
 	/* HAMMER2IOC_xxx */
 	long ioctl_cmd;
@@ -66,7 +75,36 @@ typedef struct {
 	/* HAMMER2IOC_READ */
 	char read_path[PATH_MAX];
 
+	/* checksum benchmark */
+	bool cksum_bench;
+	int cksum_bench_sizes[HAMMER2_CKSUM_BENCH_MAXSIZES];
+	int cksum_bench_nsizes;
+
+	/* compression benchmark */
+	bool comp_bench;
+	char comp_bench_path[PATH_MAX];
+
+	/* per-file compression policy, "auto" or a rule table file */
+	char comp_policy[PATH_MAX];
+
+	/* extra PFSes populated along with mount_label, -o M=label:dir */
+	int num_trees;
+	char *tree_label[HAMMER2_MAX_TREES];
+	char *tree_dir[HAMMER2_MAX_TREES];
+	struct _fsnode *tree_root[HAMMER2_MAX_TREES];
+	off_t tree_inodes[HAMMER2_MAX_TREES + 1]; /* [0] is mount_label */
+
+	/* build report */
+	int report;
+	char report_path[PATH_MAX];
+
 	hammer2_off_t image_size;
+
+	/* volume set, the image argument split on ':' */
+	int num_volumes;
+	char *volume_path[HAMMER2_MAX_VOLUMES];
+	struct makefs_fsinfo *volume_fs[HAMMER2_MAX_VOLUMES]; /* [0] is fsopts */
+	hammer2_off_t volume_size;
 } hammer2_makefs_options_t;
 
 #endif /* _HAMMER2_H */
@@ -198,11 +198,13 @@ typedef struct hammer2_xop_list	hammer2_xop_list_t;
 #define HAMMER2_LIMIT_DIRTY_CHAINS	(1024*1024)
 #define HAMMER2_LIMIT_DIRTY_INODES	(65536)
 
+/*
+ * Initial number of DIO and inode number hash chains.  The tables are
+ * doubled when the average chain length exceeds HAMMER2_HASH_LOAD.
+ */
 #define HAMMER2_IOHASH_SIZE		32768
-#define HAMMER2_IOHASH_MASK		(HAMMER2_IOHASH_SIZE - 1)
-
 #define HAMMER2_INUMHASH_SIZE		32768
-#define HAMMER2_INUMHASH_MASK		(HAMMER2_IOHASH_SIZE - 1)
+#define HAMMER2_HASH_LOAD		2
 
 /*
  * The chain structure tracks a portion of the media topology from the
@@ -344,6 +346,33 @@ struct hammer2_io_hash {
 
 typedef struct hammer2_io_hash	hammer2_io_hash_t;
 
+/*
+ * makefs: the DIO and inode number hashes are resizable.  A table is
+ * replaced by one twice the size while all of its chains are locked,
+ * then flagged stale so accessors which raced the resize retry on the
+ * new table.  Replaced tables are freed on unmount.
+ */
+struct hammer2_io_htab {
+	struct hammer2_io_htab	*prev;		/* replaced table */
+	int			mask;
+	int			stale;
+	hammer2_io_hash_t	hash[];
+};
+
+typedef struct hammer2_io_htab hammer2_io_htab_t;
+
+/*
+ * Hash statistics, reported on unmount.
+ */
+struct hammer2_hash_stats {
+	long			lookups;
+	long			hits;
+	long			resizes;
+	int			resizing;	/* resize interlock */
+};
+
+typedef struct hammer2_hash_stats hammer2_hash_stats_t;
+
 #define HAMMER2_DIO_INPROG	0x8000000000000000LLU	/* bio in progress */
 #define HAMMER2_DIO_GOOD	0x4000000000000000LLU	/* dio->bp is stable */
 #define HAMMER2_DIO_WAITING	0x2000000000000000LLU	/* wait on INPROG */
@@ -359,6 +388,15 @@ struct hammer2_inum_hash {
 
 typedef struct hammer2_inum_hash hammer2_inum_hash_t;
 
+struct hammer2_inum_htab {
+	struct hammer2_inum_htab *prev;		/* replaced table */
+	int			mask;
+	int			stale;
+	hammer2_inum_hash_t	hash[];
+};
+
+typedef struct hammer2_inum_htab hammer2_inum_htab_t;
+
 /*
  * Primary chain structure keeps track of the topology in-memory.
  */
@@ -424,7 +462,7 @@ RB_PROTOTYPE_SCAN(hammer2_chain_tree, hammer2_chain, rbnode);
 #define HAMMER2_CHAIN_NOTTESTED		0x00000080	/* crc not generated */
 #define HAMMER2_CHAIN_TESTEDGOOD	0x00000100	/* crc tested good */
 #define HAMMER2_CHAIN_ONFLUSH		0x00000200	/* on a flush list */
-#define HAMMER2_CHAIN_UNUSED0400	0x00000400
+#define HAMMER2_CHAIN_BULKLOAD		0x00000400	/* held by bulk-load */
 #define HAMMER2_CHAIN_VOLUMESYNC	0x00000800	/* needs volume sync */
 #define HAMMER2_CHAIN_UNUSED1000	0x00001000
 #define HAMMER2_CHAIN_COUNTEDBREFS	0x00002000	/* block table stats */
@@ -558,6 +596,11 @@ RB_PROTOTYPE_SCAN(hammer2_chain_tree, hammer2_chain, rbnode);
 #define HAMMER2_INSERT_PFSROOT		0x0004
 #define HAMMER2_INSERT_SAMEPARENT	0x0008
 
+/*
+ * Flags passed to hammer2_chain_bulkload()
+ */
+#define HAMMER2_BULKLOAD_HOLD		0x0001	/* hold until released */
+
 /*
  * hammer2_freemap_adjust()
  */
@@ -751,6 +794,8 @@ struct hammer2_inode {
 	uint8_t			comp_heuristic;
 	hammer2_inode_meta_t	meta;		/* copy of meta-data */
 	hammer2_off_t		osize;
+	struct hammer2_wcomp	*wcomp;		/* makefs */
+	hammer2_off_t		wbytes;		/* makefs, data allocated */
 };
 
 typedef struct hammer2_inode hammer2_inode_t;
@@ -865,6 +910,8 @@ struct hammer2_thread {
 	int		clindex;	/* cluster element index */
 	int		repidx;
 	char		*scratch;	/* MAXPHYS */
+	void		(*func)(void *);	/* makefs */
+	pthread_t	pthread;	/* makefs */
 };
 
 typedef struct hammer2_thread hammer2_thread_t;
@@ -898,6 +945,85 @@ struct hammer2_dedup {
 
 typedef struct hammer2_dedup hammer2_dedup_t;
 
+/*
+ * makefs dedup index entry.  Unlike the heuristic above the index
+ * remembers every data block recorded since mount, it is hashed by
+ * data_crc and by data_off (for invalidation).
+ */
+struct hammer2_dedup_ent {
+	struct hammer2_dedup_ent *cnext;	/* data_crc hash chain */
+	struct hammer2_dedup_ent *onext;	/* data_off hash chain */
+	hammer2_off_t	data_off;
+	uint64_t	data_crc;
+};
+
+typedef struct hammer2_dedup_ent hammer2_dedup_ent_t;
+
+/*
+ * makefs sequential allocator cursor, one per bref type.  Each cursor
+ * owns a 4MB freemap segment and carves it up in PBUFSIZE chunks,
+ * sub-PBUFSIZE allocations are packed into per-radix chunks.  Chunks
+ * carved since the last freemap update are [done, next) and are marked
+ * allocated in bulk by hammer2_freemap_bump_sync().
+ */
+#define HAMMER2_BUMP_NRADIX	(HAMMER2_PBUFRADIX - HAMMER2_RADIX_MIN)
+
+struct hammer2_bump {
+	hammer2_off_t	seg;		/* current segment, 0 if none */
+	hammer2_off_t	next;		/* next free chunk in segment */
+	hammer2_off_t	done;		/* freemap updated up to here */
+	int		vol;		/* volume to claim from next */
+	hammer2_off_t	off[HAMMER2_BUMP_NRADIX];	/* per-radix cursor */
+	hammer2_off_t	end[HAMMER2_BUMP_NRADIX];
+};
+
+typedef struct hammer2_bump hammer2_bump_t;
+
+/*
+ * LZ4 comp_algo levels.  Every level writes the same LZ4 block format,
+ * only the encoder differs.  Levels 1-4 use the fast encoder with an
+ * acceleration of 16, 8, 4 and 2, level 0 and 5 are the default encoder
+ * and levels 6-15 use LZ4-HC with compression level 3-12.
+ */
+#define HAMMER2_LZ4_LEVEL_FAST		3	/* acceleration 4 */
+#define HAMMER2_LZ4_LEVEL_DEFAULT	5
+#define HAMMER2_LZ4_LEVEL_HC		12	/* LZ4-HC level 9 */
+#define HAMMER2_LZ4_LEVEL_MAX		15
+
+/*
+ * Logical block prepared ahead of the strategy write by the makefs
+ * write pipeline.  The zero test, compression and check code are done
+ * by a worker thread, the chain is assigned later in submission order.
+ */
+struct hammer2_wcomp {
+	const char	*data;		/* logical block, pblksize bytes */
+	void		*priv;		/* submitter's cookie */
+	hammer2_key_t	lbase;
+	int		bytes;		/* bytes of file data in block */
+	int		pblksize;
+	uint8_t		comp_algo;
+	uint8_t		check_algo;
+	uint8_t		zero;		/* block is all zeros */
+	uint8_t		check_comp;	/* check covers comp_buffer */
+	int		comp_size;	/* 0 if not compressed */
+	int		comp_block_size;
+	int		check_bytes;	/* 0 if check not computed */
+	hammer2_blockref_t bref;	/* check code */
+	char		*comp_buffer;
+	char		*pad;		/* zero padded copy of short block */
+	int		done;
+};
+
+typedef struct hammer2_wcomp hammer2_wcomp_t;
+typedef struct hammer2_wpipe hammer2_wpipe_t;
+
+/*
+ * Consumer of hammer2_read_stream(), called with each run of contiguous
+ * file data.  Holes between runs read as zeros.
+ */
+typedef int (*hammer2_stream_func_t)(void *arg, hammer2_key_t off,
+				const char *data, size_t bytes);
+
 /*
  * hammer2_xop - container for VOP/XOP operation (allocated, not on stack).
  *
@@ -972,6 +1098,8 @@ struct hammer2_xop_strategy {
 	int			finished;
 	hammer2_mtx_t		lock;
 	struct bio		*bio;
+	const char		*data;	/* makefs direct write, no bio */
+	int			*donep;	/* frontend completion flag */
 };
 
 struct hammer2_xop_readdir {
@@ -1168,11 +1296,13 @@ struct hammer2_dev {
 	int		mount_count;	/* number of actively mounted PFSs */
 	TAILQ_ENTRY(hammer2_dev) mntentry; /* hammer2_mntlist */
 
-	struct malloc_type *mchain_obj;
-	struct malloc_type *mio_obj;
+	struct objcache	*mchain_obj;
+	struct objcache	*mio_obj;
 	struct malloc_type *mmsg;
 	//kdmsg_iocom_t	iocom;		/* volume-level dmsg interface */
-	hammer2_io_hash_t iohash[HAMMER2_IOHASH_SIZE];
+	hammer2_io_htab_t *iohash;
+	hammer2_hash_stats_t iohash_stats;
+	long		io_count;	/* #of dios in iohash */
 	int		iofree_count;
 	int		io_iterator;
 	int		freemap_relaxed;
@@ -1186,6 +1316,15 @@ struct hammer2_dev {
 	struct lock	bflock;		/* bulk-free manual function lock */
 	hammer2_off_t	heur_freemap[HAMMER2_FREEMAP_HEUR_SIZE];
 	hammer2_dedup_t heur_dedup[HAMMER2_DEDUP_HEUR_SIZE];
+	hammer2_spin_t	dedup_spin;	/* protects the dedup index */
+	hammer2_dedup_ent_t **dedup_crchash;	/* makefs dedup index */
+	hammer2_dedup_ent_t **dedup_offhash;
+	int		dedup_hmask;
+	int		dedup_count;
+	hammer2_mtx_t	bump_lock;	/* protects bump_xxx */
+	int		bump_enabled;	/* makefs sequential allocator */
+	hammer2_off_t	bump_seg[HAMMER2_MAX_VOLUMES]; /* next segment */
+	hammer2_bump_t	bump[HAMMER2_FREEMAP_HEUR_TYPES];
 	int		volhdrno;	/* last volhdrno written */
 	uint32_t	hflags;		/* HMNT2 flags applicable to device */
 	hammer2_off_t	free_reserved;	/* nominal free reserved */
@@ -1256,9 +1395,10 @@ struct hammer2_pfs {
 	int			unused00;
 	int			ronly;		/* read-only mount */
 	int			hflags;		/* pfs-specific mount flags */
-	struct malloc_type	*minode_obj;
+	struct objcache		*minode_obj;
 	/* note: inumhash not applicable to spmp */
-	hammer2_inum_hash_t inumhash[HAMMER2_INUMHASH_SIZE];
+	hammer2_inum_htab_t	*inumhash;
+	hammer2_hash_stats_t	inumhash_stats;
 	long			inum_count;	/* #of inodes in inumhash */
 	int			flags;
 	hammer2_tid_t		modify_tid;	/* modify transaction id */
@@ -1277,6 +1417,9 @@ struct hammer2_pfs {
 	struct inoq_head	syncq;		/* SYNCQ flagged inodes */
 	struct depq_head	depq;		/* SIDEQ flagged inodes */
 	long			sideq_count;	/* total inodes on depq */
+	hammer2_chain_t		**bulk_chains;	/* held bulk-load chains */
+	int			bulk_count;
+	int			bulk_alloc;
 	hammer2_thread_t	sync_thrs[HAMMER2_MAXCLUSTER];
 	uint32_t		cluster_flags;	/* cached cluster flags */
 	int			has_xop_threads;
@@ -1449,6 +1592,7 @@ extern struct lock hammer2_mntlk;
 extern int hammer2_aux_flags;
 extern int hammer2_debug;
 extern int hammer2_xop_nthreads;
+extern int hammer2_xop_workers;
 extern int hammer2_xop_sgroups;
 extern int hammer2_xop_xgroups;
 extern int hammer2_xop_xbase;
@@ -1463,6 +1607,7 @@ extern int hammer2_flush_pipe;
 extern int hammer2_dio_count;
 extern int hammer2_dio_limit;
 extern int hammer2_bulkfree_tps;
+extern int hammer2_bulkfree_workers;
 extern int hammer2_spread_workers;
 extern int hammer2_limit_saved_depth;
 extern long hammer2_chain_allocs;
@@ -1494,8 +1639,11 @@ extern struct objcache *cache_xops;
 /*
  * hammer2_subr.c
  */
-#define hammer2_icrc32(buf, size)	iscsi_crc32((buf), (size))
-#define hammer2_icrc32c(buf, size, crc)	iscsi_crc32_ext((buf), (size), (crc))
+/* replaces the libkern ones from hammer2_subs.h, see hammer2_cksum.c */
+#undef hammer2_icrc32
+#undef hammer2_icrc32c
+#define hammer2_icrc32(buf, size)	hammer2_cksum_icrc32((buf), (size))
+#define hammer2_icrc32c(buf, size, crc)	hammer2_cksum_icrc32c((buf), (size), (crc))
 
 int hammer2_signal_check(time_t *timep);
 const char *hammer2_error_str(int error);
@@ -1524,6 +1672,7 @@ void hammer2_adjwritecounter(int btype, size_t bytes);
  * hammer2_inode.c
  */
 void hammer2_inum_hash_init(hammer2_pfs_t *pmp);
+void hammer2_inum_hash_destroy(hammer2_pfs_t *pmp);
 struct m_vnode *hammer2_igetv(hammer2_inode_t *ip, int *errorp);
 hammer2_inode_t *hammer2_inode_lookup(hammer2_pfs_t *pmp,
 			hammer2_tid_t inum);
@@ -1561,6 +1710,8 @@ hammer2_inode_t *hammer2_inode_create_pfs(hammer2_pfs_t *spmp,
 int hammer2_inode_chain_ins(hammer2_inode_t *ip);
 int hammer2_inode_chain_des(hammer2_inode_t *ip);
 int hammer2_inode_chain_sync(hammer2_inode_t *ip);
+int hammer2_inode_bulkload(hammer2_inode_t *ip, hammer2_key_t *keys,
+			int nkeys, int fill, int flags);
 int hammer2_inode_chain_flush(hammer2_inode_t *ip, int flags);
 int hammer2_inode_unlink_finisher(hammer2_inode_t *ip, struct m_vnode **vpp);
 void hammer2_inode_vprecycle(struct m_vnode *vp);
@@ -1624,6 +1775,10 @@ int hammer2_chain_create(hammer2_chain_t **parentp, hammer2_chain_t **chainp,
 				int methods, hammer2_key_t key, int keybits,
 				int type, size_t bytes, hammer2_tid_t mtid,
 				hammer2_off_t dedup_off, int flags);
+int hammer2_chain_bulkload(hammer2_chain_t *parent,
+				const hammer2_key_t *keys, int nkeys,
+				int fill, int flags, hammer2_tid_t mtid);
+void hammer2_chain_bulkload_release(hammer2_pfs_t *pmp);
 void hammer2_chain_rename(hammer2_chain_t **parentp,
 				hammer2_chain_t *chain,
 				hammer2_tid_t mtid, int flags);
@@ -1930,6 +2085,7 @@ int hammer2_msg_adhoc_input(kdmsg_msg_t *msg);
  */
 int hammer2_vfs_sync(struct m_mount *mp, int waitflags);
 int hammer2_vfs_sync_pmp(hammer2_pfs_t *pmp, int waitfor);
+void hammer2_pfs_free_recq(hammer2_pfs_t *pmp);
 int hammer2_vfs_enospace(hammer2_inode_t *ip, off_t bytes, struct m_ucred *cred);
 
 hammer2_pfs_t *hammer2_pfsalloc(hammer2_chain_t *chain,
@@ -1965,6 +2121,9 @@ int hammer2_vfs_unmount(struct m_mount *mp, int mntflags);
 int hammer2_freemap_alloc(hammer2_chain_t *chain, size_t bytes);
 void hammer2_freemap_adjust(hammer2_dev_t *hmp,
 				hammer2_blockref_t *bref, int how);
+void hammer2_freemap_bump_start(hammer2_dev_t *hmp);
+void hammer2_freemap_bump_sync(hammer2_dev_t *hmp);
+void hammer2_freemap_bump_stop(hammer2_dev_t *hmp);
 
 /*
  * hammer2_cluster.c
@@ -2001,18 +2160,35 @@ void hammer2_volconf_update(hammer2_dev_t *hmp, int index);
  * hammer2_strategy.c
  */
 int hammer2_vop_strategy(struct vop_strategy_args *ap);
+int hammer2_strategy_write_direct(hammer2_inode_t *ip, hammer2_key_t lbase,
+				const char *data);
+int hammer2_strategy_read_stream(hammer2_inode_t *ip, char *buf, size_t size,
+				hammer2_stream_func_t func, void *arg);
 int hammer2_vop_bmap(struct vop_bmap_args *ap);
 void hammer2_bioq_sync(hammer2_pfs_t *pmp);
 void hammer2_dedup_record(hammer2_chain_t *chain, hammer2_io_t *dio,
 				const char *data);
 void hammer2_dedup_clear(hammer2_dev_t *hmp);
+void hammer2_dedup_index_delete(hammer2_dev_t *hmp, hammer2_off_t data_off);
+void hammer2_dedup_index_free(hammer2_dev_t *hmp);
+void hammer2_comp_bench(const char *path);
+hammer2_wpipe_t *hammer2_wpipe_create(int nthreads);
+void hammer2_wpipe_destroy(hammer2_wpipe_t *wp);
+int hammer2_wpipe_full(hammer2_wpipe_t *wp);
+int hammer2_wpipe_pending(hammer2_wpipe_t *wp);
+void hammer2_wpipe_submit(hammer2_wpipe_t *wp, hammer2_inode_t *ip,
+				const char *data, int bytes,
+				hammer2_key_t lbase, void *priv);
+hammer2_wcomp_t *hammer2_wpipe_wait(hammer2_wpipe_t *wp);
+void hammer2_wpipe_retire(hammer2_wpipe_t *wp);
 
 /*
  * hammer2_ondisk.c
  */
 int hammer2_open_devvp(const hammer2_devvp_list_t *devvpl, int ronly);
 int hammer2_close_devvp(const hammer2_devvp_list_t *devvpl, int ronly);
-int hammer2_init_devvp(struct m_vnode *devvp, hammer2_devvp_list_t *devvpl);
+int hammer2_init_devvp(const char *blkdevs, struct m_vnode *devvp,
+		       hammer2_devvp_list_t *devvpl);
 void hammer2_cleanup_devvp(hammer2_devvp_list_t *devvpl);
 int hammer2_init_vfsvolumes(struct m_mount *mp, const hammer2_devvp_list_t *devvpl,
 			hammer2_vfsvolume_t *volumes,
@@ -2030,7 +2206,12 @@ int hammer2_readdir(struct m_vnode *vp, void *buf, size_t size, off_t *offsetp,
 			int *ndirentp, int *eofflagp);
 int hammer2_readlink(struct m_vnode *vp, void *buf, size_t size);
 int hammer2_read(struct m_vnode *vp, void *buf, size_t size, off_t offset);
+int hammer2_read_stream(struct m_vnode *vp, void *buf, size_t size,
+			hammer2_stream_func_t func, void *arg);
 int hammer2_write(struct m_vnode *vp, void *buf, size_t size, off_t offset);
+int hammer2_write_direct(struct m_vnode *vp, const void *buf, size_t size,
+			off_t offset);
+int hammer2_write_prepare(struct m_vnode *vp, const void *buf, off_t size);
 int hammer2_nresolve(struct m_vnode *dvp, struct m_vnode **vpp, char *name, int nlen);
 int hammer2_nmkdir(struct m_vnode *dvp, struct m_vnode **vpp, char *name, int nlen,
 			mode_t mode);
@@ -2042,6 +2223,15 @@ int hammer2_nmknod(struct m_vnode *dvp, struct m_vnode **vpp, char *name, int nl
 int hammer2_nsymlink(struct m_vnode *dvp, struct m_vnode **vpp, char *name, int nlen,
 			char *target, mode_t mode);
 
+/*
+ * hammer2_cksum.c
+ */
+uint32_t hammer2_cksum_icrc32(const void *buf, size_t size);
+uint32_t hammer2_cksum_icrc32c(const void *buf, size_t size, uint32_t crc);
+void hammer2_cksum_sha256(const void *buf, size_t size, uint8_t *digest);
+void hammer2_cksum_sha192(const void *buf, size_t size, void *check);
+void hammer2_cksum_bench(const int *sizes, int nsizes);
+
 /*
  * hammer2_buf.c
  */
@@ -2049,6 +2239,11 @@ struct m_buf *getblkx(struct m_vnode *vp, off_t loffset, int size, int blkflags,
 			int slptimeo);
 int breadx(struct m_vnode *vp, off_t loffset, int size, struct m_buf **bpp);
 int bread_kvabio(struct m_vnode *vp, off_t loffset, int size, struct m_buf **bpp);
+void hammer2_brelse(struct m_buf *bp);
+int hammer2_bwrite(struct m_buf *bp);
+void hammer2_devq_init(struct m_vnode *devvp);
+int hammer2_devq_sync(struct m_vnode *devvp);
+int hammer2_devq_destroy(struct m_vnode *devvp);
 void bqrelse(struct m_buf *bp);
 int bawrite(struct m_buf *bp);
 int uiomove(caddr_t cp, size_t n, struct uio *uio);
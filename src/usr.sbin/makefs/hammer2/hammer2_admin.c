@@ -67,9 +67,142 @@ H2XOPDESCRIPTOR(inode_flush);
 H2XOPDESCRIPTOR(strategy_read);
 H2XOPDESCRIPTOR(strategy_write);
 
-//struct objcache *cache_xops;
+struct objcache *cache_xops;
 static struct thread dummy_td;
-struct thread *curthread = &dummy_td;
+__thread struct thread hammer2_curthread;
+
+/*
+ * tsleep(9)/wakeup(9) emulation.  A wakeup bumps the generation count of
+ * the ident's hash bucket, and a sleeper returns once the generation it
+ * sampled in tsleep_interlock() (or on entry without PINTERLOCKED) has
+ * changed.  Spurious wakeups are fine, callers always recheck.
+ */
+#define HAMMER2_SLEEPQ_SIZE	64
+
+static struct hammer2_sleepq {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cv;
+	u_int		gen;
+} hammer2_sleepq[HAMMER2_SLEEPQ_SIZE];
+
+static pthread_once_t hammer2_sleepq_once = PTHREAD_ONCE_INIT;
+static __thread u_int hammer2_sleep_gen;
+static int hammer2_thr_count;	/* running worker and frontend threads */
+
+static void
+hammer2_sleepq_init(void)
+{
+	int i;
+
+	for (i = 0; i < HAMMER2_SLEEPQ_SIZE; ++i) {
+		pthread_mutex_init(&hammer2_sleepq[i].lock, NULL);
+		pthread_cond_init(&hammer2_sleepq[i].cv, NULL);
+	}
+}
+
+static struct hammer2_sleepq *
+hammer2_sleepq_get(const volatile void *ident)
+{
+	uintptr_t hv;
+
+	pthread_once(&hammer2_sleepq_once, hammer2_sleepq_init);
+	hv = (uintptr_t)ident;
+	hv ^= hv >> 7;
+	hv ^= hv >> 13;
+
+	return (&hammer2_sleepq[hv % HAMMER2_SLEEPQ_SIZE]);
+}
+
+void
+tsleep_interlock(const volatile void *ident, int flags)
+{
+	struct hammer2_sleepq *sq = hammer2_sleepq_get(ident);
+
+	pthread_mutex_lock(&sq->lock);
+	hammer2_sleep_gen = sq->gen;
+	pthread_mutex_unlock(&sq->lock);
+}
+
+int
+tsleep(const volatile void *ident, int flags, const char *wmesg, int timo)
+{
+	struct hammer2_sleepq *sq = hammer2_sleepq_get(ident);
+	struct timespec ts;
+	long long nsec;
+	int error;
+
+	/*
+	 * Nothing but another worker or frontend thread can issue the
+	 * wakeup.
+	 */
+	if (timo == 0 && hammer2_thr_count == 0)
+		panic("tsleep: %s would block forever", wmesg);
+
+	if (timo) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		nsec = (long long)timo * 1000000000LL / (hz ? hz : 100);
+		nsec += ts.tv_nsec;
+		ts.tv_sec += nsec / 1000000000LL;
+		ts.tv_nsec = nsec % 1000000000LL;
+	}
+
+	error = 0;
+	pthread_mutex_lock(&sq->lock);
+	if ((flags & PINTERLOCKED) == 0)
+		hammer2_sleep_gen = sq->gen;
+	while (sq->gen == hammer2_sleep_gen) {
+		if (timo == 0) {
+			pthread_cond_wait(&sq->cv, &sq->lock);
+		} else if (pthread_cond_timedwait(&sq->cv, &sq->lock,
+		    &ts) == ETIMEDOUT) {
+			error = EWOULDBLOCK;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sq->lock);
+
+	return (error);
+}
+
+void
+wakeup(const volatile void *ident)
+{
+	struct hammer2_sleepq *sq = hammer2_sleepq_get(ident);
+
+	pthread_mutex_lock(&sq->lock);
+	++sq->gen;
+	pthread_cond_broadcast(&sq->cv);
+	pthread_mutex_unlock(&sq->lock);
+}
+
+/*
+ * Account a frontend thread, e.g. one populating another PFS, which may
+ * issue the wakeup a tsleep() in a different thread is waiting for.
+ */
+void
+hammer2_thr_attach(void)
+{
+	atomic_add_int(&hammer2_thr_count, 1);
+}
+
+void
+hammer2_thr_detach(void)
+{
+	atomic_add_int(&hammer2_thr_count, -1);
+}
+
+/*
+ * pthread entry point of a worker thread.
+ */
+static void *
+hammer2_thr_start(void *arg)
+{
+	hammer2_thread_t *thr = arg;
+
+	thr->func(thr);
+
+	return (NULL);
+}
 
 /*
  * Set flags and wakeup any waiters.
@@ -247,7 +380,18 @@ hammer2_thr_create(hammer2_thread_t *thr, hammer2_pfs_t *pmp,
 		lwkt_create(func, thr, &thr->td, NULL, 0, -1, "%s", id);
 	}
 #else
+	/*
+	 * XOP helpers only run as real threads if XOP worker threads were
+	 * requested.  Otherwise XOPs are run by the caller.
+	 */
 	thr->td = &dummy_td;
+	if (func != NULL &&
+	    (func != hammer2_primary_xops_thread || hammer2_xop_workers)) {
+		thr->func = func;
+		atomic_add_int(&hammer2_thr_count, 1);
+		if (pthread_create(&thr->pthread, NULL, hammer2_thr_start, thr))
+			panic("hammer2_thr_create: pthread_create failed");
+	}
 #endif
 }
 
@@ -264,8 +408,13 @@ hammer2_thr_delete(hammer2_thread_t *thr)
 	if (thr->td == NULL)
 		return;
 	hammer2_thr_signal(thr, HAMMER2_THREAD_STOP);
-	/* Don't wait, there's no such thread in makefs */
-	//hammer2_thr_wait(thr, HAMMER2_THREAD_STOPPED);
+	/* Don't wait unless it's a real thread in makefs */
+	if (thr->func) {
+		hammer2_thr_wait(thr, HAMMER2_THREAD_STOPPED);
+		pthread_join(thr->pthread, NULL);
+		atomic_add_int(&hammer2_thr_count, -1);
+		thr->func = NULL;
+	}
 	thr->pmp = NULL;
 	if (thr->scratch) {
 		kfree(thr->scratch, M_HAMMER2);
@@ -372,7 +521,7 @@ hammer2_xop_alloc(hammer2_inode_t *ip, int flags)
 {
 	hammer2_xop_t *xop;
 
-	xop = ecalloc(1, sizeof(*xop));
+	xop = objcache_get(cache_xops, M_WAITOK | M_ZERO);
 	KKASSERT(xop->head.cluster.array[0].chain == NULL);
 
 	xop->head.ip1 = ip;
@@ -477,9 +626,11 @@ hammer2_xop_helper_create(hammer2_pfs_t *pmp)
 	lockmgr(&pmp->lock, LK_EXCLUSIVE);
 	pmp->has_xop_threads = 1;
 
-	pmp->xop_groups = kmalloc(hammer2_xop_nthreads *
-				  sizeof(hammer2_xop_group_t),
-				  M_HAMMER2, M_WAITOK | M_ZERO);
+	if (pmp->xop_groups == NULL) {
+		pmp->xop_groups = kmalloc(hammer2_xop_nthreads *
+					  sizeof(hammer2_xop_group_t),
+					  M_HAMMER2, M_WAITOK | M_ZERO);
+	}
 	for (i = 0; i < pmp->iroot->cluster.nchains; ++i) {
 		for (j = 0; j < hammer2_xop_nthreads; ++j) {
 			if (pmp->xop_groups[j].thrs[i].td)
@@ -504,7 +655,12 @@ hammer2_xop_helper_cleanup(hammer2_pfs_t *pmp)
 		return;
 	}
 
-	for (i = 0; i < pmp->pfs_nmasters; ++i) {
+	/*
+	 * makefs: helpers are created for every chain of iroot, which
+	 * pfs_nmasters does not count, and running threads must not be
+	 * left behind with xop_groups freed.
+	 */
+	for (i = 0; i < HAMMER2_MAXCLUSTER; ++i) {
 		for (j = 0; j < hammer2_xop_nthreads; ++j) {
 			if (pmp->xop_groups[j].thrs[i].td)
 				hammer2_thr_delete(&pmp->xop_groups[j].thrs[i]);
@@ -559,7 +715,6 @@ hammer2_xop_start_except(hammer2_xop_head_t *xop, hammer2_xop_desc_t *desc,
 		 * Use worker space 0 associated with the current cpu
 		 * for strategy ops.
 		 */
-		/*
 		hammer2_xop_strategy_t *xopst;
 		u_int which;
 
@@ -567,10 +722,7 @@ hammer2_xop_start_except(hammer2_xop_head_t *xop, hammer2_xop_desc_t *desc,
 		which = ((unsigned int)ip1->ihash +
 			 ((unsigned int)xopst->lbase >> HAMMER2_PBUFRADIX)) %
 			hammer2_xop_sgroups;
-		ng = mycpu->gd_cpuid % hammer2_xop_mod +
-		     hammer2_xop_mod * which;
-		*/
-		ng = 0;
+		ng = hammer2_xop_mod * which;
 	} else if (hammer2_spread_workers == 0 && ip1->cluster.nchains == 1) {
 		/*
 		 * For now try to keep the work on the same cpu to reduce
@@ -578,26 +730,18 @@ hammer2_xop_start_except(hammer2_xop_head_t *xop, hammer2_xop_desc_t *desc,
 		 * don't be very smart and select the one to use based on
 		 * the inode hash.
 		 */
-		/*
 		u_int which;
 
 		which = (unsigned int)ip1->ihash % hammer2_xop_xgroups;
-		ng = mycpu->gd_cpuid % hammer2_xop_mod +
-		     (which * hammer2_xop_mod) +
-		     hammer2_xop_xbase;
-		*/
-		ng = 0;
+		ng = (which * hammer2_xop_mod) + hammer2_xop_xbase;
 	} else {
 		/*
 		 * Hash based on inode only, must serialize inode to same
 		 * thread regardless of current cpu.
 		 */
-		/*
 		ng = (unsigned int)ip1->ihash %
 		     (hammer2_xop_mod * hammer2_xop_xgroups) +
 		     hammer2_xop_xbase;
-		*/
-		ng = 0;
 	}
 	xop->desc = desc;
 
@@ -634,7 +778,8 @@ hammer2_xop_start_except(hammer2_xop_head_t *xop, hammer2_xop_desc_t *desc,
 		if (i != notidx) {
 			thr = &pmp->xop_groups[ng].thrs[i];
 			hammer2_thr_signal(thr, HAMMER2_THREAD_XOPQ);
-			hammer2_primary_xops_thread(thr);
+			if (thr->func == NULL)
+				hammer2_primary_xops_thread(thr);
 		}
 	}
 }
@@ -816,7 +961,7 @@ hammer2_xop_retire(hammer2_xop_head_t *xop, uint64_t mask)
 		kfree(xop->collect[i].errors, M_HAMMER2);
 	}
 
-	free(xop);
+	objcache_put(cache_xops, xop);
 }
 
 /*
@@ -880,6 +1025,17 @@ hammer2_xop_feed(hammer2_xop_head_t *xop, hammer2_chain_t *chain,
 			error = HAMMER2_ERROR_ABORTED;
 			goto done;
 		}
+		/*
+		 * The FIFO can only grow if the XOP is run by the frontend,
+		 * a worker thread waits for the frontend to collect as in
+		 * the kernel.
+		 */
+		if (fifo->thr != NULL && fifo->thr->func != NULL) {
+			tsleep_interlock(xop, 0);
+			if (fifo->ri == fifo->wi - xop->fifo_size)
+				tsleep(xop, PINTERLOCKED, "h2feed", hz*60);
+			continue;
+		}
 		xop->fifo_size *= 2;
 		hammer2_xop_fifo_alloc(fifo, xop->fifo_size);
 	}
@@ -1285,8 +1441,9 @@ hammer2_primary_xops_thread(void *arg)
 			}
 		}
 
-		/* Don't wait, this is a XOP caller thread in makefs */
-		break;
+		/* Don't wait if this is a XOP caller thread in makefs */
+		if (thr->func == NULL)
+			break;
 
 		/*
 		 * Wait for event, interlock using THREAD_WAITING and
@@ -38,6 +38,249 @@
 #include "hammer2.h"
 #include "makefs.h"
 
+/*
+ * Serializes the buffer list of ffs/buf.c, XOP worker threads call in
+ * concurrently.  Device I/O is positional and done without it.
+ */
+static pthread_mutex_t hammer2_buf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Device write queue.  Every volume of a volume set gets a writer
+ * thread, the device vnode carries its queue in v_devq.  bawrite() and
+ * bdwrite() queue the buffer and return, bwrite() queues it and waits
+ * for it, VOP_FSYNC() waits for the queue to drain.  This way a single
+ * flushing thread keeps all volumes busy.
+ *
+ * The writer is only woken up once a batch has been queued or somebody
+ * waits for the queue, hammer2 rewrites the same buffers a lot and a
+ * wakeup per buffer costs more than the write itself.
+ *
+ * Queued buffers are off the ffs/buf.c list, they stay on the queue
+ * until written so that breadx() can read from them.
+ */
+#define HAMMER2_DEVQ_BATCH	(1024 * 1024)
+#define HAMMER2_DEVQ_MAXBYTES	(16 * 1024 * 1024)	/* per volume */
+
+struct hammer2_devq {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;		/* wakes up the writer */
+	pthread_cond_t		done;		/* wakes up waiters */
+	TAILQ_HEAD(, m_buf)	queue;
+	long			bytes;		/* bytes on queue */
+	uint64_t		seq_queued;
+	uint64_t		seq_done;
+	int			error;		/* first write error */
+	int			waiters;	/* threads waiting on done */
+	int			exiting;
+	pthread_t		td;
+};
+
+static void *
+hammer2_devq_thread(void *arg)
+{
+	struct m_vnode *devvp = arg;
+	struct hammer2_devq *devq = devvp->v_devq;
+	fsinfo_t *fs = devvp->fs;
+	struct m_buf *bp;
+	off_t offset;
+	ssize_t rv;
+	int e;
+
+	pthread_mutex_lock(&devq->lock);
+	for (;;) {
+		bp = TAILQ_FIRST(&devq->queue);
+		if (bp == NULL && devq->exiting)
+			break;
+		if (bp == NULL || (devq->bytes < HAMMER2_DEVQ_BATCH &&
+				   devq->waiters == 0 && !devq->exiting)) {
+			pthread_cond_wait(&devq->cond, &devq->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&devq->lock);
+
+		offset = (off_t)bp->b_blkno * fs->sectorsize + fs->offset;
+		rv = pwrite(fs->fd, bp->b_data, (size_t)bp->b_bcount, offset);
+		e = (rv == -1) ? errno : EIO;
+		if (debug & DEBUG_BUF_BWRITE)
+			printf("%s: write %ld (offset %lld) returned %lld\n",
+			    __func__, bp->b_bcount, (long long)offset,
+			    (long long)rv);
+
+		pthread_mutex_lock(&devq->lock);
+		if (rv != bp->b_bcount && devq->error == 0)
+			devq->error = e;
+		TAILQ_REMOVE(&devq->queue, bp, b_tailq);
+		devq->bytes -= bp->b_bcount;
+		++devq->seq_done;
+		if (devq->waiters)
+			pthread_cond_broadcast(&devq->done);
+		free(bp->b_data);
+		free(bp);
+	}
+	pthread_mutex_unlock(&devq->lock);
+
+	return (NULL);
+}
+
+/*
+ * Start the writer thread of a device vnode.
+ */
+void
+hammer2_devq_init(struct m_vnode *devvp)
+{
+	struct hammer2_devq *devq;
+
+	KKASSERT(devvp->v_devq == NULL);
+	devq = ecalloc(1, sizeof(*devq));
+	pthread_mutex_init(&devq->lock, NULL);
+	pthread_cond_init(&devq->cond, NULL);
+	pthread_cond_init(&devq->done, NULL);
+	TAILQ_INIT(&devq->queue);
+	devvp->v_devq = devq;
+	if (pthread_create(&devq->td, NULL, hammer2_devq_thread, devvp))
+		errx(1, "failed to create writer thread");
+}
+
+/*
+ * Wait for the writer to make progress, kicking it if it is waiting
+ * for a batch.  Caller must hold devq->lock.
+ */
+static void
+hammer2_devq_sleep(struct hammer2_devq *devq)
+{
+	if (devq->waiters++ == 0)
+		pthread_cond_signal(&devq->cond);
+	pthread_cond_wait(&devq->done, &devq->lock);
+	--devq->waiters;
+}
+
+/*
+ * Queue (bp) for writing, returns its sequence number.  Caller must
+ * hold devq->lock.
+ */
+static uint64_t
+hammer2_devq_enter(struct hammer2_devq *devq, struct m_buf *bp)
+{
+	while (devq->bytes >= HAMMER2_DEVQ_MAXBYTES)
+		hammer2_devq_sleep(devq);
+	TAILQ_INSERT_TAIL(&devq->queue, bp, b_tailq);
+	devq->bytes += bp->b_bcount;
+	if (devq->bytes >= HAMMER2_DEVQ_BATCH &&
+	    devq->bytes - bp->b_bcount < HAMMER2_DEVQ_BATCH)
+		pthread_cond_signal(&devq->cond);
+
+	return (++devq->seq_queued);
+}
+
+/*
+ * Hand (bp) over to the writer thread, optionally waiting for the
+ * write to complete.
+ */
+static int
+hammer2_devq_write(struct m_buf *bp, int waitfor)
+{
+	struct hammer2_devq *devq = bp->b_vp->v_devq;
+	uint64_t seq;
+	int error;
+
+	pthread_mutex_lock(&hammer2_buf_lock);
+	bremlist(bp);
+	pthread_mutex_unlock(&hammer2_buf_lock);
+
+	pthread_mutex_lock(&devq->lock);
+	seq = hammer2_devq_enter(devq, bp);
+	if (waitfor) {
+		while (devq->seq_done < seq)
+			hammer2_devq_sleep(devq);
+	}
+	error = devq->error;
+	pthread_mutex_unlock(&devq->lock);
+
+	return (error);
+}
+
+/*
+ * Satisfy a read from the queue.  If the newest queued write overlapping
+ * (rbp) covers it the data is copied from there, otherwise wait for the
+ * overlapping writes to complete.  Returns non-zero if (rbp) was filled.
+ */
+static int
+hammer2_devq_read(struct m_vnode *devvp, struct m_buf *rbp)
+{
+	struct hammer2_devq *devq = devvp->v_devq;
+	struct m_buf *bp, *last;
+	off_t beg = rbp->b_loffset;
+	off_t end = rbp->b_loffset + rbp->b_bcount;
+
+	pthread_mutex_lock(&devq->lock);
+again:
+	last = NULL;
+	TAILQ_FOREACH(bp, &devq->queue, b_tailq) {
+		if (bp->b_loffset < end && beg < bp->b_loffset + bp->b_bcount)
+			last = bp;
+	}
+	if (last && (last->b_loffset > beg ||
+		     last->b_loffset + last->b_bcount < end)) {
+		hammer2_devq_sleep(devq);
+		goto again;
+	}
+	if (last)
+		bcopy(last->b_data + (beg - last->b_loffset), rbp->b_data,
+		      rbp->b_bcount);
+	pthread_mutex_unlock(&devq->lock);
+
+	return (last != NULL);
+}
+
+/*
+ * Wait for the queue to drain, returns the first write error.
+ */
+int
+hammer2_devq_sync(struct m_vnode *devvp)
+{
+	struct hammer2_devq *devq = devvp->v_devq;
+	int error;
+
+	if (devq == NULL)
+		return (0);
+
+	pthread_mutex_lock(&devq->lock);
+	while (!TAILQ_EMPTY(&devq->queue))
+		hammer2_devq_sleep(devq);
+	error = devq->error;
+	pthread_mutex_unlock(&devq->lock);
+
+	return (error);
+}
+
+/*
+ * Drain the queue and stop the writer thread.
+ */
+int
+hammer2_devq_destroy(struct m_vnode *devvp)
+{
+	struct hammer2_devq *devq = devvp->v_devq;
+	int error;
+
+	if (devq == NULL)
+		return (0);
+
+	error = hammer2_devq_sync(devvp);
+	pthread_mutex_lock(&devq->lock);
+	devq->exiting = 1;
+	pthread_cond_signal(&devq->cond);
+	pthread_mutex_unlock(&devq->lock);
+	pthread_join(devq->td, NULL);
+
+	pthread_cond_destroy(&devq->done);
+	pthread_cond_destroy(&devq->cond);
+	pthread_mutex_destroy(&devq->lock);
+	free(devq);
+	devvp->v_devq = NULL;
+
+	return (error);
+}
+
 struct m_buf *
 getblkx(struct m_vnode *vp, off_t loffset, int size, int blkflags, int slptimeo)
 {
@@ -49,7 +292,9 @@ getblkx(struct m_vnode *vp, off_t loffset, int size, int blkflags, int slptimeo)
 	else
 		blkno = loffset / DEV_BSIZE; /* fsopts->sectorsize */
 
+	pthread_mutex_lock(&hammer2_buf_lock);
 	bp = getblk(vp, blkno, size, 0, 0, 0);
+	pthread_mutex_unlock(&hammer2_buf_lock);
 	assert(bp);
 	assert(bp->b_data);
 
@@ -76,11 +321,9 @@ breadx(struct m_vnode *vp, off_t loffset, int size, struct m_buf **bpp)
 	assert(!bp->b_vp->v_logical);
 	*bpp = bp;
 
-	if (lseek(bp->b_fs->fd, bp->b_loffset, SEEK_SET) == -1)
-		err(1, "%s: lseek vp %p offset 0x%016jx",
-			__func__, vp, (intmax_t)bp->b_loffset);
-
-	ret = read(bp->b_fs->fd, bp->b_data, bp->b_bcount);
+	if (vp->v_devq && hammer2_devq_read(vp, bp))
+		return (0);
+	ret = pread(bp->b_fs->fd, bp->b_data, bp->b_bcount, bp->b_loffset);
 	if (debug & DEBUG_BUF_BREAD)
 		printf("%s: read vp %p offset 0x%016jx size 0x%jx -> 0x%jx\n",
 			__func__, vp, (intmax_t)bp->b_loffset,
@@ -109,6 +352,44 @@ bread_kvabio(struct m_vnode *vp, off_t loffset, int size, struct m_buf **bpp)
 	return (breadx(vp, loffset, size, bpp));
 }
 
+void
+hammer2_brelse(struct m_buf *bp)
+{
+	pthread_mutex_lock(&hammer2_buf_lock);
+	(brelse)(bp);
+	pthread_mutex_unlock(&hammer2_buf_lock);
+}
+
+/*
+ * Same as bwrite() in ffs/buf.c, but with a positional write.
+ */
+int
+hammer2_bwrite(struct m_buf *bp)
+{
+	fsinfo_t *fs = bp->b_fs;
+	off_t offset;
+	ssize_t rv;
+	size_t bytes;
+	int e;
+
+	if (bp->b_vp->v_devq)
+		return (hammer2_devq_write(bp, 1));
+
+	offset = (off_t)bp->b_blkno * fs->sectorsize + fs->offset;
+	bytes = (size_t)bp->b_bcount;
+	rv = pwrite(fs->fd, bp->b_data, bytes, offset);
+	e = errno;
+	if (debug & DEBUG_BUF_BWRITE)
+		printf("%s: write %ld (offset %lld) returned %lld\n", __func__,
+		    bp->b_bcount, (long long)offset, (long long)rv);
+	brelse(bp);
+	if (rv == (ssize_t)bytes)
+		return (0);
+	if (rv == -1)
+		return (e);
+	return (EAGAIN);
+}
+
 void
 bqrelse(struct m_buf *bp)
 {
@@ -118,6 +399,9 @@ bqrelse(struct m_buf *bp)
 int
 bawrite(struct m_buf *bp)
 {
+	if (bp->b_vp->v_devq)
+		return (hammer2_devq_write(bp, 0));
+
 	return (bwrite(bp));
 }
 
@@ -452,6 +452,8 @@ static void cbinfo_bmap_init(hammer2_bulkfree_info_t *cbinfo, size_t size);
 static int h2_bulkfree_callback(hammer2_bulkfree_info_t *cbinfo,
 			hammer2_blockref_t *bref);
 static int h2_bulkfree_sync(hammer2_bulkfree_info_t *cbinfo);
+static int hammer2_bulkfree_scan_mt(hammer2_chain_t *vchain,
+			hammer2_bulkfree_info_t *cbinfo, size_t size);
 static void h2_bulkfree_sync_adjust(hammer2_bulkfree_info_t *cbinfo,
 			hammer2_off_t data_off, hammer2_bmap_data_t *live,
 			hammer2_bmap_data_t *bmap, hammer2_key_t alloc_base);
@@ -664,8 +666,14 @@ hammer2_bulkfree_pass(hammer2_dev_t *hmp, hammer2_chain_t *vchain,
 		cbinfo.mtid = 0;
 #endif
 		cbinfo.pri = 0;
-		error |= hammer2_bulkfree_scan(vchain,
-					       h2_bulkfree_callback, &cbinfo);
+		if (hammer2_bulkfree_workers > 1) {
+			error |= hammer2_bulkfree_scan_mt(vchain, &cbinfo,
+							  size);
+		} else {
+			error |= hammer2_bulkfree_scan(vchain,
+						       h2_bulkfree_callback,
+						       &cbinfo);
+		}
 
 		while ((save = TAILQ_FIRST(&cbinfo.list)) != NULL &&
 		       (error & ~HAMMER2_ERROR_CHECK) == 0) {
@@ -799,6 +807,315 @@ cbinfo_bmap_init(hammer2_bulkfree_info_t *cbinfo, size_t size)
 	}
 }
 
+/*
+ * makefs: multi-threaded topology scan.
+ *
+ * The caller expands the top of the topology (the volume, the super-root,
+ * PFS roots and their top-level indirect blocks) breadth-first until
+ * there are enough subtrees to keep the workers busy.  Each worker then
+ * scans subtrees off the shared list into a private in-memory freemap
+ * (shard) which is merged into the caller's before the sync phase.
+ */
+typedef struct hammer2_bulkfree_work {
+	hammer2_spin_t		spin;
+	hammer2_chain_save_list_t list;		/* subtrees to scan */
+	int			error;
+} hammer2_bulkfree_work_t;
+
+typedef struct hammer2_bulkfree_shard {
+	hammer2_thread_t	thr;		/* must be first */
+	hammer2_bulkfree_work_t	*work;
+	hammer2_bulkfree_info_t	info;
+	int			error;
+} hammer2_bulkfree_shard_t;
+
+/*
+ * Scan the children of each chain on (list) and replace the list with
+ * the recursable children, one topology level at a time, until the list
+ * holds at least (target) subtrees.
+ */
+static int
+hammer2_bulkfree_split(hammer2_bulkfree_info_t *cbinfo,
+		       hammer2_chain_save_list_t *list, int target)
+{
+	hammer2_chain_save_list_t next;
+	hammer2_chain_save_t *save;
+	hammer2_chain_save_t *nsave;
+	hammer2_blockref_t bref;
+	hammer2_chain_t *parent;
+	hammer2_chain_t *chain;
+	int count;
+	int first;
+	int error;
+	int e2;
+
+	error = 0;
+	count = 1;
+	while (count < target && (error & ~HAMMER2_ERROR_CHECK) == 0) {
+		TAILQ_INIT(&next);
+		count = 0;
+		while ((save = TAILQ_FIRST(list)) != NULL) {
+			TAILQ_REMOVE(list, save, entry);
+			parent = save->chain;
+			kfree(save, M_HAMMER2);
+
+			hammer2_chain_lock(parent, HAMMER2_RESOLVE_ALWAYS |
+						   HAMMER2_RESOLVE_SHARED);
+			if (parent->error & HAMMER2_ERROR_CHECK) {
+				error |= parent->error;
+				hammer2_chain_unlock(parent);
+				hammer2_chain_drop(parent);
+				continue;
+			}
+			if (parent->bref.type == HAMMER2_BREF_TYPE_INODE &&
+			    (parent->bref.flags & HAMMER2_BREF_FLAG_PFSROOT)) {
+				kprintf("hammer2_bulkfree: Scanning %s\n",
+					parent->data->ipdata.filename);
+			}
+
+			chain = NULL;
+			first = 1;
+			for (;;) {
+				error |= hammer2_chain_scan(parent, &chain,
+					    &bref, &first,
+					    HAMMER2_LOOKUP_NODATA |
+					    HAMMER2_LOOKUP_SHARED);
+				if (error & ~HAMMER2_ERROR_CHECK)
+					break;
+				if (bref.type == HAMMER2_BREF_TYPE_DIRENT)
+					++cbinfo->count_dirents_scanned;
+				if ((bref.data_off &
+				     ~HAMMER2_OFF_MASK_RADIX) == 0)
+					continue;
+				e2 = h2_bulkfree_test(cbinfo, &bref, 1, 0);
+				if (e2) {
+					error |= e2 & ~HAMMER2_ERROR_EOF;
+					continue;
+				}
+				if (bref.type == HAMMER2_BREF_TYPE_INODE)
+					++cbinfo->count_inodes_scanned;
+				error |= h2_bulkfree_callback(cbinfo, &bref);
+				if (error & ~HAMMER2_ERROR_CHECK)
+					break;
+				if (chain == NULL)
+					continue;
+				cbinfo->count_bytes_scanned += chain->bytes;
+				++cbinfo->count_chains_scanned;
+
+				switch(chain->bref.type) {
+				case HAMMER2_BREF_TYPE_INODE:
+				case HAMMER2_BREF_TYPE_FREEMAP_NODE:
+				case HAMMER2_BREF_TYPE_INDIRECT:
+				case HAMMER2_BREF_TYPE_VOLUME:
+				case HAMMER2_BREF_TYPE_FREEMAP:
+					if (chain->error & HAMMER2_ERROR_CHECK)
+						break;
+					nsave = kmalloc(sizeof(*nsave),
+							M_HAMMER2,
+							M_WAITOK | M_ZERO);
+					nsave->chain = chain;
+					hammer2_chain_ref(chain);
+					TAILQ_INSERT_TAIL(&next, nsave, entry);
+					++count;
+					break;
+				default:
+					/* does not recurse */
+					break;
+				}
+			}
+			if (chain) {
+				hammer2_chain_unlock(chain);
+				hammer2_chain_drop(chain);
+			}
+			hammer2_chain_unlock(parent);
+			hammer2_chain_drop(parent);
+			if (error & ~HAMMER2_ERROR_CHECK)
+				break;
+		}
+		TAILQ_CONCAT(list, &next, entry);
+		if (count == 0)
+			break;
+	}
+	return (error & ~HAMMER2_ERROR_EOF);
+}
+
+static void
+hammer2_bulkfree_worker(void *arg)
+{
+	hammer2_bulkfree_shard_t *shard = arg;
+	hammer2_bulkfree_work_t *work = shard->work;
+	hammer2_bulkfree_info_t *info = &shard->info;
+	hammer2_chain_save_t *save;
+	int error;
+
+	for (;;) {
+		hammer2_spin_ex(&work->spin);
+		if (work->error & ~HAMMER2_ERROR_CHECK)
+			save = NULL;
+		else
+			save = TAILQ_FIRST(&work->list);
+		if (save)
+			TAILQ_REMOVE(&work->list, save, entry);
+		hammer2_spin_unex(&work->spin);
+		if (save == NULL)
+			break;
+
+		/*
+		 * Same as the single-threaded scan, except the deferred
+		 * chains are private to this worker.
+		 */
+		info->pri = 0;
+		error = hammer2_bulkfree_scan(save->chain,
+					      h2_bulkfree_callback, info);
+		hammer2_chain_drop(save->chain);
+		kfree(save, M_HAMMER2);
+		while ((save = TAILQ_FIRST(&info->list)) != NULL) {
+			TAILQ_REMOVE(&info->list, save, entry);
+			--info->list_count;
+			if ((error & ~HAMMER2_ERROR_CHECK) == 0) {
+				info->pri = 0;
+				info->backout = NULL;
+				error |= hammer2_bulkfree_scan(save->chain,
+						h2_bulkfree_callback, info);
+			}
+			hammer2_chain_drop(save->chain);
+			kfree(save, M_HAMMER2);
+		}
+		info->backout = NULL;
+		shard->error |= error;
+
+		if (error & ~HAMMER2_ERROR_CHECK) {
+			hammer2_spin_ex(&work->spin);
+			work->error |= error;
+			hammer2_spin_unex(&work->spin);
+		}
+	}
+
+	/*
+	 * Leave thr->td set, hammer2_thr_delete() joins the thread.
+	 */
+	hammer2_thr_signal(&shard->thr, HAMMER2_THREAD_STOPPED);
+}
+
+/*
+ * Merge a worker's in-memory freemap into the caller's.  Entries the
+ * worker did not touch are identical to the caller's initial state.
+ * linear is only a hint and fragment ends are tracked with a max, so
+ * the largest one is sufficient.  avail is recalculated from the merged
+ * bitmap.
+ */
+static void
+cbinfo_bmap_merge(hammer2_bulkfree_info_t *cbinfo,
+		  hammer2_bulkfree_info_t *shard, size_t size)
+{
+	hammer2_bmap_data_t *bmap = cbinfo->bmap;
+	hammer2_bmap_data_t *sbmap = shard->bmap;
+	hammer2_bitmap_t bmask;
+	uint32_t avail;
+	int i;
+
+	while (size) {
+		if (sbmap->class) {
+			if (bmap->class == 0)
+				bmap->class = sbmap->class;
+			if (bmap->linear < sbmap->linear)
+				bmap->linear = sbmap->linear;
+			avail = HAMMER2_FREEMAP_LEVEL0_SIZE;
+			for (i = 0; i < HAMMER2_BMAP_ELEMENTS; ++i) {
+				bmap->bitmapq[i] |= sbmap->bitmapq[i];
+				for (bmask = bmap->bitmapq[i]; bmask;
+				     bmask >>= 2) {
+					if (bmask & 3)
+						avail -=
+						    HAMMER2_FREEMAP_BLOCK_SIZE;
+				}
+			}
+			bmap->avail = avail;
+		}
+		size -= sizeof(*bmap);
+		++bmap;
+		++sbmap;
+	}
+	cbinfo->count_inodes_scanned += shard->count_inodes_scanned;
+	cbinfo->count_dirents_scanned += shard->count_dirents_scanned;
+	cbinfo->count_dedup_factor += shard->count_dedup_factor;
+	cbinfo->count_bytes_scanned += shard->count_bytes_scanned;
+	cbinfo->count_chains_scanned += shard->count_chains_scanned;
+	if (cbinfo->list_count_max < shard->list_count_max)
+		cbinfo->list_count_max = shard->list_count_max;
+}
+
+static int
+hammer2_bulkfree_scan_mt(hammer2_chain_t *vchain,
+			 hammer2_bulkfree_info_t *cbinfo, size_t size)
+{
+	hammer2_bulkfree_work_t work;
+	hammer2_bulkfree_shard_t *shards;
+	hammer2_bulkfree_shard_t *shard;
+	hammer2_bulkfree_info_t *info;
+	hammer2_chain_save_t *save;
+	int nworkers = hammer2_bulkfree_workers;
+	int error;
+	int i;
+
+	bzero(&work, sizeof(work));
+	hammer2_spin_init(&work.spin, "h2bfw");
+	TAILQ_INIT(&work.list);
+
+	save = kmalloc(sizeof(*save), M_HAMMER2, M_WAITOK | M_ZERO);
+	save->chain = vchain;
+	hammer2_chain_ref(vchain);
+	TAILQ_INSERT_TAIL(&work.list, save, entry);
+
+	error = hammer2_bulkfree_split(cbinfo, &work.list, nworkers * 16);
+	work.error = error;
+	if ((error & ~HAMMER2_ERROR_CHECK) == 0 &&
+	    !TAILQ_EMPTY(&work.list)) {
+		shards = kmalloc(sizeof(*shards) * nworkers, M_HAMMER2,
+				 M_WAITOK | M_ZERO);
+		for (i = 0; i < nworkers; ++i) {
+			shard = &shards[i];
+			shard->work = &work;
+			info = &shard->info;
+			info->hmp = cbinfo->hmp;
+			info->sbase = cbinfo->sbase;
+			info->sstop = cbinfo->sstop;
+			info->mtid = cbinfo->mtid;
+			info->bulkfree_ticks = ticks;
+			TAILQ_INIT(&info->list);
+			info->bmap = kmalloc(size, M_HAMMER2, M_WAITOK);
+			cbinfo_bmap_init(info, size);
+			info->dedup = kmalloc(sizeof(*info->dedup) *
+					      HAMMER2_DEDUP_HEUR_SIZE,
+					      M_HAMMER2, M_WAITOK | M_ZERO);
+			hammer2_thr_create(&shard->thr, NULL, cbinfo->hmp,
+					   "h2bfs", 0, i,
+					   hammer2_bulkfree_worker);
+		}
+		for (i = 0; i < nworkers; ++i) {
+			shard = &shards[i];
+			info = &shard->info;
+			hammer2_thr_delete(&shard->thr);
+			error |= shard->error;
+			cbinfo_bmap_merge(cbinfo, info, size);
+			kfree(info->bmap, M_HAMMER2);
+			kfree(info->dedup, M_HAMMER2);
+		}
+		kfree(shards, M_HAMMER2);
+	}
+
+	/*
+	 * Drop whatever is left after an abort.
+	 */
+	while ((save = TAILQ_FIRST(&work.list)) != NULL) {
+		TAILQ_REMOVE(&work.list, save, entry);
+		hammer2_chain_drop(save->chain);
+		kfree(save, M_HAMMER2);
+	}
+
+	return error;
+}
+
 static int
 h2_bulkfree_callback(hammer2_bulkfree_info_t *cbinfo, hammer2_blockref_t *bref)
 {
@@ -1521,6 +1521,18 @@ hammer2_chain_modify(hammer2_chain_t *chain, hammer2_tid_t mtid,
 			 * Sector overwrite allowed.
 			 */
 			newmod = 0;
+		} else if ((chain->flags & HAMMER2_CHAIN_BULKLOAD) &&
+			   chain->pmp &&
+			   chain->bref.modify_tid >
+			    chain->pmp->iroot->meta.pfs_lsnap_tid) {
+			/*
+			 * makefs indirect block held by a bulk-load.  The
+			 * block was allocated by this populate run and only
+			 * its own syncs have written it, overwrite it in
+			 * place instead of leaving a copy behind for every
+			 * sync.
+			 */
+			newmod = 0;
 		} else if ((hmp->hflags & HMNT2_EMERG) &&
 			   chain->pmp &&
 			   chain->bref.modify_tid >
@@ -4062,6 +4074,294 @@ next_key_spinlocked:
 	return(parent);
 }
 
+/*
+ * Bulk-load support.
+ *
+ * When the complete set of keys which will be inserted under an empty
+ * parent is known in advance (makefs knows the directory hashes of all
+ * entries of a directory, the logical offsets of a file and the range
+ * of inode numbers it is going to allocate), the indirect block topology
+ * can be built bottom-up in one go instead of letting
+ * hammer2_chain_create_indirect() split and re-key the block tables one
+ * insertion at a time.
+ *
+ * The keys are partitioned into power-of-2 aligned key ranges, using the
+ * smallest radix which fits each range into a leaf at the requested fill
+ * factor.  Leaf indirect blocks are sized for their entries, up to the
+ * HAMMER2_IND_BYTES_NOM used by hammer2_chain_create_indirect().  When
+ * there are more leaves than slots in the parent, intermediate indirect
+ * blocks of that same size are created at the widest radix the parent
+ * can hold and the key set is partitioned again below them.
+ *
+ * Only the indirect blocks are created, the elements themselves are later
+ * inserted normally and hammer2_chain_lookup() seeks to the right leaf.
+ * Keys outside the loaded set are handled by the normal code as well.
+ *
+ * With HAMMER2_BULKLOAD_HOLD the indirect blocks are referenced and
+ * flagged BULKLOAD until hammer2_chain_bulkload_release(), preventing the
+ * flusher from deleting or collapsing blocks which are not filled yet when
+ * the PFS is synced in the middle of the load.  Held blocks are also
+ * modified in place rather than copied by every sync.
+ */
+static
+int
+hammer2_chain_bulkload_groups(const hammer2_key_t *keys, int nkeys,
+			      hammer2_key_t key, int radix, int *maxp)
+{
+	hammer2_key_t cur;
+	hammer2_key_t prev;
+	int groups;
+	int count;
+	int i;
+
+	groups = 0;
+	count = 0;
+	*maxp = 0;
+	prev = 0;
+	for (i = 0; i < nkeys; ++i) {
+		cur = (keys[i] - key) >> radix;
+		if (i == 0 || cur != prev) {
+			++groups;
+			count = 0;
+			prev = cur;
+		}
+		if (++count > *maxp)
+			*maxp = count;
+	}
+	return (groups);
+}
+
+static
+int
+hammer2_chain_bulkload_ichain(hammer2_chain_t *parent, hammer2_key_t key,
+			      int keybits, int nslots, int flags,
+			      hammer2_tid_t mtid, hammer2_chain_t **ichainp)
+{
+	hammer2_pfs_t *pmp = parent->pmp;
+	hammer2_blockref_t dummy;
+	hammer2_chain_t *ichain;
+	int count;
+	int error;
+
+	bzero(&dummy, sizeof(dummy));
+	dummy.type = HAMMER2_BREF_TYPE_INDIRECT;
+	dummy.key = key;
+	dummy.keybits = keybits;
+	dummy.data_off = hammer2_getradix(nslots * sizeof(hammer2_blockref_t));
+	dummy.methods =
+		HAMMER2_ENC_CHECK(HAMMER2_DEC_CHECK(parent->bref.methods)) |
+		HAMMER2_ENC_COMP(HAMMER2_COMP_NONE);
+
+	ichain = hammer2_chain_alloc(parent->hmp, pmp, &dummy);
+	atomic_set_int(&ichain->flags, HAMMER2_CHAIN_INITIAL);
+	hammer2_chain_lock(ichain, HAMMER2_RESOLVE_MAYBE);
+	error = hammer2_chain_modify(ichain, mtid, 0, 0);
+	if (error) {
+		hammer2_chain_unlock(ichain);
+		hammer2_chain_drop(ichain);
+		return (error);
+	}
+	hammer2_chain_countbrefs(ichain, NULL, 0);
+
+	hammer2_chain_base_and_count(parent, &count);
+	KKASSERT(parent->core.live_count < count);
+	hammer2_chain_insert(parent, ichain,
+			     HAMMER2_CHAIN_INSERT_SPIN |
+			     HAMMER2_CHAIN_INSERT_LIVE,
+			     0);
+	hammer2_chain_setflush(ichain);
+
+	if (flags & HAMMER2_BULKLOAD_HOLD) {
+		atomic_set_int(&ichain->flags, HAMMER2_CHAIN_BULKLOAD);
+		if (pmp->bulk_count == pmp->bulk_alloc) {
+			pmp->bulk_alloc = pmp->bulk_alloc ?
+					  pmp->bulk_alloc * 2 : 64;
+			pmp->bulk_chains = krealloc(pmp->bulk_chains,
+					pmp->bulk_alloc *
+					sizeof(*pmp->bulk_chains),
+					M_HAMMER2, M_WAITOK);
+		}
+		hammer2_chain_ref(ichain);
+		pmp->bulk_chains[pmp->bulk_count++] = ichain;
+	}
+	*ichainp = ichain;
+
+	return (0);
+}
+
+/*
+ * Build the indirect blocks for (keys), which all lie within the
+ * [key, key + 2^keybits) range, under (parent) which has (nslots)
+ * free block table slots.
+ */
+static
+int
+hammer2_chain_bulkload_node(hammer2_chain_t *parent,
+			    const hammer2_key_t *keys, int nkeys,
+			    hammer2_key_t key, int keybits, int nslots,
+			    int cap, int flags, hammer2_tid_t mtid)
+{
+	hammer2_chain_t *ichain;
+	hammer2_key_t gkey;
+	int groups;
+	int leaf;
+	int live;
+	int fit;
+	int max;
+	int n;
+	int i;
+	int j;
+	int s;
+	int error;
+
+	/*
+	 * Find the radix split.  groups is monotonic in s and max is
+	 * anti-monotonic, stop at the first split that fits leaves or
+	 * fall back to the widest split the parent can hold.
+	 */
+	fit = 0;
+	leaf = 0;
+	for (s = 1; s <= keybits; ++s) {
+		groups = hammer2_chain_bulkload_groups(keys, nkeys, key,
+						       keybits - s, &max);
+		if (groups > nslots)
+			break;
+		fit = s;
+		if (max <= cap) {
+			leaf = 1;
+			break;
+		}
+	}
+	KKASSERT(fit > 0);
+	s = fit;
+
+	/*
+	 * live tracks the parent's block table entries, one per group to
+	 * begin with.  Groups whose leaf the flusher would collapse back
+	 * into the parent (see hammer2_chain_indirect_maintenance()) are
+	 * not built at all, their keys go into the parent.
+	 */
+	live = hammer2_chain_bulkload_groups(keys, nkeys, key, keybits - s,
+					     &max);
+	error = 0;
+	for (i = 0; i < nkeys && error == 0; i = j) {
+		gkey = key + (((keys[i] - key) >> (keybits - s)) <<
+			      (keybits - s));
+		for (j = i + 1; j < nkeys; ++j) {
+			if (((keys[j] - key) >> (keybits - s)) !=
+			    ((keys[i] - key) >> (keybits - s))) {
+				break;
+			}
+		}
+		n = j - i;
+
+		/*
+		 * A lone key goes straight into the parent.
+		 */
+		if (n == 1)
+			continue;
+
+		if (leaf || n <= HAMMER2_IND_COUNT_NOM) {
+			/*
+			 * Leaf, sized to hold its entries at the fill
+			 * factor.  A group which does not fit a leaf at
+			 * the fill factor but fits a full nominal block
+			 * gets one, rather than an intermediate block
+			 * over leaves the flusher would collapse.
+			 */
+			max = HAMMER2_IND_BYTES_MIN /
+			      sizeof(hammer2_blockref_t);
+			while (max < n * HAMMER2_IND_COUNT_NOM / cap &&
+			       max < HAMMER2_IND_COUNT_NOM) {
+				max <<= 1;
+			}
+			if (n <= max * 3 / 4 && live + n - 1 <= nslots) {
+				live += n - 1;
+				continue;
+			}
+			error = hammer2_chain_bulkload_ichain(parent, gkey,
+						keybits - s, max, flags,
+						mtid, &ichain);
+		} else {
+			error = hammer2_chain_bulkload_ichain(parent, gkey,
+						keybits - s,
+						HAMMER2_IND_COUNT_NOM, flags,
+						mtid, &ichain);
+			if (error == 0) {
+				error = hammer2_chain_bulkload_node(ichain,
+						keys + i, n, gkey, keybits - s,
+						HAMMER2_IND_COUNT_NOM, cap,
+						flags, mtid);
+			}
+		}
+		if (error == 0) {
+			hammer2_chain_unlock(ichain);
+			hammer2_chain_drop(ichain);
+		}
+	}
+	return (error);
+}
+
+/*
+ * Bulk-load the indirect block topology under (parent) for the sorted,
+ * unique (keys).  (fill) is the leaf fill factor in percent.  The parent
+ * must be locked and must not have any children, otherwise nothing is
+ * done.  A key set which fits in the parent needs no indirect blocks.
+ *
+ * NOTE: returns HAMMER_ERROR_* flags
+ */
+int
+hammer2_chain_bulkload(hammer2_chain_t *parent, const hammer2_key_t *keys,
+		       int nkeys, int fill, int flags, hammer2_tid_t mtid)
+{
+	hammer2_blockref_t *base;
+	int count;
+	int cap;
+
+	KKASSERT(hammer2_mtx_owned(&parent->lock));
+	KKASSERT(fill > 0 && fill <= 100);
+
+	if (parent->bref.type == HAMMER2_BREF_TYPE_INODE &&
+	    (parent->data->ipdata.meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA))
+		return (0);
+
+	base = hammer2_chain_base_and_count(parent, &count);
+	if ((parent->flags & HAMMER2_CHAIN_COUNTEDBREFS) == 0)
+		hammer2_chain_countbrefs(parent, base, count);
+	if (parent->core.live_count || nkeys <= count)
+		return (0);
+
+	cap = HAMMER2_IND_COUNT_NOM * fill / 100;
+	if (cap == 0)
+		cap = 1;
+
+	return (hammer2_chain_bulkload_node(parent, keys, nkeys, 0,
+					    64, count, cap, flags, mtid));
+}
+
+/*
+ * Release the indirect blocks held by a HAMMER2_BULKLOAD_HOLD bulk-load,
+ * the flusher maintains them normally again.  makefs releases them once
+ * the PFS is synced for unmount.
+ */
+void
+hammer2_chain_bulkload_release(hammer2_pfs_t *pmp)
+{
+	hammer2_chain_t *chain;
+	int i;
+
+	for (i = 0; i < pmp->bulk_count; ++i) {
+		chain = pmp->bulk_chains[i];
+		atomic_clear_int(&chain->flags, HAMMER2_CHAIN_BULKLOAD);
+		hammer2_chain_drop(chain);
+	}
+	if (pmp->bulk_chains)
+		kfree(pmp->bulk_chains, M_HAMMER2);
+	pmp->bulk_chains = NULL;
+	pmp->bulk_count = 0;
+	pmp->bulk_alloc = 0;
+}
+
 /*
  * Do maintenance on an indirect chain.  Both parent and chain are locked.
  *
@@ -4095,6 +4395,12 @@ hammer2_chain_indirect_maintenance(hammer2_chain_t *parent,
 		hammer2_chain_countbrefs(chain, base, count);
 	}
 
+	/*
+	 * Indirect blocks held by a bulk-load are still being filled.
+	 */
+	if (chain->flags & HAMMER2_CHAIN_BULKLOAD)
+		return 0;
+
 	/*
 	 * If the indirect block is empty we can delete it.
 	 * (ignore deletion error)
@@ -5492,24 +5798,8 @@ hammer2_chain_setcheck(hammer2_chain_t *chain, void *bdata)
 			XXH64(bdata, chain->bytes, XXH_HAMMER2_SEED);
 		break;
 	case HAMMER2_CHECK_SHA192:
-		assert(0); /* XXX unsupported */
-		/*
-		{
-			SHA256_CTX hash_ctx;
-			union {
-				uint8_t digest[SHA256_DIGEST_LENGTH];
-				uint64_t digest64[SHA256_DIGEST_LENGTH/8];
-			} u;
-
-			SHA256_Init(&hash_ctx);
-			SHA256_Update(&hash_ctx, bdata, chain->bytes);
-			SHA256_Final(u.digest, &hash_ctx);
-			u.digest64[2] ^= u.digest64[3];
-			bcopy(u.digest,
-			      chain->bref.check.sha192.data,
-			      sizeof(chain->bref.check.sha192.data));
-		}
-		*/
+		hammer2_cksum_sha192(bdata, chain->bytes,
+				     chain->bref.check.sha192.data);
 		break;
 	case HAMMER2_CHECK_FREEMAP:
 		chain->bref.check.freemap.icrc32 =
@@ -5632,22 +5922,13 @@ hammer2_chain_testcheck(hammer2_chain_t *chain, void *bdata)
 		hammer2_process_xxhash64 += chain->bytes;
 		break;
 	case HAMMER2_CHECK_SHA192:
-		assert(0); /* XXX unsupported */
-		/*
 		{
-			SHA256_CTX hash_ctx;
-			union {
-				uint8_t digest[SHA256_DIGEST_LENGTH];
-				uint64_t digest64[SHA256_DIGEST_LENGTH/8];
-			} u;
-
-			SHA256_Init(&hash_ctx);
-			SHA256_Update(&hash_ctx, bdata, chain->bytes);
-			SHA256_Final(u.digest, &hash_ctx);
-			u.digest64[2] ^= u.digest64[3];
-			if (bcmp(u.digest,
+			uint8_t check[sizeof(chain->bref.check.sha192.data)];
+
+			hammer2_cksum_sha192(bdata, chain->bytes, check);
+			if (bcmp(check,
 				 chain->bref.check.sha192.data,
-			         sizeof(chain->bref.check.sha192.data)) == 0) {
+				 sizeof(chain->bref.check.sha192.data)) == 0) {
 				r = 1;
 			} else {
 				r = 0;
@@ -5659,7 +5940,6 @@ hammer2_chain_testcheck(hammer2_chain_t *chain, void *bdata)
 					chain->bref.methods);
 			}
 		}
-		*/
 		break;
 	case HAMMER2_CHECK_FREEMAP:
 		r = (chain->bref.check.freemap.icrc32 ==
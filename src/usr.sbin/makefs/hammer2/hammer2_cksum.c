@@ -0,0 +1,597 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (c) 2022 Tomohiro Kusumi <tkusumi@netbsd.org>
+ * Copyright (c) 2011-2022 The DragonFly Project.  All rights reserved.
+ *
+ * This code is derived from software contributed to The DragonFly Project
+ * by Matthew Dillon <dillon@dragonflybsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Block check code engine.
+ *
+ * CRC32C (iscsi32) and SHA-256 (sha192) have hardware implementations on
+ * x86-64 which are selected at runtime from cpuid, the portable code is
+ * used everywhere else.  XXH64 has no faster exact implementation, its
+ * four 64-bit multiply chains are already what the scalar code runs in
+ * parallel, so it is only here for the benchmark.
+ */
+#include "hammer2.h"
+
+#include <time.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAMMER2_CKSUM_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/* sys/libkern/icrc32.c */
+uint32_t calculate_crc32c(uint32_t crc32c, const unsigned char *buffer,
+			unsigned int length);
+
+typedef uint32_t (*hammer2_crc32c_func_t)(uint32_t, const void *, size_t);
+typedef void (*hammer2_sha256_func_t)(uint32_t *, const uint8_t *, size_t);
+
+static uint32_t hammer2_crc32c_sw(uint32_t crc, const void *buf, size_t size);
+static void hammer2_sha256_sw(uint32_t *state, const uint8_t *data,
+			size_t nblocks);
+static uint32_t hammer2_crc32c_resolve(uint32_t crc, const void *buf,
+			size_t size);
+static void hammer2_sha256_resolve(uint32_t *state, const uint8_t *data,
+			size_t nblocks);
+
+static hammer2_crc32c_func_t hammer2_crc32c_func = hammer2_crc32c_resolve;
+static hammer2_sha256_func_t hammer2_sha256_func = hammer2_sha256_resolve;
+static const char *hammer2_crc32c_impl = "sw";
+static const char *hammer2_sha256_impl = "sw";
+
+static const uint32_t hammer2_sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/*
+ * CRC32C (Castagnoli), raw register in and out like calculate_crc32c().
+ */
+static uint32_t
+hammer2_crc32c_sw(uint32_t crc, const void *buf, size_t size)
+{
+	const unsigned char *p = buf;
+	unsigned int n;
+
+	while (size) {
+		n = (size > 0x40000000) ? 0x40000000 : (unsigned int)size;
+		crc = calculate_crc32c(crc, p, n);
+		p += n;
+		size -= n;
+	}
+	return (crc);
+}
+
+static __inline uint32_t
+hammer2_be32dec(const uint8_t *p)
+{
+	return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | p[3]);
+}
+
+static __inline void
+hammer2_be32enc(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+#define ROTR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+/*
+ * SHA-256 block function, FIPS 180-4.
+ */
+static void
+hammer2_sha256_sw(uint32_t *state, const uint8_t *data, size_t nblocks)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+	uint32_t s0, s1, t1, t2;
+	int i;
+
+	while (nblocks--) {
+		for (i = 0; i < 16; ++i)
+			w[i] = hammer2_be32dec(data + i * 4);
+		for (i = 16; i < 64; ++i) {
+			s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^
+			     (w[i - 15] >> 3);
+			s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^
+			     (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		f = state[5];
+		g = state[6];
+		h = state[7];
+		for (i = 0; i < 64; ++i) {
+			s1 = ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25);
+			t1 = h + s1 + ((e & f) ^ (~e & g)) +
+			     hammer2_sha256_k[i] + w[i];
+			s0 = ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22);
+			t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+		data += 64;
+	}
+}
+
+#ifdef HAMMER2_CKSUM_X86
+/*
+ * Three crc32 instruction streams are run in parallel to cover the
+ * instruction latency, and combined by shifting the preceding CRC over
+ * the following stream's length with a carry-less multiply.
+ */
+#define CRC32C_LONG	8192
+#define CRC32C_SHORT	256
+#define CRC32C_POLY	0x82f63b78U	/* bit-reflected */
+
+static uint32_t hammer2_crc32c_long_k;
+static uint32_t hammer2_crc32c_short_k;
+
+/*
+ * Return x^(8 * n - 33) mod P, the constant to shift a CRC over n bytes.
+ * clmul drops one power of x and the final crc32 adds 32.
+ */
+static uint32_t
+hammer2_crc32c_shift_k(size_t n)
+{
+	uint32_t v = 0x80000000U;	/* x^0 */
+	size_t i;
+
+	for (i = 0; i < 8 * n - 33; ++i)
+		v = (v >> 1) ^ ((v & 1) ? CRC32C_POLY : 0);
+	return (v);
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static __inline uint32_t
+hammer2_crc32c_shift(uint32_t k, uint64_t crc)
+{
+	__m128i t;
+
+	t = _mm_clmulepi64_si128(_mm_cvtsi64_si128((int64_t)crc),
+				 _mm_cvtsi32_si128((int)k), 0);
+	return (_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(t)));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t
+hammer2_crc32c_hw(uint32_t crc, const void *buf, size_t size)
+{
+	const unsigned char *p = buf;
+	const unsigned char *end;
+	uint64_t c0, c1, c2;
+	uint64_t v0, v1, v2;
+
+	while (size && ((uintptr_t)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		--size;
+	}
+	c0 = crc;
+
+	while (size >= 3 * CRC32C_LONG) {
+		c1 = c2 = 0;
+		end = p + CRC32C_LONG;
+		do {
+			memcpy(&v0, p, 8);
+			memcpy(&v1, p + CRC32C_LONG, 8);
+			memcpy(&v2, p + 2 * CRC32C_LONG, 8);
+			c0 = _mm_crc32_u64(c0, v0);
+			c1 = _mm_crc32_u64(c1, v1);
+			c2 = _mm_crc32_u64(c2, v2);
+			p += 8;
+		} while (p < end);
+		c0 = hammer2_crc32c_shift(hammer2_crc32c_long_k, c0) ^ c1;
+		c0 = hammer2_crc32c_shift(hammer2_crc32c_long_k, c0) ^ c2;
+		p += 2 * CRC32C_LONG;
+		size -= 3 * CRC32C_LONG;
+	}
+
+	while (size >= 3 * CRC32C_SHORT) {
+		c1 = c2 = 0;
+		end = p + CRC32C_SHORT;
+		do {
+			memcpy(&v0, p, 8);
+			memcpy(&v1, p + CRC32C_SHORT, 8);
+			memcpy(&v2, p + 2 * CRC32C_SHORT, 8);
+			c0 = _mm_crc32_u64(c0, v0);
+			c1 = _mm_crc32_u64(c1, v1);
+			c2 = _mm_crc32_u64(c2, v2);
+			p += 8;
+		} while (p < end);
+		c0 = hammer2_crc32c_shift(hammer2_crc32c_short_k, c0) ^ c1;
+		c0 = hammer2_crc32c_shift(hammer2_crc32c_short_k, c0) ^ c2;
+		p += 2 * CRC32C_SHORT;
+		size -= 3 * CRC32C_SHORT;
+	}
+
+	while (size >= 8) {
+		memcpy(&v0, p, 8);
+		c0 = _mm_crc32_u64(c0, v0);
+		p += 8;
+		size -= 8;
+	}
+	crc = (uint32_t)c0;
+	while (size) {
+		crc = _mm_crc32_u8(crc, *p++);
+		--size;
+	}
+	return (crc);
+}
+
+/*
+ * SHA-256 block function using the SHA extensions, the state is kept
+ * as ABEF/CDGH as sha256rnds2 wants it.
+ */
+__attribute__((target("sha,sse4.1")))
+static void
+hammer2_sha256_shani(uint32_t *state, const uint8_t *data, size_t nblocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					    0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh;
+	__m128i msg, tmp;
+	__m128i w[4];
+	int i;
+
+	tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xb1);		/* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1b);	/* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);	/* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);	/* CDGH */
+
+	while (nblocks--) {
+		abef = state0;
+		cdgh = state1;
+		for (i = 0; i < 16; ++i) {
+			if (i < 4) {
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+				    (const __m128i *)(data + i * 16)), mask);
+			} else {
+				tmp = _mm_alignr_epi8(w[(i - 1) & 3],
+						      w[(i - 2) & 3], 4);
+				tmp = _mm_add_epi32(_mm_sha256msg1_epu32(
+				    w[i & 3], w[(i - 3) & 3]), tmp);
+				w[i & 3] = _mm_sha256msg2_epu32(tmp,
+				    w[(i - 1) & 3]);
+			}
+			msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128(
+			    (const __m128i *)&hammer2_sha256_k[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0e);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);		/* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xb1);	/* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0);	/* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);	/* HGFE */
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+#endif /* HAMMER2_CKSUM_X86 */
+
+/*
+ * Pick the implementations, may run more than once if threads race the
+ * first call but always picks the same ones.
+ */
+static void
+hammer2_cksum_init(void)
+{
+#ifdef HAMMER2_CKSUM_X86
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int ecx1 = 0;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		ecx1 = ecx;
+	if ((ecx1 & bit_SSE4_2) && (ecx1 & bit_PCLMUL)) {
+		hammer2_crc32c_long_k = hammer2_crc32c_shift_k(CRC32C_LONG);
+		hammer2_crc32c_short_k = hammer2_crc32c_shift_k(CRC32C_SHORT);
+		hammer2_crc32c_impl = "sse4.2";
+		hammer2_crc32c_func = hammer2_crc32c_hw;
+	} else {
+		hammer2_crc32c_func = hammer2_crc32c_sw;
+	}
+	if ((ecx1 & bit_SSE4_1) && (ecx1 & bit_SSSE3) &&
+	    __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+	    (ebx & bit_SHA)) {
+		hammer2_sha256_impl = "sha-ni";
+		hammer2_sha256_func = hammer2_sha256_shani;
+	} else {
+		hammer2_sha256_func = hammer2_sha256_sw;
+	}
+#else
+	hammer2_crc32c_func = hammer2_crc32c_sw;
+	hammer2_sha256_func = hammer2_sha256_sw;
+#endif
+}
+
+static uint32_t
+hammer2_crc32c_resolve(uint32_t crc, const void *buf, size_t size)
+{
+	hammer2_cksum_init();
+	return (hammer2_crc32c_func(crc, buf, size));
+}
+
+static void
+hammer2_sha256_resolve(uint32_t *state, const uint8_t *data, size_t nblocks)
+{
+	hammer2_cksum_init();
+	hammer2_sha256_func(state, data, nblocks);
+}
+
+uint32_t
+hammer2_cksum_icrc32(const void *buf, size_t size)
+{
+	return (~hammer2_crc32c_func(~0U, buf, size));
+}
+
+uint32_t
+hammer2_cksum_icrc32c(const void *buf, size_t size, uint32_t crc)
+{
+	return (~hammer2_crc32c_func(~crc, buf, size));
+}
+
+static void
+hammer2_sha256_common(hammer2_sha256_func_t func, const void *buf,
+		      size_t size, uint8_t *digest)
+{
+	uint32_t state[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	uint8_t tail[128];
+	size_t nblocks;
+	size_t resid;
+	int i;
+
+	nblocks = size / 64;
+	resid = size % 64;
+	func(state, buf, nblocks);
+
+	bzero(tail, sizeof(tail));
+	bcopy((const uint8_t *)buf + nblocks * 64, tail, resid);
+	tail[resid] = 0x80;
+	nblocks = (resid < 56) ? 1 : 2;
+	hammer2_be32enc(tail + nblocks * 64 - 8, (uint32_t)(size >> 29));
+	hammer2_be32enc(tail + nblocks * 64 - 4, (uint32_t)(size << 3));
+	func(state, tail, nblocks);
+
+	for (i = 0; i < 8; ++i)
+		hammer2_be32enc(digest + i * 4, state[i]);
+}
+
+void
+hammer2_cksum_sha256(const void *buf, size_t size, uint8_t *digest)
+{
+	hammer2_sha256_common(hammer2_sha256_func, buf, size, digest);
+}
+
+/*
+ * HAMMER2_CHECK_SHA192, SHA-256 with the last 64 bits folded into the
+ * third 64-bit word.
+ */
+void
+hammer2_cksum_sha192(const void *buf, size_t size, void *check)
+{
+	union {
+		uint8_t digest[32];
+		uint64_t digest64[4];
+	} u;
+
+	hammer2_cksum_sha256(buf, size, u.digest);
+	u.digest64[2] ^= u.digest64[3];
+	bcopy(u.digest, check, 24);
+}
+
+/*
+ * Microbenchmark, throughput of every implementation for each block size.
+ * Implementations of the same algorithm are cross-checked on the way.
+ */
+#define HAMMER2_CKSUM_BENCH_BYTES	(4 * 1024 * 1024)
+#define HAMMER2_CKSUM_BENCH_NSEC	200000000LL
+
+typedef struct {
+	const char	*algo;
+	const char	*impl;
+	int		type;
+	void		*func;
+} hammer2_cksum_bench_t;
+
+static uint64_t
+hammer2_cksum_bench_one(const hammer2_cksum_bench_t *b, const char *buf,
+			int size)
+{
+	uint8_t digest[32];
+	uint64_t r = 0;
+
+	switch (b->type) {
+	case HAMMER2_CHECK_ISCSI32:
+		r = ((hammer2_crc32c_func_t)b->func)(~0U, buf, size);
+		break;
+	case HAMMER2_CHECK_XXHASH64:
+		r = XXH64(buf, size, XXH_HAMMER2_SEED);
+		break;
+	case HAMMER2_CHECK_SHA192:
+		hammer2_sha256_common((hammer2_sha256_func_t)b->func,
+				      buf, size, digest);
+		bcopy(digest, &r, sizeof(r));
+		break;
+	}
+	return (r);
+}
+
+static int64_t
+hammer2_cksum_bench_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+void
+hammer2_cksum_bench(const int *sizes, int nsizes)
+{
+	hammer2_cksum_bench_t benches[5];
+	hammer2_cksum_bench_t *b;
+	uint64_t ref, r;
+	int64_t start, elapsed, bytes;
+	char *buf;
+	size_t off;
+	int nbenches;
+	int i, j, n, len;
+
+	hammer2_cksum_init();
+
+	nbenches = 0;
+	b = &benches[nbenches++];
+	b->algo = "crc32c";
+	b->impl = "sw";
+	b->type = HAMMER2_CHECK_ISCSI32;
+	b->func = hammer2_crc32c_sw;
+	if (hammer2_crc32c_func != hammer2_crc32c_sw) {
+		b = &benches[nbenches++];
+		b->algo = "crc32c";
+		b->impl = hammer2_crc32c_impl;
+		b->type = HAMMER2_CHECK_ISCSI32;
+		b->func = hammer2_crc32c_func;
+	}
+	b = &benches[nbenches++];
+	b->algo = "xxhash64";
+	b->impl = "sw";
+	b->type = HAMMER2_CHECK_XXHASH64;
+	b->func = NULL;
+	b = &benches[nbenches++];
+	b->algo = "sha256";
+	b->impl = "sw";
+	b->type = HAMMER2_CHECK_SHA192;
+	b->func = hammer2_sha256_sw;
+	if (hammer2_sha256_func != hammer2_sha256_sw) {
+		b = &benches[nbenches++];
+		b->algo = "sha256";
+		b->impl = hammer2_sha256_impl;
+		b->type = HAMMER2_CHECK_SHA192;
+		b->func = hammer2_sha256_func;
+	}
+
+	buf = malloc(HAMMER2_CKSUM_BENCH_BYTES);
+	if (buf == NULL)
+		err(1, "malloc");
+	for (off = 0; off < HAMMER2_CKSUM_BENCH_BYTES; off += sizeof(long))
+		*(long *)(buf + off) = random();
+
+	printf("%-10s %-8s %8s %12s\n", "algorithm", "impl", "size", "MB/s");
+	for (i = 0; i < nsizes; ++i) {
+		if (sizes[i] <= 0 || sizes[i] > HAMMER2_CKSUM_BENCH_BYTES)
+			errx(1, "invalid block size %d", sizes[i]);
+		for (j = 0; j < nbenches; ++j) {
+			b = &benches[j];
+			for (off = 0; j > 0 && b->type == benches[j - 1].type &&
+			     off + sizes[i] <= HAMMER2_CKSUM_BENCH_BYTES;
+			     off += sizes[i] * 7 + 1) {
+				len = sizes[i] - (off % sizes[i]) % 64;
+				ref = hammer2_cksum_bench_one(&benches[j - 1],
+				    buf + off, len);
+				r = hammer2_cksum_bench_one(b, buf + off, len);
+				if (r != ref)
+					errx(1, "%s %s mismatch at size %d",
+					    b->algo, b->impl, len);
+			}
+
+			bytes = 0;
+			off = 0;
+			start = hammer2_cksum_bench_nsec();
+			do {
+				for (n = 0; n < 64; ++n) {
+					if (off + sizes[i] >
+					    HAMMER2_CKSUM_BENCH_BYTES)
+						off = 0;
+					hammer2_cksum_bench_one(b, buf + off,
+					    sizes[i]);
+					off += sizes[i];
+					bytes += sizes[i];
+				}
+				elapsed = hammer2_cksum_bench_nsec() - start;
+			} while (elapsed < HAMMER2_CKSUM_BENCH_NSEC);
+			printf("%-10s %-8s %8d %12.1f\n", b->algo, b->impl,
+			    sizes[i], (double)bytes * 1000 / elapsed);
+		}
+	}
+	free(buf);
+}
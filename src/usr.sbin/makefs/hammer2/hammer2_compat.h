@@ -48,9 +48,20 @@
 #include <util.h> /* ecalloc */
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "ffs/buf.h"
 
+/*
+ * ffs/buf.c is not MT-safe, route its users through hammer2_buf.c.
+ */
+#define brelse(bp)	hammer2_brelse(bp)
+#define bwrite(bp)	hammer2_bwrite(bp)
+#undef bdwrite
+#define bdwrite(bp)	bawrite(bp)
+
 #define INVARIANTS
 
 #define MALLOC_DECLARE(type)				struct __hack
@@ -64,7 +75,7 @@
 
 #define MODULE_VERSION(module, version)	struct __hack
 
-#define VOP_FSYNC(vp, waitfor, flags)	(0)
+#define VOP_FSYNC(vp, waitfor, flags)	hammer2_devq_sync(vp)
 
 #define kprintf(s, ...)		printf(s, ## __VA_ARGS__)
 #define krateprintf(r, s, ...)	kprintf(s, ## __VA_ARGS__)
@@ -77,10 +88,27 @@
 #define krealloc(addr, size, type, flags)	realloc(addr, size)
 #define kfree(addr, type)		free(addr)
 
-#define kmalloc_create_obj(typep, descr, objsize)	do{}while(0)
-#define kmalloc_destroy_obj(type)			do{}while(0)
-#define kmalloc_obj(size, type, flags)			ecalloc(1, size)
-#define kfree_obj(addr, type)				free(addr)
+/*
+ * Object allocations are backed by objcaches (hammer2_objcache.c),
+ * (type) names a struct objcache *<type>_obj as in the kernel.
+ */
+#define kmalloc_create_obj(typep, descr, objsize)	\
+	(*(typep##_obj) = objcache_create(descr, objsize))
+#define kmalloc_destroy_obj(typep)	objcache_destroy(*(typep##_obj))
+#define kmalloc_obj(size, type, flags)	objcache_get(type##_obj, flags)
+#define kfree_obj(addr, type)		objcache_put(type##_obj, addr)
+
+/* kmalloc(9) flags, only M_ZERO is honored (by objcache_get()) */
+#define M_WAITOK	0x0002
+#define M_ZERO		0x0100
+#define M_INTWAIT	0x1201
+
+struct objcache;
+
+struct objcache *objcache_create(const char *name, size_t objsize);
+void *objcache_get(struct objcache *oc, int ocflags);
+void objcache_put(struct objcache *oc, void *obj);
+void objcache_destroy(struct objcache *oc);
 
 #define kmalloc_raise_limit(typep, bytes)		do{}while(0)
 
@@ -100,11 +128,13 @@
 #define LK_SHARED	0x00000001
 #define LK_EXCLUSIVE	0x00000002
 #define LK_RELEASE	0x00000006
+#define LK_TYPE_MASK	0x0000000f
 #define LK_NOWAIT	0x00000010
 #define LK_RETRY	0x00020000
 #define LK_PCATCH	0x04000000
 
 #define MTX_EXCLUSIVE	0x80000000
+#define MTX_WANTED	0x40000000
 #define MTX_MASK	0x0FFFFFFF
 
 #define IO_APPEND	0x0002
@@ -608,16 +638,31 @@ struct uio {
 };
 
 /*
- * Since makefs(8) is a single thread program, there should never be any
- * lock contention.  Therefore, lock(9)/mutex(9)/spinlock(9) emulation always
- * succeed.  Similarly, tsleep(9) should never be called.
+ * lock(9)/mutex(9)/spinlock(9) and tsleep(9) emulation.
+ *
+ * makefs(8) runs the HAMMER2 frontend in a single thread, but XOP backends
+ * may run in worker threads (see hammer2_xop_workers), so the locks are
+ * real.  Mutexes follow the DragonFly mtx(9) semantics, exclusive locks are
+ * recursive for the owner, and a thread holding a mutex exclusively may also
+ * acquire it shared.  Blocking is done with tsleep(9)/wakeup(9), which are
+ * implemented with a hashed table of pthread condition variables.
+ *
+ * curthread is a per-thread struct thread, its address identifies the
+ * owner of an exclusive mutex.  Frontend threads other than the main one
+ * register with hammer2_thr_attach() so tsleep() knows a wakeup may come.
  */
-struct lock {
-	int reserved;
-};
+extern __thread struct thread hammer2_curthread;
+#define curthread	(&hammer2_curthread)
+
+int tsleep(const volatile void *ident, int flags, const char *wmesg, int timo);
+void tsleep_interlock(const volatile void *ident, int flags);
+void wakeup(const volatile void *ident);
+void hammer2_thr_attach(void);
+void hammer2_thr_detach(void);
 
 typedef struct {
-	unsigned int mtx_lock;
+	volatile u_int	mtx_lock;
+	struct thread	*mtx_owner;
 } mtx_t;
 
 typedef mtx_t hammer2_mtx_t;
@@ -626,137 +671,141 @@ typedef u_int mtx_state_t;
 typedef mtx_state_t hammer2_mtx_state_t;
 
 typedef struct {
-	int lock;
+	volatile u_int	lock;
 } hammer2_spin_t;
 
+struct lock {
+	hammer2_mtx_t	lk_mtx;
+};
+
 static __inline
 void
 cpu_pause(void)
 {
+#if defined(__x86_64__) || defined(__i386__)
+	__asm __volatile("pause":::"memory");
+#endif
 }
 
 static __inline
 void
 cpu_mfence(void)
 {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 }
 
 static __inline
 void
 cpu_lfence(void)
 {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
 }
 
 static __inline
 void
 cpu_sfence(void)
 {
+	__atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
 static __inline
 void
 cpu_ccfence(void)
 {
+	__asm __volatile("":::"memory");
 }
 
 static __inline
 void
-atomic_add_int(void *p, int v)
+atomic_add_int(volatile void *p, int v)
 {
-	*(unsigned int *)p +=v;
+	__atomic_fetch_add((volatile unsigned int *)p, v, __ATOMIC_SEQ_CST);
 }
 
 static __inline
 void
-atomic_add_long(void *p, long v)
+atomic_add_long(volatile void *p, long v)
 {
-	*(unsigned long *)p += v;
+	__atomic_fetch_add((volatile unsigned long *)p, v, __ATOMIC_SEQ_CST);
 }
 
 static __inline
 void
-atomic_add_64(void *p, uint64_t v)
+atomic_add_64(volatile void *p, uint64_t v)
 {
-	*(uint64_t *)p += v;
+	__atomic_fetch_add((volatile uint64_t *)p, v, __ATOMIC_SEQ_CST);
 }
 
 static __inline
 void
-atomic_set_int(void *p, int v)
+atomic_set_int(volatile void *p, int v)
 {
-	*(unsigned int *)p |= v;
+	__atomic_fetch_or((volatile unsigned int *)p, v, __ATOMIC_SEQ_CST);
 }
 
 static __inline
 void
-atomic_set_long(void *p, long v)
+atomic_set_long(volatile void *p, long v)
 {
-	*(unsigned long *)p |= v;
+	__atomic_fetch_or((volatile unsigned long *)p, v, __ATOMIC_SEQ_CST);
 }
 
 static __inline
 void
-atomic_set_64(void *p, uint64_t v)
+atomic_set_64(volatile void *p, uint64_t v)
 {
-	*(uint64_t *)p |= v;
+	__atomic_fetch_or((volatile uint64_t *)p, v, __ATOMIC_SEQ_CST);
 }
 
 static __inline
 void
-atomic_clear_int(void *p, int v)
+atomic_clear_int(volatile void *p, int v)
 {
-	*(unsigned int *)p &= ~v;
+	__atomic_fetch_and((volatile unsigned int *)p, ~v, __ATOMIC_SEQ_CST);
 }
 
 static __inline
 void
-atomic_clear_64(void *p, uint64_t v)
+atomic_clear_64(volatile void *p, uint64_t v)
 {
-	*(uint64_t *)p &= ~v;
+	__atomic_fetch_and((volatile uint64_t *)p, ~v, __ATOMIC_SEQ_CST);
 }
 
 static __inline
 int
-atomic_fetchadd_int(void *p, int v)
+atomic_fetchadd_int(volatile void *p, int v)
 {
-	int tmp = *(int *)p;
-	*(unsigned int *)p += v;
-	return (tmp);
+	return (__atomic_fetch_add((volatile int *)p, v, __ATOMIC_SEQ_CST));
+}
+
+static __inline
+long
+atomic_fetchadd_long(volatile void *p, long v)
+{
+	return (__atomic_fetch_add((volatile long *)p, v, __ATOMIC_SEQ_CST));
 }
 
 static __inline
 uint64_t
-atomic_fetchadd_64(void *p, uint64_t v)
+atomic_fetchadd_64(volatile void *p, uint64_t v)
 {
-	uint64_t tmp = *(uint64_t *)p;
-	*(uint64_t *)p += v;
-	return (tmp);
+	return (__atomic_fetch_add((volatile uint64_t *)p, v, __ATOMIC_SEQ_CST));
 }
 
 static __inline
 int
-atomic_cmpset_int(void *dst, int old, int new)
+atomic_cmpset_int(volatile void *dst, int old, int new)
 {
-	int *p = dst;
-	if (*p == old) {
-		*p = new;
-		return (1);
-	} else {
-		return (0);
-	}
+	return (__atomic_compare_exchange_n((volatile int *)dst, &old, new, 0,
+	    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
 }
 
 static __inline
 int
-atomic_cmpset_64(void *dst, uint64_t old, uint64_t new)
+atomic_cmpset_64(volatile void *dst, uint64_t old, uint64_t new)
 {
-	uint64_t *p = dst;
-	if (*p == old) {
-		*p = new;
-		return (1);
-	} else {
-		return (0);
-	}
+	return (__atomic_compare_exchange_n((volatile uint64_t *)dst, &old, new, 0,
+	    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
 }
 
 static __inline
@@ -811,7 +860,7 @@ getnewvnode(enum vtagtype tag, struct m_mount *mp, struct m_vnode **vpp,
 	vp->v_malloced = 1;
 	*vpp = vp;
 
-	vnode_count++;
+	atomic_add_64(&vnode_count, 1);
 
 	return (0);
 }
@@ -824,7 +873,7 @@ freevnode(struct m_vnode *vp)
 	assert(vp->v_malloced);
 	free(vp);
 
-	vnode_count--;
+	atomic_add_64(&vnode_count, -1);
 }
 
 static __inline
@@ -986,43 +1035,92 @@ cache_setunresolved(struct nchandle *nch)
 {
 }
 
+/*
+ * Block until the mutex changes state.  MTX_WANTED is set under the
+ * tsleep interlock, the last unlock clears it and issues the wakeup.
+ */
 static __inline
 void
-lockinit(struct lock *lkp, const char *wmesg, int timo, int flags)
+hammer2_mtx_wait(hammer2_mtx_t *mtx, u_int lock)
 {
+	tsleep_interlock(mtx, 0);
+	if (atomic_cmpset_int(&mtx->mtx_lock, lock, lock | MTX_WANTED))
+		tsleep(mtx, PINTERLOCKED, "h2mtx", 0);
 }
 
 static __inline
 int
-lockmgr(struct lock *lkp, uint32_t flags)
+hammer2_mtx_ex_try(hammer2_mtx_t *mtx)
 {
-	return (0);
+	u_int lock;
+
+	for (;;) {
+		lock = mtx->mtx_lock;
+		cpu_ccfence();
+		if ((lock & MTX_MASK) == 0) {
+			if (atomic_cmpset_int(&mtx->mtx_lock, lock,
+			    lock | MTX_EXCLUSIVE | 1)) {
+				mtx->mtx_owner = curthread;
+				return (0);
+			}
+		} else if ((lock & MTX_EXCLUSIVE) &&
+		    mtx->mtx_owner == curthread) {
+			atomic_add_int(&mtx->mtx_lock, 1);
+			return (0);
+		} else {
+			return (EAGAIN);
+		}
+	}
 }
 
 static __inline
 int
 hammer2_mtx_ex(hammer2_mtx_t *mtx)
 {
-	mtx->mtx_lock |= MTX_EXCLUSIVE;
-	mtx->mtx_lock++;
+	u_int lock;
+
+	while (hammer2_mtx_ex_try(mtx)) {
+		lock = mtx->mtx_lock;
+		cpu_ccfence();
+		if (lock & MTX_MASK)
+			hammer2_mtx_wait(mtx, lock);
+	}
 	return (0);
 }
 
 static __inline
 int
-hammer2_mtx_ex_try(hammer2_mtx_t *mtx)
+hammer2_mtx_sh_try(hammer2_mtx_t *mtx)
 {
-	mtx->mtx_lock |= MTX_EXCLUSIVE;
-	mtx->mtx_lock++;
-	return (0);
+	u_int lock;
+
+	for (;;) {
+		lock = mtx->mtx_lock;
+		cpu_ccfence();
+		if ((lock & MTX_EXCLUSIVE) == 0) {
+			if (atomic_cmpset_int(&mtx->mtx_lock, lock, lock + 1))
+				return (0);
+		} else if (mtx->mtx_owner == curthread) {
+			atomic_add_int(&mtx->mtx_lock, 1);
+			return (0);
+		} else {
+			return (EAGAIN);
+		}
+	}
 }
 
 static __inline
 int
 hammer2_mtx_sh(hammer2_mtx_t *mtx)
 {
-	mtx->mtx_lock |= MTX_EXCLUSIVE;
-	mtx->mtx_lock++;
+	u_int lock;
+
+	while (hammer2_mtx_sh_try(mtx)) {
+		lock = mtx->mtx_lock;
+		cpu_ccfence();
+		if (lock & MTX_EXCLUSIVE)
+			hammer2_mtx_wait(mtx, lock);
+	}
 	return (0);
 }
 
@@ -1030,38 +1128,73 @@ static __inline
 void
 hammer2_mtx_sh_again(hammer2_mtx_t *mtx)
 {
-	mtx->mtx_lock |= MTX_EXCLUSIVE;
-	mtx->mtx_lock++;
-}
-
-static __inline
-int
-hammer2_mtx_sh_try(hammer2_mtx_t *mtx)
-{
-	mtx->mtx_lock |= MTX_EXCLUSIVE;
-	mtx->mtx_lock++;
-	return (0);
+	KKASSERT(mtx->mtx_lock & MTX_MASK);
+	atomic_add_int(&mtx->mtx_lock, 1);
 }
 
 static __inline
 void
 hammer2_mtx_unlock(hammer2_mtx_t *mtx)
 {
-	mtx->mtx_lock &= ~MTX_EXCLUSIVE;
-	mtx->mtx_lock--;
+	u_int lock;
+
+	for (;;) {
+		lock = mtx->mtx_lock;
+		cpu_ccfence();
+		KKASSERT(lock & MTX_MASK);
+		if ((lock & MTX_MASK) == 1) {
+			if (lock & MTX_EXCLUSIVE)
+				mtx->mtx_owner = NULL;
+			if (atomic_cmpset_int(&mtx->mtx_lock, lock, 0)) {
+				if (lock & MTX_WANTED)
+					wakeup(mtx);
+				return;
+			}
+			if (lock & MTX_EXCLUSIVE)
+				mtx->mtx_owner = curthread;
+		} else {
+			if (atomic_cmpset_int(&mtx->mtx_lock, lock, lock - 1))
+				return;
+		}
+	}
 }
 
 static __inline
 int
 hammer2_mtx_upgrade_try(hammer2_mtx_t *mtx)
 {
-	return (0);
+	u_int lock;
+
+	lock = mtx->mtx_lock;
+	cpu_ccfence();
+	if (lock & MTX_EXCLUSIVE)
+		return (mtx->mtx_owner == curthread ? 0 : EDEADLK);
+	if ((lock & MTX_MASK) == 1 &&
+	    atomic_cmpset_int(&mtx->mtx_lock, lock, lock | MTX_EXCLUSIVE)) {
+		mtx->mtx_owner = curthread;
+		return (0);
+	}
+	return (EDEADLK);
 }
 
 static __inline
 int
 hammer2_mtx_downgrade(hammer2_mtx_t *mtx)
 {
+	u_int lock;
+
+	KKASSERT((mtx->mtx_lock & MTX_EXCLUSIVE) &&
+	    mtx->mtx_owner == curthread);
+	mtx->mtx_owner = NULL;
+	for (;;) {
+		lock = mtx->mtx_lock;
+		cpu_ccfence();
+		if (atomic_cmpset_int(&mtx->mtx_lock, lock,
+		    lock & ~(MTX_EXCLUSIVE | MTX_WANTED)))
+			break;
+	}
+	if (lock & MTX_WANTED)
+		wakeup(mtx);
 	return (0);
 }
 
@@ -1069,7 +1202,8 @@ static __inline
 int
 hammer2_mtx_owned(hammer2_mtx_t *mtx)
 {
-	return (1); /* XXX for asserts */
+	return ((mtx->mtx_lock & MTX_EXCLUSIVE) &&
+	    mtx->mtx_owner == curthread);
 }
 
 static __inline
@@ -1077,19 +1211,29 @@ void
 hammer2_mtx_init(hammer2_mtx_t *mtx, const char *ident)
 {
 	mtx->mtx_lock = 0;
+	mtx->mtx_owner = NULL;
 }
 
 static __inline
 hammer2_mtx_state_t
 hammer2_mtx_temp_release(hammer2_mtx_t *mtx)
 {
-	return (0);
+	hammer2_mtx_state_t state;
+
+	state = mtx->mtx_lock & MTX_EXCLUSIVE;
+	hammer2_mtx_unlock(mtx);
+
+	return (state);
 }
 
 static __inline
 void
 hammer2_mtx_temp_restore(hammer2_mtx_t *mtx, hammer2_mtx_state_t state)
 {
+	if (state & MTX_EXCLUSIVE)
+		hammer2_mtx_ex(mtx);
+	else
+		hammer2_mtx_sh(mtx);
 }
 
 static __inline
@@ -1101,76 +1245,114 @@ hammer2_mtx_refs(hammer2_mtx_t *mtx)
 
 static __inline
 void
-hammer2_spin_init(hammer2_spin_t *mtx, const char *ident)
+lockinit(struct lock *lkp, const char *wmesg, int timo, int flags)
 {
-	mtx->lock = 0;
+	hammer2_mtx_init(&lkp->lk_mtx, wmesg);
 }
 
 static __inline
-void
-hammer2_spin_sh(hammer2_spin_t *mtx)
+int
+lockmgr(struct lock *lkp, uint32_t flags)
 {
-	mtx->lock++;
+	switch (flags & LK_TYPE_MASK) {
+	case LK_SHARED:
+		if (flags & LK_NOWAIT)
+			return (hammer2_mtx_sh_try(&lkp->lk_mtx) ? EBUSY : 0);
+		return (hammer2_mtx_sh(&lkp->lk_mtx));
+	case LK_EXCLUSIVE:
+		if (flags & LK_NOWAIT)
+			return (hammer2_mtx_ex_try(&lkp->lk_mtx) ? EBUSY : 0);
+		return (hammer2_mtx_ex(&lkp->lk_mtx));
+	case LK_RELEASE:
+		hammer2_mtx_unlock(&lkp->lk_mtx);
+		return (0);
+	default:
+		panic("lockmgr: unsupported flags 0x%08x", flags);
+	}
 }
 
-static __inline
-void
-hammer2_spin_ex(hammer2_spin_t *mtx)
-{
-	mtx->lock++;
-}
+/*
+ * Spinlocks are never held across a tsleep(9), spin with a yield once in
+ * a while in case the holder isn't running.
+ */
+#define HAMMER2_SPIN_EXCLUSIVE	0x80000000U
 
 static __inline
 void
-hammer2_spin_unsh(hammer2_spin_t *mtx)
+hammer2_spin_init(hammer2_spin_t *mtx, const char *ident)
 {
-	mtx->lock--;
+	mtx->lock = 0;
 }
 
 static __inline
 void
-hammer2_spin_unex(hammer2_spin_t *mtx)
+hammer2_spin_sh(hammer2_spin_t *mtx)
 {
-	mtx->lock--;
+	u_int lock;
+	int i;
+
+	for (i = 1; ; ++i) {
+		lock = mtx->lock;
+		cpu_ccfence();
+		if ((lock & HAMMER2_SPIN_EXCLUSIVE) == 0 &&
+		    atomic_cmpset_int(&mtx->lock, lock, lock + 1))
+			break;
+		if ((i & 1023) == 0)
+			sched_yield();
+		else
+			cpu_pause();
+	}
 }
 
 static __inline
 void
-lwkt_gettoken(lwkt_token_t tok)
+hammer2_spin_ex(hammer2_spin_t *mtx)
 {
+	int i;
+
+	for (i = 1; ; ++i) {
+		if (mtx->lock == 0 &&
+		    atomic_cmpset_int(&mtx->lock, 0, HAMMER2_SPIN_EXCLUSIVE))
+			break;
+		if ((i & 1023) == 0)
+			sched_yield();
+		else
+			cpu_pause();
+	}
 }
 
 static __inline
 void
-lwkt_reltoken(lwkt_token_t tok)
+hammer2_spin_unsh(hammer2_spin_t *mtx)
 {
+	KKASSERT((mtx->lock & ~HAMMER2_SPIN_EXCLUSIVE) != 0);
+	atomic_add_int(&mtx->lock, -1);
 }
 
 static __inline
 void
-lwkt_yield(void)
+hammer2_spin_unex(hammer2_spin_t *mtx)
 {
+	KKASSERT(mtx->lock == HAMMER2_SPIN_EXCLUSIVE);
+	__atomic_store_n(&mtx->lock, 0, __ATOMIC_RELEASE);
 }
 
 static __inline
-int
-tsleep(const volatile void *ident, int flags, const char *wmesg, int timo)
+void
+lwkt_gettoken(lwkt_token_t tok)
 {
-	assert(0);
 }
 
 static __inline
 void
-tsleep_interlock(const volatile void *ident, int flags)
+lwkt_reltoken(lwkt_token_t tok)
 {
-	assert(0);
 }
 
 static __inline
 void
-wakeup(const volatile void *ident)
+lwkt_yield(void)
 {
-	assert(0);
 }
 
 static __inline
@@ -1428,7 +1428,11 @@ hammer2_xop_inode_flush(hammer2_xop_t *arg, void *scratch __unused, int clindex)
 	 *
 	 * vchain and fchain do not error on-lock since their data does
 	 * not have to be re-read from media.
+	 *
+	 * Space handed out by the makefs sequential allocator is marked
+	 * in the freemap here, in bulk.
 	 */
+	hammer2_freemap_bump_sync(hmp);
 	hammer2_chain_ref(&hmp->vchain);
 	hammer2_chain_lock(&hmp->vchain, HAMMER2_RESOLVE_ALWAYS);
 	hammer2_chain_ref(&hmp->fchain);
@@ -66,6 +66,9 @@ static int hammer2_bmap_alloc(hammer2_dev_t *hmp,
 static int hammer2_freemap_iterate(hammer2_chain_t **parentp,
 			hammer2_chain_t **chainp,
 			hammer2_fiterate_t *iter);
+static int hammer2_freemap_bump_alloc(hammer2_dev_t *hmp,
+			hammer2_blockref_t *bref, int radix,
+			hammer2_tid_t mtid);
 
 /*
  * Calculate the device offset for the specified FREEMAP_NODE or FREEMAP_LEAF
@@ -229,6 +232,26 @@ hammer2_freemap_alloc(hammer2_chain_t *chain, size_t bytes)
 
 	KKASSERT(bytes >= HAMMER2_ALLOC_MIN && bytes <= HAMMER2_ALLOC_MAX);
 
+	/*
+	 * makefs populating a fresh image hands out space sequentially.
+	 * Once the sequential allocator runs out of untouched segments
+	 * the freemap is brought up to date and we fall back to the
+	 * normal allocator for the rest of the mount.
+	 */
+	if (hmp->bump_enabled) {
+		hammer2_mtx_ex(&hmp->bump_lock);
+		if (hmp->bump_enabled) {
+			error = hammer2_freemap_bump_alloc(hmp, bref, radix,
+							   mtid);
+			if (error != HAMMER2_ERROR_ENOSPC) {
+				hammer2_mtx_unlock(&hmp->bump_lock);
+				return (error);
+			}
+			hammer2_freemap_bump_stop(hmp);
+		}
+		hammer2_mtx_unlock(&hmp->bump_lock);
+	}
+
 	/*
 	 * Heuristic tracking index.  We would like one for each distinct
 	 * bref type if possible.  heur_freemap[] has room for two classes
@@ -1253,3 +1276,448 @@ done:
  *	This is done by bulkfree to finalize POSSIBLY FREE states.
  *
  */
+
+/*
+ * makefs sequential allocator.
+ *
+ * A fresh image has nothing to reuse, so instead of scanning the freemap
+ * for every allocation each bref type claims an untouched 4MB segment and
+ * hands out its space in order.  Full PBUFSIZE allocations take the next
+ * chunk of the segment, smaller ones are packed into a chunk of their own
+ * radix so they stay naturally aligned and never straddle a 16KB freemap
+ * block.
+ *
+ * The freemap leaf is only touched when a segment is claimed (to set its
+ * class) and when the chunks carved since the last update are marked
+ * allocated, which happens when a cursor moves on to a new segment and
+ * before the freemap is flushed.  Per-radix chunks are marked as a whole,
+ * the 16KB blocks past the last allocation of each are given back when
+ * the allocator is stopped, before the final syncs.  The resulting bitmap,
+ * class, avail and allocator_free are then the same the normal allocator
+ * would have produced, so bulkfree and the kernel see a regular freemap.
+ *
+ * On a volume set segments are claimed from the volumes in turn, so the
+ * writes of a populate are spread over all of them.
+ *
+ * The cursors are shared by every PFS of the device, hmp->bump_lock is
+ * held from the cursor lookup until the chunk is carved.  It may be
+ * acquired with no chain locked, and the freemap chains are locked
+ * under it.
+ */
+void
+hammer2_freemap_bump_start(hammer2_dev_t *hmp)
+{
+	hammer2_vfsvolume_t *vol;
+	hammer2_off_t beg;
+	int i;
+
+	bzero(hmp->bump, sizeof(hmp->bump));
+	beg = (hmp->voldata.allocator_beg + HAMMER2_SEGMASK64) &
+	      ~HAMMER2_SEGMASK64;
+	for (i = 0; i < hmp->nvolumes; ++i) {
+		vol = &hmp->volumes[i];
+		hmp->bump_seg[i] = (vol->offset > beg) ? vol->offset : beg;
+	}
+	hmp->bump_enabled = 1;
+}
+
+/*
+ * Lookup the level1 freemap leaf covering (key), creating and initializing
+ * it if necessary.  Returns the locked chain or NULL with *errorp set.
+ */
+static
+hammer2_chain_t *
+hammer2_freemap_bump_leaf(hammer2_chain_t **parentp, hammer2_key_t key,
+			  hammer2_tid_t mtid, int *errorp)
+{
+	hammer2_dev_t *hmp = (*parentp)->hmp;
+	hammer2_key_t key_dummy;
+	hammer2_chain_t *chain;
+
+	chain = hammer2_chain_lookup(parentp, &key_dummy,
+				     key, key + HAMMER2_FREEMAP_LEVEL1_MASK,
+				     errorp,
+				     HAMMER2_LOOKUP_ALWAYS |
+				     HAMMER2_LOOKUP_MATCHIND);
+	if (chain == NULL) {
+		*errorp = hammer2_chain_create(parentp, &chain, NULL,
+				     hmp->spmp, HAMMER2_METH_DEFAULT,
+				     key, HAMMER2_FREEMAP_LEVEL1_RADIX,
+				     HAMMER2_BREF_TYPE_FREEMAP_LEAF,
+				     HAMMER2_FREEMAP_LEVELN_PSIZE,
+				     mtid, 0, 0);
+		KKASSERT(*errorp == 0);
+		hammer2_chain_modify(chain, mtid, 0, 0);
+		bzero(&chain->data->bmdata[0], HAMMER2_FREEMAP_LEVELN_PSIZE);
+		chain->bref.check.freemap.bigmask = (uint32_t)-1;
+		chain->bref.check.freemap.avail = HAMMER2_FREEMAP_LEVEL1_SIZE;
+		hammer2_freemap_init(hmp, key, chain);
+	} else if (chain->error) {
+		kprintf("hammer2_freemap_bump: %016jx: error %s\n",
+			(intmax_t)key, hammer2_error_str(chain->error));
+		hammer2_chain_unlock(chain);
+		hammer2_chain_drop(chain);
+		chain = NULL;
+		*errorp = HAMMER2_ERROR_EIO;
+	}
+	return (chain);
+}
+
+/*
+ * Mark the chunks carved from the cursor's segment since the last update
+ * as allocated.  A 16KB block may already have been marked by a dedup
+ * recovery, only blocks transitioning from 00 are accounted for.
+ */
+static
+void
+hammer2_freemap_bump_update(hammer2_dev_t *hmp, hammer2_bump_t *bump,
+			    hammer2_tid_t mtid)
+{
+	hammer2_chain_t *parent;
+	hammer2_chain_t *chain;
+	hammer2_bmap_data_t *bmap;
+	hammer2_bitmap_t bmmask;
+	hammer2_key_t key;
+	hammer2_off_t off;
+	size_t bgsize;
+	int error;
+	int i;
+
+	if (bump->done == bump->next)
+		return;
+
+	key = H2FMBASE(bump->seg, HAMMER2_FREEMAP_LEVEL1_RADIX);
+	parent = &hmp->fchain;
+	hammer2_chain_ref(parent);
+	hammer2_chain_lock(parent, HAMMER2_RESOLVE_ALWAYS);
+	chain = hammer2_freemap_bump_leaf(&parent, key, mtid, &error);
+	if (chain == NULL)
+		goto done;
+
+	hammer2_chain_modify(chain, mtid, 0, 0);
+	bmap = &chain->data->bmdata[(bump->seg - key) >>
+				    HAMMER2_FREEMAP_LEVEL0_RADIX];
+	bgsize = 0;
+	for (off = bump->done - bump->seg; off < bump->next - bump->seg;
+	     off += HAMMER2_FREEMAP_BLOCK_SIZE) {
+		i = off / (HAMMER2_SEGSIZE / HAMMER2_BMAP_ELEMENTS);
+		bmmask = (hammer2_bitmap_t)3 <<
+			 ((off / (HAMMER2_FREEMAP_BLOCK_SIZE / 2)) & 62);
+		if ((bmap->bitmapq[i] & bmmask) == 0)
+			bgsize += HAMMER2_FREEMAP_BLOCK_SIZE;
+		bmap->bitmapq[i] |= bmmask;
+	}
+	bmap->avail -= bgsize;
+	bump->done = bump->next;
+	hammer2_chain_unlock(chain);
+	hammer2_chain_drop(chain);
+
+	if (bgsize) {
+		hammer2_voldata_lock(hmp);
+		hammer2_voldata_modify(hmp);
+		hmp->voldata.allocator_free -= bgsize;
+		hammer2_voldata_unlock(hmp);
+	}
+done:
+	hammer2_chain_unlock(parent);
+	hammer2_chain_drop(parent);
+}
+
+/*
+ * Claim the next untouched segment of volume (i) for the cursor.
+ * Segments which were allocated from before the sequential allocator
+ * was enabled, the zone reserved areas and the trailing partial segment
+ * are skipped.
+ */
+static
+int
+hammer2_freemap_bump_claim_vol(hammer2_dev_t *hmp, hammer2_bump_t *bump,
+			       int i, uint8_t type, hammer2_tid_t mtid)
+{
+	hammer2_vfsvolume_t *vol = &hmp->volumes[i];
+	hammer2_chain_t *parent;
+	hammer2_chain_t *chain;
+	hammer2_bmap_data_t *bmap;
+	hammer2_off_t seg;
+	hammer2_key_t key;
+	uint16_t class;
+	int error;
+	int n;
+
+	class = (type << 8) | HAMMER2_PBUFRADIX;
+	parent = &hmp->fchain;
+	hammer2_chain_ref(parent);
+	hammer2_chain_lock(parent, HAMMER2_RESOLVE_ALWAYS);
+	chain = NULL;
+	error = HAMMER2_ERROR_ENOSPC;
+
+	for (seg = hmp->bump_seg[i];
+	     seg + HAMMER2_SEGSIZE <= vol->offset + vol->size;
+	     seg += HAMMER2_SEGSIZE) {
+		if ((seg & HAMMER2_ZONE_MASK64) < HAMMER2_ZONE_SEG64)
+			continue;
+		key = H2FMBASE(seg, HAMMER2_FREEMAP_LEVEL1_RADIX);
+		if (chain && chain->bref.key != key) {
+			hammer2_chain_unlock(chain);
+			hammer2_chain_drop(chain);
+			chain = NULL;
+		}
+		if (chain == NULL) {
+			chain = hammer2_freemap_bump_leaf(&parent, key, mtid,
+							  &error);
+			if (chain == NULL)
+				break;
+			error = HAMMER2_ERROR_ENOSPC;
+		}
+		n = (int)((seg - key) >> HAMMER2_FREEMAP_LEVEL0_RADIX);
+		bmap = &chain->data->bmdata[n];
+		if (bmap->class || bmap->avail != HAMMER2_FREEMAP_LEVEL0_SIZE)
+			continue;
+
+		hammer2_chain_modify(chain, mtid, 0, 0);
+		chain->data->bmdata[n].class = class;
+		bump->seg = seg;
+		bump->next = seg;
+		bump->done = seg;
+		seg += HAMMER2_SEGSIZE;
+		error = 0;
+		break;
+	}
+	hmp->bump_seg[i] = seg;
+
+	if (chain) {
+		hammer2_chain_unlock(chain);
+		hammer2_chain_drop(chain);
+	}
+	hammer2_chain_unlock(parent);
+	hammer2_chain_drop(parent);
+
+	return (error);
+}
+
+/*
+ * Claim the next untouched segment for the cursor.  Each cursor goes
+ * round-robin over the volumes on its own, so the data of a large file
+ * is striped over all of them.
+ */
+static
+int
+hammer2_freemap_bump_claim(hammer2_dev_t *hmp, hammer2_bump_t *bump,
+			   uint8_t type, hammer2_tid_t mtid)
+{
+	int error = HAMMER2_ERROR_ENOSPC;
+	int i, n;
+
+	for (n = 0; n < hmp->nvolumes; ++n) {
+		i = (bump->vol + n) % hmp->nvolumes;
+		error = hammer2_freemap_bump_claim_vol(hmp, bump, i, type,
+						       mtid);
+		if (error != HAMMER2_ERROR_ENOSPC) {
+			bump->vol = (i + 1) % hmp->nvolumes;
+			break;
+		}
+	}
+
+	return (error);
+}
+
+/*
+ * Carve the next PBUFSIZE chunk for the cursor, moving on to a new
+ * segment when the current one is used up.
+ */
+static
+int
+hammer2_freemap_bump_chunk(hammer2_dev_t *hmp, hammer2_bump_t *bump,
+			   uint8_t type, hammer2_tid_t mtid, hammer2_off_t *offp)
+{
+	int error;
+
+	if (bump->seg == 0 || bump->next == bump->seg + HAMMER2_SEGSIZE) {
+		if (bump->seg)
+			hammer2_freemap_bump_update(hmp, bump, mtid);
+		error = hammer2_freemap_bump_claim(hmp, bump, type, mtid);
+		if (error)
+			return (error);
+	}
+	*offp = bump->next;
+	bump->next += HAMMER2_PBUFSIZE;
+
+	return (0);
+}
+
+static
+int
+hammer2_freemap_bump_alloc(hammer2_dev_t *hmp, hammer2_blockref_t *bref,
+			   int radix, hammer2_tid_t mtid)
+{
+	hammer2_bump_t *bump;
+	hammer2_io_t *dio;
+	hammer2_off_t off;
+	size_t bytes;
+	int error;
+	int r;
+
+	bytes = (size_t)1 << radix;
+	bump = &hmp->bump[bref->type & (HAMMER2_FREEMAP_HEUR_TYPES - 1)];
+
+	if (radix < HAMMER2_PBUFRADIX) {
+		r = radix - HAMMER2_RADIX_MIN;
+		KKASSERT(r >= 0 && r < HAMMER2_BUMP_NRADIX);
+		if (bump->off[r] == bump->end[r]) {
+			error = hammer2_freemap_bump_chunk(hmp, bump,
+							   bref->type, mtid,
+							   &off);
+			if (error)
+				return (error);
+
+			/*
+			 * The chunk was never allocated, avoid a
+			 * read-before-write when it is partially written.
+			 */
+			hammer2_io_newnz(hmp, bref->type,
+					 off | HAMMER2_PBUFRADIX,
+					 HAMMER2_PBUFSIZE, &dio);
+			hammer2_io_putblk(&dio);
+			bump->off[r] = off;
+			bump->end[r] = off + HAMMER2_PBUFSIZE;
+		}
+		off = bump->off[r];
+		bump->off[r] += bytes;
+	} else {
+		error = hammer2_freemap_bump_chunk(hmp, bump, bref->type,
+						   mtid, &off);
+		if (error)
+			return (error);
+	}
+
+	/*
+	 * Same validity rules as the normal allocator.
+	 */
+	KKASSERT(off >= hmp->voldata.allocator_beg &&
+		 off + bytes <= hmp->total_size);
+	KKASSERT((off & HAMMER2_ZONE_MASK64) >= HAMMER2_ZONE_SEG);
+	bref->data_off = off | radix;
+
+	if (bref->type == HAMMER2_BREF_TYPE_DATA)
+		hammer2_io_dedup_set(hmp, bref);
+
+	return (0);
+}
+
+/*
+ * Bring the freemap up to date with everything handed out by the
+ * sequential allocator.  Called before the freemap is flushed.
+ */
+void
+hammer2_freemap_bump_sync(hammer2_dev_t *hmp)
+{
+	hammer2_tid_t mtid;
+	int i;
+
+	if (hmp->bump_enabled == 0)
+		return;
+
+	hammer2_mtx_ex(&hmp->bump_lock);
+	mtid = hammer2_trans_sub(hmp->spmp);
+	for (i = 0; i < HAMMER2_FREEMAP_HEUR_TYPES; ++i) {
+		if (hmp->bump[i].seg)
+			hammer2_freemap_bump_update(hmp, &hmp->bump[i], mtid);
+	}
+	hammer2_mtx_unlock(&hmp->bump_lock);
+}
+
+/*
+ * Give back the 16KB blocks of a per-radix chunk which were never handed
+ * out.  The whole chunk was marked allocated when it was carved.
+ */
+static
+void
+hammer2_freemap_bump_release(hammer2_dev_t *hmp, hammer2_off_t beg,
+			     hammer2_off_t end, hammer2_tid_t mtid)
+{
+	hammer2_chain_t *parent;
+	hammer2_chain_t *chain;
+	hammer2_bmap_data_t *bmap;
+	hammer2_bitmap_t bmmask;
+	hammer2_key_t key;
+	hammer2_off_t seg;
+	hammer2_off_t off;
+	size_t bgsize;
+	int error;
+	int i;
+
+	key = H2FMBASE(beg, HAMMER2_FREEMAP_LEVEL1_RADIX);
+	seg = H2FMBASE(beg, HAMMER2_FREEMAP_LEVEL0_RADIX);
+	parent = &hmp->fchain;
+	hammer2_chain_ref(parent);
+	hammer2_chain_lock(parent, HAMMER2_RESOLVE_ALWAYS);
+	chain = hammer2_freemap_bump_leaf(&parent, key, mtid, &error);
+	if (chain == NULL)
+		goto done;
+
+	hammer2_chain_modify(chain, mtid, 0, 0);
+	bmap = &chain->data->bmdata[(seg - key) >>
+				    HAMMER2_FREEMAP_LEVEL0_RADIX];
+	bgsize = 0;
+	for (off = beg - seg; off < end - seg;
+	     off += HAMMER2_FREEMAP_BLOCK_SIZE) {
+		i = off / (HAMMER2_SEGSIZE / HAMMER2_BMAP_ELEMENTS);
+		bmmask = (hammer2_bitmap_t)3 <<
+			 ((off / (HAMMER2_FREEMAP_BLOCK_SIZE / 2)) & 62);
+		if ((bmap->bitmapq[i] & bmmask) == bmmask)
+			bgsize += HAMMER2_FREEMAP_BLOCK_SIZE;
+		bmap->bitmapq[i] &= ~bmmask;
+	}
+	bmap->avail += bgsize;
+	chain->bref.check.freemap.bigmask = -1;
+	hammer2_chain_unlock(chain);
+	hammer2_chain_drop(chain);
+
+	if (bgsize) {
+		hammer2_voldata_lock(hmp);
+		hammer2_voldata_modify(hmp);
+		hmp->voldata.allocator_free += bgsize;
+		hammer2_voldata_unlock(hmp);
+	}
+done:
+	hammer2_chain_unlock(parent);
+	hammer2_chain_drop(parent);
+}
+
+/*
+ * Sync and disable the sequential allocator, further allocations go
+ * through the normal freemap allocator.  The unused tails of the
+ * per-radix chunks are given back, rounded to the 16KB freemap block
+ * the last allocation ended in, like the normal allocator would have
+ * left them.
+ */
+void
+hammer2_freemap_bump_stop(hammer2_dev_t *hmp)
+{
+	hammer2_bump_t *bump;
+	hammer2_off_t beg;
+	hammer2_tid_t mtid;
+	int i;
+	int r;
+
+	if (hmp->bump_enabled == 0)
+		return;
+
+	hammer2_mtx_ex(&hmp->bump_lock);
+	hammer2_freemap_bump_sync(hmp);
+	mtid = hammer2_trans_sub(hmp->spmp);
+	for (i = 0; i < HAMMER2_FREEMAP_HEUR_TYPES; ++i) {
+		bump = &hmp->bump[i];
+		for (r = 0; r < HAMMER2_BUMP_NRADIX; ++r) {
+			beg = (bump->off[r] + HAMMER2_FREEMAP_BLOCK_MASK) &
+			      ~(hammer2_off_t)HAMMER2_FREEMAP_BLOCK_MASK;
+			if (beg < bump->end[r])
+				hammer2_freemap_bump_release(hmp, beg,
+							     bump->end[r],
+							     mtid);
+		}
+	}
+	hmp->bump_enabled = 0;
+	bzero(hmp->bump, sizeof(hmp->bump));
+	hammer2_mtx_unlock(&hmp->bump_lock);
+}
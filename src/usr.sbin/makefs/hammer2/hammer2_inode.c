@@ -51,16 +51,119 @@
 /*
  * Initialize inum hash in fresh structure
  */
+static hammer2_inum_htab_t *
+hammer2_inum_htab_alloc(int size)
+{
+	hammer2_inum_htab_t *tab;
+	int i;
+
+	tab = kmalloc(sizeof(*tab) + sizeof(tab->hash[0]) * size,
+		      M_HAMMER2, M_WAITOK | M_ZERO);
+	tab->mask = size - 1;
+	for (i = 0; i < size; ++i)
+		hammer2_spin_init(&tab->hash[i].spin, "h2inum");
+
+	return tab;
+}
+
 void
 hammer2_inum_hash_init(hammer2_pfs_t *pmp)
 {
+	pmp->inumhash = hammer2_inum_htab_alloc(HAMMER2_INUMHASH_SIZE);
+}
+
+/*
+ * Free the inum hash, including tables replaced by resizes.
+ */
+void
+hammer2_inum_hash_destroy(hammer2_pfs_t *pmp)
+{
+	hammer2_inum_htab_t *tab;
+
+	while ((tab = pmp->inumhash) != NULL) {
+		pmp->inumhash = tab->prev;
+		kfree(tab, M_HAMMER2);
+	}
+}
+
+/*
+ * Replace the inum hash with one twice the size, see hammer2_io.c.
+ */
+static void
+hammer2_inum_hash_resize(hammer2_pfs_t *pmp)
+{
+	hammer2_inum_htab_t *otab;
+	hammer2_inum_htab_t *ntab;
 	hammer2_inum_hash_t *hash;
+	hammer2_inode_t *ip;
 	int i;
 
-	for (i = 0; i < HAMMER2_INUMHASH_SIZE; ++i) {
-		hash = &pmp->inumhash[i];
-		hammer2_spin_init(&hash->spin, "h2inum");
+	if (!atomic_cmpset_int(&pmp->inumhash_stats.resizing, 0, 1))
+		return;
+	otab = pmp->inumhash;
+	if (pmp->inum_count < (long)(otab->mask + 1) * HAMMER2_HASH_LOAD) {
+		atomic_clear_int(&pmp->inumhash_stats.resizing, 1);
+		return;
+	}
+	ntab = hammer2_inum_htab_alloc((otab->mask + 1) * 2);
+	ntab->prev = otab;
+
+	for (i = 0; i <= otab->mask; ++i)
+		hammer2_spin_ex(&otab->hash[i].spin);
+	for (i = 0; i <= otab->mask; ++i) {
+		while ((ip = otab->hash[i].base) != NULL) {
+			otab->hash[i].base = ip->next;
+			hash = &ntab->hash[(int)ip->meta.inum & ntab->mask];
+			ip->next = hash->base;
+			hash->base = ip;
+		}
 	}
+	cpu_sfence();
+	pmp->inumhash = ntab;
+	otab->stale = 1;
+	for (i = 0; i <= otab->mask; ++i)
+		hammer2_spin_unex(&otab->hash[i].spin);
+
+	++pmp->inumhash_stats.resizes;
+	atomic_clear_int(&pmp->inumhash_stats.resizing, 1);
+}
+
+/*
+ * Report chain lengths and lookup hits of the inum hash.
+ */
+static void
+hammer2_inum_hash_stats(hammer2_pfs_t *pmp)
+{
+	hammer2_inum_htab_t *tab = pmp->inumhash;
+	hammer2_hash_stats_t *stats = &pmp->inumhash_stats;
+	hammer2_inode_t *ip;
+	long count;
+	long used;
+	long len;
+	long maxlen;
+	int i;
+
+	count = 0;
+	used = 0;
+	maxlen = 0;
+	for (i = 0; i <= tab->mask; ++i) {
+		len = 0;
+		for (ip = tab->hash[i].base; ip; ip = ip->next)
+			++len;
+		if (len) {
+			count += len;
+			++used;
+			if (maxlen < len)
+				maxlen = len;
+		}
+	}
+	kprintf("hammer2: inumhash %d chains, %ld inodes, "
+		"chain length avg %ld.%02ld max %ld, "
+		"%ld lookups %ld hits, %ld resizes\n",
+		tab->mask + 1, count,
+		used ? count / used : 0,
+		used ? count * 100 / used % 100 : 0,
+		maxlen, stats->lookups, stats->hits, stats->resizes);
 }
 
 /*
@@ -538,13 +641,32 @@ hammer2_inode_lock_downgrade(hammer2_inode_t *ip, int wasexclusive)
 		hammer2_mtx_downgrade(&ip->lock);
 }
 
-static __inline hammer2_inum_hash_t *
-inumhash(hammer2_pfs_t *pmp, hammer2_tid_t inum)
+/*
+ * Lock and return the inum hash chain for (inum).  Retry if the table
+ * was replaced while we were waiting for the lock.
+ */
+static hammer2_inum_hash_t *
+inumhash_lock(hammer2_pfs_t *pmp, hammer2_tid_t inum, int shared)
 {
-	int hv;
+	hammer2_inum_htab_t *tab;
+	hammer2_inum_hash_t *hash;
 
-	hv = (int)inum;
-	return (&pmp->inumhash[hv & HAMMER2_INUMHASH_MASK]);
+	for (;;) {
+		tab = pmp->inumhash;
+		cpu_ccfence();
+		hash = &tab->hash[(int)inum & tab->mask];
+		if (shared)
+			hammer2_spin_sh(&hash->spin);
+		else
+			hammer2_spin_ex(&hash->spin);
+		if (tab->stale == 0)
+			break;
+		if (shared)
+			hammer2_spin_unsh(&hash->spin);
+		else
+			hammer2_spin_unex(&hash->spin);
+	}
+	return (hash);
 }
 
 
@@ -561,8 +683,7 @@ hammer2_inode_lookup(hammer2_pfs_t *pmp, hammer2_tid_t inum)
 	if (pmp->spmp_hmp) {
 		ip = NULL;
 	} else {
-		hash = inumhash(pmp, inum);
-		hammer2_spin_sh(&hash->spin);
+		hash = inumhash_lock(pmp, inum, 1);
 		for (ip = hash->base; ip; ip = ip->next) {
 			if (ip->meta.inum == inum) {
 				hammer2_inode_ref(ip);
@@ -570,6 +691,9 @@ hammer2_inode_lookup(hammer2_pfs_t *pmp, hammer2_tid_t inum)
 			}
 		}
 		hammer2_spin_unsh(&hash->spin);
+		atomic_add_long(&pmp->inumhash_stats.lookups, 1);
+		if (ip)
+			atomic_add_long(&pmp->inumhash_stats.hits, 1);
 	}
 	return(ip);
 }
@@ -620,9 +744,7 @@ hammer2_inode_drop(hammer2_inode_t *ip)
 
 			pmp = ip->pmp;
 			KKASSERT(pmp);
-			hash = inumhash(pmp, ip->meta.inum);
-
-			hammer2_spin_ex(&hash->spin);
+			hash = inumhash_lock(pmp, ip->meta.inum, 0);
 			if (atomic_cmpset_int(&ip->refs, 1, 0)) {
 				KKASSERT(hammer2_mtx_refs(&ip->lock) == 0);
 				if (ip->flags & HAMMER2_INODE_ONHASH) {
@@ -962,9 +1084,9 @@ again:
 		hammer2_inum_hash_t *hash;
 		hammer2_inode_t *xip;
 		hammer2_inode_t **xipp;
+		long count;
 
-		hash = inumhash(pmp, nip->meta.inum);
-		hammer2_spin_ex(&hash->spin);
+		hash = inumhash_lock(pmp, nip->meta.inum, 0);
 		for (xipp = &hash->base;
 		     (xip = *xipp) != NULL;
 		     xipp = &xip->next)
@@ -979,8 +1101,11 @@ again:
 		nip->next = NULL;
 		*xipp = nip;
 		atomic_set_int(&nip->flags, HAMMER2_INODE_ONHASH);
-		atomic_add_long(&pmp->inum_count, 1);
+		count = atomic_fetchadd_long(&pmp->inum_count, 1);
 		hammer2_spin_unex(&hash->spin);
+		if (count >= (long)(pmp->inumhash->mask + 1) *
+			     HAMMER2_HASH_LOAD)
+			hammer2_inum_hash_resize(pmp);
 	}
 	return (nip);
 }
@@ -1693,6 +1818,62 @@ hammer2_inode_modify(hammer2_inode_t *ip)
 		hammer2_inode_delayed_sideq(ip);
 }
 
+static int
+hammer2_key_cmp(const void *a, const void *b)
+{
+	hammer2_key_t k1 = *(const hammer2_key_t *)a;
+	hammer2_key_t k2 = *(const hammer2_key_t *)b;
+
+	if (k1 < k2)
+		return (-1);
+	if (k1 > k2)
+		return (1);
+	return (0);
+}
+
+/*
+ * Bulk-load the indirect block topology of an empty inode for the keys
+ * which are about to be inserted (see hammer2_chain_bulkload()).  The
+ * keys array is sorted and de-duplicated in place.
+ */
+int
+hammer2_inode_bulkload(hammer2_inode_t *ip, hammer2_key_t *keys, int nkeys,
+		       int fill, int flags)
+{
+	hammer2_chain_t *chain;
+	hammer2_tid_t mtid;
+	int error;
+	int i;
+	int n;
+
+	if (nkeys <= HAMMER2_SET_COUNT)
+		return (0);
+
+	qsort(keys, nkeys, sizeof(*keys), hammer2_key_cmp);
+	for (i = n = 1; i < nkeys; ++i) {
+		if (keys[i] != keys[n - 1])
+			keys[n++] = keys[i];
+	}
+
+	hammer2_trans_init(ip->pmp, 0);
+	mtid = hammer2_trans_sub(ip->pmp);
+	hammer2_inode_lock(ip, 0);
+	chain = hammer2_inode_chain(ip, 0, HAMMER2_RESOLVE_ALWAYS);
+	if (chain) {
+		error = hammer2_chain_bulkload(chain, keys, n, fill, flags,
+					       mtid);
+		hammer2_chain_unlock(chain);
+		hammer2_chain_drop(chain);
+		hammer2_inode_modify(ip);
+	} else {
+		error = HAMMER2_ERROR_EIO;
+	}
+	hammer2_inode_unlock(ip);
+	hammer2_trans_done(ip->pmp, HAMMER2_TRANS_SIDEQ);
+
+	return (hammer2_error_to_errno(error));
+}
+
 /*
  * Synchronize the inode's frontend state with the chain state prior
  * to any explicit flush of the inode or any strategy write call.  This
@@ -1849,36 +2030,46 @@ vflush(struct m_mount *mp, int rootrefs, int flags)
 	struct hammer2_inode *ip, *tmp;
 	struct m_vnode *vp;
 	hammer2_key_t count_before, count_after, count_recq;
+	hammer2_inum_htab_t *tab;
 	hammer2_inum_hash_t *hash;
 	int i;
 
 	printf("%s: total chain %ld\n", __func__, hammer2_chain_allocs);
 	printf("%s: total dio %d\n", __func__, hammer2_dio_count);
-
-	for (i = 0; i < HAMMER2_INUMHASH_SIZE; ++i) {
-		hash = &pmp->inumhash[i];
+	if (hammer2_debug)
+		hammer2_inum_hash_stats(pmp);
+
+	count_before = 0;
+	count_after = 0;
+	tab = pmp->inumhash;
+	for (i = 0; i <= tab->mask; ++i) {
+		hash = &tab->hash[i];
 		hammer2_spin_ex(&hash->spin);
-		count_before = 0;
 		for (ip = hash->base; ip; ip = ip->next)
 			count_before++;
 
 		for (ip = hash->base; ip;) {
 			tmp = ip->next;
 			vp = ip->vp;
-			assert(vp);
-			if (!vp->v_vflushed) {
+			/*
+			 * No vp if it was reclaimed, the inode is only
+			 * held by SIDEQ/SYNCQ.
+			 */
+			if (vp && !vp->v_vflushed) {
 				/*
 				 * Not all inodes are modified and ref'd,
 				 * so ip->refs requirement here is the initial 1.
 				 */
 				assert(ip->refs > 0);
-				hammer2_inode_drop(ip);
 				vp->v_vflushed = 1;
+				/* hammer2_inode_drop() takes the spinlock */
+				hammer2_spin_unex(&hash->spin);
+				hammer2_inode_drop(ip);
+				hammer2_spin_ex(&hash->spin);
 			}
 			ip = tmp;
 		}
 
-		count_after = 0;
 		for (ip = hash->base; ip; ip = ip->next)
 			count_after++;
 		hammer2_spin_unex(&hash->spin);
@@ -58,17 +58,28 @@ static hammer2_io_t *hammer2_io_hash_lookup(hammer2_dev_t *hmp,
 static hammer2_io_t *hammer2_io_hash_enter(hammer2_dev_t *hmp,
 			hammer2_io_t *dio, uint64_t *refsp);
 static void hammer2_io_hash_cleanup(hammer2_dev_t *hmp, int dio_limit);
+static void hammer2_io_hash_resize(hammer2_dev_t *hmp);
+static void hammer2_io_hash_stats(hammer2_dev_t *hmp);
 
-void
-hammer2_io_hash_init(hammer2_dev_t *hmp)
+static hammer2_io_htab_t *
+hammer2_io_htab_alloc(int size)
 {
-	hammer2_io_hash_t *hash;
+	hammer2_io_htab_t *tab;
 	int i;
 
-	for (i = 0; i < HAMMER2_IOHASH_SIZE; ++i) {
-		hash = &hmp->iohash[i];
-		hammer2_spin_init(&hash->spin, "h2iohash");
-	}
+	tab = kmalloc(sizeof(*tab) + sizeof(tab->hash[0]) * size,
+		      M_HAMMER2, M_WAITOK | M_ZERO);
+	tab->mask = size - 1;
+	for (i = 0; i < size; ++i)
+		hammer2_spin_init(&tab->hash[i].spin, "h2iohash");
+
+	return tab;
+}
+
+void
+hammer2_io_hash_init(hammer2_dev_t *hmp)
+{
+	hmp->iohash = hammer2_io_htab_alloc(HAMMER2_IOHASH_SIZE);
 }
 
 #ifdef HAMMER2_IO_DEBUG
@@ -739,6 +750,7 @@ hammer2_io_dedup_delete(hammer2_dev_t *hmp, uint8_t btype,
 		return;
 	if (btype != HAMMER2_BREF_TYPE_DATA)
 		return;
+	hammer2_dedup_index_delete(hmp, data_off);
 	dio = hammer2_io_alloc(hmp, data_off, btype, 0, &isgood);
 	if (dio) {
 		if (data_off < dio->pbase ||
@@ -808,12 +820,12 @@ _hammer2_io_ref(hammer2_io_t *dio HAMMER2_IO_DEBUG_ARGS)
 }
 
 static __inline hammer2_io_hash_t *
-hammer2_io_hashv(hammer2_dev_t *hmp, hammer2_off_t pbase)
+hammer2_io_hashv(hammer2_io_htab_t *tab, hammer2_off_t pbase)
 {
 	int hv;
 
 	hv = (int)pbase + (int)(pbase >> 16);
-	return (&hmp->iohash[hv & HAMMER2_IOHASH_MASK]);
+	return (&tab->hash[hv & tab->mask]);
 }
 
 /*
@@ -822,13 +834,21 @@ hammer2_io_hashv(hammer2_dev_t *hmp, hammer2_off_t pbase)
 static hammer2_io_t *
 hammer2_io_hash_lookup(hammer2_dev_t *hmp, hammer2_off_t pbase, uint64_t *refsp)
 {
+	hammer2_io_htab_t *tab;
 	hammer2_io_hash_t *hash;
 	hammer2_io_t *dio;
 	uint64_t refs;
 
 	*refsp = 0;
-	hash = hammer2_io_hashv(hmp, pbase);
+again:
+	tab = hmp->iohash;
+	cpu_ccfence();
+	hash = hammer2_io_hashv(tab, pbase);
 	hammer2_spin_sh(&hash->spin);
+	if (tab->stale) {
+		hammer2_spin_unsh(&hash->spin);
+		goto again;
+	}
 	for (dio = hash->base; dio; dio = dio->next) {
 		if (dio->pbase == pbase) {
 			refs = atomic_fetchadd_64(&dio->refs, 1);
@@ -840,6 +860,10 @@ hammer2_io_hash_lookup(hammer2_dev_t *hmp, hammer2_off_t pbase, uint64_t *refsp)
 	}
 	hammer2_spin_unsh(&hash->spin);
 
+	atomic_add_long(&hmp->iohash_stats.lookups, 1);
+	if (dio)
+		atomic_add_long(&hmp->iohash_stats.hits, 1);
+
 	return dio;
 }
 
@@ -853,12 +877,20 @@ hammer2_io_hash_enter(hammer2_dev_t *hmp, hammer2_io_t *dio, uint64_t *refsp)
 {
 	hammer2_io_t *xio;
 	hammer2_io_t **xiop;
+	hammer2_io_htab_t *tab;
 	hammer2_io_hash_t *hash;
 	uint64_t refs;
 
 	*refsp = 0;
-	hash = hammer2_io_hashv(hmp, dio->pbase);
+again:
+	tab = hmp->iohash;
+	cpu_ccfence();
+	hash = hammer2_io_hashv(tab, dio->pbase);
 	hammer2_spin_ex(&hash->spin);
+	if (tab->stale) {
+		hammer2_spin_unex(&hash->spin);
+		goto again;
+	}
 	for (xiop = &hash->base; (xio = *xiop) != NULL; xiop = &xio->next) {
 		if (xio->pbase == dio->pbase) {
 			refs = atomic_fetchadd_64(&xio->refs, 1);
@@ -873,15 +905,65 @@ hammer2_io_hash_enter(hammer2_dev_t *hmp, hammer2_io_t *dio, uint64_t *refsp)
 done:
 	hammer2_spin_unex(&hash->spin);
 
+	if (xio == NULL &&
+	    atomic_fetchadd_long(&hmp->io_count, 1) >=
+	    (long)(tab->mask + 1) * HAMMER2_HASH_LOAD)
+		hammer2_io_hash_resize(hmp);
+
 	return xio;
 }
 
+/*
+ * Replace the hash table with one twice the size.  All chains of the
+ * old table are held exclusively while the dios are moved, and the old
+ * table is flagged stale before they are released.
+ */
+static void
+hammer2_io_hash_resize(hammer2_dev_t *hmp)
+{
+	hammer2_io_htab_t *otab;
+	hammer2_io_htab_t *ntab;
+	hammer2_io_hash_t *hash;
+	hammer2_io_t *dio;
+	int i;
+
+	if (!atomic_cmpset_int(&hmp->iohash_stats.resizing, 0, 1))
+		return;
+	otab = hmp->iohash;
+	if (hmp->io_count < (long)(otab->mask + 1) * HAMMER2_HASH_LOAD) {
+		atomic_clear_int(&hmp->iohash_stats.resizing, 1);
+		return;
+	}
+	ntab = hammer2_io_htab_alloc((otab->mask + 1) * 2);
+	ntab->prev = otab;
+
+	for (i = 0; i <= otab->mask; ++i)
+		hammer2_spin_ex(&otab->hash[i].spin);
+	for (i = 0; i <= otab->mask; ++i) {
+		while ((dio = otab->hash[i].base) != NULL) {
+			otab->hash[i].base = dio->next;
+			hash = hammer2_io_hashv(ntab, dio->pbase);
+			dio->next = hash->base;
+			hash->base = dio;
+		}
+	}
+	cpu_sfence();
+	hmp->iohash = ntab;
+	otab->stale = 1;
+	for (i = 0; i <= otab->mask; ++i)
+		hammer2_spin_unex(&otab->hash[i].spin);
+
+	++hmp->iohash_stats.resizes;
+	atomic_clear_int(&hmp->iohash_stats.resizing, 1);
+}
+
 /*
  * Clean out a limited number of freeable DIOs
  */
 static void
 hammer2_io_hash_cleanup(hammer2_dev_t *hmp, int dio_limit)
 {
+	hammer2_io_htab_t *tab;
 	hammer2_io_hash_t *hash;
 	hammer2_io_t *dio;
 	hammer2_io_t **diop;
@@ -897,11 +979,18 @@ hammer2_io_hash_cleanup(hammer2_dev_t *hmp, int dio_limit)
 	cleanbase = NULL;
 	cleanapp = &cleanbase;
 
+	tab = hmp->iohash;
+	cpu_ccfence();
 	i = hmp->io_iterator++;
-	maxscan = HAMMER2_IOHASH_SIZE;
+	maxscan = tab->mask + 1;
 	while (count > 0 && maxscan--) {
-		hash = &hmp->iohash[i & HAMMER2_IOHASH_MASK];
+		hash = &tab->hash[i & tab->mask];
 		hammer2_spin_ex(&hash->spin);
+		if (tab->stale) {
+			/* raced a resize, pick it up on the next call */
+			hammer2_spin_unex(&hash->spin);
+			break;
+		}
 		diop = &hash->base;
 		while ((dio = *diop) != NULL) {
 			if ((dio->refs & (HAMMER2_DIO_MASK |
@@ -913,7 +1002,9 @@ hammer2_io_hash_cleanup(hammer2_dev_t *hmp, int dio_limit)
 			if (dio->act > 0) {
 				int act;
 
-				act = dio->act - (ticks - dio->ticks) / hz - 1;
+				act = dio->act - 1;
+				if (hz)
+					act -= (ticks - dio->ticks) / hz;
 				dio->act = (act < 0) ? 0 : act;
 			}
 			if (dio->act) {
@@ -928,6 +1019,7 @@ hammer2_io_hash_cleanup(hammer2_dev_t *hmp, int dio_limit)
 			--count;
 			/* diop remains unchanged */
 			atomic_add_int(&hmp->iofree_count, -1);
+			atomic_add_long(&hmp->io_count, -1);
 		}
 		hammer2_spin_unex(&hash->spin);
 		i = hmp->io_iterator++;
@@ -958,12 +1050,17 @@ hammer2_io_hash_cleanup(hammer2_dev_t *hmp, int dio_limit)
 void
 hammer2_io_hash_cleanup_all(hammer2_dev_t *hmp)
 {
+	hammer2_io_htab_t *tab;
 	hammer2_io_hash_t *hash;
 	hammer2_io_t *dio;
 	int i;
 
-	for (i = 0; i < HAMMER2_IOHASH_SIZE; ++i) {
-		hash = &hmp->iohash[i];
+	if (hammer2_debug)
+		hammer2_io_hash_stats(hmp);
+
+	tab = hmp->iohash;
+	for (i = 0; i <= tab->mask; ++i) {
+		hash = &tab->hash[i];
 
 		while ((dio = hash->base) != NULL) {
 			hash->base = dio->next;
@@ -979,6 +1076,50 @@ hammer2_io_hash_cleanup_all(hammer2_dev_t *hmp)
 			kfree_obj(dio, hmp->mio);
 			atomic_add_int(&hammer2_dio_count, -1);
 			atomic_add_int(&hmp->iofree_count, -1);
+			atomic_add_long(&hmp->io_count, -1);
+		}
+	}
+
+	while ((tab = hmp->iohash) != NULL) {
+		hmp->iohash = tab->prev;
+		kfree(tab, M_HAMMER2);
+	}
+}
+
+/*
+ * Report chain lengths and lookup hits of the DIO hash.
+ */
+static void
+hammer2_io_hash_stats(hammer2_dev_t *hmp)
+{
+	hammer2_io_htab_t *tab = hmp->iohash;
+	hammer2_hash_stats_t *stats = &hmp->iohash_stats;
+	hammer2_io_t *dio;
+	long count;
+	long used;
+	long len;
+	long maxlen;
+	int i;
+
+	count = 0;
+	used = 0;
+	maxlen = 0;
+	for (i = 0; i <= tab->mask; ++i) {
+		len = 0;
+		for (dio = tab->hash[i].base; dio; dio = dio->next)
+			++len;
+		if (len) {
+			count += len;
+			++used;
+			if (maxlen < len)
+				maxlen = len;
 		}
 	}
+	kprintf("hammer2: iohash %d chains, %ld dios, "
+		"chain length avg %ld.%02ld max %ld, "
+		"%ld lookups %ld hits, %ld resizes\n",
+		tab->mask + 1, count,
+		used ? count / used : 0,
+		used ? count * 100 / used % 100 : 0,
+		maxlen, stats->lookups, stats->hits, stats->resizes);
 }
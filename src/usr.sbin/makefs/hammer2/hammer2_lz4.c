@@ -345,19 +345,303 @@ LZ4_free(void* ctx)
 int
 LZ4_compress_limitedOutput(char* source, char* dest, int inputSize, int maxOutputSize)
 {
-    void* ctx = LZ4_create();
+    return LZ4_compress_fast_limitedOutput(source, dest, inputSize,
+			maxOutputSize, 1);
+}
+
+int
+LZ4_compress_fast_limitedOutput(char* source, char* dest, int inputSize,
+			int maxOutputSize, int acceleration)
+{
+    void* ctx;
     int result;
+    if (acceleration < 1) acceleration = 1;
+    if (acceleration > LZ4_ACCELERATION_MAX) acceleration = LZ4_ACCELERATION_MAX;
+    ctx = LZ4_create();
     if (ctx == NULL) return 0;    // Failed allocation => compression not done
     if (inputSize < LZ4_64KLIMIT)
         result = LZ4_compress64k_heap_limitedOutput(ctx, source, dest,
-			inputSize, maxOutputSize);
+			inputSize, maxOutputSize, acceleration);
     else result = LZ4_compress_heap_limitedOutput(ctx, source, dest,
-			inputSize, maxOutputSize);
+			inputSize, maxOutputSize, acceleration);
     LZ4_free(ctx);
     return result;
 }
 
 
+//****************************
+// High compression functions
+//****************************
+
+// LZ4-HC searches hash chains for the longest match at each position
+// and looks one byte ahead before committing to it.  The output is an
+// ordinary LZ4 block, decompression speed is not affected.
+
+#define LZ4HC_HASH_LOG 15
+#define LZ4HC_HASHTABLESIZE (1 << LZ4HC_HASH_LOG)
+#define LZ4HC_MAXD (1 << MAXD_LOG)
+#define LZ4HC_MAXD_MASK (LZ4HC_MAXD - 1)
+
+#define LZ4HC_HASHVALUE(p) ((A32(p) * 2654435761U) >> ((MINMATCH*8)-LZ4HC_HASH_LOG))
+#define LZ4HC_DELTANEXT(hc4, i) ((hc4)->chainTable[(i) & LZ4HC_MAXD_MASK])
+
+// Index 0 is LZ4HC_MAXD bytes before the source so that an empty
+// (zeroed) hash table entry is always out of the window.
+#define LZ4HC_INDEX(hc4, p) ((U32)((p) - (hc4)->source) + LZ4HC_MAXD)
+#define LZ4HC_PTR(hc4, i) ((hc4)->source + ((i) - LZ4HC_MAXD))
+
+typedef struct
+{
+    U32 hashTable[LZ4HC_HASHTABLESIZE];
+    U16 chainTable[LZ4HC_MAXD];
+    BYTE* source;
+    U32 nextToUpdate;
+} LZ4HC_Data_Structure;
+
+static
+inline
+int
+LZ4HC_Count(BYTE* ip, BYTE* ref, BYTE* mlimit)
+{
+    BYTE* start = ip;
+
+    while likely(ip<mlimit-(STEPSIZE-1))
+    {
+        UARCH diff = AARCH(ref) ^ AARCH(ip);
+        if (!diff) {
+			ip+=STEPSIZE;
+			ref+=STEPSIZE;
+			continue;
+		}
+        ip += LZ4_NbCommonBytes(diff);
+        return (int)(ip - start);
+    }
+    if (LZ4_ARCH64) if ((ip<(mlimit-3)) && (A32(ref) == A32(ip))) {
+		ip+=4;
+		ref+=4;
+	}
+    if ((ip<(mlimit-1)) && (A16(ref) == A16(ip))) {
+		ip+=2;
+		ref+=2;
+	}
+    if ((ip<mlimit) && (*ref == *ip))
+		ip++;
+    return (int)(ip - start);
+}
+
+// Insert all positions up to (not including) ip into the hash chains
+static
+inline
+void
+LZ4HC_Insert(LZ4HC_Data_Structure* hc4, BYTE* ip)
+{
+    U32 target = LZ4HC_INDEX(hc4, ip);
+    U32 idx = hc4->nextToUpdate;
+
+    while (idx < target)
+    {
+        U32 h = LZ4HC_HASHVALUE(LZ4HC_PTR(hc4, idx));
+        U32 delta = idx - hc4->hashTable[h];
+        if (delta > MAX_DISTANCE) delta = MAX_DISTANCE;
+        LZ4HC_DELTANEXT(hc4, idx) = (U16)delta;
+        hc4->hashTable[h] = idx;
+        idx++;
+    }
+    hc4->nextToUpdate = target;
+}
+
+static
+inline
+int
+LZ4HC_InsertAndFindBestMatch(LZ4HC_Data_Structure* hc4, BYTE* ip,
+			BYTE* mlimit, BYTE** matchpos, int maxAttempts)
+{
+    U32 current = LZ4HC_INDEX(hc4, ip);
+    U32 lowLimit = LZ4HC_MAXD;
+    U32 matchIndex;
+    int ml = 0;
+
+    if (current - lowLimit > MAX_DISTANCE)
+        lowLimit = current - MAX_DISTANCE;
+
+    LZ4HC_Insert(hc4, ip);
+    matchIndex = hc4->hashTable[LZ4HC_HASHVALUE(ip)];
+
+    while ((matchIndex >= lowLimit) && (maxAttempts-- > 0))
+    {
+        BYTE* ref = LZ4HC_PTR(hc4, matchIndex);
+        if ((ref[ml] == ip[ml]) && (A32(ref) == A32(ip)))
+        {
+            int mlt = MINMATCH + LZ4HC_Count(ip+MINMATCH, ref+MINMATCH,
+			mlimit);
+            if (mlt > ml) {
+				ml = mlt;
+				*matchpos = ref;
+			}
+        }
+        matchIndex -= LZ4HC_DELTANEXT(hc4, matchIndex);
+    }
+    return ml;
+}
+
+// Returns 0 when the output limit is reached
+static
+inline
+int
+LZ4HC_encodeSequence(BYTE** ip, BYTE** op, BYTE** anchor, int matchLength,
+			BYTE* ref, BYTE* oend)
+{
+    BYTE* s = *anchor;
+    BYTE* d = *op;
+    BYTE* token;
+    int length;
+
+    // Encode Literal length
+    length = (int)(*ip - s);
+    token = d++;
+
+    if unlikely(d + length + (2 + 1 + LASTLITERALS) + (length>>8) > oend)
+		return 0;   // Check output limit
+
+    if (length>=(int)RUN_MASK)
+    {
+        int len = length-RUN_MASK;
+        *token=(RUN_MASK<<ML_BITS);
+        for(; len >= 255 ; len-=255)
+			*d++ = 255;
+        *d++ = (BYTE)len;
+    }
+    else *token = (BYTE)(length<<ML_BITS);
+
+    // Copy Literals
+    LZ4_BLINDCOPY(s, d, length);
+
+    // Encode Offset
+    LZ4_WRITE_LITTLEENDIAN_16(d,(U16)(*ip-ref));
+
+    // Encode MatchLength
+    length = matchLength - MINMATCH;
+
+    if unlikely(d + (1 + LASTLITERALS) + (length>>8) > oend)
+		return 0;    // Check output limit
+
+    if (length>=(int)ML_MASK)
+    {
+        *token += ML_MASK;
+        length -= ML_MASK;
+        for (; length > 509 ; length-=510) {
+			*d++ = 255;
+			*d++ = 255;
+		}
+        if (length >= 255) {
+			length-=255;
+			*d++ = 255;
+		}
+        *d++ = (BYTE)length;
+    }
+    else *token += (BYTE)length;
+
+    // Prepare next loop
+    *ip += matchLength;
+    *anchor = *ip;
+    *op = d;
+    return 1;
+}
+
+static
+int
+LZ4HC_compress_limitedOutput(LZ4HC_Data_Structure* hc4, char* source,
+			char* dest, int inputSize, int maxOutputSize,
+			int maxAttempts)
+{
+    BYTE* ip = (BYTE*) source;
+    BYTE* anchor = ip;
+    BYTE* iend = ip + inputSize;
+    BYTE* mflimit = iend - MFLIMIT;
+    BYTE* mlimit = iend - LASTLITERALS;
+
+    BYTE* op = (BYTE*) dest;
+    BYTE* oend = op + maxOutputSize;
+
+    BYTE* ref = NULL;
+    BYTE* ref2 = NULL;
+    int ml, ml2;
+
+    hc4->source = ip;
+    hc4->nextToUpdate = LZ4HC_MAXD;
+
+    // Init
+    if (inputSize<MINLENGTH) goto _last_literals;
+
+    // Main Loop
+    while (ip < mflimit)
+    {
+        ml = LZ4HC_InsertAndFindBestMatch(hc4, ip, mlimit, &ref,
+			maxAttempts);
+        if (!ml) {
+			ip++;
+			continue;
+		}
+
+        // Lazy evaluation, a longer match one byte later is worth
+        // the extra literal
+        while (ip + 1 < mflimit)
+        {
+            ml2 = LZ4HC_InsertAndFindBestMatch(hc4, ip + 1, mlimit,
+			&ref2, maxAttempts);
+            if (ml2 <= ml)
+				break;
+            ip++;
+            ml = ml2;
+            ref = ref2;
+        }
+
+        if (!LZ4HC_encodeSequence(&ip, &op, &anchor, ml, ref, oend))
+			return 0;
+    }
+
+_last_literals:
+    // Encode Last Literals
+    {
+        int lastRun = (int)(iend - anchor);
+
+        if (((char*)op - dest) + lastRun + 1 +
+			((lastRun+255-RUN_MASK)/255) > (U32)maxOutputSize)
+			return 0;  // Check output limit
+
+        if (lastRun>=(int)RUN_MASK) {
+			*op++=(RUN_MASK<<ML_BITS);
+			lastRun-=RUN_MASK;
+			for(; lastRun >= 255 ; lastRun-=255)
+				*op++ = 255;
+			*op++ = (BYTE) lastRun;
+		}
+        else *op++ = (BYTE)(lastRun<<ML_BITS);
+        memcpy(op, anchor, iend - anchor);
+        op += iend-anchor;
+    }
+
+    // End
+    return (int) (((char*)op)-dest);
+}
+
+int
+LZ4_compressHC_limitedOutput(char* source, char* dest, int inputSize,
+			int maxOutputSize, int compressionLevel)
+{
+    LZ4HC_Data_Structure* hc4;
+    int result;
+    if (compressionLevel < LZ4HC_CLEVEL_MIN) compressionLevel = LZ4HC_CLEVEL_MIN;
+    if (compressionLevel > LZ4HC_CLEVEL_MAX) compressionLevel = LZ4HC_CLEVEL_MAX;
+    hc4 = kmalloc(sizeof(*hc4), C_HASHTABLE, M_INTWAIT);
+    if (hc4 == NULL) return 0;    // Failed allocation => compression not done
+    result = LZ4HC_compress_limitedOutput(hc4, source, dest, inputSize,
+			maxOutputSize, 1 << (compressionLevel - 1));
+    kfree(hc4, C_HASHTABLE);
+    return result;
+}
+
+
 //****************************
 // Decompression functions
 //****************************
@@ -88,6 +88,35 @@ LZ4_compress_limitedOutput() :
      the number of bytes written in buffer 'dest' or 0 if the compression fails
 */
 
+int LZ4_compress_fast_limitedOutput(char* source, char* dest, int inputSize,
+						int maxOutputSize, int acceleration);
+
+/*
+LZ4_compress_fast_limitedOutput() :
+    Same as LZ4_compress_limitedOutput(), but skips ahead faster through
+    data which does not match.  An 'acceleration' of 1 is the default
+    speed, larger values are faster and compress less.
+    Values are clamped to 1..LZ4_ACCELERATION_MAX.
+*/
+
+#define LZ4_ACCELERATION_MAX	64
+
+int LZ4_compressHC_limitedOutput(char* source, char* dest, int inputSize,
+						int maxOutputSize, int compressionLevel);
+
+/*
+LZ4_compressHC_limitedOutput() :
+    High compression variant of LZ4_compress_limitedOutput().  Each
+    compression level doubles the number of match candidates examined,
+    LZ4HC_CLEVEL_DEFAULT is a good balance.  The output is a regular
+    LZ4 block, LZ4_decompress_safe() decodes it at the usual speed.
+    Levels are clamped to LZ4HC_CLEVEL_MIN..LZ4HC_CLEVEL_MAX.
+*/
+
+#define LZ4HC_CLEVEL_MIN	3
+#define LZ4HC_CLEVEL_DEFAULT	9
+#define LZ4HC_CLEVEL_MAX	12
+
 #if defined (__cplusplus)
 }
 #endif
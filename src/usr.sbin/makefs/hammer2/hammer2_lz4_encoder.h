@@ -48,7 +48,8 @@ LZ4_compress_heap_limitedOutput(
                  char* source,
                  char* dest,
                  int inputSize,
-                 int maxOutputSize);
+                 int maxOutputSize,
+                 int acceleration);
                  
 int
 LZ4_compress64k_heap_limitedOutput(
@@ -56,7 +57,8 @@ LZ4_compress64k_heap_limitedOutput(
                  char* source,
                  char* dest,
                  int inputSize,
-                 int maxOutputSize);
+                 int maxOutputSize,
+                 int acceleration);
 
 
 //****************************
@@ -89,7 +91,8 @@ LZ4_compress_heap_limitedOutput(
                  char* source,
                  char* dest,
                  int inputSize,
-                 int maxOutputSize)
+                 int maxOutputSize,
+                 int acceleration)
 {
     CURRENT_H_TYPE* HashTable = (CURRENT_H_TYPE*)ctx;
 
@@ -121,7 +124,7 @@ LZ4_compress_heap_limitedOutput(
     // Main Loop
     for ( ; ; )
     {
-        int findMatchAttempts = (1U << skipStrength) + 3;
+        int findMatchAttempts = (acceleration << skipStrength) + 3;
         BYTE* forwardIp = ip;
         BYTE* ref;
         BYTE* token;
@@ -274,7 +277,8 @@ LZ4_compress64k_heap_limitedOutput(
                  char* source,
                  char* dest,
                  int inputSize,
-                 int maxOutputSize)
+                 int maxOutputSize,
+                 int acceleration)
 {
     CURRENT_H_TYPE* HashTable = (CURRENT_H_TYPE*)ctx;
 
@@ -306,7 +310,7 @@ LZ4_compress64k_heap_limitedOutput(
     // Main Loop
     for ( ; ; )
     {
-        int findMatchAttempts = (1U << skipStrength) + 3;
+        int findMatchAttempts = (acceleration << skipStrength) + 3;
         BYTE* forwardIp = ip;
         BYTE* ref;
         BYTE* token;
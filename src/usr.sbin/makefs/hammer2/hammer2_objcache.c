@@ -0,0 +1,409 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (c) 2022 Tomohiro Kusumi <tkusumi@netbsd.org>
+ * Copyright (c) 2011-2022 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * makefs: objcache(9) replacement.
+ *
+ * Objects are carved out of slabs and recycled through per-thread
+ * magazines, so allocating and freeing chains, DIOs, inodes, XOPs and
+ * compression buffers normally touches neither malloc nor a shared lock.
+ * Each thread holds a loaded and a previous magazine per cache as in
+ * the kernel, full and empty magazines are exchanged with the depot of
+ * the cache.  Memory is only returned on objcache_destroy().
+ */
+
+#include "hammer2.h"
+
+#define OBJCACHE_MAX		256	/* caches with per-thread magazines */
+#define OBJCACHE_MAGSIZE	64	/* rounds per magazine */
+#define OBJCACHE_SLABSIZE	(256 * 1024)
+#define OBJCACHE_ALIGN		16
+
+struct objcache_magazine {
+	struct objcache_magazine *next;
+	int			rounds;
+	void			*objs[OBJCACHE_MAGSIZE];
+};
+
+struct objcache_cpu {
+	struct objcache		*oc;		/* NULL if unused */
+	struct objcache_cpu	*next;		/* on oc->cpus */
+	struct objcache_magazine *loaded;
+	struct objcache_magazine *previous;
+};
+
+struct objcache_slab {
+	struct objcache_slab	*next;
+};
+
+struct objcache {
+	const char		*name;
+	size_t			objsize;
+	int			index;		/* -1 if depot only */
+	pthread_mutex_t		lock;
+	struct objcache_magazine *full;		/* depot */
+	struct objcache_magazine *empty;	/* depot */
+	struct objcache_slab	*slabs;
+	char			*slab_ptr;	/* unused part of slabs */
+	size_t			slab_left;
+	struct objcache_cpu	*cpus;		/* thread caches */
+};
+
+struct objcache_thread {
+	struct objcache_cpu	*cpu[OBJCACHE_MAX];
+};
+
+/*
+ * objcache_lock protects the index map and the attachment of thread
+ * caches to caches.
+ */
+static pthread_mutex_t objcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct objcache *objcache_map[OBJCACHE_MAX];
+static pthread_key_t objcache_key;
+static pthread_once_t objcache_once = PTHREAD_ONCE_INIT;
+static __thread struct objcache_thread *objcache_thread;
+
+static void objcache_thread_exit(void *arg);
+
+static void
+objcache_init(void)
+{
+	if (pthread_key_create(&objcache_key, objcache_thread_exit))
+		panic("objcache: pthread_key_create failed");
+}
+
+struct objcache *
+objcache_create(const char *name, size_t objsize)
+{
+	struct objcache *oc;
+	int i;
+
+	pthread_once(&objcache_once, objcache_init);
+
+	oc = ecalloc(1, sizeof(*oc));
+	oc->name = name;
+	oc->objsize = roundup(objsize, OBJCACHE_ALIGN);
+	oc->index = -1;
+	pthread_mutex_init(&oc->lock, NULL);
+
+	pthread_mutex_lock(&objcache_lock);
+	for (i = 0; i < OBJCACHE_MAX; ++i) {
+		if (objcache_map[i] == NULL) {
+			objcache_map[i] = oc;
+			oc->index = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&objcache_lock);
+
+	return (oc);
+}
+
+/*
+ * Caller must hold oc->lock.
+ */
+static struct objcache_magazine *
+objcache_mag_alloc(struct objcache *oc)
+{
+	struct objcache_magazine *mag;
+
+	if ((mag = oc->empty) != NULL) {
+		oc->empty = mag->next;
+		mag->next = NULL;
+	} else {
+		mag = ecalloc(1, sizeof(*mag));
+	}
+	return (mag);
+}
+
+/*
+ * Caller must hold oc->lock.
+ */
+static void
+objcache_mag_free(struct objcache *oc, struct objcache_magazine *mag)
+{
+	if (mag->rounds) {
+		mag->next = oc->full;
+		oc->full = mag;
+	} else {
+		mag->next = oc->empty;
+		oc->empty = mag;
+	}
+}
+
+/*
+ * Carve an object out of the current slab.  Caller must hold oc->lock.
+ */
+static void *
+objcache_slab_alloc(struct objcache *oc)
+{
+	struct objcache_slab *slab;
+	size_t size;
+	void *obj;
+
+	if (oc->slab_left < oc->objsize) {
+		size = OBJCACHE_SLABSIZE;
+		if (size < oc->objsize * 4)
+			size = oc->objsize * 4;
+		slab = emalloc(roundup(sizeof(*slab), OBJCACHE_ALIGN) + size);
+		slab->next = oc->slabs;
+		oc->slabs = slab;
+		oc->slab_ptr = (char *)slab +
+		    roundup(sizeof(*slab), OBJCACHE_ALIGN);
+		oc->slab_left = size;
+	}
+	obj = oc->slab_ptr;
+	oc->slab_ptr += oc->objsize;
+	oc->slab_left -= oc->objsize;
+
+	return (obj);
+}
+
+/*
+ * Return the calling thread's cache for (oc), NULL if (oc) is depot only.
+ */
+static struct objcache_cpu *
+objcache_cpu_get(struct objcache *oc)
+{
+	struct objcache_thread *ot;
+	struct objcache_cpu *cpu;
+
+	if (oc->index < 0)
+		return (NULL);
+	if ((ot = objcache_thread) == NULL) {
+		ot = ecalloc(1, sizeof(*ot));
+		objcache_thread = ot;
+		pthread_setspecific(objcache_key, ot);
+	}
+	cpu = ot->cpu[oc->index];
+	if (cpu && cpu->oc == oc)
+		return (cpu);
+
+	/*
+	 * First use of this cache (or of the index) by this thread.
+	 */
+	if (cpu == NULL) {
+		cpu = ecalloc(1, sizeof(*cpu));
+		ot->cpu[oc->index] = cpu;
+	}
+	pthread_mutex_lock(&objcache_lock);
+	pthread_mutex_lock(&oc->lock);
+	cpu->oc = oc;
+	cpu->loaded = objcache_mag_alloc(oc);
+	cpu->previous = objcache_mag_alloc(oc);
+	cpu->next = oc->cpus;
+	oc->cpus = cpu;
+	pthread_mutex_unlock(&oc->lock);
+	pthread_mutex_unlock(&objcache_lock);
+
+	return (cpu);
+}
+
+void *
+objcache_get(struct objcache *oc, int ocflags)
+{
+	struct objcache_cpu *cpu;
+	struct objcache_magazine *mag;
+	void *obj;
+
+	cpu = objcache_cpu_get(oc);
+	if (cpu == NULL) {
+		pthread_mutex_lock(&oc->lock);
+		if ((mag = oc->full) != NULL && mag->rounds) {
+			obj = mag->objs[--mag->rounds];
+			if (mag->rounds == 0) {
+				oc->full = mag->next;
+				objcache_mag_free(oc, mag);
+			}
+		} else {
+			obj = objcache_slab_alloc(oc);
+		}
+		pthread_mutex_unlock(&oc->lock);
+		goto done;
+	}
+
+	mag = cpu->loaded;
+	if (mag->rounds == 0) {
+		if (cpu->previous->rounds) {
+			cpu->loaded = cpu->previous;
+			cpu->previous = mag;
+		} else {
+			/*
+			 * Both magazines are empty, exchange the previous
+			 * one for a full one from the depot, or fill it
+			 * from the slab.
+			 */
+			pthread_mutex_lock(&oc->lock);
+			if ((mag = oc->full) != NULL) {
+				oc->full = mag->next;
+				mag->next = NULL;
+				objcache_mag_free(oc, cpu->previous);
+			} else {
+				mag = cpu->previous;
+				while (mag->rounds < OBJCACHE_MAGSIZE)
+					mag->objs[mag->rounds++] =
+					    objcache_slab_alloc(oc);
+			}
+			pthread_mutex_unlock(&oc->lock);
+			cpu->previous = cpu->loaded;
+			cpu->loaded = mag;
+		}
+		mag = cpu->loaded;
+	}
+	obj = mag->objs[--mag->rounds];
+done:
+	if (ocflags & M_ZERO)
+		bzero(obj, oc->objsize);
+
+	return (obj);
+}
+
+void
+objcache_put(struct objcache *oc, void *obj)
+{
+	struct objcache_cpu *cpu;
+	struct objcache_magazine *mag;
+
+	cpu = objcache_cpu_get(oc);
+	if (cpu == NULL) {
+		pthread_mutex_lock(&oc->lock);
+		if ((mag = oc->full) == NULL ||
+		    mag->rounds == OBJCACHE_MAGSIZE) {
+			mag = objcache_mag_alloc(oc);
+			mag->next = oc->full;
+			oc->full = mag;
+		}
+		mag->objs[mag->rounds++] = obj;
+		pthread_mutex_unlock(&oc->lock);
+		return;
+	}
+
+	mag = cpu->loaded;
+	if (mag->rounds == OBJCACHE_MAGSIZE) {
+		if (cpu->previous->rounds < OBJCACHE_MAGSIZE) {
+			cpu->loaded = cpu->previous;
+			cpu->previous = mag;
+		} else {
+			/*
+			 * Both magazines are full, hand the previous one
+			 * to the depot for an empty one.
+			 */
+			pthread_mutex_lock(&oc->lock);
+			mag = cpu->previous;
+			mag->next = oc->full;
+			oc->full = mag;
+			mag = objcache_mag_alloc(oc);
+			pthread_mutex_unlock(&oc->lock);
+			cpu->previous = cpu->loaded;
+			cpu->loaded = mag;
+		}
+		mag = cpu->loaded;
+	}
+	mag->objs[mag->rounds++] = obj;
+}
+
+/*
+ * Detach a thread cache from its cache, the magazines go to the depot.
+ * Caller must hold objcache_lock.
+ */
+static void
+objcache_cpu_detach(struct objcache_cpu *cpu)
+{
+	struct objcache *oc = cpu->oc;
+	struct objcache_cpu **cpup;
+
+	pthread_mutex_lock(&oc->lock);
+	for (cpup = &oc->cpus; *cpup != cpu; cpup = &(*cpup)->next)
+		;
+	*cpup = cpu->next;
+	objcache_mag_free(oc, cpu->loaded);
+	objcache_mag_free(oc, cpu->previous);
+	pthread_mutex_unlock(&oc->lock);
+
+	cpu->oc = NULL;
+	cpu->next = NULL;
+	cpu->loaded = NULL;
+	cpu->previous = NULL;
+}
+
+static void
+objcache_thread_exit(void *arg)
+{
+	struct objcache_thread *ot = arg;
+	int i;
+
+	pthread_mutex_lock(&objcache_lock);
+	for (i = 0; i < OBJCACHE_MAX; ++i) {
+		if (ot->cpu[i] == NULL)
+			continue;
+		if (ot->cpu[i]->oc)
+			objcache_cpu_detach(ot->cpu[i]);
+		free(ot->cpu[i]);
+	}
+	pthread_mutex_unlock(&objcache_lock);
+	free(ot);
+}
+
+/*
+ * Destroy a cache, all objects must have been returned.  Thread caches
+ * of other threads are detached but stay owned by their threads.
+ */
+void
+objcache_destroy(struct objcache *oc)
+{
+	struct objcache_magazine *mag;
+	struct objcache_slab *slab;
+
+	pthread_mutex_lock(&objcache_lock);
+	while (oc->cpus)
+		objcache_cpu_detach(oc->cpus);
+	if (oc->index >= 0)
+		objcache_map[oc->index] = NULL;
+	pthread_mutex_unlock(&objcache_lock);
+
+	while ((mag = oc->full) != NULL) {
+		oc->full = mag->next;
+		free(mag);
+	}
+	while ((mag = oc->empty) != NULL) {
+		oc->empty = mag->next;
+		free(mag);
+	}
+	while ((slab = oc->slabs) != NULL) {
+		oc->slabs = slab->next;
+		free(slab);
+	}
+	pthread_mutex_destroy(&oc->lock);
+	free(oc);
+}
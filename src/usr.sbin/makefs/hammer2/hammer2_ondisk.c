@@ -160,18 +160,35 @@ hammer2_close_devvp(const hammer2_devvp_list_t *devvpl, int ronly)
 	return 0;
 }
 
+/*
+ * makefs opens the volumes itself, devvp[] holds one device vnode per
+ * ':' separated path in blkdevs.
+ */
 int
-hammer2_init_devvp(struct m_vnode *devvp, hammer2_devvp_list_t *devvpl)
+hammer2_init_devvp(const char *blkdevs, struct m_vnode *devvp,
+		   hammer2_devvp_list_t *devvpl)
 {
 	hammer2_devvp_t *e;
+	const char *p;
+	size_t len;
 	int error = 0;
 
+	KKASSERT(TAILQ_EMPTY(devvpl));
+	KKASSERT(blkdevs);
+	p = blkdevs;
+
 	while (1) {
+		len = strcspn(p, ":");
 		KKASSERT(devvp);
+		KKASSERT(devvp->fs);
 		e = kmalloc(sizeof(*e), M_HAMMER2, M_WAITOK | M_ZERO);
-		e->devvp = devvp;
+		e->devvp = devvp++;
+		e->path = strndup(p, len);
 		TAILQ_INSERT_TAIL(devvpl, e, entry);
-		break;
+		p += len;
+		if (*p == '\0')
+			break;
+		p++;
 	}
 
 	return error;
@@ -194,10 +211,8 @@ hammer2_cleanup_devvp(hammer2_devvp_list_t *devvpl)
 		vrele(e->devvp);
 		e->devvp = NULL;
 		/* path */
-		/*
 		KKASSERT(e->path);
 		kfree(e->path, M_HAMMER2);
-		*/
 		e->path = NULL;
 		kfree(e, M_HAMMER2);
 	}
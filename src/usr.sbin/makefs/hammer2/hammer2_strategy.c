@@ -55,6 +55,10 @@
 #include <sys/objcache.h>
 */
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
 #include "hammer2.h"
 #include "hammer2_lz4.h"
 
@@ -64,10 +68,8 @@
 #define __DECONST(type, var)	((type)(__uintptr_t)(const void *)(var))
 #endif
 
-/*
 struct objcache *cache_buffer_read;
 struct objcache *cache_buffer_write;
-*/
 
 /*
  * Strategy code (async logical file buffer I/O from system)
@@ -91,9 +93,15 @@ static int hammer2_strategy_read(struct vop_strategy_args *ap);
 static int hammer2_strategy_write(struct vop_strategy_args *ap);
 static void hammer2_strategy_read_completion(hammer2_chain_t *focus,
 				const char *data, struct bio *bio);
+static void hammer2_strategy_wait(int *donep);
+static void hammer2_strategy_done(int *donep);
 
 static hammer2_off_t hammer2_dedup_lookup(hammer2_dev_t *hmp,
 			char **datap, int pblksize);
+static void hammer2_dedup_index_enter(hammer2_dev_t *hmp, uint64_t crc,
+			hammer2_off_t data_off);
+static hammer2_off_t hammer2_dedup_index_lookup(hammer2_dev_t *hmp,
+			const char *data, uint64_t crc, int pblksize);
 
 int
 hammer2_vop_strategy(struct vop_strategy_args *ap)
@@ -173,7 +181,7 @@ hammer2_decompress_LZ4_callback(const char *data, u_int bytes, struct bio *bio)
 	compressed_size = *(const int *)data;
 	KKASSERT((uint32_t)compressed_size <= bytes - sizeof(int));
 
-	compressed_buffer = ecalloc(1, 65536);
+	compressed_buffer = objcache_get(cache_buffer_read, M_INTWAIT);
 	result = LZ4_decompress_safe(__DECONST(char *, &data[sizeof(int)]),
 				     compressed_buffer,
 				     compressed_size,
@@ -189,7 +197,7 @@ hammer2_decompress_LZ4_callback(const char *data, u_int bytes, struct bio *bio)
 	bcopy(compressed_buffer, bp->b_data, bp->b_bufsize);
 	if (result < bp->b_bufsize)
 		bzero(bp->b_data + result, bp->b_bufsize - result);
-	free(compressed_buffer);
+	objcache_put(cache_buffer_read, compressed_buffer);
 	/*
 	bp->b_resid = 0;
 	bp->b_flags |= B_AGE;
@@ -223,7 +231,7 @@ hammer2_decompress_ZLIB_callback(const char *data, u_int bytes, struct bio *bio)
 	if (ret != Z_OK)
 		kprintf("HAMMER2 ZLIB: Fatal error in inflateInit.\n");
 
-	compressed_buffer = ecalloc(1, 65536);
+	compressed_buffer = objcache_get(cache_buffer_read, M_INTWAIT);
 	strm_decompress.next_in = __DECONST(z_Bytef *, data);
 
 	/* XXX supply proper size, subset of device bp */
@@ -240,7 +248,7 @@ hammer2_decompress_ZLIB_callback(const char *data, u_int bytes, struct bio *bio)
 	result = bp->b_bufsize - strm_decompress.avail_out;
 	if (result < bp->b_bufsize)
 		bzero(bp->b_data + result, strm_decompress.avail_out);
-	free(compressed_buffer);
+	objcache_put(cache_buffer_read, compressed_buffer);
 	ret = inflateEnd(&strm_decompress);
 
 	/*
@@ -249,6 +257,38 @@ hammer2_decompress_ZLIB_callback(const char *data, u_int bytes, struct bio *bio)
 	*/
 }
 
+/*
+ * makefs has no biodone(), the frontend waits for its own XOP to complete
+ * before returning the buffer to the caller.  Waiting on the XOP rather
+ * than on the PFS-wide lwinprog count lets strategy I/O on other inodes
+ * run in other frontend threads meanwhile.
+ *
+ * The XOP may be freed as soon as it is retired, so the backend completing
+ * it signals through the flag on the frontend's stack.
+ */
+static
+void
+hammer2_strategy_wait(int *donep)
+{
+	for (;;) {
+		if (*(volatile int *)donep)
+			break;
+		tsleep_interlock(donep, 0);
+		cpu_ccfence();
+		if (*(volatile int *)donep)
+			break;
+		tsleep(donep, PINTERLOCKED, "h2strat", hz);
+	}
+}
+
+static
+void
+hammer2_strategy_done(int *donep)
+{
+	atomic_set_int(donep, 1);
+	wakeup(donep);
+}
+
 /*
  * Logical buffer I/O, async read.
  */
@@ -260,6 +300,7 @@ hammer2_strategy_read(struct vop_strategy_args *ap)
 	struct bio *bio;
 	hammer2_inode_t *ip;
 	hammer2_key_t lbase;
+	int done = 0;
 
 	bio = ap->a_bio;
 	ip = VTOI(ap->a_vp);
@@ -271,10 +312,15 @@ hammer2_strategy_read(struct vop_strategy_args *ap)
 	xop->finished = 0;
 	xop->bio = bio;
 	xop->lbase = lbase;
+	xop->donep = &done;
 	hammer2_mtx_init(&xop->lock, "h2bior");
+	hammer2_lwinprog_ref(ip->pmp);
 	hammer2_xop_start(&xop->head, &hammer2_strategy_read_desc);
 	/* asynchronous completion */
 
+	/* makefs uses the bp as soon as we return */
+	hammer2_strategy_wait(&done);
+
 	return(0);
 }
 
@@ -287,9 +333,11 @@ void
 hammer2_xop_strategy_read(hammer2_xop_t *arg, void *scratch, int clindex)
 {
 	hammer2_xop_strategy_t *xop = &arg->xop_strategy;
+	hammer2_pfs_t *pmp;
 	hammer2_chain_t *parent;
 	hammer2_chain_t *chain;
 	hammer2_chain_t *focus;
+	int *donep;
 	hammer2_key_t key_dummy;
 	hammer2_key_t lbase;
 	struct bio *bio;
@@ -303,6 +351,7 @@ hammer2_xop_strategy_read(hammer2_xop_t *arg, void *scratch, int clindex)
 	 * that we are the ones finishing it up.
 	 */
 	lbase = xop->lbase;
+	pmp = xop->head.ip1->pmp;
 
 	/*
 	 * This is difficult to optimize.  The logical buffer might be
@@ -357,6 +406,7 @@ hammer2_xop_strategy_read(hammer2_xop_t *arg, void *scratch, int clindex)
 	}
 	bio = xop->bio;
 	bp = bio->bio_buf;
+	donep = xop->donep;
 	bkvasync(bp);
 
 	/*
@@ -390,6 +440,8 @@ hammer2_xop_strategy_read(hammer2_xop_t *arg, void *scratch, int clindex)
 		hammer2_xop_pdata(&xop->head);
 		//biodone(bio);
 		hammer2_xop_retire(&xop->head, HAMMER2_XOPMASK_VOP);
+		hammer2_lwinprog_drop(pmp);
+		hammer2_strategy_done(donep);
 		break;
 	case HAMMER2_ERROR_ENOENT:
 		xop->finished = 1;
@@ -402,6 +454,8 @@ hammer2_xop_strategy_read(hammer2_xop_t *arg, void *scratch, int clindex)
 		bzero(bp->b_data, bp->b_bcount);
 		//biodone(bio);
 		hammer2_xop_retire(&xop->head, HAMMER2_XOPMASK_VOP);
+		hammer2_lwinprog_drop(pmp);
+		hammer2_strategy_done(donep);
 		break;
 	case HAMMER2_ERROR_EINPROGRESS:
 		hammer2_mtx_unlock(&xop->lock);
@@ -418,6 +472,8 @@ hammer2_xop_strategy_read(hammer2_xop_t *arg, void *scratch, int clindex)
 		biodone(bio);
 		*/
 		hammer2_xop_retire(&xop->head, HAMMER2_XOPMASK_VOP);
+		hammer2_lwinprog_drop(pmp);
+		hammer2_strategy_done(donep);
 		break;
 	}
 }
@@ -489,6 +545,172 @@ hammer2_strategy_read_completion(hammer2_chain_t *focus, const char *data,
 	}
 }
 
+/*
+ * Decompress or copy bytes of physical block data stored with compression
+ * comp into dst, zero-filling it up to the logical block size lsize.
+ */
+static
+int
+hammer2_decompress_block(int comp, const char *data, int bytes, char *dst,
+			 int lsize)
+{
+	z_stream strm_decompress;
+	int compressed_size;
+	int result;
+	int ret;
+
+	switch (comp) {
+	case HAMMER2_COMP_LZ4:
+		compressed_size = *(const int *)data;
+		if ((uint32_t)compressed_size > bytes - sizeof(int))
+			return (EIO);
+		result = LZ4_decompress_safe(__DECONST(char *,
+						       &data[sizeof(int)]),
+					     dst, compressed_size, lsize);
+		if (result < 0)
+			return (EIO);
+		break;
+	case HAMMER2_COMP_ZLIB:
+		bzero(&strm_decompress, sizeof(strm_decompress));
+		if (inflateInit(&strm_decompress) != Z_OK)
+			return (EIO);
+		strm_decompress.next_in = __DECONST(z_Bytef *, data);
+		strm_decompress.avail_in = bytes;
+		strm_decompress.next_out = (void *)dst;
+		strm_decompress.avail_out = lsize;
+		ret = inflate(&strm_decompress, Z_FINISH);
+		result = lsize - strm_decompress.avail_out;
+		inflateEnd(&strm_decompress);
+		if (ret != Z_STREAM_END)
+			return (EIO);
+		break;
+	case HAMMER2_COMP_NONE:
+		result = bytes;
+		if (result > lsize)
+			return (EIO);
+		bcopy(data, dst, result);
+		break;
+	default:
+		return (EIO);
+	}
+	if (result < lsize)
+		bzero(dst + result, lsize - result);
+
+	return (0);
+}
+
+/*
+ * makefs streaming read of a whole file.  The data chains are iterated
+ * once in key order instead of being looked up from the inode for each
+ * logical buffer, and contiguous blocks are decompressed back to back
+ * into buf.  func is called with the run in buf whenever the next block
+ * does not follow it or does not fit, and once at the end.
+ */
+int
+hammer2_strategy_read_stream(hammer2_inode_t *ip, char *buf, size_t size,
+			     hammer2_stream_func_t func, void *arg)
+{
+	hammer2_chain_t *parent;
+	hammer2_chain_t *chain;
+	hammer2_key_t key_next;
+	hammer2_key_t lbase;
+	hammer2_key_t run_off;
+	hammer2_off_t fsize;
+	const char *data;
+	size_t run_len;
+	size_t lsize;
+	int cerror;
+	int error;
+
+	KKASSERT(size >= HAMMER2_PBUFSIZE);
+
+	hammer2_inode_lock(ip, HAMMER2_RESOLVE_SHARED);
+	fsize = ip->meta.size;
+	parent = hammer2_inode_chain(ip, 0, HAMMER2_RESOLVE_ALWAYS |
+					    HAMMER2_RESOLVE_SHARED);
+	if (parent == NULL) {
+		hammer2_inode_unlock(ip);
+		return (EIO);
+	}
+
+	run_off = 0;
+	run_len = 0;
+	cerror = 0;
+	error = 0;
+	chain = hammer2_chain_lookup(&parent, &key_next,
+				     0, HAMMER2_KEY_MAX,
+				     &cerror,
+				     HAMMER2_LOOKUP_ALWAYS |
+				     HAMMER2_LOOKUP_SHARED);
+	while (chain) {
+		if (chain->error) {
+			error = hammer2_error_to_errno(chain->error);
+			break;
+		}
+		if (chain->bref.type == HAMMER2_BREF_TYPE_INODE) {
+			/* direct data, the inode itself */
+			lbase = 0;
+			lsize = HAMMER2_EMBEDDED_BYTES;
+			data = chain->data->ipdata.u.data;
+		} else if (chain->bref.type == HAMMER2_BREF_TYPE_DATA) {
+			lbase = chain->bref.key;
+			lsize = (size_t)1 << chain->bref.keybits;
+			data = chain->data->buf;
+			/* free the chain once the iteration moves on */
+			atomic_set_int(&chain->flags, HAMMER2_CHAIN_RELEASE);
+		} else {
+			lbase = fsize;
+			lsize = 0;
+			data = NULL;
+		}
+
+		if (lbase < fsize && lsize) {
+			if (run_len &&
+			    (run_off + run_len != lbase ||
+			     run_len + lsize > size)) {
+				error = func(arg, run_off, buf, run_len);
+				run_len = 0;
+				if (error)
+					break;
+			}
+			if (run_len == 0)
+				run_off = lbase;
+			if (chain->bref.type == HAMMER2_BREF_TYPE_INODE) {
+				bcopy(data, buf + run_len, lsize);
+			} else {
+				error = hammer2_decompress_block(
+				    HAMMER2_DEC_COMP(chain->bref.methods),
+				    data, chain->bytes, buf + run_len,
+				    (int)lsize);
+				if (error)
+					break;
+			}
+			if (lsize > fsize - lbase)
+				lsize = fsize - lbase;
+			run_len += lsize;
+		}
+		chain = hammer2_chain_next(&parent, chain, &key_next,
+					   key_next, HAMMER2_KEY_MAX,
+					   &cerror,
+					   HAMMER2_LOOKUP_ALWAYS |
+					   HAMMER2_LOOKUP_SHARED);
+	}
+	if (chain) {
+		hammer2_chain_unlock(chain);
+		hammer2_chain_drop(chain);
+	}
+	hammer2_chain_unlock(parent);
+	hammer2_chain_drop(parent);
+	hammer2_inode_unlock(ip);
+
+	if (error == 0)
+		error = hammer2_error_to_errno(cerror);
+	if (error == 0 && run_len)
+		error = func(arg, run_off, buf, run_len);
+
+	return (error);
+}
+
 /****************************************************************************
  *				WRITE SUPPORT				    *
  ****************************************************************************/
@@ -511,6 +733,9 @@ static void hammer2_zero_check_and_write(char *data, hammer2_inode_t *ip,
 				hammer2_key_t lbase, int ioflag, int pblksize,
 				hammer2_tid_t mtid, int *errorp,
 				int check_algo);
+static int hammer2_compress_block(const char *data, int pblksize,
+				int comp_algo, char *comp_buffer,
+				int *comp_block_sizep);
 static int test_block_zeros(const char *buf, size_t bytes);
 static void zero_write(char *data, hammer2_inode_t *ip,
 				hammer2_chain_t **parentp,
@@ -519,7 +744,12 @@ static void zero_write(char *data, hammer2_inode_t *ip,
 static void hammer2_write_bp(hammer2_chain_t *chain, char *data,
 				int ioflag, int pblksize,
 				hammer2_tid_t mtid, int *errorp,
-				int check_algo);
+				int check_algo, hammer2_wcomp_t *wc);
+static hammer2_wcomp_t *hammer2_wcomp_get(hammer2_inode_t *ip,
+				hammer2_key_t lbase, int pblksize,
+				int comp_algo, int check_algo);
+static void hammer2_wcomp_setcheck(hammer2_chain_t *chain, void *bdata,
+				hammer2_wcomp_t *wc, int iscomp);
 
 int
 hammer2_strategy_write(struct vop_strategy_args *ap)
@@ -528,6 +758,7 @@ hammer2_strategy_write(struct vop_strategy_args *ap)
 	hammer2_pfs_t *pmp;
 	struct bio *bio;
 	hammer2_inode_t *ip;
+	int done = 0;
 
 	bio = ap->a_bio;
 	ip = VTOI(ap->a_vp);
@@ -543,11 +774,54 @@ hammer2_strategy_write(struct vop_strategy_args *ap)
 	xop->finished = 0;
 	xop->bio = bio;
 	xop->lbase = bio->bio_offset;
+	xop->donep = &done;
 	hammer2_mtx_init(&xop->lock, "h2biow");
 	hammer2_xop_start(&xop->head, &hammer2_strategy_write_desc);
 	/* asynchronous completion */
 
-	hammer2_lwinprog_wait(pmp, hammer2_flush_pipe);
+	/*
+	 * makefs releases the bp as soon as we return, there is no biodone()
+	 * to hold it until the backend has consumed the data.
+	 */
+	hammer2_strategy_wait(&done);
+
+	return(0);
+}
+
+/*
+ * makefs direct write of the logical block at lbase from data, which is
+ * used as is by the strategy code instead of being copied to a logical
+ * buffer and then to the per-thread scratch buffer.  data must cover the
+ * physical block size of the block, zero-filled past the file EOF.
+ */
+int
+hammer2_strategy_write_direct(hammer2_inode_t *ip, hammer2_key_t lbase,
+			      const char *data)
+{
+	hammer2_xop_strategy_t *xop;
+	hammer2_pfs_t *pmp;
+	int done = 0;
+
+	KKASSERT((lbase & HAMMER2_PBUFMASK64) == 0);
+	pmp = ip->pmp;
+
+	atomic_set_int(&ip->flags, HAMMER2_INODE_DIRTYDATA);
+	hammer2_lwinprog_ref(pmp);
+	hammer2_trans_assert_strategy(pmp);
+	hammer2_trans_init(pmp, HAMMER2_TRANS_BUFCACHE);
+
+	xop = hammer2_xop_alloc(ip, HAMMER2_XOP_MODIFYING |
+				    HAMMER2_XOP_STRATEGY);
+	xop->finished = 0;
+	xop->bio = NULL;
+	xop->data = data;
+	xop->lbase = lbase;
+	xop->donep = &done;
+	hammer2_mtx_init(&xop->lock, "h2biow");
+	hammer2_xop_start(&xop->head, &hammer2_strategy_write_desc);
+
+	/* data and ip->wcomp are only valid until we return */
+	hammer2_strategy_wait(&done);
 
 	return(0);
 }
@@ -570,6 +844,7 @@ hammer2_xop_strategy_write(hammer2_xop_t *arg, void *scratch, int clindex)
 	hammer2_inode_t *ip;
 	struct bio *bio;
 	struct m_buf *bp;
+	int *donep;
 	int error;
 	int lblksize;
 	int pblksize;
@@ -589,17 +864,27 @@ hammer2_xop_strategy_write(hammer2_xop_t *arg, void *scratch, int clindex)
 
 	lbase = xop->lbase;
 	bio = xop->bio;			/* ephermal */
-	bp = bio->bio_buf;		/* ephermal */
 	ip = xop->head.ip1;		/* retained by ref */
-	bio_data = scratch;
 
 	/* hammer2_trans_init(parent->hmp->spmp, HAMMER2_TRANS_BUFCACHE); */
 
-	lblksize = hammer2_calc_logical(ip, bio->bio_offset, &lbase, NULL);
-	pblksize = hammer2_calc_physical(ip, lbase);
-	bkvasync(bp);
-	KKASSERT(lblksize <= MAXPHYS);
-	bcopy(bp->b_data, bio_data, lblksize);
+	if (xop->data) {
+		/*
+		 * makefs direct write, the caller's data stays valid
+		 * until we return.
+		 */
+		pblksize = hammer2_calc_physical(ip, lbase);
+		bio_data = __DECONST(char *, xop->data);
+	} else {
+		bp = bio->bio_buf;	/* ephermal */
+		bio_data = scratch;
+		lblksize = hammer2_calc_logical(ip, bio->bio_offset,
+						&lbase, NULL);
+		pblksize = hammer2_calc_physical(ip, lbase);
+		bkvasync(bp);
+		KKASSERT(lblksize <= MAXPHYS);
+		bcopy(bp->b_data, bio_data, lblksize);
+	}
 
 	hammer2_mtx_unlock(&xop->lock);
 	bp = NULL;	/* safety, illegal to access after unlock */
@@ -653,7 +938,7 @@ hammer2_xop_strategy_write(hammer2_xop_t *arg, void *scratch, int clindex)
 	hammer2_mtx_unlock(&xop->lock);
 
 	bio = xop->bio;		/* now owned by us */
-	bp = bio->bio_buf;	/* now owned by us */
+	donep = xop->donep;
 
 	if (error == HAMMER2_ERROR_ENOENT || error == 0) {
 		/*
@@ -664,7 +949,7 @@ hammer2_xop_strategy_write(hammer2_xop_t *arg, void *scratch, int clindex)
 		*/
 	} else {
 		kprintf("xop_strategy_write: error %d loff=%016jx\n",
-			error, (intmax_t)bp->b_loffset);
+			error, (intmax_t)lbase);
 		assert(0);
 		/*
 		bp->b_flags |= B_ERROR;
@@ -676,6 +961,7 @@ hammer2_xop_strategy_write(hammer2_xop_t *arg, void *scratch, int clindex)
 	hammer2_trans_assert_strategy(ip->pmp);
 	hammer2_lwinprog_drop(ip->pmp);
 	hammer2_trans_done(ip->pmp, HAMMER2_TRANS_BUFCACHE);
+	hammer2_strategy_done(donep);
 }
 
 /*
@@ -801,6 +1087,8 @@ hammer2_assign_physical(hammer2_inode_t *ip, hammer2_chain_t **parentp,
 	} else {
 		*errorp = chain->error;
 	}
+	if (*errorp == 0 && chain->bref.type == HAMMER2_BREF_TYPE_DATA)
+		ip->wbytes += pblksize;
 	atomic_set_int(&ip->flags, HAMMER2_INODE_DIRTYDATA);
 failed:
 	return (chain);
@@ -822,12 +1110,16 @@ hammer2_write_file_core(char *data, hammer2_inode_t *ip,
 			hammer2_tid_t mtid, int *errorp)
 {
 	hammer2_chain_t *chain;
+	hammer2_wcomp_t *wc;
 	char *bdata;
 
 	*errorp = 0;
 
 	switch(HAMMER2_DEC_ALGO(ip->meta.comp_algo)) {
 	case HAMMER2_COMP_NONE:
+		wc = hammer2_wcomp_get(ip, lbase, pblksize,
+				       ip->meta.comp_algo,
+				       ip->meta.check_algo);
 		/*
 		 * We have to assign physical storage to the buffer
 		 * we intend to dirty or write now to avoid deadlocks
@@ -848,7 +1140,7 @@ hammer2_write_file_core(char *data, hammer2_inode_t *ip,
 			KKASSERT(wipdata->meta.op_flags &
 				 HAMMER2_OPFLAG_DIRECTDATA);
 			bcopy(data, wipdata->u.data, HAMMER2_EMBEDDED_BYTES);
-			++hammer2_iod_file_wembed;
+			atomic_add_long(&hammer2_iod_file_wembed, 1);
 		} else if (bdata == NULL) {
 			/*
 			 * Copy of data already present on-media.
@@ -856,11 +1148,11 @@ hammer2_write_file_core(char *data, hammer2_inode_t *ip,
 			chain->bref.methods =
 				HAMMER2_ENC_COMP(HAMMER2_COMP_NONE) +
 				HAMMER2_ENC_CHECK(ip->meta.check_algo);
-			hammer2_chain_setcheck(chain, data);
+			hammer2_wcomp_setcheck(chain, data, wc, 0);
 			atomic_clear_int(&chain->flags, HAMMER2_CHAIN_INITIAL);
 		} else {
 			hammer2_write_bp(chain, data, ioflag, pblksize,
-					 mtid, errorp, ip->meta.check_algo);
+					 mtid, errorp, ip->meta.check_algo, wc);
 		}
 		if (chain) {
 			hammer2_chain_unlock(chain);
@@ -906,11 +1198,17 @@ hammer2_compress_and_write(char *data, hammer2_inode_t *ip,
 	hammer2_tid_t mtid, int *errorp, int comp_algo, int check_algo)
 {
 	hammer2_chain_t *chain;
+	hammer2_wcomp_t *wc;
 	int comp_size;
 	int comp_block_size;
 	char *comp_buffer;
 	char *bdata;
 
+	/*
+	 * Use the work done ahead by the write pipeline if any.
+	 */
+	wc = hammer2_wcomp_get(ip, lbase, pblksize, comp_algo, check_algo);
+
 	/*
 	 * An all-zeros write creates a hole unless the check code
 	 * is disabled.  When the check code is disabled all writes
@@ -920,7 +1218,7 @@ hammer2_compress_and_write(char *data, hammer2_inode_t *ip,
 	 *	 (see the HAMMER2_CHECK_NONE in hammer2_chain.c).
 	 */
 	if (check_algo != HAMMER2_CHECK_NONE &&
-	    test_block_zeros(data, pblksize)) {
+	    (wc ? wc->zero : test_block_zeros(data, pblksize))) {
 		zero_write(data, ip, parentp, lbase, mtid, errorp);
 		return;
 	}
@@ -933,73 +1231,28 @@ hammer2_compress_and_write(char *data, hammer2_inode_t *ip,
 	 * uncompressable and avoid the compression attempt in that
 	 * case.  If the compression heuristic is turned off, we always
 	 * try to compress.
+	 *
+	 * The write pipeline always compresses, its result is simply
+	 * ignored when the heuristic says not to try so the image does
+	 * not depend on it.
 	 */
 	comp_size = 0;
+	comp_block_size = pblksize;
 	comp_buffer = NULL;
 
 	KKASSERT(pblksize / 2 <= 32768);
 
 	if (ip->comp_heuristic < 8 || (ip->comp_heuristic & 7) == 0 ||
 	    hammer2_always_compress) {
-		z_stream strm_compress;
-		int comp_level;
-		int ret;
-
-		switch(HAMMER2_DEC_ALGO(comp_algo)) {
-		case HAMMER2_COMP_LZ4:
-			/*
-			 * We need to prefix with the size, LZ4
-			 * doesn't do it for us.  Add the related
-			 * overhead.
-			 *
-			 * NOTE: The LZ4 code seems to assume at least an
-			 *	 8-byte buffer size granularity and may
-			 *	 overrun the buffer if given a 4-byte
-			 *	 granularity.
-			 */
-			comp_buffer = ecalloc(1, 32768);
-			comp_size = LZ4_compress_limitedOutput(
-					data,
-					&comp_buffer[sizeof(int)],
-					pblksize,
-					pblksize / 2 - sizeof(int64_t));
-			*(int *)comp_buffer = comp_size;
-			if (comp_size)
-				comp_size += sizeof(int);
-			break;
-		case HAMMER2_COMP_ZLIB:
-			comp_level = HAMMER2_DEC_LEVEL(comp_algo);
-			if (comp_level == 0)
-				comp_level = 6;	/* default zlib compression */
-			else if (comp_level < 6)
-				comp_level = 6;
-			else if (comp_level > 9)
-				comp_level = 9;
-			bzero(&strm_compress, sizeof(strm_compress));
-			ret = deflateInit(&strm_compress, comp_level);
-			if (ret != Z_OK) {
-				kprintf("HAMMER2 ZLIB: fatal error "
-					"on deflateInit.\n");
-			}
-
-			comp_buffer = ecalloc(1, 32768);
-			strm_compress.next_in = (void *)data;
-			strm_compress.avail_in = pblksize;
-			strm_compress.next_out = (void *)comp_buffer;
-			strm_compress.avail_out = pblksize / 2;
-			ret = deflate(&strm_compress, Z_FINISH);
-			if (ret == Z_STREAM_END) {
-				comp_size = pblksize / 2 -
-					    strm_compress.avail_out;
-			} else {
-				comp_size = 0;
-			}
-			ret = deflateEnd(&strm_compress);
-			break;
-		default:
-			kprintf("Error: Unknown compression method.\n");
-			kprintf("Comp_method = %d.\n", comp_algo);
-			break;
+		if (wc) {
+			comp_size = wc->comp_size;
+			comp_block_size = wc->comp_block_size;
+		} else {
+			comp_buffer = objcache_get(cache_buffer_write,
+						   M_INTWAIT);
+			comp_size = hammer2_compress_block(data, pblksize,
+					comp_algo, comp_buffer,
+					&comp_block_size);
 		}
 	}
 
@@ -1015,33 +1268,8 @@ hammer2_compress_and_write(char *data, hammer2_inode_t *ip,
 		 * compression succeeded
 		 */
 		ip->comp_heuristic = 0;
-		if (comp_size <= 1024) {
-			comp_block_size = 1024;
-		} else if (comp_size <= 2048) {
-			comp_block_size = 2048;
-		} else if (comp_size <= 4096) {
-			comp_block_size = 4096;
-		} else if (comp_size <= 8192) {
-			comp_block_size = 8192;
-		} else if (comp_size <= 16384) {
-			comp_block_size = 16384;
-		} else if (comp_size <= 32768) {
-			comp_block_size = 32768;
-		} else {
-			panic("hammer2: WRITE PATH: "
-			      "Weird comp_size value.");
-			/* NOT REACHED */
-			comp_block_size = pblksize;
-		}
-
-		/*
-		 * Must zero the remainder or dedup (which operates on a
-		 * physical block basis) will not find matches.
-		 */
-		if (comp_size < comp_block_size) {
-			bzero(comp_buffer + comp_size,
-			      comp_block_size - comp_size);
-		}
+		if (wc)
+			comp_buffer = wc->comp_buffer;
 	}
 
 	/*
@@ -1065,7 +1293,7 @@ hammer2_compress_and_write(char *data, hammer2_inode_t *ip,
 			KKASSERT(wipdata->meta.op_flags &
 				 HAMMER2_OPFLAG_DIRECTDATA);
 			bcopy(data, wipdata->u.data, HAMMER2_EMBEDDED_BYTES);
-			++hammer2_iod_file_wembed;
+			atomic_add_long(&hammer2_iod_file_wembed, 1);
 		}
 	} else if (bdata == NULL) {
 		/*
@@ -1083,7 +1311,7 @@ hammer2_compress_and_write(char *data, hammer2_inode_t *ip,
 				HAMMER2_ENC_CHECK(check_algo);
 		}
 		bdata = comp_size ? comp_buffer : data;
-		hammer2_chain_setcheck(chain, bdata);
+		hammer2_wcomp_setcheck(chain, bdata, wc, comp_size != 0);
 		atomic_clear_int(&chain->flags, HAMMER2_CHAIN_INITIAL);
 	} else {
 		hammer2_io_t *dio;
@@ -1134,7 +1362,8 @@ hammer2_compress_and_write(char *data, hammer2_inode_t *ip,
 			 * file data (doing so can result in excessive I/O),
 			 * so we do it here.
 			 */
-			hammer2_chain_setcheck(chain, bdata);
+			hammer2_wcomp_setcheck(chain, bdata, wc,
+					       comp_size != 0);
 
 			/*
 			 * Device buffer is now valid, chain is no longer in
@@ -1174,8 +1403,341 @@ done:
 		hammer2_chain_unlock(chain);
 		hammer2_chain_drop(chain);
 	}
-	if (comp_buffer)
-		free(comp_buffer);
+	if (comp_buffer && (wc == NULL || comp_buffer != wc->comp_buffer))
+		objcache_put(cache_buffer_write, comp_buffer);
+}
+
+/*
+ * Per-thread deflate stream.  deflateInit allocates and zeroes several
+ * hundred KB of state, so the stream is kept and reset between blocks and
+ * only reinitialized when the level changes.  Freed at thread exit.
+ */
+struct hammer2_deflate_ctx {
+	z_stream	strm;
+	int		level;
+};
+
+static pthread_key_t hammer2_deflate_key;
+static pthread_once_t hammer2_deflate_once = PTHREAD_ONCE_INIT;
+static __thread struct hammer2_deflate_ctx *hammer2_deflate_ctx;
+
+static
+void
+hammer2_deflate_ctx_free(void *arg)
+{
+	struct hammer2_deflate_ctx *ctx = arg;
+
+	deflateEnd(&ctx->strm);
+	free(ctx);
+}
+
+static
+void
+hammer2_deflate_key_init(void)
+{
+	if (pthread_key_create(&hammer2_deflate_key, hammer2_deflate_ctx_free))
+		panic("hammer2: pthread_key_create failed");
+}
+
+static
+z_stream *
+hammer2_deflate_get(int level)
+{
+	struct hammer2_deflate_ctx *ctx = hammer2_deflate_ctx;
+
+	if (ctx == NULL) {
+		pthread_once(&hammer2_deflate_once, hammer2_deflate_key_init);
+		ctx = ecalloc(1, sizeof(*ctx));
+		ctx->level = -1;
+		hammer2_deflate_ctx = ctx;
+		pthread_setspecific(hammer2_deflate_key, ctx);
+	}
+	if (ctx->level == level && deflateReset(&ctx->strm) == Z_OK)
+		return (&ctx->strm);
+
+	if (ctx->level >= 0)
+		deflateEnd(&ctx->strm);
+	bzero(&ctx->strm, sizeof(ctx->strm));
+	if (deflateInit(&ctx->strm, level) != Z_OK) {
+		ctx->level = -1;
+		return (NULL);
+	}
+	ctx->level = level;
+
+	return (&ctx->strm);
+}
+
+/*
+ * Helper
+ *
+ * Compress pblksize bytes of data into comp_buffer (32KB), returning
+ * the compressed size or 0 if the block does not compress to half its
+ * size.  The physical block size is returned in *comp_block_sizep and
+ * the remainder of the physical block is zeroed.
+ *
+ * Does not touch any chain or inode and may be called from the write
+ * pipeline worker threads.
+ */
+static
+int
+hammer2_compress_block(const char *data, int pblksize, int comp_algo,
+		       char *comp_buffer, int *comp_block_sizep)
+{
+	z_stream *strm_compress;
+	int comp_level;
+	int comp_size;
+	int comp_block_size;
+	int ret;
+
+	comp_size = 0;
+	switch(HAMMER2_DEC_ALGO(comp_algo)) {
+	case HAMMER2_COMP_LZ4:
+		/*
+		 * We need to prefix with the size, LZ4
+		 * doesn't do it for us.  Add the related
+		 * overhead.
+		 *
+		 * NOTE: The LZ4 code seems to assume at least an
+		 *	 8-byte buffer size granularity and may
+		 *	 overrun the buffer if given a 4-byte
+		 *	 granularity.
+		 *
+		 * The level selects the encoder, see HAMMER2_LZ4_LEVEL_*.
+		 */
+		comp_level = HAMMER2_DEC_LEVEL(comp_algo);
+		if (comp_level > HAMMER2_LZ4_LEVEL_DEFAULT) {
+			comp_size = LZ4_compressHC_limitedOutput(
+				__DECONST(char *, data),
+				&comp_buffer[sizeof(int)],
+				pblksize,
+				pblksize / 2 - sizeof(int64_t),
+				comp_level - HAMMER2_LZ4_LEVEL_DEFAULT +
+				LZ4HC_CLEVEL_MIN - 1);
+		} else {
+			if (comp_level == 0)
+				comp_level = HAMMER2_LZ4_LEVEL_DEFAULT;
+			comp_size = LZ4_compress_fast_limitedOutput(
+				__DECONST(char *, data),
+				&comp_buffer[sizeof(int)],
+				pblksize,
+				pblksize / 2 - sizeof(int64_t),
+				1 << (HAMMER2_LZ4_LEVEL_DEFAULT - comp_level));
+		}
+		*(int *)comp_buffer = comp_size;
+		if (comp_size)
+			comp_size += sizeof(int);
+		break;
+	case HAMMER2_COMP_ZLIB:
+		comp_level = HAMMER2_DEC_LEVEL(comp_algo);
+		if (comp_level == 0)
+			comp_level = 6;	/* default zlib compression */
+		else if (comp_level < 6)
+			comp_level = 6;
+		else if (comp_level > 9)
+			comp_level = 9;
+		strm_compress = hammer2_deflate_get(comp_level);
+		if (strm_compress == NULL) {
+			kprintf("HAMMER2 ZLIB: fatal error "
+				"on deflateInit.\n");
+			break;
+		}
+
+		strm_compress->next_in = __DECONST(void *, data);
+		strm_compress->avail_in = pblksize;
+		strm_compress->next_out = (void *)comp_buffer;
+		strm_compress->avail_out = pblksize / 2;
+		ret = deflate(strm_compress, Z_FINISH);
+		if (ret == Z_STREAM_END) {
+			comp_size = pblksize / 2 -
+				    strm_compress->avail_out;
+		} else {
+			comp_size = 0;
+		}
+		break;
+	default:
+		kprintf("Error: Unknown compression method.\n");
+		kprintf("Comp_method = %d.\n", comp_algo);
+		break;
+	}
+
+	if (comp_size == 0) {
+		*comp_block_sizep = pblksize;
+		return (0);
+	}
+
+	if (comp_size <= 1024) {
+		comp_block_size = 1024;
+	} else if (comp_size <= 2048) {
+		comp_block_size = 2048;
+	} else if (comp_size <= 4096) {
+		comp_block_size = 4096;
+	} else if (comp_size <= 8192) {
+		comp_block_size = 8192;
+	} else if (comp_size <= 16384) {
+		comp_block_size = 16384;
+	} else if (comp_size <= 32768) {
+		comp_block_size = 32768;
+	} else {
+		panic("hammer2: WRITE PATH: "
+		      "Weird comp_size value.");
+		/* NOT REACHED */
+		comp_block_size = pblksize;
+	}
+
+	/*
+	 * Must zero the remainder or dedup (which operates on a
+	 * physical block basis) will not find matches.
+	 */
+	if (comp_size < comp_block_size) {
+		bzero(comp_buffer + comp_size,
+		      comp_block_size - comp_size);
+	}
+	*comp_block_sizep = comp_block_size;
+
+	return (comp_size);
+}
+
+/*
+ * Compression microbenchmark.  The sample is compressed in HAMMER2_PBUFSIZE
+ * blocks by hammer2_compress_block() with each algorithm and level, and
+ * every compressed block is decoded by the read path decompressor and
+ * compared with the input.  The ratio is physical bytes written over
+ * logical bytes.  Without a sample file, generated text is used.
+ */
+#define HAMMER2_COMP_BENCH_BYTES	(8 * 1024 * 1024)
+
+static int64_t
+hammer2_comp_bench_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+static size_t
+hammer2_comp_bench_sample(const char *path, char *buf, size_t size)
+{
+	static const char *words[] = {
+		"the", "of", "and", "to", "a", "in", "is", "that", "for", "it",
+		"hammer2", "chain", "inode", "block", "volume", "freemap",
+		"return", "error", "struct", "int", "if", "else", "while",
+		"(", ")", "{", "}", ";", "=", "->", "0", "1", "NULL",
+	};
+	ssize_t n;
+	size_t off, len;
+	const char *w;
+	int fd;
+
+	if (path) {
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			err(1, "failed to open `%s'", path);
+		off = 0;
+		while (off < size) {
+			n = read(fd, buf + off, size - off);
+			if (n < 0)
+				err(1, "failed to read `%s'", path);
+			if (n == 0)
+				break;
+			off += n;
+		}
+		close(fd);
+		return (rounddown(off, HAMMER2_PBUFSIZE));
+	}
+
+	srandom(1);
+	off = 0;
+	while (off < size) {
+		/* skewed towards the front of the list, like real text */
+		w = words[random() % (random() % nitems(words) + 1)];
+		len = strlen(w);
+		if (off + len + 1 > size)
+			break;
+		bcopy(w, buf + off, len);
+		off += len;
+		buf[off++] = (random() % 11) ? ' ' : '\n';
+	}
+	bzero(buf + off, size - off);
+	return (size);
+}
+
+void
+hammer2_comp_bench(const char *path)
+{
+	static const struct {
+		const char	*name;
+		int		algo;
+		int		level;
+	} benches[] = {
+		{ "lz4",	HAMMER2_COMP_LZ4,	0 },
+		{ "lz4",	HAMMER2_COMP_LZ4,	HAMMER2_LZ4_LEVEL_FAST },
+		{ "lz4",	HAMMER2_COMP_LZ4,	HAMMER2_LZ4_LEVEL_HC },
+		{ "zlib",	HAMMER2_COMP_ZLIB,	6 },
+		{ "zlib",	HAMMER2_COMP_ZLIB,	7 },
+		{ "zlib",	HAMMER2_COMP_ZLIB,	8 },
+		{ "zlib",	HAMMER2_COMP_ZLIB,	9 },
+	};
+	char *buf, *comp, *dst;
+	int64_t start, ctime, dtime, pbytes, dbytes;
+	size_t size, off;
+	int *csizes;
+	int i, j, nblocks, comp_algo, comp_block_size;
+
+	buf = malloc(HAMMER2_COMP_BENCH_BYTES);
+	if (buf == NULL)
+		err(1, "malloc");
+	size = hammer2_comp_bench_sample(path, buf, HAMMER2_COMP_BENCH_BYTES);
+	if (size == 0)
+		errx(1, "sample `%s' is smaller than %d bytes", path,
+		    HAMMER2_PBUFSIZE);
+	nblocks = size / HAMMER2_PBUFSIZE;
+	comp = malloc(size);
+	csizes = calloc(nblocks, sizeof(*csizes));
+	dst = malloc(HAMMER2_PBUFSIZE);
+	if (comp == NULL || csizes == NULL || dst == NULL)
+		err(1, "malloc");
+
+	printf("%-10s %6s %8s %12s %12s\n",
+	    "algorithm", "level", "ratio", "comp MB/s", "decomp MB/s");
+	for (i = 0; i < (int)nitems(benches); ++i) {
+		comp_algo = HAMMER2_ENC_ALGO(benches[i].algo) |
+			    HAMMER2_ENC_LEVEL(benches[i].level);
+
+		pbytes = 0;
+		start = hammer2_comp_bench_nsec();
+		for (j = 0, off = 0; j < nblocks; ++j, off += HAMMER2_PBUFSIZE) {
+			csizes[j] = hammer2_compress_block(buf + off,
+			    HAMMER2_PBUFSIZE, comp_algo, comp + off,
+			    &comp_block_size);
+			pbytes += comp_block_size;
+		}
+		ctime = hammer2_comp_bench_nsec() - start;
+
+		dbytes = 0;
+		start = hammer2_comp_bench_nsec();
+		for (j = 0, off = 0; j < nblocks; ++j, off += HAMMER2_PBUFSIZE) {
+			if (csizes[j] == 0)
+				continue;	/* stored uncompressed */
+			if (hammer2_decompress_block(benches[i].algo,
+			    comp + off, csizes[j], dst, HAMMER2_PBUFSIZE) ||
+			    bcmp(dst, buf + off, HAMMER2_PBUFSIZE))
+				errx(1, "%s level %d: block %d does not "
+				    "decompress", benches[i].name,
+				    benches[i].level, j);
+			dbytes += HAMMER2_PBUFSIZE;
+		}
+		dtime = hammer2_comp_bench_nsec() - start;
+
+		printf("%-10s %6d %8.3f %12.1f %12.1f\n",
+		    benches[i].name, benches[i].level,
+		    (double)pbytes / size, (double)size * 1000 / ctime,
+		    dbytes ? (double)dbytes * 1000 / dtime : 0.0);
+	}
+	free(dst);
+	free(csizes);
+	free(comp);
+	free(buf);
 }
 
 /*
@@ -1193,10 +1755,13 @@ hammer2_zero_check_and_write(char *data, hammer2_inode_t *ip,
 	int check_algo)
 {
 	hammer2_chain_t *chain;
+	hammer2_wcomp_t *wc;
 	char *bdata;
 
+	wc = hammer2_wcomp_get(ip, lbase, pblksize, ip->meta.comp_algo,
+			       check_algo);
 	if (check_algo != HAMMER2_CHECK_NONE &&
-	    test_block_zeros(data, pblksize)) {
+	    (wc ? wc->zero : test_block_zeros(data, pblksize))) {
 		/*
 		 * An all-zeros write creates a hole unless the check code
 		 * is disabled.  When the check code is disabled all writes
@@ -1217,13 +1782,13 @@ hammer2_zero_check_and_write(char *data, hammer2_inode_t *ip,
 			/* do nothing */
 		} else if (bdata) {
 			hammer2_write_bp(chain, data, ioflag, pblksize,
-					 mtid, errorp, check_algo);
+					 mtid, errorp, check_algo, wc);
 		} else {
 			/* dedup occurred */
 			chain->bref.methods =
 				HAMMER2_ENC_COMP(HAMMER2_COMP_NONE) +
 				HAMMER2_ENC_CHECK(check_algo);
-			hammer2_chain_setcheck(chain, data);
+			hammer2_wcomp_setcheck(chain, data, wc, 0);
 			atomic_clear_int(&chain->flags, HAMMER2_CHAIN_INITIAL);
 		}
 		if (chain) {
@@ -1283,19 +1848,19 @@ zero_write(char *data, hammer2_inode_t *ip,
 				KKASSERT(wipdata->meta.op_flags &
 					 HAMMER2_OPFLAG_DIRECTDATA);
 				bzero(wipdata->u.data, HAMMER2_EMBEDDED_BYTES);
-				++hammer2_iod_file_wembed;
+				atomic_add_long(&hammer2_iod_file_wembed, 1);
 			}
 		} else {
 			/* chain->error ok for deletion */
 			hammer2_chain_delete(*parentp, chain,
 					     mtid, HAMMER2_DELETE_PERMANENT);
-			++hammer2_iod_file_wzero;
+			atomic_add_long(&hammer2_iod_file_wzero, 1);
 		}
 		atomic_set_int(&ip->flags, HAMMER2_INODE_DIRTYDATA);
 		hammer2_chain_unlock(chain);
 		hammer2_chain_drop(chain);
 	} else {
-		++hammer2_iod_file_wzero;
+		atomic_add_long(&hammer2_iod_file_wzero, 1);
 	}
 }
 
@@ -1310,7 +1875,8 @@ static
 void
 hammer2_write_bp(hammer2_chain_t *chain, char *data, int ioflag,
 		 int pblksize,
-		 hammer2_tid_t mtid, int *errorp, int check_algo)
+		 hammer2_tid_t mtid, int *errorp, int check_algo,
+		 hammer2_wcomp_t *wc)
 {
 	hammer2_inode_data_t *wipdata;
 	hammer2_io_t *dio;
@@ -1327,7 +1893,7 @@ hammer2_write_bp(hammer2_chain_t *chain, char *data, int ioflag,
 		KKASSERT(wipdata->meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA);
 		bcopy(data, wipdata->u.data, HAMMER2_EMBEDDED_BYTES);
 		error = 0;
-		++hammer2_iod_file_wembed;
+		atomic_add_long(&hammer2_iod_file_wembed, 1);
 		break;
 	case HAMMER2_BREF_TYPE_DATA:
 		error = hammer2_io_newnz(chain->hmp,
@@ -1351,7 +1917,7 @@ hammer2_write_bp(hammer2_chain_t *chain, char *data, int ioflag,
 		 * file data (doing so can result in excessive I/O),
 		 * so we do it here.
 		 */
-		hammer2_chain_setcheck(chain, bdata);
+		hammer2_wcomp_setcheck(chain, bdata, wc, 0);
 
 		/*
 		 * Device buffer is now valid, chain is no longer in
@@ -1494,6 +2060,7 @@ hammer2_dedup_record(hammer2_chain_t *chain, hammer2_io_t *dio,
 	dedup->ticks = ticks;
 	dedup->data_off = chain->bref.data_off;
 	dedup->data_crc = crc;
+	hammer2_dedup_index_enter(hmp, crc, chain->bref.data_off);
 
 	/*
 	 * Set the valid bits for the dedup only after we know the data
@@ -1590,7 +2157,16 @@ hammer2_dedup_lookup(hammer2_dev_t *hmp, char **datap, int pblksize)
 			hammer2_io_putblk(&dio);
 		}
 	}
-	return 0;
+
+	/*
+	 * Not in the heuristic or its DIO is gone, try the index.
+	 */
+	off = hammer2_dedup_index_lookup(hmp, data, crc, pblksize);
+	if (off) {
+		*datap = NULL;
+		atomic_add_long(&hammer2_iod_file_wdedup, pblksize);
+	}
+	return off;
 }
 
 /*
@@ -1611,4 +2187,532 @@ hammer2_dedup_clear(hammer2_dev_t *hmp)
 		hmp->heur_dedup[i].data_off = 0;
 		hmp->heur_dedup[i].ticks = ticks - 1;
 	}
+	hammer2_dedup_index_free(hmp);
+}
+
+/*
+ * MAKEFS DEDUP INDEX
+ *
+ * The heuristic only finds a duplicate if the block was recorded recently
+ * and its DIO is still cached.  makefs additionally indexes every recorded
+ * data block by its xxhash64 for the life of the mount so each duplicate
+ * block in the image is stored once.  A hash match is always confirmed
+ * by reading the block back and comparing it in full.
+ *
+ * The index is shared by every thread writing to the device and is
+ * protected by hmp->dedup_spin, which is never held across I/O.
+ */
+#define HAMMER2_DEDUP_INDEX_MIN		1024	/* initial buckets */
+#define HAMMER2_DEDUP_INDEX_PROBE	8	/* candidates read per lookup */
+
+static __inline int
+hammer2_dedup_offhashv(hammer2_off_t data_off)
+{
+	data_off &= ~HAMMER2_OFF_MASK_RADIX;
+	return ((int)((data_off >> HAMMER2_RADIX_MIN) ^ (data_off >> 32)));
+}
+
+/*
+ * Called with hmp->dedup_spin held.
+ */
+static void
+hammer2_dedup_index_resize(hammer2_dev_t *hmp, int nbuckets)
+{
+	hammer2_dedup_ent_t **crchash;
+	hammer2_dedup_ent_t **offhash;
+	hammer2_dedup_ent_t *ent;
+	int hmask;
+	int i;
+	int n;
+
+	crchash = kmalloc(sizeof(*crchash) * nbuckets, M_HAMMER2,
+			  M_WAITOK | M_ZERO);
+	offhash = kmalloc(sizeof(*offhash) * nbuckets, M_HAMMER2,
+			  M_WAITOK | M_ZERO);
+	hmask = nbuckets - 1;
+
+	if (hmp->dedup_crchash) {
+		for (i = 0; i <= hmp->dedup_hmask; ++i) {
+			while ((ent = hmp->dedup_crchash[i]) != NULL) {
+				hmp->dedup_crchash[i] = ent->cnext;
+				n = (int)ent->data_crc & hmask;
+				ent->cnext = crchash[n];
+				crchash[n] = ent;
+				n = hammer2_dedup_offhashv(ent->data_off) &
+				    hmask;
+				ent->onext = offhash[n];
+				offhash[n] = ent;
+			}
+		}
+		kfree(hmp->dedup_crchash, M_HAMMER2);
+		kfree(hmp->dedup_offhash, M_HAMMER2);
+	}
+	hmp->dedup_crchash = crchash;
+	hmp->dedup_offhash = offhash;
+	hmp->dedup_hmask = hmask;
+}
+
+static void
+hammer2_dedup_index_enter(hammer2_dev_t *hmp, uint64_t crc,
+			  hammer2_off_t data_off)
+{
+	hammer2_dedup_ent_t *ent;
+	int n;
+
+	hammer2_spin_ex(&hmp->dedup_spin);
+	if (hmp->dedup_crchash == NULL)
+		hammer2_dedup_index_resize(hmp, HAMMER2_DEDUP_INDEX_MIN);
+
+	/*
+	 * Keep one entry per content, the first block recorded with it
+	 * is the one further duplicates point to.
+	 */
+	n = (int)crc & hmp->dedup_hmask;
+	for (ent = hmp->dedup_crchash[n]; ent; ent = ent->cnext) {
+		if (ent->data_crc == crc &&
+		    (ent->data_off & HAMMER2_OFF_MASK_RADIX) ==
+		    (data_off & HAMMER2_OFF_MASK_RADIX)) {
+			hammer2_spin_unex(&hmp->dedup_spin);
+			return;
+		}
+	}
+
+	ent = kmalloc(sizeof(*ent), M_HAMMER2, M_WAITOK | M_ZERO);
+	ent->data_off = data_off;
+	ent->data_crc = crc;
+	ent->cnext = hmp->dedup_crchash[n];
+	hmp->dedup_crchash[n] = ent;
+	n = hammer2_dedup_offhashv(data_off) & hmp->dedup_hmask;
+	ent->onext = hmp->dedup_offhash[n];
+	hmp->dedup_offhash[n] = ent;
+
+	if (++hmp->dedup_count > hmp->dedup_hmask)
+		hammer2_dedup_index_resize(hmp, (hmp->dedup_hmask + 1) * 2);
+	hammer2_spin_unex(&hmp->dedup_spin);
+}
+
+static hammer2_off_t
+hammer2_dedup_index_lookup(hammer2_dev_t *hmp, const char *data,
+			   uint64_t crc, int pblksize)
+{
+	hammer2_dedup_ent_t *ent;
+	hammer2_io_t *dio;
+	hammer2_off_t cand[HAMMER2_DEDUP_INDEX_PROBE];
+	hammer2_off_t off;
+	int error;
+	int count;
+	int i;
+
+	/*
+	 * Collect the candidates under the spinlock, then read them back
+	 * without it.
+	 */
+	count = 0;
+	hammer2_spin_ex(&hmp->dedup_spin);
+	if (hmp->dedup_crchash)
+		ent = hmp->dedup_crchash[(int)crc & hmp->dedup_hmask];
+	else
+		ent = NULL;
+	for (; ent && count < HAMMER2_DEDUP_INDEX_PROBE; ent = ent->cnext) {
+		off = ent->data_off;
+		if (ent->data_crc != crc)
+			continue;
+		if ((1 << (int)(off & HAMMER2_OFF_MASK_RADIX)) != pblksize)
+			continue;
+		cand[count++] = off;
+	}
+	hammer2_spin_unex(&hmp->dedup_spin);
+
+	for (i = 0; i < count; ++i) {
+		off = cand[i];
+		error = hammer2_io_bread(hmp, HAMMER2_BREF_TYPE_DATA,
+					 off, pblksize, &dio);
+		if (error == 0 &&
+		    bcmp(data, hammer2_io_data(dio, off), pblksize) == 0) {
+			if (hammer2_debug & 0x40000) {
+				kprintf("DEDUP INDEX SUCCESS %016jx\n",
+					(intmax_t)off);
+			}
+			hammer2_io_bqrelse(&dio);
+			return off;
+		}
+		if (dio)
+			hammer2_io_bqrelse(&dio);
+	}
+	return 0;
+}
+
+/*
+ * The block at data_off is being destroyed, stop handing it out.
+ */
+void
+hammer2_dedup_index_delete(hammer2_dev_t *hmp, hammer2_off_t data_off)
+{
+	hammer2_dedup_ent_t **entp;
+	hammer2_dedup_ent_t *ent;
+	int n;
+
+	hammer2_spin_ex(&hmp->dedup_spin);
+	if (hmp->dedup_offhash == NULL) {
+		hammer2_spin_unex(&hmp->dedup_spin);
+		return;
+	}
+
+	data_off &= ~HAMMER2_OFF_MASK_RADIX;
+	n = hammer2_dedup_offhashv(data_off) & hmp->dedup_hmask;
+	for (entp = &hmp->dedup_offhash[n]; (ent = *entp) != NULL; ) {
+		if ((ent->data_off & ~HAMMER2_OFF_MASK_RADIX) != data_off) {
+			entp = &ent->onext;
+			continue;
+		}
+		*entp = ent->onext;
+		n = (int)ent->data_crc & hmp->dedup_hmask;
+		entp = &hmp->dedup_crchash[n];
+		while (*entp != ent)
+			entp = &(*entp)->cnext;
+		*entp = ent->cnext;
+		kfree(ent, M_HAMMER2);
+		--hmp->dedup_count;
+		break;
+	}
+	hammer2_spin_unex(&hmp->dedup_spin);
+}
+
+void
+hammer2_dedup_index_free(hammer2_dev_t *hmp)
+{
+	hammer2_dedup_ent_t *ent;
+	int i;
+
+	hammer2_spin_ex(&hmp->dedup_spin);
+	if (hmp->dedup_crchash == NULL) {
+		hammer2_spin_unex(&hmp->dedup_spin);
+		return;
+	}
+
+	for (i = 0; i <= hmp->dedup_hmask; ++i) {
+		while ((ent = hmp->dedup_crchash[i]) != NULL) {
+			hmp->dedup_crchash[i] = ent->cnext;
+			kfree(ent, M_HAMMER2);
+		}
+	}
+	kfree(hmp->dedup_crchash, M_HAMMER2);
+	kfree(hmp->dedup_offhash, M_HAMMER2);
+	hmp->dedup_crchash = NULL;
+	hmp->dedup_offhash = NULL;
+	hmp->dedup_hmask = 0;
+	hmp->dedup_count = 0;
+	hammer2_spin_unex(&hmp->dedup_spin);
+}
+
+/*
+ * MAKEFS WRITE PIPELINE
+ *
+ * makefs submits the logical blocks of the files it writes to a pool of
+ * worker threads, which run the zero test, the compression and the check
+ * code computation ahead of time.  The blocks are then written through
+ * the normal strategy path in submission order with ip->wcomp pointing
+ * to the prepared block, so chain insertion stays single threaded and
+ * the resulting image does not depend on the number of threads.  With a
+ * single thread there are no workers, the submitting thread prepares each
+ * block in hammer2_wpipe_submit() and the blocks are written in the same
+ * order.
+ *
+ * The workers only touch the hammer2_wcomp_t they were handed, never a
+ * chain, inode or dio.
+ */
+#define HAMMER2_WPIPE_DEPTH	64	/* blocks in flight */
+
+struct hammer2_wpipe {
+	pthread_mutex_t	lock;
+	pthread_cond_t	workcv;		/* block queued or stopping */
+	pthread_cond_t	donecv;		/* block prepared */
+	pthread_t	*threads;
+	int		nthreads;
+	int		stop;
+	hammer2_wcomp_t	ring[HAMMER2_WPIPE_DEPTH];
+	u_int		head;		/* oldest block, next to retire */
+	u_int		next;		/* next block to prepare */
+	u_int		tail;		/* next free slot */
+};
+
+static void *hammer2_wpipe_thread(void *arg);
+static void hammer2_wcomp_prepare(hammer2_wcomp_t *wc);
+
+hammer2_wpipe_t *
+hammer2_wpipe_create(int nthreads)
+{
+	hammer2_wpipe_t *wp;
+	hammer2_wcomp_t *wc;
+	int i;
+
+	KKASSERT(nthreads > 0);
+	wp = ecalloc(1, sizeof(*wp));
+	pthread_mutex_init(&wp->lock, NULL);
+	pthread_cond_init(&wp->workcv, NULL);
+	pthread_cond_init(&wp->donecv, NULL);
+	for (i = 0; i < HAMMER2_WPIPE_DEPTH; ++i) {
+		wc = &wp->ring[i];
+		wc->comp_buffer = ecalloc(1, 32768);
+		wc->pad = ecalloc(1, HAMMER2_PBUFSIZE);
+	}
+	if (nthreads == 1)
+		return (wp);
+	wp->threads = ecalloc(nthreads, sizeof(*wp->threads));
+	for (i = 0; i < nthreads; ++i) {
+		if (pthread_create(&wp->threads[i], NULL,
+				   hammer2_wpipe_thread, wp))
+			panic("hammer2_wpipe_create: pthread_create failed");
+		++wp->nthreads;
+	}
+
+	return (wp);
+}
+
+/*
+ * All submitted blocks must have been retired.
+ */
+void
+hammer2_wpipe_destroy(hammer2_wpipe_t *wp)
+{
+	int i;
+
+	KKASSERT(wp->head == wp->tail);
+	pthread_mutex_lock(&wp->lock);
+	wp->stop = 1;
+	pthread_cond_broadcast(&wp->workcv);
+	pthread_mutex_unlock(&wp->lock);
+	for (i = 0; i < wp->nthreads; ++i)
+		pthread_join(wp->threads[i], NULL);
+
+	for (i = 0; i < HAMMER2_WPIPE_DEPTH; ++i) {
+		free(wp->ring[i].comp_buffer);
+		free(wp->ring[i].pad);
+	}
+	free(wp->threads);
+	pthread_cond_destroy(&wp->donecv);
+	pthread_cond_destroy(&wp->workcv);
+	pthread_mutex_destroy(&wp->lock);
+	free(wp);
+}
+
+/*
+ * head and tail are only modified by the submitting thread.
+ */
+int
+hammer2_wpipe_full(hammer2_wpipe_t *wp)
+{
+	return (wp->tail - wp->head == HAMMER2_WPIPE_DEPTH);
+}
+
+int
+hammer2_wpipe_pending(hammer2_wpipe_t *wp)
+{
+	return (wp->tail - wp->head);
+}
+
+/*
+ * Queue bytes of file data at lbase of ip.  data must remain valid until
+ * the block is retired, unless it is shorter than the physical block in
+ * which case it is copied.
+ */
+void
+hammer2_wpipe_submit(hammer2_wpipe_t *wp, hammer2_inode_t *ip,
+		     const char *data, int bytes, hammer2_key_t lbase,
+		     void *priv)
+{
+	hammer2_wcomp_t *wc;
+	int pblksize;
+
+	KKASSERT(!hammer2_wpipe_full(wp));
+	KKASSERT(bytes > 0 && bytes <= HAMMER2_PBUFSIZE);
+	KKASSERT((lbase & HAMMER2_PBUFMASK64) == 0);
+
+	/*
+	 * Same as hammer2_calc_physical() once the file is extended to
+	 * cover this block.
+	 */
+	pblksize = HAMMER2_PBUFSIZE;
+	if (bytes < HAMMER2_PBUFSIZE) {
+		while (pblksize >= bytes && pblksize >= HAMMER2_ALLOC_MIN)
+			pblksize >>= 1;
+		pblksize <<= 1;
+	}
+
+	wc = &wp->ring[wp->tail % HAMMER2_WPIPE_DEPTH];
+	if (bytes < pblksize) {
+		bcopy(data, wc->pad, bytes);
+		bzero(wc->pad + bytes, pblksize - bytes);
+		wc->data = wc->pad;
+	} else {
+		wc->data = data;
+	}
+	wc->priv = priv;
+	wc->lbase = lbase;
+	wc->bytes = bytes;
+	wc->pblksize = pblksize;
+	wc->comp_algo = ip->meta.comp_algo;
+	wc->check_algo = ip->meta.check_algo;
+	wc->done = 0;
+
+	if (wp->nthreads == 0) {
+		hammer2_wcomp_prepare(wc);
+		wc->done = 1;
+		++wp->tail;
+		return;
+	}
+
+	pthread_mutex_lock(&wp->lock);
+	++wp->tail;
+	pthread_cond_signal(&wp->workcv);
+	pthread_mutex_unlock(&wp->lock);
+}
+
+/*
+ * Wait for the oldest block to be prepared and return it.
+ */
+hammer2_wcomp_t *
+hammer2_wpipe_wait(hammer2_wpipe_t *wp)
+{
+	hammer2_wcomp_t *wc;
+
+	KKASSERT(wp->head != wp->tail);
+	wc = &wp->ring[wp->head % HAMMER2_WPIPE_DEPTH];
+	pthread_mutex_lock(&wp->lock);
+	while (wc->done == 0)
+		pthread_cond_wait(&wp->donecv, &wp->lock);
+	pthread_mutex_unlock(&wp->lock);
+
+	return (wc);
+}
+
+/*
+ * Release the oldest block once it has been written.
+ */
+void
+hammer2_wpipe_retire(hammer2_wpipe_t *wp)
+{
+	KKASSERT(wp->head != wp->tail);
+	KKASSERT(wp->ring[wp->head % HAMMER2_WPIPE_DEPTH].done);
+	++wp->head;
+}
+
+static void *
+hammer2_wpipe_thread(void *arg)
+{
+	hammer2_wpipe_t *wp = arg;
+	hammer2_wcomp_t *wc;
+
+	pthread_mutex_lock(&wp->lock);
+	for (;;) {
+		while (wp->next == wp->tail && wp->stop == 0)
+			pthread_cond_wait(&wp->workcv, &wp->lock);
+		if (wp->next == wp->tail)
+			break;
+		wc = &wp->ring[wp->next++ % HAMMER2_WPIPE_DEPTH];
+		pthread_mutex_unlock(&wp->lock);
+
+		hammer2_wcomp_prepare(wc);
+
+		pthread_mutex_lock(&wp->lock);
+		wc->done = 1;
+		pthread_cond_signal(&wp->donecv);
+	}
+	pthread_mutex_unlock(&wp->lock);
+
+	return (NULL);
+}
+
+/*
+ * Run the parts of hammer2_write_file_core() which only depend on the
+ * data.  The compression is always attempted, regardless of the inode's
+ * compression heuristic.
+ */
+static void
+hammer2_wcomp_prepare(hammer2_wcomp_t *wc)
+{
+	const char *bdata;
+	int algo;
+	int bytes;
+
+	algo = HAMMER2_DEC_ALGO(wc->comp_algo);
+	wc->zero = 0;
+	wc->comp_size = 0;
+	wc->comp_block_size = wc->pblksize;
+	wc->check_bytes = 0;
+
+	if (algo != HAMMER2_COMP_NONE &&
+	    wc->check_algo != HAMMER2_CHECK_NONE &&
+	    test_block_zeros(wc->data, wc->pblksize)) {
+		wc->zero = 1;
+		return;
+	}
+
+	if (algo == HAMMER2_COMP_LZ4 || algo == HAMMER2_COMP_ZLIB) {
+		wc->comp_size = hammer2_compress_block(wc->data, wc->pblksize,
+						       wc->comp_algo,
+						       wc->comp_buffer,
+						       &wc->comp_block_size);
+	}
+	if (wc->comp_size) {
+		bdata = wc->comp_buffer;
+		bytes = wc->comp_block_size;
+		wc->check_comp = 1;
+	} else {
+		bdata = wc->data;
+		bytes = wc->pblksize;
+		wc->check_comp = 0;
+	}
+
+	switch(wc->check_algo) {
+	case HAMMER2_CHECK_ISCSI32:
+		wc->bref.check.iscsi32.value = hammer2_icrc32(bdata, bytes);
+		break;
+	case HAMMER2_CHECK_XXHASH64:
+		wc->bref.check.xxhash64.value =
+			XXH64(bdata, bytes, XXH_HAMMER2_SEED);
+		break;
+	case HAMMER2_CHECK_SHA192:
+		hammer2_cksum_sha192(bdata, bytes, wc->bref.check.sha192.data);
+		break;
+	default:
+		/* left to hammer2_chain_setcheck() */
+		return;
+	}
+	wc->check_bytes = bytes;
+}
+
+/*
+ * Return the prepared block for (lbase, pblksize) of ip, if any.
+ */
+static hammer2_wcomp_t *
+hammer2_wcomp_get(hammer2_inode_t *ip, hammer2_key_t lbase, int pblksize,
+		  int comp_algo, int check_algo)
+{
+	hammer2_wcomp_t *wc;
+
+	wc = ip->wcomp;
+	if (wc == NULL || wc->lbase != lbase || wc->pblksize != pblksize ||
+	    wc->comp_algo != comp_algo || wc->check_algo != check_algo)
+		return (NULL);
+	return (wc);
+}
+
+/*
+ * hammer2_chain_setcheck() using the check code computed by the write
+ * pipeline when it covers the same data (compressed or not).
+ */
+static void
+hammer2_wcomp_setcheck(hammer2_chain_t *chain, void *bdata,
+		       hammer2_wcomp_t *wc, int iscomp)
+{
+	if (wc && wc->check_bytes == chain->bytes &&
+	    wc->check_comp == iscomp &&
+	    HAMMER2_DEC_CHECK(chain->bref.methods) == wc->check_algo) {
+		atomic_clear_int(&chain->flags, HAMMER2_CHAIN_NOTTESTED);
+		bcopy(&wc->bref.check, &chain->bref.check,
+		      sizeof(chain->bref.check));
+	} else {
+		hammer2_chain_setcheck(chain, bdata);
+	}
 }
@@ -322,7 +322,7 @@ hammer2_calc_physical(hammer2_inode_t *ip, hammer2_key_t lbase)
 	return (pblksize);
 }
 
-extern fsnode *hammer2_curnode;
+extern __thread fsnode *hammer2_curnode;
 
 static void
 hammer2_get_curtime(uint64_t *timep)
@@ -64,6 +64,7 @@ int hammer2_supported_version = HAMMER2_VOL_VERSION_DEFAULT;
 int hammer2_debug;
 int hammer2_aux_flags;
 int hammer2_xop_nthreads;
+int hammer2_xop_workers;		/* makefs: 0 runs XOPs in the caller */
 int hammer2_xop_sgroups;
 int hammer2_xop_xgroups;
 int hammer2_xop_xbase;
@@ -78,6 +79,7 @@ int hammer2_flush_pipe = 100;
 int hammer2_dio_count;
 int hammer2_dio_limit = 256;
 int hammer2_bulkfree_tps = 5000;
+int hammer2_bulkfree_workers = 1;	/* makefs: topology scan threads */
 int hammer2_spread_workers;
 int hammer2_limit_saved_depth;
 long hammer2_chain_allocs;
@@ -274,21 +276,26 @@ hammer2_vfs_init(void)
 	/*
 	 * hammer2_xop_nthreads must be a multiple of ncpus,
 	 * minimum 2 * ncpus.
+	 *
+	 * makefs has no per-cpu threads, hammer2_xop_workers threads (if
+	 * any) are split between the strategy and the other XOPs.
 	 */
 	const int ncpus = 1;
 	mod = ncpus;
 	hammer2_xop_mod = mod;
 	hammer2_xop_nthreads = mod * 2;
+	if (hammer2_xop_nthreads < hammer2_xop_workers)
+		hammer2_xop_nthreads = hammer2_xop_workers;
 	/*
 	while (hammer2_xop_nthreads / mod < HAMMER2_XOPGROUPS_MIN ||
 	       hammer2_xop_nthreads < HAMMER2_XOPTHREADS_MIN)
 	{
 		hammer2_xop_nthreads += mod;
 	}
+	*/
 	hammer2_xop_sgroups = hammer2_xop_nthreads / mod / 2;
 	hammer2_xop_xgroups = hammer2_xop_nthreads / mod - hammer2_xop_sgroups;
 	hammer2_xop_xbase = hammer2_xop_sgroups * mod;
-	*/
 
 	/*
 	 * A large DIO cache is needed to retain dedup enablement masks.
@@ -352,6 +359,10 @@ hammer2_vfs_init(void)
 				objcache_malloc_alloc_zero,
 				objcache_malloc_free,
 				&margs_vop);
+#else
+	cache_buffer_read = objcache_create("HAMMER2-decompbuffer", 65536);
+	cache_buffer_write = objcache_create("HAMMER2-compbuffer", 32768);
+	cache_xops = objcache_create("HAMMER2-xops", sizeof(hammer2_xop_t));
 #endif
 
 
@@ -381,11 +392,10 @@ hammer2_vfs_init(void)
 int
 hammer2_vfs_uninit(void)
 {
-	/*
 	objcache_destroy(cache_buffer_read);
 	objcache_destroy(cache_buffer_write);
 	objcache_destroy(cache_xops);
-	*/
+
 	return 0;
 }
 
@@ -700,7 +710,7 @@ hammer2_pfsdealloc(hammer2_pfs_t *pmp, int clindex, int destroying)
 static void
 hammer2_pfsfree(hammer2_pfs_t *pmp)
 {
-	hammer2_inode_t *iroot, *ip;
+	hammer2_inode_t *iroot;
 	hammer2_chain_t *chain;
 	int chains_still_present = 0;
 	int i;
@@ -744,38 +754,54 @@ hammer2_pfsfree(hammer2_pfs_t *pmp)
 		pmp->iroot = NULL;
 	}
 
+	/*
+	 * makefs: the super-root never goes through hammer2_vfs_unmount(),
+	 * stop the XOP helpers it started on demand.
+	 */
+	hammer2_xop_helper_cleanup(pmp);
+
 	/*
 	 * Free remaining pmp resources
 	 */
 	if (chains_still_present) {
 		kprintf("hammer2: cannot free pmp %p, still in use\n", pmp);
 	} else {
-		/*
-		 * Free inode in reclaim queue.
-		 */
-		while ((ip = TAILQ_FIRST(&pmp->recq)) != NULL) {
-			TAILQ_REMOVE(&pmp->recq, ip, recq_entry);
-			/*
-			 * VOP_RECLAIM is currently unused,
-			 * so directly free vnode before inode.
-			 */
-			if (ip->vp) {
-				if (ip->vp->v_malloced)
-					freevnode(ip->vp);
-			} else {
-				/* PFS inode ? */
-			}
-			kfree_obj(ip, pmp->minode);
-			atomic_add_long(&pmp->inmem_inodes, -1);
-		}
+		hammer2_pfs_free_recq(pmp);
 		assert(TAILQ_EMPTY(&pmp->recq));
 		assert(pmp->inmem_inodes == 0);
 
 		kmalloc_destroy_obj(&pmp->minode);
+		hammer2_inum_hash_destroy(pmp);
 		kfree(pmp, M_HAMMER2);
 	}
 }
 
+/*
+ * Free inodes in reclaim queue.  The inodes have no refs left, so this
+ * can be called whenever no VOP is in progress.
+ */
+void
+hammer2_pfs_free_recq(hammer2_pfs_t *pmp)
+{
+	hammer2_inode_t *ip;
+
+	while ((ip = TAILQ_FIRST(&pmp->recq)) != NULL) {
+		TAILQ_REMOVE(&pmp->recq, ip, recq_entry);
+		/*
+		 * VOP_RECLAIM is not used by vflush(),
+		 * so directly free vnode before inode.
+		 */
+		if (ip->vp) {
+			if (ip->vp->v_malloced)
+				freevnode(ip->vp);
+		} else {
+			/* PFS inode or reclaimed vnode */
+		}
+		kfree_obj(ip, pmp->minode);
+		atomic_add_long(&pmp->inmem_inodes, -1);
+	}
+}
+
 /*
  * Remove all references to hmp from the pfs list.  Any PFS which becomes
  * empty is terminated and freed.
@@ -984,14 +1010,14 @@ hammer2_vfs_mount(struct m_vnode *makefs_devvp, struct m_mount *mp,
 	const hammer2_inode_data_t *ripdata;
 	hammer2_devvp_list_t devvpl;
 	hammer2_devvp_t *e, *e_tmp;
-	char *devstr;
+	const char *devstr;
 	int ronly = ((mp->mnt_flag & MNT_RDONLY) != 0);
 	int error;
 	int i;
 
 	hmp = NULL;
 	pmp = NULL;
-	devstr = "(null)";
+	devstr = info.volume ? info.volume : "(null)";
 
 	kprintf("hammer2_mount: device=\"%s\" label=\"%s\" rdonly=%d\n",
 		devstr, label, ronly);
@@ -1000,7 +1026,7 @@ hammer2_vfs_mount(struct m_vnode *makefs_devvp, struct m_mount *mp,
 	 * Initialize all device vnodes.
 	 */
 	TAILQ_INIT(&devvpl);
-	error = hammer2_init_devvp(makefs_devvp, &devvpl);
+	error = hammer2_init_devvp(devstr, makefs_devvp, &devvpl);
 	if (error) {
 		kprintf("hammer2: failed to initialize devvp in %s\n", devstr);
 		hammer2_cleanup_devvp(&devvpl);
@@ -1138,6 +1164,8 @@ next_hmp:
 		TAILQ_INSERT_TAIL(&hammer2_mntlist, hmp, mntentry);
 		hammer2_io_hash_init(hmp);
 		hammer2_spin_init(&hmp->list_spin, "h2mount_list");
+		hammer2_spin_init(&hmp->dedup_spin, "h2dedup");
+		hammer2_mtx_init(&hmp->bump_lock, "h2bump");
 
 		lockinit(&hmp->vollk, "h2vol", 0, 0);
 		lockinit(&hmp->bulklk, "h2bulk", 0, 0);
@@ -1599,6 +1627,11 @@ hammer2_vfs_unmount(struct m_mount *mp, int mntflags)
 	 * its vnodes and sync the underlying mount points.  Three syncs
 	 * are required to fully flush the filesystem (freemap updates lag
 	 * by one flush, and one extra for safety).
+	 *
+	 * The makefs sequential allocator is stopped before the syncs, the
+	 * freemap changes it makes are only on media once a sync writes the
+	 * volume header.  Indirect blocks held by a makefs bulk-load are
+	 * released after the syncs, so they are written in place.
 	 */
 	if (mntflags & MNT_FORCE)
 		flags = FORCECLOSE;
@@ -1608,9 +1641,12 @@ hammer2_vfs_unmount(struct m_mount *mp, int mntflags)
 		error = vflush(mp, 0, flags);
 		if (error)
 			goto failed;
+		if (pmp->pfs_hmps[0])
+			hammer2_freemap_bump_stop(pmp->pfs_hmps[0]);
 		hammer2_vfs_sync(mp, MNT_WAIT);
 		hammer2_vfs_sync(mp, MNT_WAIT);
 		hammer2_vfs_sync(mp, MNT_WAIT);
+		hammer2_chain_bulkload_release(pmp);
 	}
 
 	/*
@@ -1837,6 +1873,7 @@ again:
 	hammer2_chain_drop(&hmp->vchain);
 
 	hammer2_io_hash_cleanup_all(hmp);
+	hammer2_dedup_index_free(hmp);
 	if (hmp->iofree_count) {
 		kprintf("io_cleanup: %d I/O's left hanging\n",
 			hmp->iofree_count);
@@ -2831,7 +2868,6 @@ hammer2_lwinprog_ref(hammer2_pfs_t *pmp)
 void
 hammer2_lwinprog_drop(hammer2_pfs_t *pmp)
 {
-#if 0
 	int lwinprog;
 
 	lwinprog = atomic_fetchadd_int(&pmp->count_lwinprog, -1);
@@ -2841,19 +2877,18 @@ hammer2_lwinprog_drop(hammer2_pfs_t *pmp)
 				 HAMMER2_LWINPROG_WAITING);
 		wakeup(&pmp->count_lwinprog);
 	}
+	/* fetchadd returns the count before the drop */
 	if ((lwinprog & HAMMER2_LWINPROG_WAITING0) &&
-	    (lwinprog & HAMMER2_LWINPROG_MASK) <= 0) {
+	    (lwinprog & HAMMER2_LWINPROG_MASK) <= 1) {
 		atomic_clear_int(&pmp->count_lwinprog,
 				 HAMMER2_LWINPROG_WAITING0);
 		wakeup(&pmp->count_lwinprog);
 	}
-#endif
 }
 
 void
 hammer2_lwinprog_wait(hammer2_pfs_t *pmp, int flush_pipe)
 {
-#if 0
 	int lwinprog;
 	int lwflag = (flush_pipe) ? HAMMER2_LWINPROG_WAITING :
 				    HAMMER2_LWINPROG_WAITING0;
@@ -2870,7 +2905,6 @@ hammer2_lwinprog_wait(hammer2_pfs_t *pmp, int flush_pipe)
 			break;
 		tsleep(&pmp->count_lwinprog, PINTERLOCKED, "h2wpipe", hz);
 	}
-#endif
 }
 
 #if 0
@@ -969,6 +969,24 @@ hammer2_read(struct m_vnode *vp, void *buf, size_t size, off_t offset)
 	return hammer2_vop_read(&ap);
 }
 
+/*
+ * Read the whole regular file vp, see hammer2_strategy_read_stream().
+ */
+int
+hammer2_read_stream(struct m_vnode *vp, void *buf, size_t size,
+		    hammer2_stream_func_t func, void *arg)
+{
+	assert(buf);
+	assert(size >= HAMMER2_PBUFSIZE);
+
+	if (vp->v_type == VDIR)
+		return (EISDIR);
+	if (vp->v_type != VREG)
+		return (EINVAL);
+
+	return hammer2_strategy_read_stream(VTOI(vp), buf, size, func, arg);
+}
+
 static
 int
 hammer2_vop_write(struct vop_write_args *ap)
@@ -1076,6 +1094,140 @@ hammer2_write(struct m_vnode *vp, void *buf, size_t size, off_t offset)
 	return hammer2_vop_write(&ap);
 }
 
+/*
+ * makefs write of one logical block which bypasses the logical buffer,
+ * buf is handed to the strategy code as is.  offset must be logical
+ * block aligned.  Only a block ending short of its physical block size
+ * is copied, the physical block has to be zero-filled past the file EOF.
+ */
+int
+hammer2_write_direct(struct m_vnode *vp, const void *buf, size_t size,
+		     off_t offset)
+{
+	hammer2_inode_t *ip;
+	hammer2_key_t new_eof;
+	uint64_t mtime;
+	char *pad;
+	int pblksize;
+
+	assert(buf);
+	assert(size > 0);
+	assert(size <= HAMMER2_PBUFSIZE);
+	assert((offset & HAMMER2_PBUFMASK64) == 0);
+
+	ip = VTOI(vp);
+	if (ip->pmp->ronly || (ip->pmp->flags & HAMMER2_PMPF_EMERG))
+		return (EROFS);
+	if (hammer2_vfs_enospace(ip, size, NULL) == 2)
+		return (ENOSPC);
+
+	hammer2_trans_init(ip->pmp, 0);
+	hammer2_mtx_ex(&ip->lock);
+	hammer2_mtx_sh(&ip->truncate_lock);
+	new_eof = offset + size;
+	if (new_eof > ip->meta.size)
+		hammer2_extend_file(ip, new_eof);
+	pblksize = hammer2_calc_physical(ip, offset);
+	hammer2_mtx_unlock(&ip->lock);
+
+	pad = NULL;
+	if (size < (size_t)pblksize) {
+		pad = ecalloc(1, pblksize);
+		bcopy(buf, pad, size);
+		buf = pad;
+	}
+	hammer2_strategy_write_direct(ip, offset, buf);
+	free(pad);
+
+	hammer2_update_time(&mtime, true);
+	hammer2_mtx_ex(&ip->lock);
+	hammer2_inode_modify(ip);
+	ip->meta.mtime = mtime;
+	vclrflags(vp, VLASTWRITETS);
+	hammer2_mtx_unlock(&ip->lock);
+	hammer2_knote(vp, NOTE_WRITE);
+
+	hammer2_trans_assert_strategy(ip->pmp);
+	hammer2_mtx_unlock(&ip->truncate_lock);
+	hammer2_trans_done(ip->pmp, HAMMER2_TRANS_SIDEQ);
+
+	return (0);
+}
+
+/*
+ * Test whether (bytes) of the caller's data are all zeros.
+ */
+static int
+hammer2_write_zeros(const char *buf, size_t bytes)
+{
+	size_t i;
+
+	for (i = 0; i + sizeof(long) <= bytes; i += sizeof(long)) {
+		if (*(const long *)(buf + i) != 0)
+			return (0);
+	}
+	for (; i < bytes; ++i) {
+		if (buf[i] != 0)
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Extend a new file to its final size before its data (buf) is written
+ * with hammer2_write_direct(), and bulk-load the indirect blocks for its
+ * logical blocks so the strategy code never has to split them.  All-zero
+ * blocks become holes unless the check code is disabled, their keys are
+ * left out so no indirect block is built only to be deleted empty.
+ */
+int
+hammer2_write_prepare(struct m_vnode *vp, const void *buf, off_t size)
+{
+	hammer2_inode_t *ip;
+	hammer2_key_t *keys;
+	hammer2_key_t lbase;
+	off_t offset;
+	off_t resid;
+	int lblksize;
+	int holes;
+	int nkeys;
+	int error;
+
+	ip = VTOI(vp);
+	if (ip->pmp->ronly || (ip->pmp->flags & HAMMER2_PMPF_EMERG))
+		return (EROFS);
+	if (size <= HAMMER2_EMBEDDED_BYTES)
+		return (0);
+
+	hammer2_trans_init(ip->pmp, 0);
+	hammer2_mtx_ex(&ip->lock);
+	if ((hammer2_key_t)size > ip->meta.size)
+		hammer2_extend_file(ip, size);
+	hammer2_mtx_unlock(&ip->lock);
+	hammer2_trans_done(ip->pmp, HAMMER2_TRANS_SIDEQ);
+
+	nkeys = (size + HAMMER2_PBUFMASK64) / HAMMER2_PBUFSIZE;
+	if (nkeys <= HAMMER2_SET_COUNT)
+		return (0);
+	holes = (ip->meta.check_algo != HAMMER2_CHECK_NONE);
+	keys = ecalloc(nkeys, sizeof(*keys));
+	nkeys = 0;
+	for (offset = 0; offset < size; offset += lblksize) {
+		lblksize = hammer2_calc_logical(ip, offset, &lbase, NULL);
+		resid = size - offset;
+		if (resid > lblksize)
+			resid = lblksize;
+		if (holes &&
+		    hammer2_write_zeros((const char *)buf + offset, resid))
+			continue;
+		keys[nkeys++] = lbase;
+	}
+	error = hammer2_inode_bulkload(ip, keys, nkeys, 100, 0);
+	free(keys);
+
+	return (error);
+}
+
 /*
  * Perform read operations on a file or symlink given an UNLOCKED
  * inode and uio.
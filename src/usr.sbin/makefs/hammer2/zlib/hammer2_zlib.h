@@ -337,6 +337,17 @@ int deflateEnd(z_streamp strm);
    deallocated).
 */
 
+int deflateReset(z_streamp strm);
+/*
+     This function is equivalent to deflateEnd followed by deflateInit,
+   but does not free and reallocate all the internal compression state.  The
+   stream will keep the same compression level and any other attributes
+   that may have been set by deflateInit2.
+
+     deflateReset returns Z_OK if success, or Z_STREAM_ERROR if the source
+   stream state was inconsistent (such as zalloc or state being Z_NULL).
+*/
+
 int inflateInit(z_streamp strm);
 
 /*
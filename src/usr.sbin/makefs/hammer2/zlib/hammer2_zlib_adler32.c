@@ -9,6 +9,15 @@
 
 #define local static
 
+/* HAMMER2: x86-64 has an SSSE3 version of the 32 byte inner loop which is
+ * picked at runtime from cpuid, see adler32_simd().
+ */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define ADLER32_SIMD
+#  include <cpuid.h>
+#  include <immintrin.h>
+#endif
+
 //local uLong adler32_combine_ (uLong adler1, uLong adler2, z_off64_t len2);
 
 #define BASE 65521      /* largest prime smaller than 65536 */
@@ -65,8 +74,9 @@ local uLong adler32_combine_(uLong adler1, uLong adler2, z_off64_t len2);
 uLong adler32_combine(uLong adler1, uLong adler2, z_off_t len2);
 
 /* ========================================================================= */
+local
 uLong
-adler32(uLong adler, const Bytef *buf, uInt len)
+adler32_sw(uLong adler, const Bytef *buf, uInt len)
 {
     unsigned long sum2;
     unsigned n;
@@ -133,6 +143,111 @@ adler32(uLong adler, const Bytef *buf, uInt len)
     return adler | (sum2 << 16);
 }
 
+#ifdef ADLER32_SIMD
+/* ========================================================================= */
+/* 32 bytes per iteration.  s1 is the byte sum (psadbw), s2 gets the bytes
+ * weighted by their distance from the end of the block (pmaddubsw) plus
+ * 32 times the s1 of every previous block, accumulated in v_ps.  NMAX / 32
+ * blocks keep all the 32 bit lanes from overflowing between reductions.
+ */
+#define ADLER32_BLOCK 32
+
+__attribute__((target("ssse3")))
+local
+uLong
+adler32_ssse3(uLong adler, const Bytef *buf, uInt len)
+{
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                       24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9,
+                                       8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    unsigned long s1 = adler & 0xffff;
+    unsigned long s2 = (adler >> 16) & 0xffff;
+    unsigned blocks = len / ADLER32_BLOCK;
+    unsigned n;
+
+    len -= blocks * ADLER32_BLOCK;
+    while (blocks) {
+        __m128i v_ps, v_s1, v_s2;
+
+        n = NMAX / ADLER32_BLOCK;
+        if (n > blocks)
+            n = blocks;
+        blocks -= n;
+
+        v_ps = _mm_set_epi32(0, 0, 0, (int)(s1 * n));
+        v_s2 = _mm_set_epi32(0, 0, 0, (int)s2);
+        v_s1 = _mm_setzero_si128();
+        do {
+            const __m128i bytes1 = _mm_loadu_si128((const __m128i *)buf);
+            const __m128i bytes2 = _mm_loadu_si128((const __m128i *)
+                                                   (buf + 16));
+
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(
+                       _mm_maddubs_epi16(bytes1, tap1), ones));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(
+                       _mm_maddubs_epi16(bytes2, tap2), ones));
+            buf += ADLER32_BLOCK;
+        } while (--n);
+
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        /* horizontal sums */
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, 0xb1));
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, 0x4e));
+        s1 += (unsigned)_mm_cvtsi128_si32(v_s1);
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, 0xb1));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, 0x4e));
+        s2 = (unsigned)_mm_cvtsi128_si32(v_s2);
+
+        MOD(s1);
+        MOD(s2);
+    }
+
+    /* less than 32 bytes left */
+    if (len) {
+        while (len--) {
+            s1 += *buf++;
+            s2 += s1;
+        }
+        MOD(s1);
+        MOD(s2);
+    }
+    return s1 | (s2 << 16);
+}
+
+local int adler32_simd_ok = -1;
+
+local
+int
+adler32_simd(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (adler32_simd_ok < 0) {
+        adler32_simd_ok = __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+                          (ecx & bit_SSSE3);
+    }
+    return adler32_simd_ok;
+}
+#endif /* ADLER32_SIMD */
+
+/* ========================================================================= */
+uLong
+adler32(uLong adler, const Bytef *buf, uInt len)
+{
+#ifdef ADLER32_SIMD
+    if (len >= 64 && buf != Z_NULL && adler32_simd())
+        return adler32_ssse3(adler, buf, len);
+#endif
+    return adler32_sw(adler, buf, len);
+}
+
 /* ========================================================================= */
 local
 uLong
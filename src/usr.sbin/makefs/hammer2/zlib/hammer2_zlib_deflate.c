@@ -162,12 +162,16 @@ struct static_tree_desc_s {int dummy;}; /* for buggy compilers */
 #define RANK(f) (((f) << 1) - ((f) > 4 ? 9 : 0))
 
 /* ===========================================================================
- * Update a hash value with the given input byte
- * IN  assertion: all calls to to UPDATE_HASH are made with consecutive
- *    input characters, so that a running hash key can be computed from the
- *    previous key instead of complete recalculation each time.
+ * Compute the hash of the MIN_MATCH bytes at window index str.
+ * HAMMER2: a multiplicative hash of all three bytes instead of the rolling
+ *    shift/xor hash, which only kept the low 5 bits of the first byte and
+ *    chained unrelated strings together on text.  Equal hash keys no longer
+ *    imply equal bytes, longest_match() compares all of them.
  */
-#define UPDATE_HASH(s,h,c) (h = (((h)<<s->hash_shift) ^ (c)) & s->hash_mask)
+#define HASH_CALC(s, str) \
+   ((((ulg)s->window[(str)] | ((ulg)s->window[(str) + 1] << 8) | \
+      ((ulg)s->window[(str) + 2] << 16)) * 2654435761U & 0xffffffffU) >> \
+    (32 - s->hash_bits))
 
 
 /* ===========================================================================
@@ -176,12 +180,11 @@ struct static_tree_desc_s {int dummy;}; /* for buggy compilers */
  * the previous length of the hash chain.
  * If this file is compiled with -DFASTEST, the compression level is forced
  * to 1, and no hash chains are maintained.
- * IN  assertion: all calls to to INSERT_STRING are made with consecutive
- *    input characters and the first MIN_MATCH bytes of str are valid
- *    (except for the last MIN_MATCH-1 bytes of the input file).
+ * IN  assertion: the first MIN_MATCH bytes of str are valid (except for the
+ *    last MIN_MATCH-1 bytes of the input file).
  */
 #define INSERT_STRING(s, str, match_head) \
-   (UPDATE_HASH(s, s->ins_h, s->window[(str) + (MIN_MATCH-1)]), \
+   (s->ins_h = HASH_CALC(s, str), \
     match_head = s->prev[(str) & s->w_mask] = s->head[s->ins_h], \
     s->head[s->ins_h] = (Pos)(str))
 
@@ -612,9 +615,54 @@ lm_init (deflate_state *s)
  * OUT assertion: the match length is not greater than s->lookahead.
  */
 #ifndef ASMV
-/* For 80x86 and 680x0, an optimized version will be provided in match.asm or
- * match.S. The code will be functionally equivalent.
+/* HAMMER2: compare eight bytes at a time and locate the first difference
+ * with a bit scan, the first and last two bytes of a candidate are checked
+ * with 16 bit loads before that.  The matches found are the same as with
+ * the byte at a time loop.
  */
+#if defined(__GNUC__) && BYTE_ORDER == LITTLE_ENDIAN
+#  define MATCH_WORDS
+#endif
+
+local
+inline
+ush
+load_16(const Bytef *p)
+{
+    ush v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Return the number of equal bytes at scan and match, at most 256.
+ * Reads 256 bytes of both.
+ */
+local
+inline
+uInt
+compare_256(const Bytef *scan, const Bytef *match)
+{
+    uInt len;
+#ifdef MATCH_WORDS
+    uint64_t sv, mv, diff;
+
+    for (len = 0; len < 256; len += 8) {
+        memcpy(&sv, scan + len, sizeof(sv));
+        memcpy(&mv, match + len, sizeof(mv));
+        diff = sv ^ mv;
+        if (diff)
+            return len + (__builtin_ctzll(diff) >> 3);
+    }
+#else
+    for (len = 0; len < 256; len++) {
+        if (scan[len] != match[len])
+            break;
+    }
+#endif
+    return len;
+}
+
 local
 uInt
 longest_match(deflate_state *s, IPos cur_match) /* cur_match = current match */
@@ -632,23 +680,9 @@ longest_match(deflate_state *s, IPos cur_match) /* cur_match = current match */
      */
     Posf *prev = s->prev;
     uInt wmask = s->w_mask;
+    ush scan_start = load_16(scan);
+    ush scan_end = load_16(scan + best_len - 1);
 
-#ifdef UNALIGNED_OK
-    /* Compare two bytes at a time. Note: this is not always beneficial.
-     * Try with and without -DUNALIGNED_OK to check.
-     */
-    register Bytef *strend = s->window + s->strstart + MAX_MATCH - 1;
-    register ush scan_start = *(ushf*)scan;
-    register ush scan_end   = *(ushf*)(scan+best_len-1);
-#else
-    register Bytef *strend = s->window + s->strstart + MAX_MATCH;
-    register Byte scan_end1  = scan[best_len-1];
-    register Byte scan_end   = scan[best_len];
-#endif
-
-    /* The code is optimized for HASH_BITS >= 8 and MAX_MATCH-2 multiple of 16.
-     * It is easy to get rid of this optimization if necessary.
-     */
     Assert(s->hash_bits >= 8 && MAX_MATCH == 258, "Code too clever");
 
     /* Do not waste too much time if we already have a good match: */
@@ -666,90 +700,22 @@ longest_match(deflate_state *s, IPos cur_match) /* cur_match = current match */
         Assert(cur_match < s->strstart, "no future");
         match = s->window + cur_match;
 
-        /* Skip to next match if the match length cannot increase
-         * or if the match length is less than 2.  Note that the checks below
-         * for insufficient lookahead only occur occasionally for performance
-         * reasons.  Therefore uninitialized memory will be accessed, and
-         * conditional jumps will be made that depend on those values.
-         * However the length of the match is limited to the lookahead, so
-         * the output of deflate is not affected by the uninitialized values.
-         */
-#if (defined(UNALIGNED_OK) && MAX_MATCH == 258)
-        /* This code assumes sizeof(unsigned short) == 2. Do not use
-         * UNALIGNED_OK if your compiler uses a different size.
-         */
-        if (*(ushf*)(match+best_len-1) != scan_end ||
-            *(ushf*)match != scan_start) continue;
-
-        /* It is not necessary to compare scan[2] and match[2] since they are
-         * always equal when the other bytes match, given that the hash keys
-         * are equal and that HASH_BITS >= 8. Compare 2 bytes at a time at
-         * strstart+3, +5, ... up to strstart+257. We check for insufficient
-         * lookahead only every 4th comparison; the 128th check will be made
-         * at strstart+257. If MAX_MATCH-2 is not a multiple of 8, it is
-         * necessary to put more guard bytes at the end of the window, or
-         * to check more often for insufficient lookahead.
-         */
-        Assert(scan[2] == match[2], "scan[2]?");
-        scan++, match++;
-        do {
-        } while (*(ushf*)(scan+=2) == *(ushf*)(match+=2) &&
-                 *(ushf*)(scan+=2) == *(ushf*)(match+=2) &&
-                 *(ushf*)(scan+=2) == *(ushf*)(match+=2) &&
-                 *(ushf*)(scan+=2) == *(ushf*)(match+=2) &&
-                 scan < strend);
-        /* The funny "do {}" generates better code on most compilers */
-
-        /* Here, scan <= window+strstart+257 */
-        Assert(scan <= s->window+(unsigned)(s->window_size-1), "wild scan");
-        if (*scan == *match) scan++;
-
-        len = (MAX_MATCH - 1) - (int)(strend-scan);
-        scan = strend - (MAX_MATCH-1);
-
-#else /* UNALIGNED_OK */
-
-        if (match[best_len]   != scan_end  ||
-            match[best_len-1] != scan_end1 ||
-            *match            != *scan     ||
-            *++match          != scan[1])      continue;
-
-        /* The check at best_len-1 can be removed because it will be made
-         * again later. (This heuristic is not always a win.)
-         * It is not necessary to compare scan[2] and match[2] since they
-         * are always equal when the other bytes match, given that
-         * the hash keys are equal and that HASH_BITS >= 8.
+        /* Skip to next match if the match length cannot increase or if
+         * the first two bytes differ.  As with the byte loop, up to
+         * MAX_MATCH bytes are compared regardless of the lookahead, the
+         * result is limited to it below.
          */
-        scan += 2, match++;
-        Assert(*scan == *match, "match[2]?");
+        if (load_16(match + best_len - 1) != scan_end ||
+            load_16(match) != scan_start) continue;
 
-        /* We check for insufficient lookahead only every 8th comparison;
-         * the 256th check will be made at strstart+258.
-         */
-        do {
-        } while (*++scan == *++match && *++scan == *++match &&
-                 *++scan == *++match && *++scan == *++match &&
-                 *++scan == *++match && *++scan == *++match &&
-                 *++scan == *++match && *++scan == *++match &&
-                 scan < strend);
-
-        Assert(scan <= s->window+(unsigned)(s->window_size-1), "wild scan");
-
-        len = MAX_MATCH - (int)(strend - scan);
-        scan = strend - MAX_MATCH;
-
-#endif /* UNALIGNED_OK */
+        len = 2 + (int)compare_256(scan + 2, match + 2);
+        Assert(scan+len <= s->window+(unsigned)(s->window_size-1), "wild scan");
 
         if (len > best_len) {
             s->match_start = cur_match;
             best_len = len;
             if (len >= nice_match) break;
-#ifdef UNALIGNED_OK
-            scan_end = *(ushf*)(scan+best_len-1);
-#else
-            scan_end1  = scan[best_len-1];
-            scan_end   = scan[best_len];
-#endif
+            scan_end = load_16(scan + best_len - 1);
         }
     } while ((cur_match = prev[cur_match & wmask]) > limit
              && --chain_length != 0);
@@ -882,13 +848,8 @@ fill_window(deflate_state *s)
         /* Initialize the hash value now that we have some input: */
         if (s->lookahead + s->insert >= MIN_MATCH) {
             uInt str = s->strstart - s->insert;
-            s->ins_h = s->window[str];
-            UPDATE_HASH(s, s->ins_h, s->window[str + 1]);
-#if MIN_MATCH != 3
-            Call UPDATE_HASH() MIN_MATCH-3 more times
-#endif
             while (s->insert) {
-                UPDATE_HASH(s, s->ins_h, s->window[str + MIN_MATCH-1]);
+                s->ins_h = HASH_CALC(s, str);
 #ifndef FASTEST
                 s->prev[str & s->w_mask] = s->head[s->ins_h];
 #endif
@@ -310,6 +310,18 @@ main(int argc, char *argv[])
 			errx(1, "%s: invalid argument", argv[1]);
 	} else if (strcmp(argv[1], "-") == 0) {
 		sb.st_mode = S_IFREG;
+#ifdef MAKEFS_HAMMER2
+	} else if (hammer2_source_probe(argv[1])) {
+		/* DragonFly: walk a HAMMER2 image instead of a directory. */
+		if (!strcmp(fstype->type, "hammer2"))
+			errx(1, "%s: HAMMER2 image as the source of a HAMMER2 "
+			    "image", argv[1]);
+		subtree = argv[1];
+		TIMER_START(start);
+		root = hammer2_source_walk(subtree);
+		TIMER_RESULTS(start, "hammer2_source_walk");
+		goto append_dir;
+#endif
 	} else {
 		if (stat(argv[1], &sb) == -1)
 			err(1, "Can't stat `%s'", argv[1]);
@@ -333,6 +345,9 @@ main(int argc, char *argv[])
 		/* NOTREACHED */
 	}
 
+#ifdef MAKEFS_HAMMER2
+append_dir:
+#endif
 	/* append extra directory */
 	for (i = 2; i < argc; i++) {
 		if (stat(argv[i], &sb) == -1)
@@ -363,6 +378,9 @@ ignore_walk_dir:
 	TIMER_RESULTS(start, "make_fs");
 
 	free_fsnodes(root);
+#ifdef MAKEFS_HAMMER2
+	hammer2_source_close();
+#endif
 
 	exit(0);
 	/* NOTREACHED */
@@ -81,6 +81,7 @@ enum fi_flags {
 	FI_ALLOCATED =	1<<1,		/* fsinode->ino allocated */
 	FI_WRITTEN =	1<<2,		/* inode written */
 	FI_ROOT =	1<<3,		/* root of a ZFS dataset */
+	FI_SOURCE =	1<<4,		/* in a source image, not on disk */
 };
 
 typedef struct {
@@ -178,7 +179,10 @@ int		set_option(const option_t *, const char *, char *, size_t);
 int		set_option_var(const option_t *, const char *, const char *,
     char *, size_t);
 fsnode *	walk_dir(const char *, const char *, fsnode *, fsnode *);
+fsnode *	create_fsnode(const char *, const char *, const char *,
+		    struct stat *);
 void		free_fsnodes(fsnode *);
+int		fsnode_open(const fsnode *, const char *);
 option_t *	copy_opts(const option_t *);
 
 #define DECLARE_FUN(fs)							\
@@ -192,6 +196,10 @@ DECLARE_FUN(ffs);
 DECLARE_FUN(msdos);
 #ifdef MAKEFS_HAMMER2
 DECLARE_FUN(hammer2);
+int		hammer2_source_probe(const char *);
+fsnode *	hammer2_source_walk(const char *);
+int		hammer2_source_open(const fsnode *);
+void		hammer2_source_close(void);
 #endif
 #ifdef MAKEFS_EXFAT
 DECLARE_FUN(exfat);
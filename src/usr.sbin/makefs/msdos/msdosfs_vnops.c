@@ -461,7 +461,7 @@ msdosfs_wfile(const char *path, struct denode *dep, fsnode *node)
 			return error;
 	}
 
-	if ((fd = open(path, O_RDONLY)) == -1) {
+	if ((fd = fsnode_open(node, path)) == -1) {
 		error = errno;
 		fprintf(stderr, "open %s: %s\n", path, strerror(error));
 		return error;
@@ -57,8 +57,6 @@
 
 static	void	 apply_specdir(const char *, NODE *, fsnode *, int);
 static	void	 apply_specentry(const char *, NODE *, fsnode *);
-static	fsnode	*create_fsnode(const char *, const char *, const char *,
-			       struct stat *);
 
 
 /*
@@ -214,7 +212,7 @@ walk_dir(const char *root, const char *dir, fsnode *parent, fsnode *join)
 	return (first);
 }
 
-static fsnode *
+fsnode *
 create_fsnode(const char *root, const char *path, const char *name,
     struct stat *stbuf)
 {
@@ -245,6 +243,24 @@ create_fsnode(const char *root, const char *path, const char *name,
 	return (cur);
 }
 
+/*
+ * fsnode_open --
+ *	open the contents of the regular file `node' for reading, from
+ *	`path' unless they are in a source image and not replaced by a
+ *	"contents" keyword.
+ */
+int
+fsnode_open(const fsnode *node, const char *path)
+{
+
+#ifdef MAKEFS_HAMMER2
+	if (node != NULL && node->contents == NULL &&
+	    (node->inode->flags & FI_SOURCE))
+		return (hammer2_source_open(node));
+#endif
+	return (open(path, O_RDONLY));
+}
+
 /*
  * free_fsnodes --
  *	Removes node from tree and frees it and all of